@@ -13,6 +13,9 @@
 #include <io.h>
 #endif
 
+// the fixed footprint build has no files; only is_big_endian is left of this.
+#ifndef LZW_FIXED_FOOTPRINT
+
 long fileSize (const char *filename)
 {
   FILE *fp = fopen (filename, "rb");
@@ -28,6 +31,8 @@ long fileSize (const char *filename)
   return ret;
 }
 
+#endif // LZW_FIXED_FOOTPRINT
+
 bool is_big_endian(void)
 {
     union {
@@ -38,6 +43,8 @@ bool is_big_endian(void)
     return (bint.c[0] == 1); 
 }
 
+#ifndef LZW_FIXED_FOOTPRINT
+
 void cleanup (const char *outfile, int flags)
 {
   if (0 == (flags & KEEP_ON_ERROR))
@@ -105,3 +112,5 @@ int strcpy_s(char *dest, size_t dest_len, const char *src)
 }
 
 #endif // _MSC_VER
+
+#endif // LZW_FIXED_FOOTPRINT
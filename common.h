@@ -15,10 +15,34 @@
 
 #define PACKER_VERSION  0
 #define VARIABLE_WIDTH  1
-#define BUFFLEN         16384    /* the larger, the better for compression. This value must be the same for coder and decoder. */
+#define BUFFLEN         16384    /* read size of files without a block size in the header; their codes restart every BUFFLEN bytes. */
+
+#define DEFAULT_BLOCK_SIZE  65536
+#define MIN_BLOCK_SIZE      4096
+#define MAX_BLOCK_SIZE      (64 << 20)
+
+#define SUBBLOCK_SIZE       4096          /* SUBBLOCK_FRAMING: bytes of codes per sub-block; up to 32767. */
+
+#define DIRECT_BLOCK        (1 << 20)     /* DIRECT_IO reads and writes; multiples of 4 Kb. */
+#define MIN_DIRECT_BLOCK    (64 << 10)
+#define MAX_DIRECT_BLOCK    (64 << 20)
 
 #define DEFAULT_MAX_BITS    15
-#define SUPPORTED_MAX_BITS  16
+#define SUPPORTED_MAX_BITS  20
+
+#define Z_MAX_BITS          16            /* COMPRESS_FORMAT: widest codes compress(1) reads. */
+#define Z_CLEAR             256           /* COMPRESS_FORMAT, block mode: clears the dictionary. */
+
+/* Messages of the packer and unpacker. The fixed footprint build has no
+   stdio and drops them; its calls report failure by their return only. */
+#ifdef LZW_FIXED_FOOTPRINT
+#define LZW_ERROR(...)  ((void)0)
+#define LZW_PRINT(...)  ((void)0)
+#else
+#include <stdio.h>
+#define LZW_ERROR(...)  fprintf (stderr, __VA_ARGS__)
+#define LZW_PRINT(...)  printf (__VA_ARGS__)
+#endif
 
 
 long fileSize (const char *filename);
@@ -1,6 +1,19 @@
 #pragma once
 
-enum { KEEP_ON_ERROR = 1, VERBOSE_OUTPUT = 2, OVERWRITE_FLAG = 4, DIAGNOSTIC_OUTPUT = 8 };
+#include <stddef.h>
+
+enum { KEEP_ON_ERROR = 1, VERBOSE_OUTPUT = 2, OVERWRITE_FLAG = 4, DIAGNOSTIC_OUTPUT = 8,
+       PIPELINED_IO = 16, /* reader and writer threads overlap file I/O with coding */
+       URING_IO = 32,     /* asynchronous file I/O through io_uring; stdio where unavailable */
+       RLE_STAGE = 64,    /* collapse long byte runs ahead of the dictionary coder */
+       ENTROPY_STAGE = 128, /* Huffman-code the emitted codes, one table per segment */
+       SPARSE_OUTPUT = 256, /* unpacked files: seek over 4 Kb blocks of zeros, leaving holes; overrides URING_IO */
+       DIRECT_IO = 512,    /* keep files out of the page cache (O_DIRECT, else posix_fadvise); overrides URING_IO */
+       SUBBLOCK_FRAMING = 1024, /* packer: frame segments as 4 Kb sub-blocks, so neither side holds a whole segment */
+       LRU_EVICTION = 2048, /* packer, LZW engine: a full dictionary gives up its least recently used leaf phrases
+                              one at a time instead of being cleared; implies SUBBLOCK_FRAMING, not with ENTROPY_STAGE */
+       COMPRESS_FORMAT = 4096 /* the .Z format of compress(1), codes of 9 to 16 bits; the packer writes block mode,
+                                 LZW engine only, without stages or filters */ };
 
 #ifdef __cplusplus
 extern "C"
@@ -10,9 +23,294 @@ extern "C"
 /* The following functions return 1 on success, 0 on error */
 extern int Decompress (const char *, const char *, int flags);
 extern int Compress (const char *, const char *, int flags);
-/* max_bits must be between 12 and 15 */
+/* max_bits must be between 12 and 20; 9 to 16 with COMPRESS_FORMAT */
 extern int Compress2 (const char *, const char *, int flags, int max_bits);
+/* Writes only the first n bytes of the unpacked file (all of it when shorter),
+   decoding and reading no further than they need. */
+extern int DecompressPrefix (const char *, size_t n, const char *, int flags);
+
+/* Reusable contexts. A context keeps its dictionary and I/O buffers between
+   calls, so repeated calls do not allocate. A context must only be used by one
+   thread at a time; different contexts may be used concurrently. */
+typedef struct LZW_CCtx LZW_CCtx;
+typedef struct LZW_DCtx LZW_DCtx;
+
+extern LZW_CCtx *lzw_cctx_create (void);
+extern void lzw_cctx_free (LZW_CCtx *);
+extern void lzw_cctx_reset (LZW_CCtx *);
+extern int lzw_compress_cctx (LZW_CCtx *, const char *, const char *, int flags, int max_bits);
+
+extern LZW_DCtx *lzw_dctx_create (void);
+extern void lzw_dctx_free (LZW_DCtx *);
+extern void lzw_dctx_reset (LZW_DCtx *);
+extern int lzw_decompress_dctx (LZW_DCtx *, const char *, const char *, int flags);
+extern int lzw_decompress_prefix_dctx (LZW_DCtx *, const char *, size_t n, const char *, int flags);
+
+/* Reversible filters run over the input, in the order they were added, before
+   it is packed; the chain is recorded in the header and undone by Decompress.
+   Delta subtracts the byte stride positions back (param 1..255); shuffle
+   groups byte k of each element of param bytes (2..255) together, per 64 Kb
+   block. For little-endian int32 records try delta 4 followed by shuffle 4.
+   Returns 0 when the filter or its param is invalid or the chain is full. */
+enum { LZW_FILTER_DELTA = 1, LZW_FILTER_SHUFFLE = 2 };
+
+#define LZW_MAX_FILTERS 4
+
+extern int lzw_cctx_add_filter (LZW_CCtx *, int filter, int param);
+extern void lzw_cctx_clear_filters (LZW_CCtx *);
+
+/* Size of the reads the packer codes from, 4 Kb to 64 Mb; 64 Kb by default.
+   Matches carry across reads, so this only trades memory for fewer calls.
+   It is stored in the header and sizes the unpacker's output buffer.
+   Returns 0 when out of range. */
+extern int lzw_cctx_set_block_size (LZW_CCtx *, size_t size);
+
+/* How the dictionary grows. LZW adds a phrase one byte longer than the last
+   one coded. LZMW adds the last two coded phrases joined, and LZAP adds the
+   first of them joined with every prefix of the second, so long repeats are
+   learnt in a few steps instead of one byte at a time. The phrase engines
+   need about three times the packer memory of LZW at the same width.
+   Returns 0 for an unknown engine. */
+enum { LZW_ENGINE_LZW = 0, LZW_ENGINE_LZMW = 1, LZW_ENGINE_LZAP = 2 };
+
+extern int lzw_cctx_set_engine (LZW_CCtx *, int engine);
+
+/* Size of the reads and writes of DIRECT_IO, 64 Kb to 64 Mb in steps of
+   4 Kb; 1 Mb by default. Returns 0 when out of range. */
+extern int lzw_cctx_set_io_block_size (LZW_CCtx *, size_t size);
+extern int lzw_dctx_set_io_block_size (LZW_DCtx *, size_t size);
+
+/* Gives dst the filters, block size, engine and memory limit of src. */
+extern void lzw_cctx_copy_settings (LZW_CCtx *dst, const LZW_CCtx *src);
+
+/* Memory accounting. A context counts every byte it allocates (tables,
+   segment buffers, stages and I/O rings, which it keeps between calls), and
+   peak_memory is the most it has held at once; the context object itself is
+   not included. Under a limit (0 for none), an allocation that would go
+   over it fails, and so does the call. Limits also cut the I/O rings of
+   PIPELINED_IO and URING_IO to an eighth of the limit each, dropping them
+   when two blocks do not fit; DIRECT_IO falls back to stdio when its block
+   does not fit. */
+extern int lzw_cctx_set_memory_limit (LZW_CCtx *, size_t bytes);
+extern int lzw_dctx_set_memory_limit (LZW_DCtx *, size_t bytes);
+extern size_t lzw_cctx_peak_memory (const LZW_CCtx *);
+extern size_t lzw_dctx_peak_memory (const LZW_DCtx *);
+extern size_t lzw_cctx_memory_limit (const LZW_CCtx *);
+
+/* Custom allocator. All internal allocations of a context created with
+   lzw_?ctx_create_advanced go through it. free receives the size that was
+   passed to alloc. Returned memory must be aligned for any type. */
+typedef struct lzw_allocator
+{
+  void *(*alloc) (void *opaque, size_t size);
+  void (*free) (void *opaque, void *ptr, size_t size);
+  void *opaque;
+} lzw_allocator;
+
+extern LZW_CCtx *lzw_cctx_create_advanced (const lzw_allocator *);
+extern LZW_DCtx *lzw_dctx_create_advanced (const lzw_allocator *);
+
+/* Built-in strategies. The arena hands out memory by bumping a pointer and
+   frees nothing until lzw_arena_reset/lzw_arena_release; it suits one-shot
+   calls. The huge page allocator backs large blocks (dictionaries) with
+   MAP_HUGETLB pages, or transparent huge pages when none are reserved. */
+enum { LZW_ARENA_HUGEPAGES = 1 };
+
+typedef struct lzw_arena lzw_arena;
+
+extern lzw_arena *lzw_arena_create (size_t capacity, int arena_flags);
+extern void lzw_arena_reset (lzw_arena *);
+extern void lzw_arena_release (lzw_arena *);
+extern lzw_allocator lzw_arena_allocator (lzw_arena *);
+extern lzw_allocator lzw_hugepage_allocator (void);
+
+/* Streaming decompression. Compressed input is pulled through source->read,
+   which returns the number of bytes placed in buf, 0 at the end of input or
+   -1 on error. Decoded output is pushed to sink->write straight from the
+   unpacker's output buffer (after the run-length and filter stages, when the
+   file uses them), in chunks no larger than the block size or 2^max_bits,
+   whichever is larger. A non-zero return from write stops decoding, and the
+   call then fails without a message. */
+typedef struct lzw_source
+{
+  ptrdiff_t (*read) (void *opaque, void *buf, size_t len);
+  void *opaque;
+} lzw_source;
+
+typedef struct lzw_sink
+{
+  int (*write) (void *opaque, const void *buf, size_t len);
+  void *opaque;
+} lzw_sink;
+
+extern int lzw_decompress_stream (LZW_DCtx *, const lzw_source *, const lzw_sink *, int flags);
+
+/* Packs exactly size bytes pulled from source; fails if the source ends
+   early or has more. */
+extern int lzw_compress_stream (LZW_CCtx *, const lzw_source *, size_t size, const lzw_sink *, int flags, int max_bits);
+
+/* Multi-member archives. Each file is packed as its own stream, with the
+   filters, block size and engine of settings (defaults when NULL), and
+   listed by name in a table of contents, so single members unpack without
+   touching the others. Names must be relative paths without . or ..
+   parts; members unpack to the same paths, creating directories on the way.
+   Extract unpacks the named members, or all of them when count is 0. Work
+   is spread over jobs threads, one per core when jobs is 0, each with its
+   own context. */
+extern int lzw_archive_create (const char *archive, const char *const *files, int count, const LZW_CCtx *settings,
+                               int flags, int max_bits, int jobs);
+extern int lzw_archive_extract (const char *archive, const char *const *names, int count, int flags, int jobs);
+/* Extract within max_memory bytes (0 for no limit), shared evenly by the
+   workers; there are no more of them than can each unpack the widest
+   member at its worst case (lzw_dctx_workspace_size). Create takes its
+   limit from settings, and halves each worker's share between its context
+   and the packed member it holds. */
+extern int lzw_archive_extract2 (const char *archive, const char *const *names, int count, int flags, int jobs,
+                                 size_t max_memory);
+extern int lzw_archive_list (const char *archive);
+
+/* Appending. Files packed since this was added record the unpacked size of
+   everything in them, and further streams may follow the first one; the
+   unpackers decode them in turn. lzw_append packs filename onto the end of
+   archive, with the filters, block size and engine of settings (defaults
+   when NULL); lzw_concat adds the streams of other, packed separately, as
+   they are. Either updates the recorded size in place, and on failure
+   truncates archive back to what it was. Older files cannot be appended to. */
+extern int lzw_append (const char *archive, const char *filename, const LZW_CCtx *settings, int flags, int max_bits);
+extern int lzw_concat (const char *archive, const char *other);
+
+/* Search. Finds every occurrence of pattern, overlapping ones included, in
+   what filename unpacks to, without writing it anywhere, and calls match
+   (when not NULL) with the offset of each, in increasing order, from the
+   calling thread; a non-zero return stops the search. Streams packed with
+   the LZW engine, in blocks and without RLE, filters or sub-blocks, are
+   searched on their codes: every dictionary entry gets bit masks of how
+   the pattern overlaps it when it is added, so a code costs the same
+   whatever its length, and the segments between dictionary resets are
+   shared out over jobs threads, one per core when jobs is 0. Anything
+   else, and patterns over 64 bytes, is unpacked in memory and scanned. Returns the number of
+   matches, or -1 on error. */
+typedef int (*lzw_match_fn) (void *opaque, unsigned long long offset);
+
+extern long long lzw_search (const char *filename, const void *pattern, size_t length, int flags, int jobs,
+                             lzw_match_fn match, void *opaque);
+
+/* Random access. lzw_open unpacks filename once, into nothing, to index
+   where each segment starts in the file and in the unpacked data; as a
+   segment starts with an empty dictionary, lzw_pread then unpacks only the
+   segments the range falls in. The ones read last are kept unpacked, up
+   to cache_size bytes (LZW_DEFAULT_CACHE when 0); larger ones are
+   unpacked up to the end of the range each time. Streams with RLE or
+   filters, and files packed before blocks, are a single segment.
+   lzw_pread returns the number of bytes read, fewer than len only at the
+   end of the data, or -1 on error. A handle is for one thread at a time. */
+#define LZW_DEFAULT_CACHE (16 << 20)
+
+typedef struct LZW_File LZW_File;
+
+extern LZW_File *lzw_open (const char *filename, size_t cache_size);
+extern ptrdiff_t lzw_pread (LZW_File *file, void *buf, size_t len, unsigned long long offset);
+extern unsigned long long lzw_file_size (const LZW_File *file);
+extern void lzw_close (LZW_File *file);
+
+/* Contexts in a workspace the caller provides, at least
+   lzw_?ctx_workspace_size (max_bits) bytes and aligned for any type. All
+   they can need at up to max_bits codes, with any engine, the entropy
+   stage, RLE and filters, is set aside in it when they are created, so
+   later calls never allocate; wider streams are refused. The packer reads
+   in blocks of LZW_STATIC_BLOCK_SIZE and its block size cannot be changed.
+   The workspace must outlive the context, and is not freed by lzw_?ctx_free.
+
+   Built with LZW_FIXED_FOOTPRINT defined (make fixedlib), the library has no
+   heap and no stdio: only the stream functions and contexts created here or
+   with a caller's allocator are left, and errors are reported by return
+   values alone. */
+enum { LZW_STATIC_BLOCK_SIZE = 4096 };
+
+extern LZW_CCtx *lzw_cctx_create_static (void *workspace, size_t size, int max_bits);
+extern LZW_DCtx *lzw_dctx_create_static (void *workspace, size_t size, int max_bits);
+
+/* Client of the lzw16d daemon (Linux), which packs and unpacks on worker
+   threads with warm contexts, so short-lived processes do not pay for
+   setting up their own. The calls mirror the ones above: files are handed
+   to the daemon as open descriptors, and stream payloads larger than 64 Kb
+   are passed in a sealed memfd rather than through the socket. path is the
+   daemon's socket, LZW_DAEMON_SOCKET when NULL. A connection must only be
+   used by one thread at a time. */
+#define LZW_DAEMON_SOCKET "/tmp/lzw16d.sock"
+
+typedef struct LZW_Client LZW_Client;
+
+extern LZW_Client *lzw_client_connect (const char *path);
+extern void lzw_client_close (LZW_Client *);
+extern int lzw_client_set_engine (LZW_Client *, int engine);
+extern int lzw_client_compress (LZW_Client *, const char *, const char *, int flags, int max_bits);
+extern int lzw_client_decompress (LZW_Client *, const char *, const char *, int flags);
+extern int lzw_client_compress_stream (LZW_Client *, const lzw_source *, size_t size, const lzw_sink *, int flags, int max_bits);
+extern int lzw_client_decompress_stream (LZW_Client *, const lzw_source *, const lzw_sink *, int flags);
+
+/* Daemon counters since it started; [0] for packing, [1] for unpacking.
+   latency[k] counts requests served in under 2^k microseconds (and at
+   least half that), the last bucket everything slower. */
+enum { LZW_DAEMON_LATENCY_BUCKETS = 24 };
+
+typedef struct lzw_daemon_stats
+{
+  unsigned long long requests[2], failures[2];
+  unsigned long long bytes_in[2], bytes_out[2];
+  unsigned long long busy_ns[2], max_ns[2];
+  unsigned long long latency[2][LZW_DAEMON_LATENCY_BUCKETS];
+  unsigned long long uptime_ns;
+  unsigned long long workers;
+} lzw_daemon_stats;
+
+extern int lzw_client_stats (LZW_Client *, lzw_daemon_stats *);
 
 #ifdef __cplusplus
 } // extern "C"
+
+/* What the workspaces are made of; the library checks these against its
+   own sizes when it is built. */
+namespace lzw_footprint
+{
+  constexpr size_t ARENA = 32;                    // bump allocator bookkeeping.
+  constexpr size_t CCTX = 6144, DCTX = 12288;     // the context objects.
+  constexpr size_t STAGES = 3 * 65536;            // RLE block, filter block and filter scratch.
+  constexpr size_t PHRASE_CAP = 8192;             // packer look-ahead past a block.
+  constexpr size_t LEGACY_BLOCK = 16384;          // restart interval of files without a block size.
+  constexpr size_t SUB_BLOCK = 4096 + 256;        // SUBBLOCK_FRAMING: a sub-block and the codes carried over.
+
+  constexpr size_t codes (int bits) { return (size_t)1 << bits; }
+
+  constexpr size_t larger (size_t a, size_t b) { return a > b ? a : b; }
+
+  // one segment as the packer builds it: the Huffman codings take up to
+  // 32 bits a code, plus the table. Sub-blocks, which LRU_EVICTION segments
+  // are sent in as they never end, can be longer at narrow widths.
+  constexpr size_t pack_line (int bits) { return larger (4 * codes (bits) + 256, SUB_BLOCK); }
+
+  // one segment as the unpacker reads it, at most every code at full width,
+  // or the window on a segment read in sub-blocks.
+  constexpr size_t unpack_segment (int bits) { return larger (codes (bits) * bits / 8 + 64, SUB_BLOCK); }
+
+  constexpr bool valid (int bits) { return bits >= 9 && bits <= 20; }
+}
+
+// hash table of the phrase trie (32), its tables (16), entropy stage codes and distances (8).
+constexpr size_t lzw_cctx_workspace_size (int max_bits)
+{
+  return !lzw_footprint::valid (max_bits) ? 0 :
+         lzw_footprint::ARENA + lzw_footprint::CCTX + lzw_footprint::STAGES +
+         LZW_STATIC_BLOCK_SIZE + lzw_footprint::PHRASE_CAP + lzw_footprint::pack_line (max_bits) +
+         (32 + 16 + 8) * lzw_footprint::codes (max_bits);
+}
+
+// dictionary (5), phrase tables (20), then the string stack and output line.
+constexpr size_t lzw_dctx_workspace_size (int max_bits)
+{
+  return !lzw_footprint::valid (max_bits) ? 0 :
+         lzw_footprint::ARENA + lzw_footprint::DCTX + lzw_footprint::STAGES +
+         lzw_footprint::unpack_segment (max_bits) + (5 + 20) * lzw_footprint::codes (max_bits) +
+         2 * lzw_footprint::larger (lzw_footprint::codes (max_bits), lzw_footprint::LEGACY_BLOCK);
+}
 #endif
@@ -27,6 +27,245 @@
 
 #ifdef LIBTEST_MAIN  // add LIBTEST #define to compile the test with static library
 
+/* counts what a context allocates, to report dictionary footprints. */
+struct countingHeap
+{
+    size_t current, peak;
+};
+
+static void *countingAlloc (void *opaque, size_t size)
+{
+    countingHeap *heap = (countingHeap *)opaque;
+
+    void *ptr = malloc (size);
+
+    if (ptr)
+    {
+        heap->current += size;
+        if (heap->current > heap->peak) heap->peak = heap->current;
+    }
+
+    return ptr;
+}
+
+static void countingFree (void *opaque, void *ptr, size_t size)
+{
+    countingHeap *heap = (countingHeap *)opaque;
+
+    if (ptr) heap->current -= size;
+
+    free (ptr);
+}
+
+/* stream callbacks: the source reads a FILE *, the sink compares what it is
+   given with another one and can stop after a number of bytes. */
+struct streamCheck
+{
+    FILE *expected;
+    size_t seen, stop_after;
+    bool mismatch;
+};
+
+static ptrdiff_t fileSource (void *opaque, void *buf, size_t len)
+{
+    FILE *fp = (FILE *)opaque;
+
+    size_t n = fread (buf, 1, len, fp);
+
+    return ferror (fp) ? -1 : (ptrdiff_t)n;
+}
+
+static int compareSink (void *opaque, const void *buf, size_t len)
+{
+    streamCheck *check = (streamCheck *)opaque;
+    char chunk[4096];
+
+    for (size_t done = 0; done < len; )
+    {
+        size_t n = (len - done < sizeof(chunk)) ? len - done : sizeof(chunk);
+
+        if (n != fread (chunk, 1, n, check->expected) || memcmp (chunk, (const char *)buf + done, n) != 0)
+        {
+            check->mismatch = true;
+            return 1;
+        }
+
+        done += n;
+    }
+
+    check->seen += len;
+
+    return (check->seen >= check->stop_after) ? 1 : 0;
+}
+
+static int fileSink (void *opaque, const void *buf, size_t len)
+{
+    return (len == fwrite (buf, 1, len, (FILE *)opaque)) ? 0 : 1;
+}
+
+/* search callback: checks each match against the unpacked data and that
+   they come in order; can stop after a number of them. */
+struct searchCheck
+{
+    const unsigned char *data, *pattern;
+    size_t size, length;
+    unsigned long long next;
+    long long seen, stop_after;
+    bool mismatch;
+};
+
+static int checkMatch (void *opaque, unsigned long long offset)
+{
+    searchCheck *check = (searchCheck *)opaque;
+
+    if (offset < check->next || offset + check->length > check->size ||
+        memcmp (check->data + offset, check->pattern, check->length) != 0)
+        check->mismatch = true;
+
+    check->next = offset + 1;
+    check->seen++;
+
+    return (check->seen == check->stop_after) ? 1 : 0;
+}
+
+/* a 9-bit .Z stream whose 257 codes of 'a' fill its table, followed by
+   two codes of 512, a phrase that can never exist. */
+static bool writeFullTableZ (const char *filename)
+{
+    unsigned char data[3 + 33 * 9 + 10] = { 0x1F, 0x9D, 9 };
+    size_t bit = 0;
+
+    for (int k = 0; k < 259; k++)
+    {
+        // the group of the 257th code is padded as the codes widen to 10 bits.
+        unsigned code = (k < 257) ? 'a' : 512, n = (k < 257) ? 9 : 10;
+
+        if (k == 257)
+            bit = 33 * 9 * 8;
+
+        for (unsigned b = 0; b < n; b++, bit++)
+            if (code & (1U << b))
+                data[3 + bit / 8] |= (unsigned char)(1U << (bit % 8));
+    }
+
+    FILE *fp = fopen (filename, "wb");
+
+    if (!fp)
+        return false;
+
+    bool ok = sizeof(data) == fwrite (data, 1, sizeof(data), fp);
+
+    return (fclose (fp) == 0) && ok;
+}
+
+/* packs inputFile into compressedFile through the callbacks. */
+static int streamCompress (LZW_CCtx *cctx, const char *inputFile, const char *compressedFile, int flags, int bits)
+{
+    FILE *in = fopen (inputFile, "rb");
+    FILE *out = fopen (compressedFile, "wb");
+
+    lzw_source source = { fileSource, in };
+    lzw_sink sink = { fileSink, out };
+
+    int ret = in && out && lzw_compress_stream (cctx, &source, (size_t)fileSize (inputFile), &sink, flags, bits);
+
+    if (in) fclose (in);
+    if (out && fclose (out) != 0) ret = 0;
+
+    return ret;
+}
+
+/* decodes compressedFile through the callbacks, checking it against
+   inputFile; returns the Decompress result. */
+static int streamDecompress (LZW_DCtx *dctx, const char *compressedFile, const char *inputFile,
+                             size_t stop_after, streamCheck & check)
+{
+    FILE *in = fopen (compressedFile, "rb");
+    FILE *expected = fopen (inputFile, "rb");
+
+    check.expected = expected;
+    check.seen = 0;
+    check.stop_after = stop_after;
+    check.mismatch = false;
+
+    lzw_source source = { fileSource, in };
+    lzw_sink sink = { compareSink, &check };
+
+    int ret = in && expected && lzw_decompress_stream (dctx, &source, &sink, 0);
+
+    if (in) fclose (in);
+    if (expected) fclose (expected);
+
+    return ret;
+}
+
+/* memory / speed / ratio of every other code width on one file, and of the
+   phrase engines at 16 and 20 bits. */
+static int benchmarkWidths (const char *inputFile, const char *compressedFile, const char *outputFile)
+{
+    static const char *names[] = { "lzw", "lzmw", "lzap" };
+    static const struct { int bits, engine, flags; } runs[] =
+    {
+        { 12, LZW_ENGINE_LZW, 0 }, { 14, LZW_ENGINE_LZW, 0 }, { 16, LZW_ENGINE_LZW, 0 },
+        { 17, LZW_ENGINE_LZW, 0 }, { 18, LZW_ENGINE_LZW, 0 }, { 19, LZW_ENGINE_LZW, 0 },
+        { 20, LZW_ENGINE_LZW, 0 },
+        { 16, LZW_ENGINE_LZMW, 0 }, { 16, LZW_ENGINE_LZAP, 0 },
+        { 20, LZW_ENGINE_LZMW, 0 }, { 20, LZW_ENGINE_LZAP, 0 },
+        { 16, LZW_ENGINE_LZW, ENTROPY_STAGE }, { 20, LZW_ENGINE_LZW, ENTROPY_STAGE },
+        { 20, LZW_ENGINE_LZMW, ENTROPY_STAGE }, { 20, LZW_ENGINE_LZAP, ENTROPY_STAGE }
+    };
+
+    long orig_size = fileSize (inputFile);
+
+    printf ("bits engine  huff  ratio    pack ms  pack mem   unpack ms  unpack mem\n");
+
+    for (const auto & run : runs)
+    {
+        int bits = run.bits;
+        int engine = run.engine;
+
+        countingHeap pheap = { 0, 0 }, uheap = { 0, 0 };
+        lzw_allocator pa = { countingAlloc, countingFree, &pheap };
+        lzw_allocator ua = { countingAlloc, countingFree, &uheap };
+
+        LZW_CCtx *cctx = lzw_cctx_create_advanced (&pa);
+        LZW_DCtx *dctx = lzw_dctx_create_advanced (&ua);
+
+        auto t0 = std::chrono::high_resolution_clock::now();
+
+        int ret = cctx && lzw_cctx_set_engine (cctx, engine) &&
+                  lzw_compress_cctx (cctx, inputFile, compressedFile, run.flags, bits);
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+
+        ret = ret && dctx && lzw_decompress_dctx (dctx, compressedFile, outputFile, OVERWRITE_FLAG);
+
+        auto t2 = std::chrono::high_resolution_clock::now();
+
+        lzw_cctx_free (cctx);
+        lzw_dctx_free (dctx);
+
+        if (!ret)
+        {
+            printf ("%d bits %s failed.\n", bits, names[engine]);
+            return EXIT_FAILURE;
+        }
+
+        long packed_size = fileSize (compressedFile);
+
+        printf ("%4d %-6s %-4s %5.1f%%  %9ld  %7zu Kb  %9ld  %7zu Kb\n", bits, names[engine],
+                (run.flags & ENTROPY_STAGE) ? "yes" : "no",
+                100.0 * packed_size / (orig_size ? orig_size : 1),
+                (long)std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count(), pheap.peak / 1024,
+                (long)std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1).count(), uheap.peak / 1024);
+    }
+
+    remove (compressedFile);
+    remove (outputFile);
+
+    return EXIT_SUCCESS;
+}
+
 int main (int argc, char *argv[])
 {
     int bits = DEFAULT_MAX_BITS;
@@ -38,13 +277,21 @@ int main (int argc, char *argv[])
 
     char outputFile [PATH_MAX] = { 0 };
 
+    bool bench = false;
+
     if (2 == argc)
     {
         strcpy_s (inputFile, PATH_MAX, argv[1]);
     } 
     else if (3 == argc)
     {
-        if (0 == strncmp (argv[1], "-b", 2))
+        if (0 == strcmp (argv[1], "-bench"))
+        {
+            bench = true;
+
+            strcpy_s(inputFile, PATH_MAX, argv[2]);
+        }
+        else if (0 == strncmp (argv[1], "-b", 2))
         {
             char *ptr = argv[1];
             bits = atoi (ptr + 2);
@@ -57,7 +304,7 @@ int main (int argc, char *argv[])
 
     if (strlen (inputFile) == 0 || (bits < 9 || bits > SUPPORTED_MAX_BITS))
     {
-        printf ("Usage: %s [-b{12-16}] fileToCompress\n", argv[0]);
+        printf ("Usage: %s [-b{9-20} | -bench] fileToCompress\n", argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -69,6 +316,9 @@ int main (int argc, char *argv[])
 
     assert (strlen(compressedFile) > 0 && strlen (outputFile) > 0);
 
+    if (bench)
+        return benchmarkWidths (inputFile, compressedFile, outputFile);
+
     std::chrono::high_resolution_clock::time_point start;
 
     start = std::chrono::high_resolution_clock::now();
@@ -104,6 +354,411 @@ int main (int argc, char *argv[])
 
     std::cout << duration.count() << " microsecs\n";
 
+    /* just the beginning of the file. */
+
+    long head = fileSize (inputFile) / 3;
+
+    ret = DecompressPrefix (compressedFile, (size_t)head, outputFile, OVERWRITE_FLAG) && fileSize (outputFile) == head;
+
+    printf ("Prefix decompression %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* with holes for the blocks of zeros, which must not shorten it. */
+
+    ret = Decompress (compressedFile, outputFile, OVERWRITE_FLAG | SPARSE_OUTPUT) && fileSize (outputFile) == fileSize (inputFile);
+
+    printf ("Sparse decompression %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* around the page cache, with an odd number of 4 Kb pages per block. */
+
+    LZW_DCtx *direct = lzw_dctx_create ();
+
+    ret = direct && lzw_dctx_set_io_block_size (direct, 68 * 1024) && !lzw_dctx_set_io_block_size (direct, 68 * 1024 + 1) &&
+          lzw_decompress_dctx (direct, compressedFile, outputFile, OVERWRITE_FLAG | DIRECT_IO) &&
+          fileSize (outputFile) == fileSize (inputFile);
+
+    lzw_dctx_free (direct);
+
+    printf ("Direct I/O decompression %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* the .Z format of compress(1), whose codes stop at 16 bits. */
+
+    ret = Compress2 (inputFile, compressedFile, OVERWRITE_FLAG | COMPRESS_FORMAT, bits > Z_MAX_BITS ? Z_MAX_BITS : bits) &&
+          Decompress (compressedFile, outputFile, OVERWRITE_FLAG | COMPRESS_FORMAT) && fileSize (outputFile) == fileSize (inputFile);
+
+    printf (".Z format %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    ret = writeFullTableZ (compressedFile) && !Decompress (compressedFile, outputFile, OVERWRITE_FLAG | COMPRESS_FORMAT);
+
+    printf (".Z past a full table %s.\n", ret ? "rejected" : "accepted");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* segments framed as sub-blocks; the copy appended below is not. */
+
+    ret = Compress2 (inputFile, compressedFile, OVERWRITE_FLAG | SUBBLOCK_FRAMING, bits) &&
+          Decompress (compressedFile, outputFile, OVERWRITE_FLAG) && fileSize (outputFile) == fileSize (inputFile);
+
+    printf ("Sub-block framing %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* a full dictionary gives up its least recently used phrases instead. */
+
+    ret = Compress2 (inputFile, compressedFile, OVERWRITE_FLAG | LRU_EVICTION, bits) &&
+          Decompress (compressedFile, outputFile, OVERWRITE_FLAG) && fileSize (outputFile) == fileSize (inputFile);
+
+    printf ("LRU eviction %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* the file appended to its own packed copy unpacks twice over. */
+
+    ret = lzw_append (compressedFile, inputFile, NULL, 0, bits) &&
+          Decompress (compressedFile, outputFile, OVERWRITE_FLAG) && fileSize (outputFile) == 2 * fileSize (inputFile);
+
+    printf ("Append %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* same round trip through reusable contexts; later passes allocate nothing. */
+
+    LZW_CCtx *cctx = lzw_cctx_create ();
+    LZW_DCtx *dctx = lzw_dctx_create ();
+
+    if (!cctx || !dctx)
+    {
+        printf ("Failed to create contexts.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int pass = 0; pass < 3; pass++)
+    {
+        start = std::chrono::high_resolution_clock::now();
+
+        ret = lzw_compress_cctx (cctx, inputFile, compressedFile, 0, bits) &&
+              lzw_decompress_dctx (dctx, compressedFile, outputFile, OVERWRITE_FLAG);
+
+        end = std::chrono::high_resolution_clock::now();
+        duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+        printf ("Context pass %d %s: ", pass + 1, ret ? "successful" : "failed");
+        std::cout << duration.count() << " microsecs\n";
+
+        if (!ret)
+            return EXIT_FAILURE;
+    }
+
+    /* the same file through stream callbacks: in full, then stopping after the first chunk. */
+
+    streamCheck check;
+
+    ret = streamDecompress (dctx, compressedFile, inputFile, (size_t)-1, check);
+
+    printf ("Stream decompression %s.\n", (ret && !check.mismatch) ? "successful" : "failed");
+
+    if (!ret || check.mismatch)
+        return EXIT_FAILURE;
+
+    if (fileSize (inputFile) > 0)
+    {
+        ret = streamDecompress (dctx, compressedFile, inputFile, 1, check);
+
+        printf ("Stopped stream %s.\n", (!ret && !check.mismatch && check.seen > 0) ? "successful" : "failed");
+
+        if (ret || check.mismatch || check.seen == 0)
+            return EXIT_FAILURE;
+    }
+
+    /* and packed through them too. */
+
+    ret = streamCompress (cctx, inputFile, compressedFile, 0, bits) && streamDecompress (dctx, compressedFile, inputFile, (size_t)-1, check) && !check.mismatch;
+
+    /* a source with more or less than the size given is refused. */
+
+    for (int k = -1; ret && k <= 1 && fileSize (inputFile) > 0; k += 2)
+    {
+        FILE *in = fopen (inputFile, "rb");
+        FILE *out = fopen (compressedFile, "wb");
+
+        lzw_source source = { fileSource, in };
+        lzw_sink sink = { fileSink, out };
+
+        ret = in && out && !lzw_compress_stream (cctx, &source, (size_t)(fileSize (inputFile) + k), &sink, 0, bits);
+
+        if (in) fclose (in);
+        if (out) fclose (out);
+    }
+
+    printf ("Stream compression %s.\n", ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    lzw_cctx_free (cctx);
+    lzw_dctx_free (dctx);
+
+    /* one-shot round trip with everything placed in a bump arena, then with huge pages. */
+
+    lzw_arena *arena = lzw_arena_create (64 << 20, 0);
+    lzw_allocator allocators[2];
+
+    if (!arena)
+    {
+        printf ("Failed to create arena.\n");
+        return EXIT_FAILURE;
+    }
+
+    allocators[0] = lzw_arena_allocator (arena);
+    allocators[1] = lzw_hugepage_allocator ();
+
+    for (int k = 0; k < 2; k++)
+    {
+        cctx = lzw_cctx_create_advanced (&allocators[k]);
+        dctx = lzw_dctx_create_advanced (&allocators[k]);
+
+        ret = cctx && dctx &&
+              lzw_compress_cctx (cctx, inputFile, compressedFile, 0, bits) &&
+              lzw_decompress_dctx (dctx, compressedFile, outputFile, OVERWRITE_FLAG);
+
+        printf ("%s allocator %s.\n", k == 0 ? "Arena" : "Huge page", ret ? "successful" : "failed");
+
+        lzw_cctx_free (cctx);
+        lzw_dctx_free (dctx);
+
+        if (!ret)
+            return EXIT_FAILURE;
+    }
+
+    lzw_arena_release (arena);
+
+    /* static contexts, in workspaces of exactly the documented size: every
+       stage at once with two engines, then a stream too wide for them. */
+
+    static const struct { int bits; size_t cctx, dctx; } footprints[] =
+    {
+        {  9,   248096,   258848 },
+        { 10,   276768,   271648 },
+        { 11,   338208,   297248 },
+        { 12,   461088,   350304 },
+        { 13,   706848,   459872 },
+        { 14,  1198368,   680032 },
+        { 15,  2181408,  1155168 },
+        { 16,  4147488,  2109536 },
+        { 17,  8079648,  4026464 },
+        { 18, 15943968,  7876704 },
+        { 19, 31672608, 15609952 },
+        { 20, 63129888, 31141984 },
+    };
+
+    for (const auto & f : footprints)
+    {
+        if (lzw_cctx_workspace_size (f.bits) != f.cctx || lzw_dctx_workspace_size (f.bits) != f.dctx)
+        {
+            printf ("Workspace sizes for %d bits changed.\n", f.bits);
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t csize = lzw_cctx_workspace_size (bits), dsize = lzw_dctx_workspace_size (bits);
+    void *cspace = malloc (csize);
+    void *dspace = malloc (dsize);
+
+    cctx = cspace ? lzw_cctx_create_static (cspace, csize, bits) : NULL;
+    dctx = dspace ? lzw_dctx_create_static (dspace, dsize, bits) : NULL;
+
+    ret = cctx && dctx && lzw_cctx_add_filter (cctx, LZW_FILTER_DELTA, 4) && lzw_cctx_add_filter (cctx, LZW_FILTER_SHUFFLE, 4);
+
+    for (int pass = 0; ret && pass < 3; pass++)
+    {
+        lzw_cctx_set_engine (cctx, pass == 0 ? LZW_ENGINE_LZAP : LZW_ENGINE_LZW);
+
+        ret = streamCompress (cctx, inputFile, compressedFile, RLE_STAGE | (pass == 2 ? LRU_EVICTION : ENTROPY_STAGE), bits) &&
+              streamDecompress (dctx, compressedFile, inputFile, (size_t)-1, check) && !check.mismatch;
+    }
+
+    if (ret && bits < SUPPORTED_MAX_BITS)
+        ret = !streamCompress (cctx, inputFile, compressedFile, 0, bits + 1);
+
+    printf ("Static contexts (%zu and %zu bytes) %s.\n", csize, dsize, ret ? "successful" : "failed");
+
+    lzw_cctx_free (cctx);
+    lzw_dctx_free (dctx);
+    free (cspace);
+    free (dspace);
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* memory accounting: the contexts' peaks are what their allocators saw
+       beyond the context objects, and limits of exactly the peaks hold the
+       same work, while a byte less does not. */
+
+    countingHeap pheap = { 0, 0 }, uheap = { 0, 0 };
+    lzw_allocator pa = { countingAlloc, countingFree, &pheap };
+    lzw_allocator ua = { countingAlloc, countingFree, &uheap };
+
+    cctx = lzw_cctx_create_advanced (&pa);
+    dctx = lzw_dctx_create_advanced (&ua);
+
+    size_t pobject = pheap.peak, uobject = uheap.peak;
+
+    ret = cctx && dctx && streamCompress (cctx, inputFile, compressedFile, ENTROPY_STAGE, bits) &&
+          streamDecompress (dctx, compressedFile, inputFile, (size_t)-1, check) && !check.mismatch;
+
+    size_t ppeak = lzw_cctx_peak_memory (cctx), upeak = lzw_dctx_peak_memory (dctx);
+
+    ret = ret && ppeak > 0 && upeak > 0 && ppeak == pheap.peak - pobject && upeak == uheap.peak - uobject;
+
+    lzw_cctx_free (cctx);
+    lzw_dctx_free (dctx);
+
+    for (int under = 0; ret && under < 2; under++)
+    {
+        cctx = lzw_cctx_create ();
+        dctx = lzw_dctx_create ();
+
+        ret = cctx && dctx && lzw_cctx_set_memory_limit (cctx, ppeak - under) && lzw_dctx_set_memory_limit (dctx, upeak - under);
+
+        // unpacking first, the stream packed by the run before.
+        int unpacked = ret && streamDecompress (dctx, compressedFile, inputFile, (size_t)-1, check) && !check.mismatch;
+        int packed = ret && streamCompress (cctx, inputFile, compressedFile, ENTROPY_STAGE, bits);
+
+        ret = ret && (under ? !packed && !unpacked : packed && unpacked);
+
+        lzw_cctx_free (cctx);
+        lzw_dctx_free (dctx);
+    }
+
+    printf ("Memory accounting (%zu and %zu bytes at peak) %s.\n", ppeak, upeak, ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
+    /* searching the packed file finds what searching the input does: short
+       patterns on the codes, on one thread and on several, and a long one
+       and an RLE stream by unpacking. */
+
+    size_t size = (size_t)fileSize (inputFile);
+    unsigned char *data = (unsigned char *)malloc (size + 1);
+    FILE *in = fopen (inputFile, "rb");
+
+    ret = data && in && size == fread (data, 1, size, in);
+
+    if (in)
+        fclose (in);
+
+    static const struct { size_t length; int flags, jobs; } searches[] =
+    {
+        { 4, 0, 1 }, { 4, 0, 4 }, { 1, ENTROPY_STAGE, 3 }, { 64, 0, 2 }, { 100, 0, 2 }, { 4, RLE_STAGE, 1 }
+    };
+
+    long long matches = 0;
+
+    for (const auto & run : searches)
+    {
+        if (!ret)
+            break;
+
+        if (size < run.length)
+            continue;
+
+        const unsigned char *pattern = data + (size - run.length) / 2;
+        searchCheck check = { data, pattern, size, run.length, 0, 0, -1, false };
+        long long expected = 0;
+
+        for (size_t k = 0; k + run.length <= size; k++)
+            expected += (memcmp (data + k, pattern, run.length) == 0);
+
+        ret = Compress2 (inputFile, compressedFile, run.flags | OVERWRITE_FLAG, bits) &&
+              lzw_search (compressedFile, pattern, run.length, 0, run.jobs, checkMatch, &check) == expected &&
+              check.seen == expected && !check.mismatch;
+
+        matches += expected;
+
+        // stopped at the first match.
+        check.next = 0;
+        check.seen = 0;
+        check.stop_after = 1;
+
+        ret = ret && lzw_search (compressedFile, pattern, run.length, 0, run.jobs, checkMatch, &check) == 1 &&
+              check.seen == 1 && !check.mismatch;
+    }
+
+    printf ("Search (%lld matches) %s.\n", matches, ret ? "successful" : "failed");
+
+    if (!ret)
+    {
+        free (data);
+        return EXIT_FAILURE;
+    }
+
+    /* reads at random offsets through a small cache, so that segments are
+       both kept and unpacked each time; then with the entropy stage, and
+       with the file appended to itself, which reads it twice over. */
+
+    static const int randomFlags[] = { 0, ENTROPY_STAGE, -1 };
+
+    unsigned char *window = (unsigned char *)malloc (1 << 16);
+    unsigned seed = 1;
+    int reads = 0;
+
+    ret = (window != NULL);
+
+    for (int flags : randomFlags)
+    {
+        if (!ret)
+            break;
+
+        ret = (flags < 0) ? lzw_append (compressedFile, inputFile, NULL, 0, bits)
+                          : Compress2 (inputFile, compressedFile, flags | OVERWRITE_FLAG, bits);
+
+        unsigned long long total = (flags < 0) ? 2 * (unsigned long long)size : size;
+        LZW_File *file = ret ? lzw_open (compressedFile, 64 * 1024) : NULL;
+
+        ret = file && lzw_file_size (file) == total && lzw_pread (file, window, 1, total) == 0;
+
+        for (int k = 0; ret && k < 200; k++)
+        {
+            seed = seed * 1103515245 + 12345;
+            unsigned long long offset = (unsigned long long)seed % (total + 1);
+            size_t len = (seed >> 8) % (1 << 16);
+            size_t expected = (total - offset < len) ? (size_t)(total - offset) : len;
+
+            ret = lzw_pread (file, window, len, offset) == (ptrdiff_t)expected;
+
+            for (size_t j = 0; ret && j < expected; j++)
+                ret = window[j] == data[(offset + j) % size];
+
+            reads++;
+        }
+
+        lzw_close (file);
+    }
+
+    free (window);
+    free (data);
+
+    printf ("Random access (%d reads) %s.\n", reads, ret ? "successful" : "failed");
+
+    if (!ret)
+        return EXIT_FAILURE;
+
     remove (compressedFile);
     remove (outputFile);
 
@@ -0,0 +1,295 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Default, arena and huge page allocators.      */
+/**************************************************/
+
+#include "lzw16alloc.h"
+#include "common.h"
+
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <new>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#define HUGE_PAGE_SIZE      (2UL << 20)
+#define HUGE_PAGE_THRESHOLD (256UL << 10)  /* smaller blocks are not worth a huge page. */
+#define ARENA_ALIGN         alignof(std::max_align_t)
+
+#if defined(LZW_FIXED_FOOTPRINT) && defined(USE_STL_HASH)
+#error "the fixed footprint build has no heap for std::unordered_map"
+#endif
+
+/*--------------------------------------------------------------------*/
+/* malloc/free                                                        */
+/*--------------------------------------------------------------------*/
+
+#ifdef LZW_FIXED_FOOTPRINT
+
+// no heap: contexts come from lzw_?ctx_create_static or a caller's allocator.
+static void *heap_alloc (void *, size_t)
+{
+  return NULL;
+}
+
+static void heap_free (void *, void *, size_t)
+{
+}
+
+#else
+
+static void *heap_alloc (void *, size_t size)
+{
+  return malloc (size);
+}
+
+static void heap_free (void *, void *ptr, size_t)
+{
+  free (ptr);
+}
+
+#endif // LZW_FIXED_FOOTPRINT
+
+lzw_allocator lzw_default_allocator (void)
+{
+  lzw_allocator a = { heap_alloc, heap_free, NULL };
+  return a;
+}
+
+void *LZWAllocator::Refuse (size_t size)
+{
+  LZW_ERROR ("Memory limit of %zu bytes reached: %zu bytes in use, %zu more wanted.\n", limit, used, size);
+  (void)size;   // the fixed footprint build has no message.
+
+  errno = ENOMEM;
+  return NULL;
+}
+
+/*--------------------------------------------------------------------*/
+/* Huge pages                                                         */
+/*--------------------------------------------------------------------*/
+
+#ifndef LZW_FIXED_FOOTPRINT
+
+static size_t huge_round (size_t size)
+{
+  return (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+}
+
+static void *huge_map (size_t size)
+{
+#if defined(__linux__)
+  size_t rounded = huge_round (size);
+
+#ifdef MAP_HUGETLB
+  void *ptr = mmap (NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+  if (ptr != MAP_FAILED) return ptr;
+#endif
+
+  // no reserved huge pages: map with 2 MB alignment and ask for transparent ones.
+
+  size_t span = rounded + HUGE_PAGE_SIZE;
+
+  char *raw = (char *)mmap (NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (raw == (char *)MAP_FAILED) return NULL;
+
+  char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+  if (aligned > raw) munmap (raw, aligned - raw);
+  if (raw + span > aligned + rounded) munmap (aligned + rounded, (raw + span) - (aligned + rounded));
+
+#ifdef MADV_HUGEPAGE
+  madvise (aligned, rounded, MADV_HUGEPAGE);
+#endif
+
+  return aligned;
+#else
+  return malloc (size);
+#endif
+}
+
+static void huge_unmap (void *ptr, size_t size)
+{
+#if defined(__linux__)
+  munmap (ptr, huge_round (size));
+#else
+  (void)size;
+  free (ptr);
+#endif
+}
+
+static void *hugepage_alloc (void *, size_t size)
+{
+  if (size < HUGE_PAGE_THRESHOLD) return malloc (size);
+
+  return huge_map (size);
+}
+
+static void hugepage_free (void *, void *ptr, size_t size)
+{
+  if (size < HUGE_PAGE_THRESHOLD) free (ptr);
+  else huge_unmap (ptr, size);
+}
+
+lzw_allocator lzw_hugepage_allocator (void)
+{
+  lzw_allocator a = { hugepage_alloc, hugepage_free, NULL };
+  return a;
+}
+
+#endif // LZW_FIXED_FOOTPRINT
+
+/*--------------------------------------------------------------------*/
+/* Bump arena                                                         */
+/*--------------------------------------------------------------------*/
+
+struct lzw_arena
+{
+  char *base;
+  size_t capacity;
+  size_t used;
+  int flags;
+};
+
+static_assert (sizeof (lzw_arena) <= lzw_footprint::ARENA && lzw_footprint::ARENA % ARENA_ALIGN == 0,
+               "lzw_footprint::ARENA must hold an aligned lzw_arena");
+
+lzw_arena *lzw_arena_place (void *memory, size_t size)
+{
+  if (!memory || (uintptr_t)memory % ARENA_ALIGN != 0 || size < lzw_footprint::ARENA)
+    return NULL;
+
+  lzw_arena *arena = (lzw_arena *)memory;
+
+  arena->base = (char *)memory + lzw_footprint::ARENA;
+  arena->capacity = size - lzw_footprint::ARENA;
+  arena->used = 0;
+  arena->flags = 0;
+
+  return arena;
+}
+
+#ifndef LZW_FIXED_FOOTPRINT
+
+lzw_arena *lzw_arena_create (size_t capacity, int arena_flags)
+{
+  lzw_arena *arena = (lzw_arena *)malloc (sizeof (lzw_arena));
+
+  if (!arena) return NULL;
+
+  arena->base = (char *)((arena_flags & LZW_ARENA_HUGEPAGES) ? huge_map (capacity) : malloc (capacity));
+
+  if (!arena->base)
+  {
+    free (arena);
+    return NULL;
+  }
+
+  arena->capacity = capacity;
+  arena->used = 0;
+  arena->flags = arena_flags;
+
+  return arena;
+}
+
+void lzw_arena_reset (lzw_arena *arena)
+{
+  if (arena) arena->used = 0;
+}
+
+void lzw_arena_release (lzw_arena *arena)
+{
+  if (!arena) return;
+
+  if (arena->flags & LZW_ARENA_HUGEPAGES) huge_unmap (arena->base, arena->capacity);
+  else free (arena->base);
+
+  free (arena);
+}
+
+#endif // LZW_FIXED_FOOTPRINT
+
+static void *arena_alloc (void *opaque, size_t size)
+{
+  lzw_arena *arena = (lzw_arena *)opaque;
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  if (size > arena->capacity - arena->used) return NULL;
+
+  void *ptr = arena->base + arena->used;
+  arena->used += size;
+
+  return ptr;
+}
+
+static void arena_free (void *opaque, void *ptr, size_t size)
+{
+  lzw_arena *arena = (lzw_arena *)opaque;
+
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  // only the most recent block can be given back.
+  if ((char *)ptr + size == arena->base + arena->used)
+    arena->used -= size;
+}
+
+lzw_allocator lzw_arena_allocator (lzw_arena *arena)
+{
+  lzw_allocator a = { arena_alloc, arena_free, arena };
+  return a;
+}
+
+/*--------------------------------------------------------------------*/
+/* std::pmr bridges                                                   */
+/*--------------------------------------------------------------------*/
+
+#ifndef LZW_FIXED_FOOTPRINT
+
+void *LZWMemoryResource::do_allocate (size_t bytes, size_t alignment)
+{
+  if (alignment > alignof(std::max_align_t))
+    throw std::bad_alloc();
+
+  void *ptr = alloc.Alloc (bytes ? bytes : 1);
+
+  if (!ptr) throw std::bad_alloc();
+
+  return ptr;
+}
+
+void LZWMemoryResource::do_deallocate (void *p, size_t bytes, size_t)
+{
+  alloc.Free (p, bytes ? bytes : 1);
+}
+
+static void *resource_alloc (void *opaque, size_t size)
+{
+  try
+  {
+    return ((std::pmr::memory_resource *)opaque)->allocate (size, alignof(std::max_align_t));
+  }
+  catch (const std::bad_alloc &)
+  {
+    return NULL;
+  }
+}
+
+static void resource_free (void *opaque, void *ptr, size_t size)
+{
+  ((std::pmr::memory_resource *)opaque)->deallocate (ptr, size, alignof(std::max_align_t));
+}
+
+lzw_allocator lzw_allocator_from_resource (std::pmr::memory_resource *resource)
+{
+  lzw_allocator a = { resource_alloc, resource_free, resource };
+  return a;
+}
+
+#endif // LZW_FIXED_FOOTPRINT
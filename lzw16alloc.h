@@ -0,0 +1,111 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Allocator plumbing shared by the packer and   */
+/*  unpacker. Every internal allocation goes      */
+/*  through an lzw_allocator (see export.h).      */
+/**************************************************/
+
+#pragma once
+
+#include "export.h"
+
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+
+lzw_allocator lzw_default_allocator (void);
+
+/* An arena over memory the caller owns, whose first lzw_footprint::ARENA
+   bytes hold the arena itself; NULL when memory is too small or not
+   aligned for any type. It is never released. */
+lzw_arena *lzw_arena_place (void *memory, size_t size);
+
+/* Exposes a std::pmr::memory_resource as an lzw_allocator, so C++ callers
+   can hand their own resources to lzw_?ctx_create_advanced. The resource
+   must outlive every context created with it. */
+lzw_allocator lzw_allocator_from_resource (std::pmr::memory_resource *);
+
+/* Counts the bytes it hands out, so the peak is exact, and refuses any
+   allocation that would take the count over the limit (0 for none). */
+class LZWAllocator
+{
+  private:
+    lzw_allocator a;
+    size_t used, peak, limit;
+
+    void *Refuse (size_t size);
+
+  public:
+    explicit LZWAllocator (const lzw_allocator *custom = NULL) : used (0), peak (0), limit (0)
+    {
+      a = custom ? *custom : lzw_default_allocator();
+    }
+
+    void *Alloc (size_t size)
+    {
+      if (!size) return NULL;
+
+      if (limit && (size > limit || used > limit - size))
+        return Refuse (size);
+
+      void *ptr = a.alloc (a.opaque, size);
+
+      if (ptr)
+      {
+        used += size;
+        if (used > peak) peak = used;
+      }
+
+      return ptr;
+    }
+
+    void Free (void *ptr, size_t size)
+    {
+      if (ptr)
+      {
+        a.free (a.opaque, ptr, size);
+        used -= size;
+      }
+    }
+
+    // realloc replacement: the old block is released only on success.
+    void *Realloc (void *ptr, size_t old_size, size_t new_size)
+    {
+      void *ret = Alloc (new_size);
+
+      if (ret && ptr)
+      {
+        memcpy (ret, ptr, old_size < new_size ? old_size : new_size);
+        Free (ptr, old_size);
+      }
+
+      return ret;
+    }
+
+    const lzw_allocator & Get (void) const { return a; }
+
+    size_t Peak (void) const { return peak; }
+    size_t Limit (void) const { return limit; }
+    void SetLimit (size_t bytes) { limit = bytes; }
+
+    // what an I/O ring may take: an eighth of the limit, anything without one.
+    size_t RingBudget (void) const { return limit ? limit / 8 : (size_t)-1; }
+};
+
+/* std::pmr view of an LZWAllocator, used for the STL containers. */
+class LZWMemoryResource : public std::pmr::memory_resource
+{
+  private:
+    LZWAllocator & alloc;
+
+    void *do_allocate (size_t bytes, size_t alignment) override;
+    void do_deallocate (void *p, size_t bytes, size_t alignment) override;
+    bool do_is_equal (const std::pmr::memory_resource & other) const noexcept override
+    {
+      return this == &other;
+    }
+
+  public:
+    explicit LZWMemoryResource (LZWAllocator & a) : alloc (a) { }
+};
@@ -0,0 +1,1008 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Multi-member archives: packing and unpacking  */
+/*  on a pool of worker threads, each with its    */
+/*  own reusable context. Also appending streams  */
+/*  to the end of .lzw files.                     */
+/**************************************************/
+
+#include "common.h"
+#include "lzw16archive.h"
+#include "lzw16header.h"
+#include "lzw16io.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const char ARCHIVE_MAGIC[4] = { 'L', 'Z', 'W', 'A' };
+
+// flags the workers pass on; progress is reported by the archive code.
+#define MEMBER_FLAGS  (RLE_STAGE | ENTROPY_STAGE | SUBBLOCK_FRAMING | LRU_EVICTION | OVERWRITE_FLAG | KEEP_ON_ERROR)
+
+// packed bytes a worker holds in memory; a member packing to more takes
+// the end of the archive and is written straight into it.
+#define MEMBER_BUFFER  (1 << 20)
+
+// flags lzw_append passes on to the packer.
+#define APPEND_FLAGS  (RLE_STAGE | ENTROPY_STAGE | SUBBLOCK_FRAMING | LRU_EVICTION | VERBOSE_OUTPUT)
+
+/*--------------------------------------------------------------------*/
+/* Table of contents                                                  */
+/*--------------------------------------------------------------------*/
+
+ArchiveTOC::~ArchiveTOC ()
+{
+  for (uint32_t k = 0; k < count; k++)
+    free (members[k].name);
+
+  free (members);
+}
+
+bool ArchiveTOC::Read (FILE *fp)
+{
+  unsigned char header[ARCHIVE_HEADER_SIZE];
+  uint64_t toc_offset, file_size;
+
+  if (ARCHIVE_HEADER_SIZE != fread (header, 1, ARCHIVE_HEADER_SIZE, fp) || memcmp (header, ARCHIVE_MAGIC, 4) != 0)
+  {
+    fprintf (stderr, "Not LZW archive!\n");
+    return false;
+  }
+
+  if (header[4] != ARCHIVE_VERSION)
+  {
+    fprintf (stderr, "Archive version mismatch (%d vs %d).\n", header[4], ARCHIVE_VERSION);
+    return false;
+  }
+
+  memcpy (&toc_offset, header + 8, sizeof(toc_offset));
+
+  if (fseeko (fp, 0, SEEK_END) != 0 || (file_size = (uint64_t)ftello (fp)) < toc_offset + 4 ||
+      toc_offset < ARCHIVE_HEADER_SIZE || fseeko (fp, (off_t)toc_offset, SEEK_SET) != 0)
+  {
+    fprintf (stderr, "Corrupt archive: bad table offset.\n");
+    return false;
+  }
+
+  uint32_t n;
+
+  // each entry takes at least 27 bytes; a count the file cannot hold is corrupt.
+  if (4 != fread (&n, 1, 4, fp) || n > (file_size - toc_offset - 4) / 27)
+  {
+    fprintf (stderr, "Corrupt archive: bad member count.\n");
+    return false;
+  }
+
+  members = (ArchiveMember *)calloc (n ? n : 1, sizeof(ArchiveMember));
+
+  if (!members)
+  {
+    fprintf (stderr, "Cannot allocate memory: %s\n", strerror (errno));
+    return false;
+  }
+
+  for (count = 0; count < n; count++)
+  {
+    ArchiveMember & m = members[count];
+    uint16_t len;
+
+    if (2 != fread (&len, 1, 2, fp) || len == 0 || len > ARCHIVE_MAX_NAME)
+      break;
+
+    if (!(m.name = (char *)malloc (len + 1)))
+      break;
+
+    if (len != fread (m.name, 1, len, fp))
+    {
+      free (m.name);
+      break;
+    }
+
+    m.name[len] = '\0';
+
+    if (8 != fread (&m.size, 1, 8, fp) || 8 != fread (&m.offset, 1, 8, fp) || 8 != fread (&m.length, 1, 8, fp) ||
+        m.offset < ARCHIVE_HEADER_SIZE || m.length > toc_offset || m.offset > toc_offset - m.length)
+    {
+      free (m.name);
+      break;
+    }
+  }
+
+  if (count != n)
+  {
+    fprintf (stderr, "Corrupt archive: bad entry %u.\n", (unsigned)count);
+    return false;
+  }
+
+  // a name listed twice would have two workers write the same file.
+  std::unordered_set<std::string> names;
+
+  for (uint32_t k = 0; k < count; k++)
+  {
+    if (!names.insert (members[k].name).second)
+    {
+      fprintf (stderr, "Corrupt archive: \'%s\' is listed twice.\n", members[k].name);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int64_t ArchiveTOC::Find (const char *name) const
+{
+  for (uint32_t k = 0; k < count; k++)
+  {
+    if (strcmp (members[k].name, name) == 0)
+      return k;
+  }
+
+  return -1;
+}
+
+bool ValidMemberName (const char *name)
+{
+  size_t len = strlen (name);
+
+  if (len == 0 || len > ARCHIVE_MAX_NAME || name[0] == '/')
+    return false;
+
+  for (const char *p = name; *p; )
+  {
+    const char *end = strchr (p, '/');
+    size_t n = end ? (size_t)(end - p) : strlen (p);
+
+    if (n == 0 || (n == 1 && p[0] == '.') || (n == 2 && p[0] == '.' && p[1] == '.'))
+      return false;
+
+    p += n + (end ? 1 : 0);
+
+    if (end && *p == '\0')  // trailing slash
+      return false;
+  }
+
+  return true;
+}
+
+/*--------------------------------------------------------------------*/
+/* Stream callbacks                                                   */
+/*--------------------------------------------------------------------*/
+
+static ptrdiff_t fileRead (void *opaque, void *buf, size_t len)
+{
+  FILE *fp = (FILE *)opaque;
+
+  size_t n = fread (buf, 1, len, fp);
+
+  return ferror (fp) ? -1 : (ptrdiff_t)n;
+}
+
+// one member's bytes of the archive; positional reads, so workers share the descriptor.
+struct rangeSource
+{
+  int fd;
+  uint64_t offset, remaining;
+};
+
+static ptrdiff_t rangeRead (void *opaque, void *buf, size_t len)
+{
+  rangeSource *src = (rangeSource *)opaque;
+
+  if (len > src->remaining)
+    len = (size_t)src->remaining;
+
+  if (len == 0)
+    return 0;
+
+  ssize_t n = pread (src->fd, buf, len, (off_t)src->offset);
+
+  if (n < 0)
+    return -1;
+
+  src->offset += n;
+  src->remaining -= n;
+
+  return n;
+}
+
+static int fileWrite (void *opaque, const void *buf, size_t len)
+{
+  FILE *fp = (FILE *)opaque;
+
+  if (len != fwrite (buf, 1, len, fp))
+  {
+    fprintf (stderr, "Write error. Out of disk space?\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+static int outputWrite (void *opaque, const void *buf, size_t len)
+{
+  if (!((LZWOutput *)opaque)->Write (buf, len))
+  {
+    fprintf (stderr, "Write error. Out of disk space?\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+// A packed member: collected in data up to limit bytes, then appended to
+// the archive whole. Past that, the member takes the end of the archive
+// (tail, guarding *end too) and writes the rest straight after what it had.
+struct memberSink
+{
+  unsigned char *data;
+  size_t len, cap, limit;
+  FILE *out;
+  std::unique_lock<std::mutex> tail;   // held while the member streams.
+  uint64_t *end;
+  uint64_t offset, written;            // of a streaming member, in the archive.
+
+  memberSink (std::mutex & lock, FILE *archive, uint64_t *archive_end, size_t max)
+    : data (NULL), len (0), cap (0), limit (max), out (archive), tail (lock, std::defer_lock),
+      end (archive_end), offset (0), written (0) { }
+};
+
+static int memberWrite (void *opaque, const void *buf, size_t len)
+{
+  memberSink *sink = (memberSink *)opaque;
+
+  if (!sink->tail.owns_lock () && sink->len + len > sink->limit)
+  {
+    sink->tail.lock ();
+    sink->offset = *sink->end;
+    sink->written = 0;
+
+    if (sink->len && fileWrite (sink->out, sink->data, sink->len) != 0)
+      return 1;
+
+    sink->written = sink->len;
+    sink->len = 0;
+  }
+
+  if (sink->tail.owns_lock ())
+  {
+    if (fileWrite (sink->out, buf, len) != 0)
+      return 1;
+
+    sink->written += len;
+    return 0;
+  }
+
+  if (sink->len + len > sink->cap)
+  {
+    size_t cap = sink->cap ? sink->cap : 65536;
+
+    while (cap < sink->len + len)
+      cap *= 2;
+
+    if (cap > sink->limit)
+      cap = sink->limit;
+
+    unsigned char *ptr = (unsigned char *)realloc (sink->data, cap);
+
+    if (!ptr)
+    {
+      fprintf (stderr, "Failed to allocate memory: %s\n", strerror (errno));
+      return 1;
+    }
+
+    sink->data = ptr;
+    sink->cap = cap;
+  }
+
+  memcpy (sink->data + sink->len, buf, len);
+  sink->len += len;
+
+  return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/* Worker pool                                                        */
+/*--------------------------------------------------------------------*/
+
+// Runs worker on up to jobs threads, the calling one included; jobs below 1
+// means one per core. Workers pick items off a shared counter until none
+// are left.
+template <typename Worker>
+static void runWorkers (int jobs, uint32_t items, Worker worker)
+{
+  if (jobs < 1)
+    jobs = (int)std::thread::hardware_concurrency ();
+
+  if (jobs < 1)
+    jobs = 1;
+
+  if ((uint32_t)jobs > items)
+    jobs = items ? (int)items : 1;
+
+  std::vector<std::thread> helpers;
+
+  try
+  {
+    for (int k = 1; k < jobs; k++)
+      helpers.emplace_back (worker);
+  }
+  catch (const std::exception &)
+  {
+    // fewer helpers; the items still all get done.
+  }
+
+  worker ();
+
+  for (auto & t : helpers)
+    t.join ();
+}
+
+// Workers for items under a memory limit, at need bytes each; the
+// limit cuts jobs (one per core when below 1) down to what fits, but
+// never below one.
+static int budgetJobs (int jobs, uint32_t items, size_t limit, size_t need)
+{
+  if (jobs < 1)
+    jobs = (int)std::thread::hardware_concurrency ();
+
+  if (jobs < 1)
+    jobs = 1;
+
+  if ((uint32_t)jobs > items && items > 0)
+    jobs = (int)items;
+
+  if (limit && need && (size_t)jobs > limit / need)
+    jobs = (limit / need > 0) ? (int)(limit / need) : 1;
+
+  return jobs;
+}
+
+/*--------------------------------------------------------------------*/
+/* Packing                                                            */
+/*--------------------------------------------------------------------*/
+
+static bool writeU64 (FILE *fp, uint64_t v) { return 8 == fwrite (&v, 1, 8, fp); }
+
+int lzw_archive_create (const char *archive, const char *const *files, int count, const LZW_CCtx *settings,
+                        int flags, int max_bits, int jobs)
+{
+  if (count <= 0)
+  {
+    fprintf (stderr, "No files to archive.\n");
+    return 0;
+  }
+
+  if (is_big_endian ())
+  {
+    fprintf (stderr, "Not supported on big endian machines.\n");
+    return 0;
+  }
+
+  std::unordered_set<std::string> names;
+
+  for (int k = 0; k < count; k++)
+  {
+    if (!ValidMemberName (files[k]))
+    {
+      fprintf (stderr, "Cannot store \'%s\': names must be relative, without . or .. parts.\n", files[k]);
+      return 0;
+    }
+
+    struct stat st;
+
+    if (stat (files[k], &st) != 0)
+    {
+      fprintf (stderr, "Cannot open file \'%s\': %s\n", files[k], strerror (errno));
+      return 0;
+    }
+
+    if (!S_ISREG (st.st_mode))
+    {
+      fprintf (stderr, "Cannot store \'%s\': not a regular file.\n", files[k]);
+      return 0;
+    }
+
+    if (!names.insert (files[k]).second)
+    {
+      fprintf (stderr, "\'%s\' is listed twice.\n", files[k]);
+      return 0;
+    }
+  }
+
+  FILE *out = fopen (archive, "wb");
+
+  if (!out)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", archive, strerror (errno));
+    return 0;
+  }
+
+  unsigned char header[ARCHIVE_HEADER_SIZE] = { 0 };
+
+  memcpy (header, ARCHIVE_MAGIC, 4);
+  header[4] = ARCHIVE_VERSION;
+
+  ArchiveMember *members = (ArchiveMember *)calloc (count, sizeof(ArchiveMember));
+  bool ok = (members != NULL) && ARCHIVE_HEADER_SIZE == fwrite (header, 1, ARCHIVE_HEADER_SIZE, out);
+
+  std::mutex lock;   // guards the archive file, end and the verbose output.
+  std::atomic<uint32_t> next (0);
+  std::atomic<bool> failed (!ok);
+  uint64_t end = ARCHIVE_HEADER_SIZE;
+
+  // a worker holds a context and the packed bytes of its member, with half
+  // of its share of the limit for each.
+  size_t limit = settings ? lzw_cctx_memory_limit (settings) : 0;
+
+  jobs = budgetJobs (jobs, (uint32_t)count, limit, 2 * (lzw_cctx_workspace_size (max_bits) + DEFAULT_BLOCK_SIZE));
+
+  size_t share = limit / (size_t)jobs;
+
+  runWorkers (jobs, (uint32_t)count, [&] ()
+  {
+    LZW_CCtx *ctx = lzw_cctx_create ();
+    memberSink packed (lock, out, &end, (share && share - share / 2 < MEMBER_BUFFER) ? share - share / 2 : MEMBER_BUFFER);
+
+    if (!ctx)
+    {
+      fprintf (stderr, "Failed to allocate memory: %s\n", strerror (errno));
+      failed = true;
+      return;
+    }
+
+    lzw_cctx_copy_settings (ctx, settings);
+
+    if (share)
+      lzw_cctx_set_memory_limit (ctx, share / 2);
+
+    uint32_t k;
+
+    while (!failed && (k = next++) < (uint32_t)count)
+    {
+      FILE *in = fopen (files[k], "rb");
+
+      if (!in)
+      {
+        fprintf (stderr, "Cannot open file \'%s\': %s\n", files[k], strerror (errno));
+        failed = true;
+        break;
+      }
+
+      off_t size = (fseeko (in, 0, SEEK_END) == 0) ? ftello (in) : -1;
+      lzw_source source = { fileRead, in };
+      lzw_sink sink = { memberWrite, &packed };
+
+      packed.len = 0;
+
+      bool member_ok = size >= 0 && fseeko (in, 0, SEEK_SET) == 0 &&
+                       lzw_compress_stream (ctx, &source, (size_t)size, &sink, flags & MEMBER_FLAGS, max_bits);
+
+      fclose (in);
+
+      if (!member_ok)
+      {
+        fprintf (stderr, "Failed to pack \'%s\'.\n", files[k]);
+        failed = true;
+        break;
+      }
+
+      // a member that fit in memory is appended now; one that streamed is in place.
+      if (!packed.tail.owns_lock ())
+      {
+        packed.tail.lock ();
+
+        if (fileWrite (out, packed.data, packed.len) != 0)
+        {
+          failed = true;
+          break;
+        }
+
+        packed.offset = end;
+        packed.written = packed.len;
+      }
+
+      members[k].size = (uint64_t)size;
+      members[k].offset = packed.offset;
+      members[k].length = packed.written;
+      end += packed.written;
+
+      if (flags & VERBOSE_OUTPUT)
+        printf ("%s: %lld -> %lld\n", files[k], (long long)size, (long long)packed.written);
+
+      packed.len = 0;
+      packed.tail.unlock ();
+    }
+
+    if (packed.tail.owns_lock ())
+      packed.tail.unlock ();
+
+    free (packed.data);
+    lzw_cctx_free (ctx);
+  });
+
+  ok = !failed;
+
+  // the table, then its offset in the header.
+  uint32_t n = (uint32_t)count;
+
+  ok = ok && 4 == fwrite (&n, 1, 4, out);
+
+  for (int k = 0; ok && k < count; k++)
+  {
+    uint16_t len = (uint16_t)strlen (files[k]);
+
+    ok = 2 == fwrite (&len, 1, 2, out) && len == fwrite (files[k], 1, len, out) &&
+         writeU64 (out, members[k].size) && writeU64 (out, members[k].offset) && writeU64 (out, members[k].length);
+  }
+
+  ok = ok && fseeko (out, 8, SEEK_SET) == 0 && writeU64 (out, end);
+
+  if (fclose (out) != 0 && ok)
+  {
+    fprintf (stderr, "Write error. Out of disk space? \n");
+    ok = false;
+  }
+  else if (!ok && !failed)
+  {
+    fprintf (stderr, "Write error. Out of disk space? \n");
+  }
+
+  free (members);
+
+  if (!ok)
+    cleanup (archive, flags);
+
+  return ok ? 1 : 0;
+}
+
+/*--------------------------------------------------------------------*/
+/* Unpacking                                                          */
+/*--------------------------------------------------------------------*/
+
+// creates the directories on the way to name.
+static bool makeParents (const char *name)
+{
+  char path[ARCHIVE_MAX_NAME + 1];
+
+  strcpy_s (path, sizeof(path), name);
+
+  for (char *p = strchr (path, '/'); p; p = strchr (p + 1, '/'))
+  {
+    *p = '\0';
+
+    if (mkdir (path, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf (stderr, "Cannot create directory \'%s\': %s\n", path, strerror (errno));
+      return false;
+    }
+
+    *p = '/';
+  }
+
+  return true;
+}
+
+static bool extractMember (LZW_DCtx *ctx, int fd, const ArchiveMember & m, int flags)
+{
+  if (!ValidMemberName (m.name))
+  {
+    fprintf (stderr, "Refusing to unpack \'%s\'.\n", m.name);
+    return false;
+  }
+
+  if (!(flags & OVERWRITE_FLAG) && file_exists (m.name))
+  {
+    fprintf (stderr, "File \'%s\' already exists. Use overwrite flag.\n", m.name);
+    return false;
+  }
+
+  if (!makeParents (m.name))
+    return false;
+
+  FILE *out = fopen (m.name, "wb");
+
+  if (!out)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", m.name, strerror (errno));
+    return false;
+  }
+
+  rangeSource range = { fd, m.offset, m.length };
+  lzw_source source = { rangeRead, &range };
+  lzw_sink sink = { fileWrite, out };
+  SparseOutput sparse (out, false);
+
+  if (flags & SPARSE_OUTPUT)
+    sink = { outputWrite, &sparse };
+
+  bool ok = lzw_decompress_stream (ctx, &source, &sink, flags & MEMBER_FLAGS) &&
+            (!(flags & SPARSE_OUTPUT) || sparse.Finish ());
+
+  if (fclose (out) != 0 && ok)
+  {
+    fprintf (stderr, "Write error. Out of disk space?\n");
+    ok = false;
+  }
+
+  if (!ok)
+  {
+    fprintf (stderr, "Failed to unpack \'%s\'.\n", m.name);
+    cleanup (m.name, flags);
+  }
+
+  return ok;
+}
+
+// the code width of a member, from its header; the widest when it cannot be read.
+static int memberBits (int fd, const ArchiveMember & m)
+{
+  rangeSource range = { fd, m.offset, m.length };
+  lzw_source source = { rangeRead, &range };
+  CallbackInput in (source);
+  LZWHeader header;
+
+  return header.Read (in) ? header.bits : SUPPORTED_MAX_BITS;
+}
+
+int lzw_archive_extract (const char *archive, const char *const *names, int count, int flags, int jobs)
+{
+  return lzw_archive_extract2 (archive, names, count, flags, jobs, 0);
+}
+
+int lzw_archive_extract2 (const char *archive, const char *const *names, int count, int flags, int jobs,
+                          size_t max_memory)
+{
+  FILE *fp = fopen (archive, "rb");
+
+  if (!fp)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", archive, strerror (errno));
+    return 0;
+  }
+
+  ArchiveTOC toc;
+
+  if (!toc.Read (fp))
+  {
+    fclose (fp);
+    return 0;
+  }
+
+  // members to unpack, by index; all of them when no names are given.
+  uint32_t total = (count > 0) ? (uint32_t)count : toc.count;
+  std::vector<uint32_t> picked (total);
+
+  for (uint32_t k = 0; k < total; k++)
+  {
+    int64_t index = (count > 0) ? toc.Find (names[k]) : k;
+
+    if (index < 0)
+    {
+      fprintf (stderr, "No member \'%s\' in archive.\n", names[k]);
+      fclose (fp);
+      return 0;
+    }
+
+    picked[k] = (uint32_t)index;
+  }
+
+  int fd = fileno (fp);
+  std::atomic<uint32_t> next (0);
+  std::atomic<bool> failed (false);
+  std::mutex lock;
+
+  // workers the limit holds at the widest member's worst case, sharing it evenly.
+  size_t need = 0;
+
+  for (uint32_t k = 0; max_memory && k < total; k++)
+  {
+    size_t size = lzw_dctx_workspace_size (memberBits (fd, toc.members[picked[k]]));
+
+    if (size > need)
+      need = size;
+  }
+
+  jobs = budgetJobs (jobs, total, max_memory, need);
+
+  size_t share = max_memory / (size_t)jobs;
+
+  runWorkers (jobs, total, [&] ()
+  {
+    LZW_DCtx *ctx = lzw_dctx_create ();
+
+    if (!ctx)
+    {
+      fprintf (stderr, "Cannot allocate memory: %s\n", strerror (errno));
+      failed = true;
+      return;
+    }
+
+    if (share)
+      lzw_dctx_set_memory_limit (ctx, share);
+
+    uint32_t k;
+
+    while (!failed && (k = next++) < total)
+    {
+      const ArchiveMember & m = toc.members[picked[k]];
+
+      if (!extractMember (ctx, fd, m, flags))
+      {
+        failed = true;
+        break;
+      }
+
+      if (flags & VERBOSE_OUTPUT)
+      {
+        std::lock_guard<std::mutex> guard (lock);
+
+        printf ("%s: %lld bytes\n", m.name, (long long)m.size);
+      }
+    }
+
+    lzw_dctx_free (ctx);
+  });
+
+  fclose (fp);
+
+  return failed ? 0 : 1;
+}
+
+int lzw_archive_list (const char *archive)
+{
+  FILE *fp = fopen (archive, "rb");
+
+  if (!fp)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", archive, strerror (errno));
+    return 0;
+  }
+
+  ArchiveTOC toc;
+  bool ok = toc.Read (fp);
+
+  fclose (fp);
+
+  if (!ok)
+    return 0;
+
+  printf ("%12s %12s  ratio  name\n", "size", "packed");
+
+  for (uint32_t k = 0; k < toc.count; k++)
+  {
+    const ArchiveMember & m = toc.members[k];
+
+    printf ("%12lld %12lld %5.1f%%  %s\n", (long long)m.size, (long long)m.length,
+            m.size ? 100.0 * m.length / m.size : 0.0, m.name);
+  }
+
+  return 1;
+}
+
+/*--------------------------------------------------------------------*/
+/* Appending to .lzw files                                            */
+/*--------------------------------------------------------------------*/
+
+// Opens archive for appending, once its header shows it records the total
+// size and it is not the file input reads; total_at is where that total is
+// stored and end where streams go.
+static FILE *openAppendable (const char *archive, FILE *input, uint64_t & total, off_t & total_at, off_t & end)
+{
+  FILE *fp = fopen (archive, "r+b");
+
+  if (!fp)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", archive, strerror (errno));
+    return NULL;
+  }
+
+  struct stat ist, ast;
+
+  if (fstat (fileno (input), &ist) != 0 || fstat (fileno (fp), &ast) != 0)
+  {
+    fprintf (stderr, "Cannot read file \'%s\': %s\n", archive, strerror (errno));
+    fclose (fp);
+    return NULL;
+  }
+
+  if (ist.st_dev == ast.st_dev && ist.st_ino == ast.st_ino)
+  {
+    fprintf (stderr, "Cannot append \'%s\' to itself.\n", archive);
+    fclose (fp);
+    return NULL;
+  }
+
+  LZWHeader header;
+  StdioInput in (fp, false);
+
+  bool ok = header.Read (in);
+
+  if (ok && !(header.features & FEATURE_APPEND))
+  {
+    fprintf (stderr, "\'%s\' was packed before files could be appended to; unpack and pack it again.\n", archive);
+    ok = false;
+  }
+
+  if (ok && (fseeko (fp, 0, SEEK_END) != 0 || (end = ftello (fp)) < 0))
+  {
+    fprintf (stderr, "Cannot seek in \'%s\': %s\n", archive, strerror (errno));
+    ok = false;
+  }
+
+  if (!ok)
+  {
+    fclose (fp);
+    return NULL;
+  }
+
+  // the total is the last field of the header.
+  total = header.totalSize;
+  total_at = (off_t)(in.Position() - sizeof(uint64_t));
+
+  return fp;
+}
+
+// Stores the new total once the streams are in place; on any failure cuts
+// the file back to its old end, so it unpacks as before.
+static int finishAppend (const char *archive, FILE *fp, bool ok, uint64_t total, off_t total_at, off_t end)
+{
+  if (ok)
+  {
+    ok = fflush (fp) == 0 && fseeko (fp, total_at, SEEK_SET) == 0 &&
+         sizeof(uint64_t) == fwrite (&total, 1, sizeof(uint64_t), fp) && fflush (fp) == 0;
+
+    if (!ok)
+      fprintf (stderr, "Write error. Out of disk space?\n");
+  }
+
+  if (!ok)
+  {
+    fflush (fp);
+
+    if (ftruncate (fileno (fp), end) != 0)
+      fprintf (stderr, "Cannot restore \'%s\': %s\n", archive, strerror (errno));
+  }
+
+  if (fclose (fp) != 0 && ok)
+  {
+    fprintf (stderr, "Write error. Out of disk space?\n");
+    return 0;
+  }
+
+  return ok ? 1 : 0;
+}
+
+int lzw_append (const char *archive, const char *filename, const LZW_CCtx *settings, int flags, int max_bits)
+{
+  if (is_big_endian ())
+  {
+    fprintf (stderr, "Not supported on big endian machines.\n");
+    return 0;
+  }
+
+  FILE *in = fopen (filename, "rb");
+
+  if (!in)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", filename, strerror (errno));
+    return 0;
+  }
+
+  off_t size = (fseeko (in, 0, SEEK_END) == 0) ? ftello (in) : -1;
+
+  if (size < 0 || fseeko (in, 0, SEEK_SET) != 0)
+  {
+    fprintf (stderr, "Cannot read file \'%s\': %s\n", filename, strerror (errno));
+    fclose (in);
+    return 0;
+  }
+
+  uint64_t total;
+  off_t total_at, end;
+
+  FILE *fp = openAppendable (archive, in, total, total_at, end);
+
+  if (!fp)
+  {
+    fclose (in);
+    return 0;
+  }
+
+  LZW_CCtx *ctx = lzw_cctx_create ();
+
+  if (!ctx)
+    fprintf (stderr, "Failed to allocate memory: %s\n", strerror (errno));
+
+  lzw_cctx_copy_settings (ctx, settings);
+
+  lzw_source source = { fileRead, in };
+  lzw_sink sink = { fileWrite, fp };
+
+  bool ok = ctx && lzw_compress_stream (ctx, &source, (size_t)size, &sink, flags & APPEND_FLAGS, max_bits);
+
+  lzw_cctx_free (ctx);
+  fclose (in);
+
+  return finishAppend (archive, fp, ok, total + (uint64_t)size, total_at, end);
+}
+
+int lzw_concat (const char *archive, const char *other)
+{
+  if (is_big_endian ())
+  {
+    fprintf (stderr, "Not supported on big endian machines.\n");
+    return 0;
+  }
+
+  FILE *in = fopen (other, "rb");
+
+  if (!in)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", other, strerror (errno));
+    return 0;
+  }
+
+  // any stream can follow; what it adds is its own total, or its size when
+  // it has none.
+  LZWHeader header;
+  StdioInput source (in, true);
+
+  if (!header.Read (source))
+    return 0;
+
+  off_t size = (fseeko (in, 0, SEEK_END) == 0) ? ftello (in) : -1;
+
+  if (size < 0 || fseeko (in, 0, SEEK_SET) != 0)
+  {
+    fprintf (stderr, "Cannot read file \'%s\': %s\n", other, strerror (errno));
+    return 0;
+  }
+
+  uint64_t total;
+  off_t total_at, end;
+
+  FILE *fp = openAppendable (archive, in, total, total_at, end);
+
+  if (!fp)
+    return 0;
+
+  static const size_t CHUNK = 65536;
+  char *chunk = (char *)malloc (CHUNK);
+  bool ok = (chunk != NULL);
+
+  if (!ok)
+    fprintf (stderr, "Failed to allocate memory: %s\n", strerror (errno));
+
+  for (off_t done = 0; ok && done < size; )
+  {
+    size_t n = (size - done < (off_t)CHUNK) ? (size_t)(size - done) : CHUNK;
+
+    if (n != fread (chunk, 1, n, in))
+    {
+      fprintf (stderr, "Cannot read file \'%s\'.\n", other);
+      ok = false;
+    }
+    else if (fileWrite (fp, chunk, n) != 0)
+      ok = false;
+
+    done += n;
+  }
+
+  free (chunk);
+
+  return finishAppend (archive, fp, ok, total + header.totalSize, total_at, end);
+}
@@ -0,0 +1,54 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Multi-member archives. Members are complete   */
+/*  LZW streams, each with its own header; a      */
+/*  table of contents at the end gives their      */
+/*  names, sizes and offsets, so any one of them  */
+/*  can be unpacked without reading the others.   */
+/*                                                */
+/*  "LZWA", version byte, 3 zero bytes, 64-bit    */
+/*  offset of the table of contents. The table:   */
+/*  32-bit member count, then for each member a   */
+/*  16-bit name length, the name, and 64-bit      */
+/*  unpacked size, offset and packed length.      */
+/**************************************************/
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+#define ARCHIVE_VERSION      0
+#define ARCHIVE_HEADER_SIZE  16
+#define ARCHIVE_MAX_NAME     4095
+
+struct ArchiveMember
+{
+  char *name;
+  uint64_t size;      // unpacked.
+  uint64_t offset;    // of the member's LZW header.
+  uint64_t length;    // packed.
+};
+
+struct ArchiveTOC
+{
+  ArchiveMember *members;
+  uint32_t count;
+
+  ArchiveTOC () : members (NULL), count (0) { }
+  ~ArchiveTOC ();
+
+  ArchiveTOC (const ArchiveTOC &) = delete;
+  ArchiveTOC & operator=(const ArchiveTOC &) = delete;
+
+  // reads and checks the table of fp's archive; errors go to stderr.
+  bool Read (FILE *fp);
+
+  // index of the member called name, -1 if there is none.
+  int64_t Find (const char *name) const;
+};
+
+// a name an archive may store: relative, without "." or ".." components.
+bool ValidMemberName (const char *name);
@@ -0,0 +1,178 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Scalar and BMI2 code (un)packing kernels.     */
+/**************************************************/
+
+#include "lzw16bits.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(LZW_NO_BMI2)
+#define HAVE_BMI2_KERNELS
+#include <immintrin.h>
+#endif
+
+/*--------------------------------------------------------------------*/
+/* Scalar                                                             */
+/*--------------------------------------------------------------------*/
+
+static uint32_t unpack_scalar (const unsigned char *src, uint32_t pos, unsigned bits, unsigned count, uint32_t *dst)
+{
+  const uint32_t mask = (1U << bits) - 1;
+
+  for (unsigned k = 0; k < count; k++)
+  {
+    uint32_t val;
+    memcpy (&val, src + (pos >> 3), sizeof(val));
+
+    dst[k] = (val >> (pos & 0x07)) & mask;
+    pos += bits;
+  }
+
+  return pos;
+}
+
+static unsigned char *pack_scalar (const uint32_t *codes, unsigned count, unsigned bits, uint64_t & acc, unsigned & accbits, unsigned char *dst)
+{
+  for (unsigned k = 0; k < count; k++)
+  {
+    acc |= (uint64_t)codes[k] << accbits;
+    accbits += bits;
+
+    if (accbits >= 32)
+    {
+      uint32_t lo = (uint32_t)acc;
+      memcpy (dst, &lo, sizeof(lo));
+
+      dst += 4;
+      acc >>= 32;
+      accbits -= 32;
+    }
+  }
+
+  while (accbits >= 8)
+  {
+    *dst++ = (unsigned char)acc;
+    acc >>= 8;
+    accbits -= 8;
+  }
+
+  return dst;
+}
+
+/*--------------------------------------------------------------------*/
+/* BMI2: pdep spreads packed codes into 32-bit lanes and pext gathers */
+/* them back, two codes per instruction and a group per 64-bit load.  */
+/*--------------------------------------------------------------------*/
+
+#ifdef HAVE_BMI2_KERNELS
+
+// one 64-bit load holds at least 57 usable bits after the sub-byte shift;
+// packing a group onto up to 7 pending bits must also stay below 64.
+static unsigned group_size (unsigned bits)
+{
+  return (bits * 4 <= 56) ? 4 : (bits * 3 <= 56) ? 3 : 2;
+}
+
+static uint64_t lane_mask (unsigned bits, unsigned lanes)
+{
+  uint64_t mask = (1U << bits) - 1;
+
+  return (lanes == 2) ? (mask | (mask << 32)) : mask;
+}
+
+__attribute__((target("bmi2")))
+static uint32_t unpack_bmi2 (const unsigned char *src, uint32_t pos, unsigned bits, unsigned count, uint32_t *dst)
+{
+  const unsigned group = group_size (bits);
+  const uint64_t lo = lane_mask (bits, 2);
+  const uint64_t hi = lane_mask (bits, group - 2);
+  unsigned k = 0;
+
+  for (; k + group <= count; k += group)
+  {
+    uint64_t word;
+    memcpy (&word, src + (pos >> 3), sizeof(word));
+
+    word >>= (pos & 0x07);
+
+    uint64_t first = _pdep_u64 (word, lo);
+    memcpy (dst + k, &first, sizeof(first));
+
+    if (group > 2)
+    {
+      uint64_t second = _pdep_u64 (word >> (2 * bits), hi);
+      memcpy (dst + k + 2, &second, (group - 2) * sizeof(uint32_t));
+    }
+
+    pos += group * bits;
+  }
+
+  for (; k < count; k++)
+  {
+    uint64_t word;
+    memcpy (&word, src + (pos >> 3), sizeof(word));
+
+    dst[k] = (uint32_t)_bzhi_u64 (word >> (pos & 0x07), bits);
+    pos += bits;
+  }
+
+  return pos;
+}
+
+__attribute__((target("bmi2")))
+static unsigned char *pack_bmi2 (const uint32_t *codes, unsigned count, unsigned bits, uint64_t & acc, unsigned & accbits, unsigned char *dst)
+{
+  const unsigned group = group_size (bits);
+  const uint64_t lo = lane_mask (bits, 2);
+  const uint64_t hi = lane_mask (bits, group - 2);
+  unsigned k = 0;
+
+  for (; k + group <= count; k += group)
+  {
+    uint64_t pair, rest = 0;
+    memcpy (&pair, codes + k, sizeof(pair));
+
+    uint64_t packed = _pext_u64 (pair, lo);
+
+    if (group > 2)
+    {
+      memcpy (&rest, codes + k + 2, (group - 2) * sizeof(uint32_t));
+      packed |= _pext_u64 (rest, hi) << (2 * bits);
+    }
+
+    acc |= packed << accbits;
+    accbits += group * bits;
+
+    // store all 8 bytes, keep only the completed ones.
+    memcpy (dst, &acc, sizeof(acc));
+    dst += accbits >> 3;
+    acc >>= (accbits & ~7U);
+    accbits &= 7;
+  }
+
+  return pack_scalar (codes + k, count - k, bits, acc, accbits, dst);
+}
+
+static bool cpu_has_bmi2 (void)
+{
+  __builtin_cpu_init ();
+  return __builtin_cpu_supports ("bmi2");
+}
+
+#endif // HAVE_BMI2_KERNELS
+
+const LZWBitKernels & SelectBitKernels (void)
+{
+  static const LZWBitKernels scalar = { unpack_scalar, pack_scalar, "scalar" };
+
+#ifdef HAVE_BMI2_KERNELS
+  static const LZWBitKernels bmi2 = { unpack_bmi2, pack_bmi2, "bmi2" };
+  static const bool use_bmi2 = cpu_has_bmi2 ();
+
+  if (use_bmi2) return bmi2;
+#endif
+
+  return scalar;
+}
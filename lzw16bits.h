@@ -0,0 +1,32 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Bit packing kernels for runs of codes of one  */
+/*  width. The best variant for the running CPU   */
+/*  is picked once at startup.                    */
+/**************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+/* Codes are up to 20 bits wide and travel in 32-bit lanes. */
+
+/* Extracts count codes of the given width starting at bit position pos of
+   src into dst and returns the bit position after them. May read up to 8
+   bytes past the last code, so src must be padded. */
+typedef uint32_t (*UnpackCodesFn) (const unsigned char *src, uint32_t pos, unsigned bits, unsigned count, uint32_t *dst);
+
+/* Appends count codes of the given width to the bit accumulator (acc holds
+   accbits < 8 pending bits) and writes every completed byte to dst. Returns
+   the end of the written bytes; up to 8 bytes past it may be clobbered. */
+typedef unsigned char *(*PackCodesFn) (const uint32_t *codes, unsigned count, unsigned bits, uint64_t & acc, unsigned & accbits, unsigned char *dst);
+
+struct LZWBitKernels
+{
+  UnpackCodesFn unpack;
+  PackCodesFn pack;
+  const char *name;
+};
+
+const LZWBitKernels & SelectBitKernels (void);
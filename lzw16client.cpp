@@ -0,0 +1,629 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Client of the lzw16d daemon, and the message  */
+/*  framing both sides share (see lzw16d.h).      */
+/**************************************************/
+
+#include "common.h"
+#include "lzw16d.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define MAX_FDS 2
+
+// the seals LZWDSpill::Seal adds; F_SEAL_GROW too, so the size is final.
+#define LZWD_SEALS  (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+
+/*--------------------------------------------------------------------*/
+/* Framing                                                            */
+/*--------------------------------------------------------------------*/
+
+union FdControl
+{
+  char buf[CMSG_SPACE (sizeof (int) * MAX_FDS)];
+  struct cmsghdr align;
+};
+
+bool lzwd_send (int sock, const void *head, size_t head_len, const void *data, size_t data_len, const int *fds, int nfds)
+{
+  struct iovec iov[2] = { { (void *)head, head_len }, { (void *)data, data_len } };
+  struct msghdr msg;
+  FdControl control;
+
+  if (nfds > MAX_FDS)
+    return false;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = data_len ? 2 : 1;
+
+  if (nfds > 0)
+  {
+    memset (&control, 0, sizeof (control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE (sizeof (int) * nfds);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int) * nfds);
+    memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * nfds);
+  }
+
+  size_t left = head_len + data_len;
+
+  while (left > 0)
+  {
+    ssize_t n = sendmsg (sock, &msg, MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      return false;
+
+    left -= (size_t)n;
+
+    // the descriptors went with the first bytes.
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+
+    while (n > 0)
+    {
+      size_t step = ((size_t)n < msg.msg_iov->iov_len) ? (size_t)n : msg.msg_iov->iov_len;
+
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + step;
+      msg.msg_iov->iov_len -= step;
+      n -= (ssize_t)step;
+
+      if (msg.msg_iov->iov_len == 0 && msg.msg_iovlen > 1)
+      {
+        msg.msg_iov++;
+        msg.msg_iovlen--;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool lzwd_recv (int sock, void *head, size_t head_len, int *fds, int maxfds, int *nfds)
+{
+  size_t got = 0;
+  bool ok = true;
+
+  *nfds = 0;
+
+  while (ok && got < head_len)
+  {
+    struct iovec iov = { (char *)head + got, head_len - got };
+    struct msghdr msg;
+    FdControl control;
+
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+
+    ssize_t n = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg); n > 0 && cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+
+      int count = (int)((cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int));
+
+      for (int k = 0; k < count; k++)
+      {
+        int fd;
+
+        memcpy (&fd, CMSG_DATA (cmsg) + k * sizeof (int), sizeof (int));
+
+        if (*nfds < maxfds)
+          fds[(*nfds)++] = fd;
+        else
+          close (fd);
+      }
+    }
+
+    // descriptors cut off by the kernel are lost; the request cannot be served.
+    ok = (n > 0) && !(msg.msg_flags & MSG_CTRUNC);
+
+    if (ok)
+      got += (size_t)n;
+  }
+
+  if (!ok)
+  {
+    for (int k = 0; k < *nfds; k++)
+      close (fds[k]);
+
+    *nfds = 0;
+  }
+
+  return ok;
+}
+
+bool lzwd_read (int sock, void *buf, size_t len)
+{
+  size_t got = 0;
+
+  while (got < len)
+  {
+    ssize_t n = read (sock, (char *)buf + got, len - got);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      return false;
+
+    got += (size_t)n;
+  }
+
+  return true;
+}
+
+bool lzwd_write (int fd, const void *data, size_t len)
+{
+  size_t done = 0;
+
+  while (done < len)
+  {
+    ssize_t n = write (fd, (const char *)data + done, len - done);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      return false;
+
+    done += (size_t)n;
+  }
+
+  return true;
+}
+
+bool lzwd_sealed (int fd, uint64_t len)
+{
+  struct stat st;
+  int seals = fcntl (fd, F_GET_SEALS);
+
+  return seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) == (F_SEAL_SHRINK | F_SEAL_WRITE) &&
+         fstat (fd, &st) == 0 && (uint64_t)st.st_size >= len;
+}
+
+LZWDSpill::~LZWDSpill ()
+{
+  free (buf);
+
+  if (fd >= 0)
+    close (fd);
+}
+
+bool LZWDSpill::Write (const void *data, size_t len)
+{
+  if (fd < 0 && length + len <= LZWD_INLINE_MAX)
+  {
+    if (!buf && !(buf = (unsigned char *)malloc (LZWD_INLINE_MAX)))
+      return false;
+
+    memcpy (buf + length, data, len);
+    length += len;
+    return true;
+  }
+
+  if (fd < 0)
+  {
+    fd = memfd_create ("lzw16d", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0 || !lzwd_write (fd, buf, (size_t)length))
+      return false;
+  }
+
+  if (!lzwd_write (fd, data, len))
+    return false;
+
+  length += len;
+  return true;
+}
+
+bool LZWDSpill::Seal ()
+{
+  return fd < 0 || fcntl (fd, F_ADD_SEALS, LZWD_SEALS) == 0;
+}
+
+/*--------------------------------------------------------------------*/
+/* Client                                                             */
+/*--------------------------------------------------------------------*/
+
+struct LZW_Client
+{
+  int sock;
+  int engine;
+  unsigned char *buf;   // LZWD_INLINE_MAX bytes.
+};
+
+LZW_Client *lzw_client_connect (const char *path)
+{
+  struct sockaddr_un addr;
+
+  if (!path)
+    path = LZW_DAEMON_SOCKET;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+  {
+    fprintf (stderr, "Socket path too long: %s\n", path);
+    return NULL;
+  }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  int sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (sock < 0 || connect (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+  {
+    fprintf (stderr, "Cannot connect to lzw16d at \'%s\': %s\n", path, strerror (errno));
+
+    if (sock >= 0)
+      close (sock);
+
+    return NULL;
+  }
+
+  LZW_Client *client = (LZW_Client *)malloc (sizeof (LZW_Client));
+  unsigned char *buf = (unsigned char *)malloc (LZWD_INLINE_MAX);
+
+  if (!client || !buf)
+  {
+    fprintf (stderr, "Memory allocation error.\n");
+    free (client);
+    free (buf);
+    close (sock);
+    return NULL;
+  }
+
+  client->sock = sock;
+  client->engine = LZW_ENGINE_LZW;
+  client->buf = buf;
+
+  return client;
+}
+
+void lzw_client_close (LZW_Client *client)
+{
+  if (!client) return;
+
+  close (client->sock);
+  free (client->buf);
+  free (client);
+}
+
+int lzw_client_set_engine (LZW_Client *client, int engine)
+{
+  if (!client) return 0;
+
+  if (engine != LZW_ENGINE_LZW && engine != LZW_ENGINE_LZMW && engine != LZW_ENGINE_LZAP)
+  {
+    fprintf (stderr, "Unknown engine %d.\n", engine);
+    return 0;
+  }
+
+  client->engine = engine;
+  return 1;
+}
+
+static LZWDRequest makeRequest (const LZW_Client *client, int op, int flags, int max_bits)
+{
+  LZWDRequest req;
+
+  memset (&req, 0, sizeof (req));
+  req.magic = LZWD_MAGIC;
+  req.version = LZWD_VERSION;
+  req.op = (uint8_t)op;
+  req.max_bits = (uint8_t)((max_bits >= 0 && max_bits < 256) ? max_bits : 0);
+  req.engine = (uint8_t)client->engine;
+  req.flags = flags & LZWD_FLAGS;
+
+  return req;
+}
+
+// Sends req with its inline payload or descriptors, and reads the reply
+// header; *reply_fd is the descriptor that came with it, -1 if none.
+static bool transact (LZW_Client *client, const LZWDRequest & req, const void *data, const int *fds,
+                      LZWDReply & reply, int *reply_fd)
+{
+  int nfds = (req.fds & LZWD_INPUT_FD ? 1 : 0) + (req.fds & LZWD_OUTPUT_FD ? 1 : 0);
+  int got[1];
+
+  *reply_fd = -1;
+
+  if (!lzwd_send (client->sock, &req, sizeof (req), data, data ? (size_t)req.length : 0, fds, nfds) ||
+      !lzwd_recv (client->sock, &reply, sizeof (reply), got, 1, &nfds) || reply.magic != LZWD_MAGIC)
+  {
+    fprintf (stderr, "Lost connection to lzw16d.\n");
+
+    if (nfds > 0)
+      close (got[0]);
+
+    return false;
+  }
+
+  if (nfds > 0)
+    *reply_fd = got[0];
+
+  return true;
+}
+
+// Hands the output of a reply to sink: inline after it, or in the memfd
+// that came with it.
+static bool deliver (LZW_Client *client, const LZWDReply & reply, int fd, const lzw_sink *sink)
+{
+  if (reply.length <= LZWD_INLINE_MAX)
+  {
+    if (fd >= 0)
+      close (fd);
+
+    if (!lzwd_read (client->sock, client->buf, (size_t)reply.length))
+    {
+      fprintf (stderr, "Lost connection to lzw16d.\n");
+      return false;
+    }
+
+    return reply.length == 0 || sink->write (sink->opaque, client->buf, (size_t)reply.length) == 0;
+  }
+
+  void *map = MAP_FAILED;
+
+  if (fd >= 0 && lzwd_sealed (fd, reply.length))
+    map = mmap (NULL, (size_t)reply.length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (fd >= 0)
+    close (fd);
+
+  if (map == MAP_FAILED)
+  {
+    fprintf (stderr, "Cannot map the output of lzw16d.\n");
+    return false;
+  }
+
+  bool ok = true;
+
+  for (uint64_t pos = 0; ok && pos < reply.length; pos += LZWD_INLINE_MAX)
+  {
+    size_t len = (size_t)((reply.length - pos < LZWD_INLINE_MAX) ? reply.length - pos : LZWD_INLINE_MAX);
+
+    ok = sink->write (sink->opaque, (const unsigned char *)map + pos, len) == 0;
+  }
+
+  munmap (map, (size_t)reply.length);
+
+  return ok;
+}
+
+// Pulls source to its end, into memory or a memfd; false if it holds more
+// than limit bytes.
+static bool gather (LZW_Client *client, const lzw_source *source, LZWDSpill & input, uint64_t limit)
+{
+  for (;;)
+  {
+    ptrdiff_t n = source->read (source->opaque, client->buf, LZWD_INLINE_MAX);
+
+    if (n < 0)
+    {
+      fprintf (stderr, "Read error.\n");
+      return false;
+    }
+
+    if (n == 0)
+      return true;
+
+    if (input.Length () + (uint64_t)n > limit)
+    {
+      fprintf (stderr, "Input is longer than its size.\n");
+      return false;
+    }
+
+    if (!input.Write (client->buf, (size_t)n))
+    {
+      fprintf (stderr, "Cannot buffer the input: %s\n", strerror (errno));
+      return false;
+    }
+  }
+}
+
+static int streamRequest (LZW_Client *client, int op, const lzw_source *source, uint64_t size,
+                          const lzw_sink *sink, int flags, int max_bits)
+{
+  if (!client || !source || !sink || !source->read || !sink->write) return 0;
+
+  LZWDSpill input;
+
+  if (!gather (client, source, input, size))
+    return 0;
+
+  if (!input.Seal ())
+  {
+    fprintf (stderr, "Cannot seal the input: %s\n", strerror (errno));
+    return 0;
+  }
+
+  if (op == LZWD_COMPRESS && input.Length () != size)
+  {
+    fprintf (stderr, "Input is shorter than its size.\n");
+    return 0;
+  }
+
+  LZWDRequest req = makeRequest (client, op, flags, max_bits);
+  LZWDReply reply;
+  int fd = input.Descriptor (), reply_fd;
+
+  req.length = input.Length ();
+  req.fds = (fd >= 0) ? LZWD_INPUT_FD : 0;
+
+  if (!transact (client, req, input.Inline (), &fd, reply, &reply_fd))
+    return 0;
+
+  if (reply.status != 1)
+  {
+    if (reply_fd >= 0)
+      close (reply_fd);
+
+    fprintf (stderr, "lzw16d could not %s the data.\n", op == LZWD_COMPRESS ? "pack" : "unpack");
+    return 0;
+  }
+
+  return deliver (client, reply, reply_fd, sink) ? 1 : 0;
+}
+
+int lzw_client_compress_stream (LZW_Client *client, const lzw_source *source, size_t size, const lzw_sink *sink, int flags, int max_bits)
+{
+  return streamRequest (client, LZWD_COMPRESS, source, size, sink, flags, max_bits);
+}
+
+int lzw_client_decompress_stream (LZW_Client *client, const lzw_source *source, const lzw_sink *sink, int flags)
+{
+  return streamRequest (client, LZWD_DECOMPRESS, source, UINT64_MAX, sink, flags, 0);
+}
+
+// Files go to the daemon as open descriptors: it reads the input in place
+// and writes the output itself.
+static int fileRequest (LZW_Client *client, int op, const char *filename, const char *outfile, int flags, int max_bits)
+{
+  if (!client) return 0;
+
+  if (op == LZWD_DECOMPRESS && !(flags & OVERWRITE_FLAG) && file_exists (outfile))
+  {
+    fprintf (stderr, "File \'%s\' already exists. Use overwrite flag.\n", outfile);
+    return 0;
+  }
+
+  struct stat st;
+  int fds[2];
+
+  fds[0] = open (filename, O_RDONLY | O_CLOEXEC);
+
+  if (fds[0] < 0 || fstat (fds[0], &st) != 0 || !S_ISREG (st.st_mode))
+  {
+    fprintf (stderr, "Cannot open input file \'%s\'.\n", filename);
+
+    if (fds[0] >= 0)
+      close (fds[0]);
+
+    return 0;
+  }
+
+  fds[1] = open (outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+
+  if (fds[1] < 0)
+  {
+    fprintf (stderr, "Cannot open file \'%s\': %s\n", outfile, strerror (errno));
+    close (fds[0]);
+    return 0;
+  }
+
+  LZWDRequest req = makeRequest (client, op, flags, max_bits);
+  LZWDReply reply;
+  int reply_fd;
+
+  req.length = (uint64_t)st.st_size;
+  req.fds = LZWD_INPUT_FD | LZWD_OUTPUT_FD;
+
+  bool ok = transact (client, req, NULL, fds, reply, &reply_fd);
+
+  if (reply_fd >= 0)
+    close (reply_fd);
+
+  ok = ok && reply.status == 1;
+
+  close (fds[0]);
+
+  if (close (fds[1]) != 0)
+    ok = false;
+
+  if (!ok)
+  {
+    fprintf (stderr, "lzw16d could not %s \'%s\'.\n", op == LZWD_COMPRESS ? "pack" : "unpack", filename);
+    cleanup (outfile, flags);
+    return 0;
+  }
+
+  if (op == LZWD_COMPRESS && (flags & VERBOSE_OUTPUT) && st.st_size > 0)
+  {
+    printf ("Compression ratio %.2f%%\n", 100.0 * ((double)st.st_size - (double)reply.length) / (double)st.st_size);
+  }
+
+  return 1;
+}
+
+int lzw_client_compress (LZW_Client *client, const char *filename, const char *outfile, int flags, int max_bits)
+{
+  return fileRequest (client, LZWD_COMPRESS, filename, outfile, flags, max_bits);
+}
+
+int lzw_client_decompress (LZW_Client *client, const char *filename, const char *outfile, int flags)
+{
+  return fileRequest (client, LZWD_DECOMPRESS, filename, outfile, flags, 0);
+}
+
+int lzw_client_stats (LZW_Client *client, lzw_daemon_stats *stats)
+{
+  if (!client || !stats) return 0;
+
+  LZWDRequest req = makeRequest (client, LZWD_STATS, 0, 0);
+  LZWDReply reply;
+  int reply_fd;
+
+  if (!transact (client, req, NULL, NULL, reply, &reply_fd))
+    return 0;
+
+  if (reply_fd >= 0)
+    close (reply_fd);
+
+  if (reply.status != 1 || reply.length != sizeof (*stats) || !lzwd_read (client->sock, stats, sizeof (*stats)))
+  {
+    fprintf (stderr, "Bad reply from lzw16d.\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+#else // not Linux: no daemon to talk to.
+
+LZW_Client *lzw_client_connect (const char *)
+{
+  fprintf (stderr, "lzw16d is only available on Linux.\n");
+  return NULL;
+}
+
+void lzw_client_close (LZW_Client *) { }
+int lzw_client_set_engine (LZW_Client *, int) { return 0; }
+int lzw_client_compress (LZW_Client *, const char *, const char *, int, int) { return 0; }
+int lzw_client_decompress (LZW_Client *, const char *, const char *, int) { return 0; }
+int lzw_client_compress_stream (LZW_Client *, const lzw_source *, size_t, const lzw_sink *, int, int) { return 0; }
+int lzw_client_decompress_stream (LZW_Client *, const lzw_source *, const lzw_sink *, int) { return 0; }
+int lzw_client_stats (LZW_Client *, lzw_daemon_stats *) { return 0; }
+
+#endif
@@ -0,0 +1,618 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  lzw16d: packs and unpacks for other processes */
+/*  on a UNIX domain socket (Linux only). Worker  */
+/*  threads take requests one at a time, from     */
+/*  whichever connection has one, and keep their  */
+/*  own contexts, warm from the start, so         */
+/*  requests do not allocate or zero tables.      */
+/*  Protocol in lzw16d.h; client in export.h.     */
+/**************************************************/
+
+#include "common.h"
+#include "lzw16d.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#if defined(__linux__)
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+typedef std::chrono::steady_clock Clock;
+
+/*--------------------------------------------------------------------*/
+/* Counters                                                           */
+/*--------------------------------------------------------------------*/
+
+struct Counters
+{
+  std::atomic<uint64_t> requests[2], failures[2];
+  std::atomic<uint64_t> bytes_in[2], bytes_out[2];
+  std::atomic<uint64_t> busy_ns[2], max_ns[2];
+  std::atomic<uint64_t> latency[2][LZW_DAEMON_LATENCY_BUCKETS];
+};
+
+static Counters counters;
+static Clock::time_point started;
+static unsigned nworkers;
+
+static const char *socketPath = LZW_DAEMON_SOCKET;
+
+// k is 0 for packing, 1 for unpacking.
+static void record (int k, bool ok, uint64_t in, uint64_t out, uint64_t ns)
+{
+  counters.requests[k]++;
+  counters.bytes_in[k] += in;
+  counters.bytes_out[k] += out;
+  counters.busy_ns[k] += ns;
+
+  if (!ok)
+    counters.failures[k]++;
+
+  uint64_t prev = counters.max_ns[k].load ();
+
+  while (ns > prev && !counters.max_ns[k].compare_exchange_weak (prev, ns))
+    ;
+
+  uint64_t us = ns / 1000;
+  int bucket = 0;
+
+  while (bucket < LZW_DAEMON_LATENCY_BUCKETS - 1 && us >= ((uint64_t)1 << bucket))
+    bucket++;
+
+  counters.latency[k][bucket]++;
+}
+
+static void snapshot (lzw_daemon_stats & stats)
+{
+  for (int k = 0; k < 2; k++)
+  {
+    stats.requests[k] = counters.requests[k];
+    stats.failures[k] = counters.failures[k];
+    stats.bytes_in[k] = counters.bytes_in[k];
+    stats.bytes_out[k] = counters.bytes_out[k];
+    stats.busy_ns[k] = counters.busy_ns[k];
+    stats.max_ns[k] = counters.max_ns[k];
+
+    for (int b = 0; b < LZW_DAEMON_LATENCY_BUCKETS; b++)
+      stats.latency[k][b] = counters.latency[k][b];
+  }
+
+  stats.uptime_ns = (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds> (Clock::now () - started).count ();
+  stats.workers = nworkers;
+}
+
+/*--------------------------------------------------------------------*/
+/* Requests                                                           */
+/*--------------------------------------------------------------------*/
+
+struct MemorySource
+{
+  const unsigned char *data;
+  size_t size, pos;
+};
+
+static ptrdiff_t memoryRead (void *opaque, void *buf, size_t len)
+{
+  MemorySource *src = (MemorySource *)opaque;
+  size_t n = (src->size - src->pos < len) ? src->size - src->pos : len;
+
+  memcpy (buf, src->data + src->pos, n);
+  src->pos += n;
+
+  return (ptrdiff_t)n;
+}
+
+// a client's file, read where it is rather than mapped: it could shrink
+// under a mapping, which would then fault.
+struct FileSource
+{
+  int fd;
+  uint64_t size, pos;
+};
+
+static ptrdiff_t fileRead (void *opaque, void *buf, size_t len)
+{
+  FileSource *src = (FileSource *)opaque;
+
+  if (len > src->size - src->pos)
+    len = (size_t)(src->size - src->pos);
+
+  ssize_t n;
+
+  while ((n = pread (src->fd, buf, len, (off_t)src->pos)) < 0 && errno == EINTR)
+    ;
+
+  if (n < 0)
+    return -1;
+
+  src->pos += (uint64_t)n;
+  return (ptrdiff_t)n;
+}
+
+struct FileSink
+{
+  int fd;
+  uint64_t written;
+};
+
+static int fileWrite (void *opaque, const void *buf, size_t len)
+{
+  FileSink *sink = (FileSink *)opaque;
+
+  if (!lzwd_write (sink->fd, buf, len))
+    return 1;
+
+  sink->written += len;
+  return 0;
+}
+
+static int spillWrite (void *opaque, const void *buf, size_t len)
+{
+  return ((LZWDSpill *)opaque)->Write (buf, len) ? 0 : 1;
+}
+
+struct Worker
+{
+  LZW_CCtx *cctx;
+  LZW_DCtx *dctx;
+  unsigned char *buf;   // inline payload of a request, LZWD_INLINE_MAX bytes.
+};
+
+// Serves one request. Returns false when the connection should be dropped:
+// it broke, or the peer does not speak the protocol.
+static bool handleRequest (Worker & w, int conn, const LZWDRequest & req, const int *fds, int nfds)
+{
+  int expect = (req.fds & LZWD_INPUT_FD ? 1 : 0) + (req.fds & LZWD_OUTPUT_FD ? 1 : 0);
+
+  if (req.magic != LZWD_MAGIC || req.version != LZWD_VERSION || nfds != expect ||
+      (req.fds & ~(LZWD_INPUT_FD | LZWD_OUTPUT_FD)))
+    return false;
+
+  LZWDReply reply = { LZWD_MAGIC, 0, 0 };
+
+  if (req.op == LZWD_STATS)
+  {
+    lzw_daemon_stats stats;
+
+    snapshot (stats);
+    reply.status = 1;
+    reply.length = sizeof (stats);
+
+    return lzwd_send (conn, &reply, sizeof (reply), &stats, sizeof (stats), NULL, 0);
+  }
+
+  if (req.op != LZWD_COMPRESS && req.op != LZWD_DECOMPRESS)
+    return false;
+
+  Clock::time_point start = Clock::now ();
+
+  int k = (req.op == LZWD_COMPRESS) ? 0 : 1;
+  int in_fd = (req.fds & LZWD_INPUT_FD) ? fds[0] : -1;
+  int out_fd = (req.fds & LZWD_OUTPUT_FD) ? fds[expect - 1] : -1;
+
+  const unsigned char *data = w.buf;
+  void *map = NULL;
+  bool ok = true;
+
+  // the input: inline after the request, mapped from a sealed memfd, or
+  // read from the file of a request that has its own output.
+  if (in_fd < 0)
+  {
+    if (req.length > LZWD_INLINE_MAX || !lzwd_read (conn, w.buf, (size_t)req.length))
+      return false;
+  }
+  else if (out_fd < 0 && req.length > 0)
+  {
+    if (!lzwd_sealed (in_fd, req.length) ||
+        (map = mmap (NULL, (size_t)req.length, PROT_READ, MAP_PRIVATE, in_fd, 0)) == MAP_FAILED)
+    {
+      fprintf (stderr, "Cannot map the input of a request: it must be a sealed memfd of its length.\n");
+      map = NULL;
+      ok = false;
+    }
+
+    data = (const unsigned char *)map;
+  }
+
+  MemorySource src = { data, (size_t)req.length, 0 };
+  FileSource file_src = { in_fd, req.length, 0 };
+  lzw_source source = { memoryRead, &src };
+
+  if (in_fd >= 0 && out_fd >= 0)
+  {
+    source.read = fileRead;
+    source.opaque = &file_src;
+  }
+
+  LZWDSpill spill;
+  FileSink file = { out_fd, 0 };
+  lzw_sink sink = { spillWrite, &spill };
+
+  if (out_fd >= 0)
+  {
+    sink.write = fileWrite;
+    sink.opaque = &file;
+  }
+
+  int flags = req.flags & LZWD_FLAGS;
+
+  if (ok && k == 0)
+    ok = lzw_cctx_set_engine (w.cctx, req.engine) && lzw_compress_stream (w.cctx, &source, (size_t)req.length, &sink, flags, req.max_bits);
+  else if (ok)
+    ok = lzw_decompress_stream (w.dctx, &source, &sink, flags);
+
+  if (map)
+    munmap (map, (size_t)req.length);
+
+  uint64_t out_len = (out_fd >= 0) ? file.written : spill.Length ();
+
+  if (ok && out_fd < 0 && !spill.Seal ())
+  {
+    fprintf (stderr, "Cannot seal the output of a request: %s\n", strerror (errno));
+    ok = false;
+  }
+
+  reply.status = ok ? 1 : 0;
+  reply.length = ok ? out_len : 0;
+
+  bool sent;
+
+  if (ok && out_fd < 0 && out_len > LZWD_INLINE_MAX)
+  {
+    int fd = spill.Descriptor ();
+
+    sent = lzwd_send (conn, &reply, sizeof (reply), NULL, 0, &fd, 1);
+  }
+  else
+  {
+    bool inline_data = ok && out_fd < 0;
+
+    sent = lzwd_send (conn, &reply, sizeof (reply), inline_data ? spill.Inline () : NULL,
+                      inline_data ? (size_t)out_len : 0, NULL, 0);
+  }
+
+  uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds> (Clock::now () - start).count ();
+
+  record (k, ok, req.length, reply.length, ns);
+
+  return sent;
+}
+
+// Serves the request waiting on conn; false when conn is done with.
+static bool serveRequest (Worker & w, int conn)
+{
+  LZWDRequest req;
+  int fds[2], nfds;
+
+  if (!lzwd_recv (conn, &req, sizeof (req), fds, 2, &nfds))
+    return false;
+
+  bool keep = handleRequest (w, conn, req, fds, nfds);
+
+  for (int k = 0; k < nfds; k++)
+    close (fds[k]);
+
+  return keep;
+}
+
+// (Re)arms fd in events for one readiness event, taken by a single worker.
+static bool watch (int events, int fd, int op)
+{
+  struct epoll_event ev;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.fd = fd;
+
+  return epoll_ctl (events, op, fd, &ev) == 0;
+}
+
+// Workers wait on one epoll set, holding the listener and each connection
+// between requests. A worker serves a single request, then hands the
+// connection back to the set, so idle connections do not tie workers up.
+static void workerLoop (Worker * w, int listener, int events)
+{
+  for (;;)
+  {
+    struct epoll_event ev;
+
+    int n = epoll_wait (events, &ev, 1, -1);
+
+    if (n < 0 && errno != EINTR)
+    {
+      fprintf (stderr, "epoll_wait: %s\n", strerror (errno));
+      std::this_thread::sleep_for (std::chrono::milliseconds (10));
+    }
+
+    if (n <= 0)
+      continue;
+
+    if (ev.data.fd == listener)
+    {
+      int conn = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+
+      watch (events, listener, EPOLL_CTL_MOD);
+
+      if (conn < 0)
+      {
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+        {
+          fprintf (stderr, "accept: %s\n", strerror (errno));
+          std::this_thread::sleep_for (std::chrono::milliseconds (10));
+        }
+      }
+      else if (!watch (events, conn, EPOLL_CTL_ADD))
+      {
+        fprintf (stderr, "epoll_ctl: %s\n", strerror (errno));
+        close (conn);
+      }
+
+      continue;
+    }
+
+    // closing conn also takes it out of the set.
+    if (!serveRequest (*w, ev.data.fd) || !watch (events, ev.data.fd, EPOLL_CTL_MOD))
+      close (ev.data.fd);
+  }
+}
+
+/*--------------------------------------------------------------------*/
+/* Startup                                                            */
+/*--------------------------------------------------------------------*/
+
+// Packs and unpacks a few bytes, so the tables for the default width are in
+// place before the first request.
+static bool warmUp (Worker & w)
+{
+  static const unsigned char sample[] = "lzw16d warm-up";
+
+  MemorySource src = { sample, sizeof (sample), 0 };
+  lzw_source source = { memoryRead, &src };
+  LZWDSpill packed, unpacked;
+  lzw_sink sink = { spillWrite, &packed };
+
+  if (!lzw_compress_stream (w.cctx, &source, sizeof (sample), &sink, 0, DEFAULT_MAX_BITS))
+    return false;
+
+  MemorySource back = { packed.Inline (), (size_t)packed.Length (), 0 };
+
+  source.opaque = &back;
+  sink.opaque = &unpacked;
+
+  return lzw_decompress_stream (w.dctx, &source, &sink, 0) && unpacked.Length () == sizeof (sample);
+}
+
+static int listenOn (const char *path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (strlen (path) >= sizeof (addr.sun_path))
+  {
+    fprintf (stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  // a socket left by a daemon that did not exit cleanly is replaced; a live one is not.
+  if (lstat (path, &st) == 0)
+  {
+    int probe = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool live = probe >= 0 && connect (probe, (struct sockaddr *)&addr, sizeof (addr)) == 0;
+
+    if (probe >= 0)
+      close (probe);
+
+    if (live || !S_ISSOCK (st.st_mode))
+    {
+      fprintf (stderr, live ? "lzw16d is already running on \'%s\'.\n" : "\'%s\' exists and is not a socket.\n", path);
+      return -1;
+    }
+
+    unlink (path);
+  }
+
+  // non-blocking, as the connection it was ready for may be gone by accept.
+  int sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+  if (sock < 0 || bind (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0 || listen (sock, SOMAXCONN) != 0)
+  {
+    fprintf (stderr, "Cannot listen on \'%s\': %s\n", path, strerror (errno));
+
+    if (sock >= 0)
+      close (sock);
+
+    return -1;
+  }
+
+  return sock;
+}
+
+static void onSignal (int)
+{
+  unlink (socketPath);
+  _exit (0);
+}
+
+// the percentile q of a latency histogram, as the bucket's upper bound in microseconds.
+static unsigned long long percentile (const unsigned long long *latency, unsigned long long count, double q)
+{
+  unsigned long long seen = 0;
+
+  for (int b = 0; b < LZW_DAEMON_LATENCY_BUCKETS; b++)
+  {
+    seen += latency[b];
+
+    if (seen > 0 && (double)seen >= q * (double)count)
+      return 1ULL << b;
+  }
+
+  return 1ULL << (LZW_DAEMON_LATENCY_BUCKETS - 1);
+}
+
+static int printStats (const char *path)
+{
+  LZW_Client *client = lzw_client_connect (path);
+  lzw_daemon_stats stats;
+
+  if (!client)
+    return 1;
+
+  int ret = lzw_client_stats (client, &stats);
+
+  lzw_client_close (client);
+
+  if (!ret)
+    return 1;
+
+  printf ("%llu workers, up %.1f s\n", stats.workers, stats.uptime_ns / 1e9);
+
+  for (int k = 0; k < 2; k++)
+  {
+    unsigned long long n = stats.requests[k];
+    double busy = stats.busy_ns[k] / 1e9;
+
+    printf ("%s: %llu requests, %llu failed, %.2f MB in, %.2f MB out", k ? "unpack" : "pack", n, stats.failures[k],
+            stats.bytes_in[k] / 1048576.0, stats.bytes_out[k] / 1048576.0);
+
+    if (n > 0)
+    {
+      printf (", %.1f MB/s, mean %.0f us, p50 < %llu us, p99 < %llu us, max %.0f us", busy > 0 ? stats.bytes_in[k] / 1048576.0 / busy : 0.0,
+              stats.busy_ns[k] / 1e3 / n, percentile (stats.latency[k], n, 0.5), percentile (stats.latency[k], n, 0.99),
+              stats.max_ns[k] / 1e3);
+    }
+
+    printf ("\n");
+  }
+
+  return 0;
+}
+
+static void printSyntax (const char *prog)
+{
+  printf ("syntax: %s [--jobs=N] [--socket=PATH] \n", prog);
+  printf ("        %s --stats [--socket=PATH] \n", prog);
+  printf ("\t --jobs=N - worker threads, each with its own contexts. Default is one per core.\n");
+  printf ("\t --socket=PATH - socket to listen on. Default is %s.\n", LZW_DAEMON_SOCKET);
+  printf ("\t --stats - print the counters of the daemon running on the socket \n");
+}
+
+int main (int argc, char *argv[])
+{
+  bool stats = false;
+  int jobs = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (strncmp (argv[i], "--jobs=", 7) == 0)
+    {
+      jobs = atoi (argv[i] + 7);
+
+      if (jobs < 1 || jobs > 1024)
+      {
+        fprintf (stderr, "Invalid number of jobs. Allowed range 1 to 1024.\n");
+        return 1;
+      }
+    }
+    else if (strncmp (argv[i], "--socket=", 9) == 0 && argv[i][9])
+    {
+      socketPath = argv[i] + 9;
+    }
+    else if (strcmp (argv[i], "--stats") == 0)
+    {
+      stats = true;
+    }
+    else
+    {
+      printSyntax (argv[0]);
+      return 1;
+    }
+  }
+
+  if (stats)
+    return printStats (socketPath);
+
+  if (jobs == 0)
+    jobs = (int)std::thread::hardware_concurrency ();
+
+  if (jobs < 1)
+    jobs = 1;
+
+  std::vector<Worker> workers (jobs);
+
+  for (Worker & w : workers)
+  {
+    w.cctx = lzw_cctx_create ();
+    w.dctx = lzw_dctx_create ();
+    w.buf = (unsigned char *)malloc (LZWD_INLINE_MAX);
+
+    if (!w.cctx || !w.dctx || !w.buf || !warmUp (w))
+    {
+      fprintf (stderr, "Cannot set up the workers.\n");
+      return 1;
+    }
+  }
+
+  int listener = listenOn (socketPath);
+
+  if (listener < 0)
+    return 1;
+
+  int events = epoll_create1 (EPOLL_CLOEXEC);
+
+  if (events < 0 || !watch (events, listener, EPOLL_CTL_ADD))
+  {
+    fprintf (stderr, "Cannot watch \'%s\': %s\n", socketPath, strerror (errno));
+    unlink (socketPath);
+    return 1;
+  }
+
+  signal (SIGPIPE, SIG_IGN);
+  signal (SIGINT, onSignal);
+  signal (SIGTERM, onSignal);
+
+  started = Clock::now ();
+  nworkers = (unsigned)jobs;
+
+  printf ("lzw16d listening on %s with %d workers\n", socketPath, jobs);
+  fflush (stdout);
+
+  std::vector<std::thread> threads;
+
+  for (int k = 1; k < jobs; k++)
+    threads.emplace_back (workerLoop, &workers[k], listener, events);
+
+  workerLoop (&workers[0], listener, events);
+
+  return 0;
+}
+
+#else
+
+int main (void)
+{
+  fprintf (stderr, "lzw16d is only available on Linux.\n");
+  return 1;
+}
+
+#endif
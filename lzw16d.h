@@ -0,0 +1,107 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  lzw16d wire protocol. A client sends a        */
+/*  request, possibly with descriptors attached   */
+/*  (SCM_RIGHTS), and reads one reply; requests   */
+/*  may follow each other on a connection.        */
+/*                                                */
+/*  Payloads up to LZWD_INLINE_MAX bytes follow   */
+/*  the request or reply in the stream. Larger    */
+/*  ones travel as a memfd holding them from      */
+/*  offset 0, so they are never copied through    */
+/*  the socket; it is sealed against shrinking    */
+/*  and writes, as it is mapped on the other      */
+/*  side. A request may also carry its own        */
+/*  output descriptor (an open file), which the   */
+/*  daemon then writes to instead of replying     */
+/*  with the data; its input descriptor is then   */
+/*  an open file as well, read, not mapped.       */
+/**************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#define LZWD_MAGIC       0x44575a4cU   /* "LZWD" */
+#define LZWD_VERSION     0
+#define LZWD_INLINE_MAX  65536
+
+// flags a request passes on to the daemon; the client handles the others
+// itself, and the daemon never prints progress.
+#define LZWD_FLAGS  (RLE_STAGE | ENTROPY_STAGE | SUBBLOCK_FRAMING | LRU_EVICTION)
+
+enum { LZWD_COMPRESS = 1, LZWD_DECOMPRESS = 2, LZWD_STATS = 3 };
+
+// descriptors attached to a request, in this order.
+enum { LZWD_INPUT_FD = 1, LZWD_OUTPUT_FD = 2 };
+
+struct LZWDRequest
+{
+  uint32_t magic;
+  uint8_t version;
+  uint8_t op;
+  uint8_t fds;        // LZWD_INPUT_FD | LZWD_OUTPUT_FD.
+  uint8_t max_bits;   // packing only.
+  uint8_t engine;     // packing only.
+  uint8_t reserved[3];
+  int32_t flags;      // LZWD_FLAGS; others are ignored.
+  uint64_t length;    // input bytes, inline or at the start of the input descriptor.
+};
+
+struct LZWDReply
+{
+  uint32_t magic;
+  int32_t status;     // 1 done, 0 failed.
+  uint64_t length;    // output bytes: inline, in the attached memfd when larger
+                      // than LZWD_INLINE_MAX, or written to the output descriptor.
+};
+
+static_assert (sizeof (LZWDRequest) == 24 && sizeof (LZWDReply) == 16, "lzw16d messages must not be padded");
+
+// sends head and data as one message, with nfds descriptors attached.
+bool lzwd_send (int sock, const void *head, size_t head_len, const void *data, size_t data_len, const int *fds, int nfds);
+
+// reads exactly head_len bytes; descriptors that came with them are stored in
+// fds (up to maxfds, the rest closed) and counted in *nfds. False at the end
+// of the stream or on error.
+bool lzwd_recv (int sock, void *head, size_t head_len, int *fds, int maxfds, int *nfds);
+
+// reads exactly len bytes of inline payload.
+bool lzwd_read (int sock, void *buf, size_t len);
+
+// writes all of data to fd.
+bool lzwd_write (int fd, const void *data, size_t len);
+
+// true if fd is a memfd sealed as LZWDSpill::Seal leaves it, holding at
+// least len bytes, so that it can be mapped safely.
+bool lzwd_sealed (int fd, uint64_t len);
+
+// Output of unknown length: kept in memory up to LZWD_INLINE_MAX bytes, then
+// moved to a memfd, which takes the rest.
+class LZWDSpill
+{
+  private:
+    unsigned char *buf;
+    int fd;
+    uint64_t length;
+
+  public:
+    LZWDSpill () : buf (NULL), fd (-1), length (0) { }
+    ~LZWDSpill ();
+
+    LZWDSpill (const LZWDSpill &) = delete;
+    LZWDSpill & operator=(const LZWDSpill &) = delete;
+
+    bool Write (const void *data, size_t len);
+
+    // seals the memfd, if there is one, before it is sent; no writes after.
+    bool Seal ();
+
+    uint64_t Length () const { return length; }
+
+    // the data when it fits inline, NULL once it is in the memfd.
+    const unsigned char *Inline () const { return fd < 0 ? buf : NULL; }
+    int Descriptor () const { return fd; }
+};
@@ -0,0 +1,362 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Page-cache-aware stream backend (DIRECT_IO).  */
+/*  Large aligned O_DIRECT reads and writes go    */
+/*  around the page cache. Where the file system  */
+/*  refuses O_DIRECT, plain reads and writes are  */
+/*  given posix_fadvise hints and their pages are */
+/*  dropped once the block is done with.          */
+/**************************************************/
+
+#include "common.h"
+#include "lzw16io.h"
+
+#include <cstring>
+#include <cerrno>
+#include <new>
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DIRECT_ALIGN 4096
+
+// posix_fadvise drops only page cache folios wholly inside the range, and
+// they can be as large as 2 Mb, so drops reach back to the 2 Mb boundary.
+#define FOLIO_SPAN   ((uint64_t)2 << 20)
+
+static void dropPages (int fd, uint64_t from, uint64_t to)
+{
+  from &= ~(FOLIO_SPAN - 1);
+
+  if (to > from)
+    posix_fadvise (fd, (off_t)from, (off_t)(to - from), POSIX_FADV_DONTNEED);
+}
+
+/* One block, aligned for O_DIRECT, from the allocator. */
+struct DirectBuffer
+{
+  LZWAllocator & alloc;
+  unsigned char *memory, *data;
+  size_t size;
+
+  DirectBuffer (LZWAllocator & a, size_t block) : alloc (a), memory (NULL), data (NULL), size (block)
+  {
+    if (block + DIRECT_ALIGN <= alloc.RingBudget ())
+      memory = (unsigned char *)alloc.Alloc (block + DIRECT_ALIGN);
+
+    if (memory)
+      data = memory + (DIRECT_ALIGN - (uintptr_t)memory % DIRECT_ALIGN) % DIRECT_ALIGN;
+  }
+
+  ~DirectBuffer ()
+  {
+    alloc.Free (memory, size + DIRECT_ALIGN);
+  }
+};
+
+static bool setDirect (int fd, bool on)
+{
+  int fl = fcntl (fd, F_GETFL);
+
+  if (fl < 0) return false;
+
+  return fcntl (fd, F_SETFL, on ? (fl | O_DIRECT) : (fl & ~O_DIRECT)) == 0;
+}
+
+/*--------------------------------------------------------------------*/
+/* Input: one block at a time, at the file offset after the last.     */
+/*--------------------------------------------------------------------*/
+
+class DirectInput : public LZWInput
+{
+  private:
+    FILE *fp;
+    int fd;
+    DirectBuffer buffer;
+    int64_t file_size;
+    uint64_t offset;            // of the next read.
+    size_t length, consumed;    // of the block in the buffer.
+    bool direct, failed, owned;
+
+    // cached reads drop the block just consumed and ask for the next one.
+    bool Fill (void)
+    {
+      if (!direct && length > 0)
+        dropPages (fd, offset - length, offset);
+
+      ssize_t n;
+
+      for (;;)
+      {
+        n = pread (fd, buffer.data, buffer.size, (off_t)offset);
+
+        if (n >= 0) break;
+
+        if (errno == EINTR) continue;
+
+        // O_DIRECT was taken but not its reads (or a short read left us unaligned).
+        if (errno == EINVAL && direct && setDirect (fd, false))
+        {
+          direct = false;
+          posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+          continue;
+        }
+
+        return false;
+      }
+
+      length = (size_t)n;
+      consumed = 0;
+      offset += length;
+
+      if (!direct && length > 0)
+        posix_fadvise (fd, (off_t)offset, (off_t)buffer.size, POSIX_FADV_WILLNEED);
+
+      return true;
+    }
+
+  public:
+    DirectInput (FILE *f, LZWAllocator & a, size_t block) : fp (f), fd (fileno (f)), buffer (a, block)
+    {
+      file_size = 0;
+      offset = 0;
+      length = consumed = 0;
+      direct = failed = owned = false;
+    }
+
+    ~DirectInput () override
+    {
+      if (!direct && owned)
+        posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+      if (owned) fclose (fp);
+    }
+
+    bool Start (void)
+    {
+      struct stat st;
+
+      if (!buffer.data || fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)) return false;
+
+      file_size = st.st_size;
+      direct = setDirect (fd, true);
+
+      if (!direct)
+        posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+      owned = true;
+      return true;
+    }
+
+    size_t Read (void *buf, size_t len) override
+    {
+      size_t total = 0;
+
+      while (total < len && !failed)
+      {
+        if (consumed == length)
+        {
+          if (!Fill ())
+          {
+            failed = true;
+            break;
+          }
+
+          if (length == 0) break;   // end of file.
+        }
+
+        size_t n = (len - total < length - consumed) ? len - total : length - consumed;
+
+        memcpy ((unsigned char *)buf + total, buffer.data + consumed, n);
+
+        total += n;
+        consumed += n;
+      }
+
+      position += total;
+      return total;
+    }
+
+    int64_t Size (void) override { return file_size; }
+    bool Failed (void) const override { return failed; }
+};
+
+/*--------------------------------------------------------------------*/
+/* Output: whole blocks are written; the last one is padded to the    */
+/* alignment for O_DIRECT and the file cut back to length.            */
+/*--------------------------------------------------------------------*/
+
+class DirectOutput : public LZWOutput
+{
+  private:
+    FILE *fp;
+    int fd;
+    DirectBuffer buffer;
+    size_t fill;
+    uint64_t offset;            // of the next write.
+    uint64_t dropped;           // cached writes: pages up to here are written back and dropped.
+    bool direct, failed, owned;
+
+    // cached writes: starts writeback of the block just written and drops
+    // the ones before it, which have had a block's time to get to disk.
+    void Drop (uint64_t end)
+    {
+      const unsigned all = SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER;
+
+      sync_file_range (fd, (off_t)offset, (off_t)(end - offset), SYNC_FILE_RANGE_WRITE);
+
+      if (offset > dropped)
+      {
+        sync_file_range (fd, (off_t)dropped, (off_t)(offset - dropped), all);
+        dropPages (fd, dropped, offset);
+        dropped = offset;
+      }
+    }
+
+    // writes the first len bytes of the buffer at offset.
+    bool Flush (size_t len)
+    {
+      size_t done = 0;
+
+      while (done < len)
+      {
+        ssize_t n = pwrite (fd, buffer.data + done, len - done, (off_t)(offset + done));
+
+        if (n < 0 && errno == EINTR) continue;
+
+        if (n < 0 && errno == EINVAL && direct && setDirect (fd, false))
+        {
+          direct = false;
+          continue;
+        }
+
+        if (n <= 0) return false;
+
+        done += (size_t)n;
+      }
+
+      if (!direct)
+        Drop (offset + len);
+
+      offset += len;
+      return true;
+    }
+
+  public:
+    DirectOutput (FILE *f, LZWAllocator & a, size_t block) : fp (f), fd (fileno (f)), buffer (a, block)
+    {
+      fill = 0;
+      offset = dropped = 0;
+      direct = failed = owned = false;
+    }
+
+    ~DirectOutput () override
+    {
+      if (owned) fclose (fp);
+    }
+
+    bool Start (void)
+    {
+      struct stat st;
+
+      if (!buffer.data || fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)) return false;
+
+      direct = setDirect (fd, true);
+      owned = true;
+      return true;
+    }
+
+    bool Write (const void *buf, size_t len) override
+    {
+      const unsigned char *ptr = (const unsigned char *)buf;
+      size_t left = len;
+
+      while (left > 0 && !failed)
+      {
+        size_t n = (left < buffer.size - fill) ? left : buffer.size - fill;
+
+        memcpy (buffer.data + fill, ptr, n);
+
+        fill += n;
+        ptr += n;
+        left -= n;
+
+        if (fill == buffer.size)
+        {
+          failed = !Flush (fill);
+          fill = 0;
+        }
+      }
+
+      if (failed) return false;
+
+      position += len;
+      return true;
+    }
+
+    bool Finish (void) override
+    {
+      if (failed) return false;
+
+      if (fill > 0)
+      {
+        size_t len = fill;
+
+        if (direct)
+        {
+          len = (fill + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+          memset (buffer.data + fill, 0, len - fill);
+        }
+
+        failed = !Flush (len) || (len != fill && ftruncate (fd, (off_t)position) != 0);
+        fill = 0;
+      }
+
+      // the rest, once it is written back.
+      if (!failed && !direct &&
+          sync_file_range (fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+        posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+      return !failed;
+    }
+};
+
+/* On success the stream owns fp; otherwise fp is left open for stdio. */
+
+LZWInput *OpenDirectInput (FILE *fp, LZWAllocator & alloc, size_t block)
+{
+  DirectInput *in = new (std::nothrow) DirectInput (fp, alloc, block);
+
+  if (in && in->Start()) return in;
+
+  delete in;
+  return NULL;
+}
+
+LZWOutput *OpenDirectOutput (FILE *fp, LZWAllocator & alloc, size_t block)
+{
+  DirectOutput *out = new (std::nothrow) DirectOutput (fp, alloc, block);
+
+  if (out && out->Start()) return out;
+
+  delete out;
+  return NULL;
+}
+
+#else // no O_DIRECT or posix_fadvise on this platform
+
+LZWInput *OpenDirectInput (FILE *, LZWAllocator &, size_t)
+{
+  return NULL;
+}
+
+LZWOutput *OpenDirectOutput (FILE *, LZWAllocator &, size_t)
+{
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,365 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+#include "lzw16filter.h"
+
+#include <cstring>
+
+/*--------------------------------------------------------------------*/
+/* RLE                                                                */
+/*--------------------------------------------------------------------*/
+
+RLEInput::RLEInput (LZWInput & source, LZWAllocator & a) : src (source), alloc (a),
+  pos (0), end (0), last (-1), repeat (0), vpos (0), vlen (0), eof (false)
+{
+  block = (unsigned char *)alloc.Alloc (FILTER_BLOCK);
+}
+
+RLEInput::~RLEInput ()
+{
+  alloc.Free (block, FILTER_BLOCK);
+}
+
+bool RLEInput::Fill (void)
+{
+  if (pos < end) return true;
+  if (eof) return false;
+
+  pos = 0;
+  end = src.Read (block, FILTER_BLOCK);
+
+  if (end < FILTER_BLOCK) eof = true;
+
+  return end > 0;
+}
+
+size_t RLEInput::Read (void *buf, size_t len)
+{
+  unsigned char *out = (unsigned char *)buf;
+  size_t n = 0;
+
+  while (n < len)
+  {
+    if (vpos < vlen)
+    {
+      out[n++] = varint[vpos++];
+      continue;
+    }
+
+    if (!Fill ()) break;
+
+    if (repeat == RLE_MIN_RUN)
+    {
+      // swallow the rest of the run, however long, and emit its length.
+      uint64_t extra = 0;
+
+      do
+      {
+        while (pos < end && block[pos] == last) { pos++; extra++; }
+      }
+      while (pos == end && Fill ());
+
+      vpos = vlen = 0;
+
+      do
+      {
+        varint[vlen++] = (unsigned char)((extra & 0x7F) | (extra > 0x7F ? 0x80 : 0));
+        extra >>= 7;
+      }
+      while (extra);
+
+      last = -1;
+      repeat = 0;
+      continue;
+    }
+
+    unsigned char c = block[pos++];
+
+    if (c == last) repeat++;
+    else { last = c; repeat = 1; }
+
+    out[n++] = c;
+  }
+
+  position += n;
+  return n;
+}
+
+RLEOutput::RLEOutput (LZWOutput & destination, LZWAllocator & a) : dst (destination), alloc (a),
+  fill (0), last (-1), repeat (0), count (0), shift (0), in_count (false), failed (false)
+{
+  block = (unsigned char *)alloc.Alloc (FILTER_BLOCK);
+}
+
+RLEOutput::~RLEOutput ()
+{
+  alloc.Free (block, FILTER_BLOCK);
+}
+
+bool RLEOutput::Flush (void)
+{
+  if (fill && !dst.Write (block, fill)) failed = true;
+
+  fill = 0;
+  return !failed;
+}
+
+bool RLEOutput::Put (unsigned char c, size_t n)
+{
+  position += n;
+
+  while (n)
+  {
+    if (fill == FILTER_BLOCK && !Flush ()) return false;
+
+    size_t chunk = FILTER_BLOCK - fill;
+    if (chunk > n) chunk = n;
+
+    memset (block + fill, c, chunk);
+    fill += chunk;
+    n -= chunk;
+  }
+
+  return true;
+}
+
+bool RLEOutput::Write (const void *buf, size_t len)
+{
+  const unsigned char *in = (const unsigned char *)buf;
+
+  for (size_t k = 0; k < len && !failed; k++)
+  {
+    unsigned char c = in[k];
+
+    if (in_count)
+    {
+      if (shift < 64) count |= (uint64_t)(c & 0x7F) << shift;
+      shift += 7;
+
+      if (c & 0x80) continue;
+
+      if (!Put ((unsigned char)last, (size_t)count)) return false;
+
+      in_count = false;
+      last = -1;
+      repeat = 0;
+      continue;
+    }
+
+    if (c == last) repeat++;
+    else { last = c; repeat = 1; }
+
+    if (fill == FILTER_BLOCK && !Flush ()) return false;
+
+    block[fill++] = c;
+    position++;
+
+    if (repeat == RLE_MIN_RUN)
+    {
+      in_count = true;
+      count = 0;
+      shift = 0;
+    }
+  }
+
+  return !failed;
+}
+
+bool RLEOutput::Finish (void)
+{
+  return Flush () && dst.Finish ();
+}
+
+/*--------------------------------------------------------------------*/
+/* Delta / shuffle                                                    */
+/*--------------------------------------------------------------------*/
+
+FilterChain::FilterChain (const FilterSpec *filters, unsigned n, LZWAllocator & a) : alloc (a), count (n)
+{
+  memcpy (spec, filters, n * sizeof(FilterSpec));
+  memset (history, 0, sizeof(history));
+
+  scratch = (unsigned char *)alloc.Alloc (FILTER_BLOCK);
+}
+
+FilterChain::~FilterChain ()
+{
+  alloc.Free (scratch, FILTER_BLOCK);
+}
+
+// hist holds the stride bytes preceding the block, oldest first.
+void FilterChain::DeltaEncode (unsigned char *hist, unsigned stride, unsigned char *b, size_t n)
+{
+  unsigned char next[256];
+
+  if (n >= stride)
+    memcpy (next, b + n - stride, stride);
+  else
+  {
+    memcpy (next, hist + n, stride - n);
+    memcpy (next + stride - n, b, n);
+  }
+
+  // backwards, so b[i - stride] is still the original byte.
+  for (size_t i = n; i-- > stride; )
+    b[i] -= b[i - stride];
+
+  for (size_t i = 0; i < n && i < stride; i++)
+    b[i] -= hist[i];
+
+  memcpy (hist, next, stride);
+}
+
+void FilterChain::DeltaDecode (unsigned char *hist, unsigned stride, unsigned char *b, size_t n)
+{
+  for (size_t i = 0; i < n && i < stride; i++)
+    b[i] += hist[i];
+
+  for (size_t i = stride; i < n; i++)
+    b[i] += b[i - stride];
+
+  if (n >= stride)
+    memcpy (hist, b + n - stride, stride);
+  else
+  {
+    memmove (hist, hist + n, stride - n);
+    memcpy (hist + stride - n, b, n);
+  }
+}
+
+// trailing bytes that do not make a whole element stay where they are.
+void FilterChain::Shuffle (unsigned elem, unsigned char *b, size_t n)
+{
+  size_t items = n / elem;
+
+  for (size_t k = 0; k < items; k++)
+    for (unsigned j = 0; j < elem; j++)
+      scratch[j * items + k] = b[k * elem + j];
+
+  memcpy (b, scratch, items * elem);
+}
+
+void FilterChain::Unshuffle (unsigned elem, unsigned char *b, size_t n)
+{
+  size_t items = n / elem;
+
+  for (unsigned j = 0; j < elem; j++)
+    for (size_t k = 0; k < items; k++)
+      scratch[k * elem + j] = b[j * items + k];
+
+  memcpy (b, scratch, items * elem);
+}
+
+void FilterChain::Encode (unsigned char *block, size_t n)
+{
+  for (unsigned k = 0; k < count; k++)
+  {
+    if (spec[k].id == LZW_FILTER_DELTA)
+      DeltaEncode (history[k], spec[k].param, block, n);
+    else
+      Shuffle (spec[k].param, block, n);
+  }
+}
+
+void FilterChain::Decode (unsigned char *block, size_t n)
+{
+  for (unsigned k = count; k-- > 0; )
+  {
+    if (spec[k].id == LZW_FILTER_DELTA)
+      DeltaDecode (history[k], spec[k].param, block, n);
+    else
+      Unshuffle (spec[k].param, block, n);
+  }
+}
+
+FilterInput::FilterInput (LZWInput & source, const FilterSpec *filters, unsigned n, LZWAllocator & a) :
+  src (source), alloc (a), chain (filters, n, a), pos (0), end (0), eof (false)
+{
+  block = (unsigned char *)alloc.Alloc (FILTER_BLOCK);
+}
+
+FilterInput::~FilterInput ()
+{
+  alloc.Free (block, FILTER_BLOCK);
+}
+
+size_t FilterInput::Read (void *buf, size_t len)
+{
+  unsigned char *out = (unsigned char *)buf;
+  size_t n = 0;
+
+  while (n < len)
+  {
+    if (pos == end)
+    {
+      if (eof) break;
+
+      pos = 0;
+      end = src.Read (block, FILTER_BLOCK);
+
+      if (end < FILTER_BLOCK) eof = true;
+      if (end == 0) break;
+
+      chain.Encode (block, end);
+    }
+
+    size_t chunk = end - pos;
+    if (chunk > len - n) chunk = len - n;
+
+    memcpy (out + n, block + pos, chunk);
+    pos += chunk;
+    n += chunk;
+  }
+
+  position += n;
+  return n;
+}
+
+FilterOutput::FilterOutput (LZWOutput & destination, const FilterSpec *filters, unsigned n, LZWAllocator & a) :
+  dst (destination), alloc (a), chain (filters, n, a), fill (0), failed (false)
+{
+  block = (unsigned char *)alloc.Alloc (FILTER_BLOCK);
+}
+
+FilterOutput::~FilterOutput ()
+{
+  alloc.Free (block, FILTER_BLOCK);
+}
+
+bool FilterOutput::Flush (void)
+{
+  if (fill)
+  {
+    chain.Decode (block, fill);
+
+    if (!dst.Write (block, fill)) failed = true;
+  }
+
+  fill = 0;
+  return !failed;
+}
+
+bool FilterOutput::Write (const void *buf, size_t len)
+{
+  const unsigned char *in = (const unsigned char *)buf;
+
+  while (len && !failed)
+  {
+    size_t chunk = FILTER_BLOCK - fill;
+    if (chunk > len) chunk = len;
+
+    memcpy (block + fill, in, chunk);
+    fill += chunk;
+    position += chunk;
+    in += chunk;
+    len -= chunk;
+
+    if (fill == FILTER_BLOCK) Flush ();
+  }
+
+  return !failed;
+}
+
+bool FilterOutput::Finish (void)
+{
+  return Flush () && dst.Finish ();
+}
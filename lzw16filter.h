@@ -0,0 +1,148 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Reversible byte filters applied around the    */
+/*  dictionary coder. Each one wraps a stream;    */
+/*  the packer filters what it reads and the      */
+/*  unpacker undoes it on what it writes. Which   */
+/*  filters ran is recorded in the header.        */
+/**************************************************/
+
+#pragma once
+
+#include "lzw16io.h"
+#include "lzw16header.h"
+
+#define FILTER_BLOCK  65536
+
+/*--------------------------------------------------------------------*/
+/* Run-length stage: after RLE_MIN_RUN equal bytes the number of      */
+/* further repeats follows as a 7-bit varint, then coding restarts.   */
+/*--------------------------------------------------------------------*/
+
+#define RLE_MIN_RUN  4
+
+class RLEInput : public LZWInput
+{
+  private:
+    LZWInput & src;
+    LZWAllocator & alloc;
+    unsigned char *block;
+    size_t pos, end;
+    int last, repeat;
+    unsigned char varint[10];
+    unsigned vpos, vlen;
+    bool eof;
+
+    bool Fill (void);
+
+  public:
+    RLEInput (LZWInput & source, LZWAllocator & a);
+    ~RLEInput () override;
+
+    bool Ok (void) const { return block != NULL; }
+
+    size_t Read (void *buf, size_t len) override;
+    int64_t Size (void) override { return src.Size(); }
+    bool Failed (void) const override { return src.Failed(); }
+};
+
+class RLEOutput : public LZWOutput
+{
+  private:
+    LZWOutput & dst;
+    LZWAllocator & alloc;
+    unsigned char *block;
+    size_t fill;
+    int last, repeat;
+    uint64_t count;
+    unsigned shift;
+    bool in_count, failed;
+
+    bool Put (unsigned char c, size_t n);
+    bool Flush (void);
+
+  public:
+    RLEOutput (LZWOutput & destination, LZWAllocator & a);
+    ~RLEOutput () override;
+
+    bool Ok (void) const { return block != NULL; }
+
+    bool Write (const void *buf, size_t len) override;
+    bool Finish (void) override;
+    bool Stopped (void) const override { return dst.Stopped(); }
+};
+
+/*--------------------------------------------------------------------*/
+/* Delta and shuffle chain. Both keep the length, so the chain runs   */
+/* over FILTER_BLOCK sized blocks taken at the same stream offsets on */
+/* either side.                                                       */
+/*--------------------------------------------------------------------*/
+
+class FilterChain
+{
+  private:
+    LZWAllocator & alloc;
+    FilterSpec spec[LZW_MAX_FILTERS];
+    unsigned count;
+    unsigned char history[LZW_MAX_FILTERS][256];  // last stride bytes seen by each delta.
+    unsigned char *scratch;
+
+    void DeltaEncode (unsigned char *hist, unsigned stride, unsigned char *b, size_t n);
+    void DeltaDecode (unsigned char *hist, unsigned stride, unsigned char *b, size_t n);
+    void Shuffle (unsigned elem, unsigned char *b, size_t n);
+    void Unshuffle (unsigned elem, unsigned char *b, size_t n);
+
+  public:
+    FilterChain (const FilterSpec *filters, unsigned n, LZWAllocator & a);
+    ~FilterChain ();
+
+    bool Ok (void) const { return scratch != NULL; }
+
+    void Encode (unsigned char *block, size_t n);
+    void Decode (unsigned char *block, size_t n);
+};
+
+class FilterInput : public LZWInput
+{
+  private:
+    LZWInput & src;
+    LZWAllocator & alloc;
+    FilterChain chain;
+    unsigned char *block;
+    size_t pos, end;
+    bool eof;
+
+  public:
+    FilterInput (LZWInput & source, const FilterSpec *filters, unsigned n, LZWAllocator & a);
+    ~FilterInput () override;
+
+    bool Ok (void) const { return block != NULL && chain.Ok(); }
+
+    size_t Read (void *buf, size_t len) override;
+    int64_t Size (void) override { return src.Size(); }
+    bool Failed (void) const override { return src.Failed(); }
+};
+
+class FilterOutput : public LZWOutput
+{
+  private:
+    LZWOutput & dst;
+    LZWAllocator & alloc;
+    FilterChain chain;
+    unsigned char *block;
+    size_t fill;
+    bool failed;
+
+    bool Flush (void);
+
+  public:
+    FilterOutput (LZWOutput & destination, const FilterSpec *filters, unsigned n, LZWAllocator & a);
+    ~FilterOutput () override;
+
+    bool Ok (void) const { return block != NULL && chain.Ok(); }
+
+    bool Write (const void *buf, size_t len) override;
+    bool Finish (void) override;
+    bool Stopped (void) const override { return dst.Stopped(); }
+};
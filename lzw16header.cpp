@@ -0,0 +1,255 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+#include "common.h"
+#include "lzw16header.h"
+
+#include <cstring>
+
+bool ValidFilter (int id, int param)
+{
+  switch (id)
+  {
+    case LZW_FILTER_DELTA: return param >= 1 && param <= 255;
+    case LZW_FILTER_SHUFFLE: return param >= 2 && param <= 255;
+    default: return false;
+  }
+}
+
+bool ValidEngine (int id)
+{
+  return id == LZW_ENGINE_LZW || id == LZW_ENGINE_LZMW || id == LZW_ENGINE_LZAP;
+}
+
+bool LZWHeader::Write (LZWOutput & out) const
+{
+  const char label[4] = "LZW";
+
+  unsigned char infoBits = 0;
+
+  infoBits |= (is_big_endian() ? 1 : 0);
+  infoBits |= VARIABLE_WIDTH ? 2 : 0;
+  infoBits |= features ? HEADER_EXTENDED : 0;
+  infoBits |= ((bits - 8) << 4); // we use left 4 bits for MAX_BITS information; can be between 8 and 23.
+
+  bool ok = out.Write (label, 4);
+  ok = ok && out.Write (&version, 1);
+  ok = ok && out.Write (&infoBits, 1);
+  uint32_t lowSize = (uint32_t)inputSize;
+
+  ok = ok && out.Write (&lowSize, sizeof(uint32_t));
+
+  if (features)
+    ok = ok && out.Write (&features, sizeof(uint32_t));
+
+  if (features & FEATURE_FILTERS)
+  {
+    uint8_t count = (uint8_t)filterCount;
+
+    ok = ok && out.Write (&count, 1);
+    ok = ok && out.Write (filters, filterCount * sizeof(FilterSpec));
+  }
+
+  if (features & FEATURE_BLOCKS)
+    ok = ok && out.Write (&blockSize, sizeof(uint32_t));
+
+  if (features & FEATURE_ENGINE)
+    ok = ok && out.Write (&engine, 1);
+
+  if (features & FEATURE_LARGE)
+    ok = ok && out.Write (&inputSize, sizeof(uint64_t));
+
+  if (features & FEATURE_APPEND)
+    ok = ok && out.Write (&totalSize, sizeof(uint64_t));
+
+  return ok;
+}
+
+bool LZWHeader::Read (LZWInput & in)
+{
+  bool ended = false;
+
+  if (ReadNext (in, ended))
+    return true;
+
+  if (ended)
+    LZW_PRINT ("Not LZW file!\n");
+
+  return false;
+}
+
+bool LZWHeader::ReadNext (LZWInput & in, bool & ended)
+{
+  char label[4] = { 0 };
+
+  size_t n = in.Read (label, 4);
+
+  ended = (n == 0 && !in.Failed());
+
+  if (ended)
+    return false;
+
+  if (4 != n || memcmp(label, "LZW", 3) != 0)
+  {
+    LZW_PRINT ("Not LZW file!\n");
+    return false;
+  }
+
+  if (1 != in.Read (&version, 1))
+  {
+    LZW_ERROR ("Unexpected read error.\n");
+    return false;
+  }
+
+  if (version != PACKER_VERSION)
+  {
+    LZW_ERROR ("Packer/unpacker version mismatch.\n");
+    return false;
+  }
+
+  unsigned char infoBits = 0;
+
+  infoBits |= (is_big_endian() ? 1 : 0);
+  infoBits |= VARIABLE_WIDTH ? 2 : 0;
+
+  // get infoFlags byte:
+  unsigned char infoFlag = 0;
+
+  if (1 != in.Read (&infoFlag, 1))
+  {
+    LZW_ERROR ("Unexpected read error.\n");
+    return false;
+  }
+
+  // compare only last 4 bits, apart from the extended header bit. first 4 bits have "number of bits".
+
+  if ((infoBits & 0x0F) != (infoFlag & 0x0F & ~HEADER_EXTENDED))
+  {
+    LZW_ERROR ("Encoding flags mismatch.\n");
+    return false;
+  }
+
+  bits = 8 + (infoFlag >> 4);
+
+  uint32_t lowSize = 0;
+
+  if (4 != in.Read (&lowSize, sizeof(uint32_t)))
+  {
+    LZW_ERROR ("Unexpected read error.\n");
+    return false;
+  }
+
+  features = 0;
+
+  if (infoFlag & HEADER_EXTENDED)
+  {
+    if (4 != in.Read (&features, sizeof(uint32_t)))
+    {
+      LZW_ERROR ("Unexpected read error.\n");
+      return false;
+    }
+
+    if (features & ~KNOWN_FEATURES)
+    {
+      LZW_ERROR ("Unsupported encoding features 0x%x.\n", features & ~KNOWN_FEATURES);
+      return false;
+    }
+  }
+
+  filterCount = 0;
+
+  if (features & FEATURE_FILTERS)
+  {
+    uint8_t count = 0;
+
+    if (1 != in.Read (&count, 1) || count > LZW_MAX_FILTERS ||
+        count * sizeof(FilterSpec) != in.Read (filters, count * sizeof(FilterSpec)))
+    {
+      LZW_ERROR ("Invalid filter chain.\n");
+      return false;
+    }
+
+    filterCount = count;
+
+    for (unsigned k = 0; k < filterCount; k++)
+    {
+      if (!ValidFilter (filters[k].id, filters[k].param))
+      {
+        LZW_ERROR ("Unsupported filter %d (%d).\n", filters[k].id, filters[k].param);
+        return false;
+      }
+    }
+  }
+
+  blockSize = BUFFLEN;
+
+  if (features & FEATURE_BLOCKS)
+  {
+    if (4 != in.Read (&blockSize, sizeof(uint32_t)))
+    {
+      LZW_ERROR ("Unexpected read error.\n");
+      return false;
+    }
+
+    if (blockSize < MIN_BLOCK_SIZE || blockSize > MAX_BLOCK_SIZE)
+    {
+      LZW_ERROR ("Unsupported block size %u.\n", blockSize);
+      return false;
+    }
+  }
+
+  engine = LZW_ENGINE_LZW;
+
+  if (features & FEATURE_ENGINE)
+  {
+    if (1 != in.Read (&engine, 1))
+    {
+      LZW_ERROR ("Unexpected read error.\n");
+      return false;
+    }
+
+    if (!ValidEngine (engine))
+    {
+      LZW_ERROR ("Unsupported engine %d.\n", engine);
+      return false;
+    }
+  }
+
+  // codes are reused by the LZW engine only, in streams without restarts,
+  // and never Huffman coded.
+  if ((features & FEATURE_LRU) &&
+      (engine != LZW_ENGINE_LZW || (features & (FEATURE_BLOCKS | FEATURE_ENTROPY)) != FEATURE_BLOCKS))
+  {
+    LZW_ERROR ("Unsupported encoding features 0x%x.\n", features);
+    return false;
+  }
+
+  inputSize = lowSize;
+
+  if (features & FEATURE_LARGE)
+  {
+    if (8 != in.Read (&inputSize, sizeof(uint64_t)))
+    {
+      LZW_ERROR ("Unexpected read error.\n");
+      return false;
+    }
+
+    if ((uint32_t)inputSize != lowSize || inputSize <= UINT32_MAX)
+    {
+      LZW_ERROR ("Invalid input size.\n");
+      return false;
+    }
+  }
+
+  totalSize = inputSize;
+
+  if (features & FEATURE_APPEND)
+  {
+    if (8 != in.Read (&totalSize, sizeof(uint64_t)))
+    {
+      LZW_ERROR ("Unexpected read error.\n");
+      return false;
+    }
+  }
+
+  return true;
+}
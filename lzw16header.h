@@ -0,0 +1,72 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Compressed file header.                       */
+/*                                                */
+/*  "LZW\0", version, infoBits, 32-bit input size */
+/*  (its low bits, past 4 Gb)                     */
+/*  infoBits: bit 0 big endian, bit 1 variable    */
+/*  width, bit 2 extended header, bits 4-7 max   */
+/*  bits - 8. The extended header is a 32-bit     */
+/*  feature word, followed by the fields of the   */
+/*  features that are set, in bit order, but for  */
+/*  the total of FEATURE_APPEND, which is last.   */
+/**************************************************/
+
+#pragma once
+
+#include "common.h"
+#include "lzw16io.h"
+
+#include <cstdint>
+
+#define HEADER_EXTENDED  0x04
+
+enum LZWFeature
+{
+  FEATURE_RLE = 0x01,     /* run-length stage ahead of the dictionary coder */
+  FEATURE_FILTERS = 0x02, /* filter chain: count byte, then (id, param) byte pairs */
+  FEATURE_BLOCKS = 0x04,  /* matches run across read blocks; 32-bit block size follows */
+  FEATURE_ENGINE = 0x08,  /* dictionary growth other than LZW; engine id byte follows */
+  FEATURE_ENTROPY = 0x10, /* each segment starts with a byte telling packed codes from Huffman coded ones */
+  FEATURE_APPEND = 0x20,  /* more streams may follow this one; 64-bit unpacked size of them all follows */
+  FEATURE_SUBBLOCKS = 0x40, /* segments are split in sub-blocks, each with a 16-bit length; bit 15 marks the last */
+  FEATURE_LRU = 0x80,     /* once the dictionary is full, least recently used leaf phrases give up their codes */
+  FEATURE_LARGE = 0x100   /* the input is 4 Gb or more; its 64-bit size follows */
+};
+
+#define KNOWN_FEATURES (FEATURE_RLE | FEATURE_FILTERS | FEATURE_BLOCKS | FEATURE_ENGINE | FEATURE_ENTROPY | \
+                        FEATURE_APPEND | FEATURE_SUBBLOCKS | FEATURE_LRU | FEATURE_LARGE)
+
+struct FilterSpec
+{
+  uint8_t id, param;
+};
+
+bool ValidFilter (int id, int param);
+bool ValidEngine (int id);
+
+struct LZWHeader
+{
+  uint8_t version;
+  int bits;
+  uint64_t inputSize;   // the 32-bit field unless FEATURE_LARGE is set.
+  uint32_t features;
+  unsigned filterCount;
+  FilterSpec filters[LZW_MAX_FILTERS];
+  uint32_t blockSize;   // BUFFLEN, with codes restarting at each block, unless FEATURE_BLOCKS is set.
+  uint8_t engine;       // LZW_ENGINE_LZW unless FEATURE_ENGINE is set.
+  uint64_t totalSize;   // inputSize unless FEATURE_APPEND is set; the last field of the header.
+
+  LZWHeader () : version (PACKER_VERSION), bits (DEFAULT_MAX_BITS), inputSize (0), features (0), filterCount (0),
+    blockSize (BUFFLEN), engine (LZW_ENGINE_LZW),
+    totalSize (0) { }
+
+  bool Write (LZWOutput & out) const;
+
+  // prints the reason and returns false for anything this build cannot decode.
+  bool Read (LZWInput & in);
+
+  // Read, except that an input already at its end sets ended and prints nothing.
+  bool ReadNext (LZWInput & in, bool & ended);
+};
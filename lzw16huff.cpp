@@ -0,0 +1,212 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+#include "lzw16huff.h"
+
+#include <algorithm>
+#include <cstring>
+
+static uint16_t reverse_bits (uint16_t v, unsigned n)
+{
+  uint16_t r = 0;
+
+  for (unsigned k = 0; k < n; k++)
+  {
+    r = (uint16_t)((r << 1) | (v & 1));
+    v >>= 1;
+  }
+
+  return r;
+}
+
+// Huffman code lengths by the two-queue method over symbols sorted by
+// frequency; returns the longest length.
+static unsigned huffman_lengths (const uint32_t *freq, uint8_t *len)
+{
+  unsigned order[HUFF_SYMBOLS], n = 0;
+
+  for (unsigned s = 0; s < HUFF_SYMBOLS; s++)
+  {
+    len[s] = 0;
+    if (freq[s]) order[n++] = s;
+  }
+
+  if (n == 0) return 0;
+
+  if (n == 1)
+  {
+    len[order[0]] = 1;
+    return 1;
+  }
+
+  std::sort (order, order + n, [freq] (unsigned a, unsigned b) { return freq[a] < freq[b] || (freq[a] == freq[b] && a < b); });
+
+  // nodes 0..n-1 are leaves in order, n.. are internal in creation order.
+  uint64_t weight[2 * HUFF_SYMBOLS];
+  unsigned parent[2 * HUFF_SYMBOLS];
+  unsigned leaf = 0, inner = n, next = n;
+
+  for (unsigned k = 0; k < n; k++)
+    weight[k] = freq[order[k]];
+
+  auto pick = [&] () -> unsigned
+  {
+    if (leaf < n && (inner == next || weight[leaf] <= weight[inner]))
+      return leaf++;
+
+    return inner++;
+  };
+
+  while (next < 2 * n - 1)
+  {
+    unsigned a = pick ();
+    unsigned b = pick ();
+
+    weight[next] = weight[a] + weight[b];
+    parent[a] = parent[b] = next;
+    next++;
+  }
+
+  unsigned depth[2 * HUFF_SYMBOLS], longest = 0;
+
+  depth[2 * n - 2] = 0;
+
+  for (unsigned k = 2 * n - 2; k-- > 0; )
+  {
+    depth[k] = depth[parent[k]] + 1;
+
+    if (k < n)
+    {
+      len[order[k]] = (uint8_t)depth[k];
+      if (depth[k] > longest) longest = depth[k];
+    }
+  }
+
+  return longest;
+}
+
+void HuffEncoder::Build (const uint32_t *freq)
+{
+  uint32_t f[HUFF_SYMBOLS];
+
+  memcpy (f, freq, sizeof(f));
+
+  // flatten the distribution until the tree is shallow enough.
+  while (huffman_lengths (f, len) > HUFF_MAX_LEN)
+  {
+    for (unsigned s = 0; s < HUFF_SYMBOLS; s++)
+      if (f[s]) f[s] = (f[s] >> 1) | 1;
+  }
+
+  // canonical codes: by length, then by symbol.
+  unsigned count[HUFF_MAX_LEN + 1] = { 0 };
+  uint16_t next[HUFF_MAX_LEN + 1];
+
+  for (unsigned s = 0; s < HUFF_SYMBOLS; s++)
+    count[len[s]]++;
+
+  count[0] = 0;
+  next[0] = 0;
+
+  uint16_t c = 0;
+
+  for (unsigned l = 1; l <= HUFF_MAX_LEN; l++)
+  {
+    c = (uint16_t)((c + count[l - 1]) << 1);
+    next[l] = c;
+  }
+
+  for (unsigned s = 0; s < HUFF_SYMBOLS; s++)
+    code[s] = len[s] ? reverse_bits (next[len[s]]++, len[s]) : 0;
+}
+
+size_t HuffEncoder::WriteTable (unsigned char *dst) const
+{
+  unsigned used = HUFF_SYMBOLS;
+
+  while (used > 0 && len[used - 1] == 0)
+    used--;
+
+  dst[0] = (unsigned char)(used & 0xFF);
+  dst[1] = (unsigned char)(used >> 8);
+
+  size_t n = 2;
+
+  for (unsigned s = 0; s < used; s += 2)
+    dst[n++] = (unsigned char)(len[s] | ((s + 1 < used ? len[s + 1] : 0) << 4));
+
+  return n;
+}
+
+bool HuffDecoder::ReadTable (const unsigned char *src, size_t avail, size_t & used)
+{
+  if (avail < 2) return false;
+
+  unsigned symbols = src[0] | (src[1] << 8);
+  size_t size = 2 + (symbols + 1) / 2;
+
+  if (symbols > HUFF_SYMBOLS || avail < size) return false;
+
+  uint8_t len[HUFF_SYMBOLS] = { 0 };
+  unsigned count[16] = { 0 };
+
+  for (unsigned s = 0; s < symbols; s++)
+  {
+    len[s] = (src[2 + s / 2] >> (4 * (s & 1))) & 0x0F;
+
+    if (len[s] > HUFF_MAX_LEN) return false;
+
+    count[len[s]]++;
+  }
+
+  // reject over-subscribed tables; incomplete ones leave gaps marked 0.
+  uint32_t kraft = 0;
+
+  for (unsigned l = 1; l <= HUFF_MAX_LEN; l++)
+    kraft += count[l] << (HUFF_MAX_LEN - l);
+
+  if (kraft > (1U << HUFF_MAX_LEN)) return false;
+
+  uint16_t next[HUFF_MAX_LEN + 1];
+  uint16_t c = 0;
+
+  count[0] = 0;
+
+  for (unsigned l = 1; l <= HUFF_MAX_LEN; l++)
+  {
+    c = (uint16_t)((c + count[l - 1]) << 1);
+    next[l] = c;
+  }
+
+  memset (table, 0, sizeof(table));
+
+  for (unsigned s = 0; s < symbols; s++)
+  {
+    if (!len[s]) continue;
+
+    uint16_t r = reverse_bits (next[len[s]]++, len[s]);
+
+    for (uint32_t k = r; k < (1U << HUFF_MAX_LEN); k += (1U << len[s]))
+      table[k] = (uint16_t)((s << 4) | len[s]);
+  }
+
+  used = size;
+  return true;
+}
+
+uint64_t HuffEncoder::Cost (const uint32_t *freq) const
+{
+  uint64_t bits = 0;
+
+  for (unsigned s = 0; s < HUFF_SYMBOLS; s++)
+  {
+    unsigned nextra = 0;
+    uint32_t base;
+
+    if (s >= 256 && s < HUFF_SYM_CLEAR)
+      HuffBucket (s, nextra, base);
+
+    bits += (uint64_t)freq[s] * (len[s] + nextra);
+  }
+
+  return bits;
+}
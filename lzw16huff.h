@@ -0,0 +1,92 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Canonical Huffman stage for the code stream.  */
+/*  Bytes and small values are symbols of their   */
+/*  own; larger ones fall in buckets (four per    */
+/*  power of two) followed by raw extra bits, as  */
+/*  in deflate distances. Each segment carries    */
+/*  its own table of 4-bit code lengths.          */
+/**************************************************/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// first byte of each segment when the stage is on.
+enum { SEGMENT_PACKED = 0, SEGMENT_HUFFMAN = 1, SEGMENT_HUFFMAN_DISTANCE = 2 };
+
+#define HUFF_MANTISSA    2      // leading bits of a value the bucket symbol gives; the rest are extra bits.
+
+#define HUFF_DIRECT      (1 << (HUFF_MANTISSA + 1))
+#define HUFF_SYM_CLEAR   (256 + HUFF_DIRECT + (19 - HUFF_MANTISSA) * (1 << HUFF_MANTISSA))
+#define HUFF_SYM_EOF     (HUFF_SYM_CLEAR + 1)
+#define HUFF_SYMBOLS     (HUFF_SYM_CLEAR + 2)
+#define HUFF_MAX_LEN     12
+
+// largest table: symbol count, then two lengths per byte.
+#define HUFF_TABLE_MAX   (2 + (HUFF_SYMBOLS + 1) / 2)
+
+// value is a byte, a dictionary code, or 256 plus a code's distance back.
+inline unsigned HuffSymbol (uint32_t value, unsigned & nextra, uint32_t & extra)
+{
+  uint32_t v = value - 256;
+
+  if (value < 256 + HUFF_DIRECT)
+  {
+    nextra = 0;
+    extra = 0;
+    return value;
+  }
+
+  unsigned b = 31 - __builtin_clz (v);
+
+  nextra = b - HUFF_MANTISSA;
+  extra = v & ((1U << nextra) - 1);
+
+  return 256 + HUFF_DIRECT + ((b - HUFF_MANTISSA - 1) << HUFF_MANTISSA) + ((v >> nextra) & ((1 << HUFF_MANTISSA) - 1));
+}
+
+// extra bits and base value of a bucket symbol (>= 256 and < HUFF_SYM_CLEAR).
+inline void HuffBucket (unsigned sym, unsigned & nextra, uint32_t & base)
+{
+  unsigned s = sym - 256;
+
+  if (s < HUFF_DIRECT)
+  {
+    nextra = 0;
+    base = sym;
+    return;
+  }
+
+  s -= HUFF_DIRECT;
+
+  unsigned b = (s >> HUFF_MANTISSA) + HUFF_MANTISSA + 1;
+
+  nextra = b - HUFF_MANTISSA;
+  base = 256 + (((1U << HUFF_MANTISSA) | (s & ((1 << HUFF_MANTISSA) - 1))) << nextra);
+}
+
+struct HuffEncoder
+{
+  uint8_t len[HUFF_SYMBOLS];
+  uint16_t code[HUFF_SYMBOLS];   // bit-reversed, ready to be written LSB first.
+
+  // lengths limited to HUFF_MAX_LEN.
+  void Build (const uint32_t *freq);
+
+  // size in bits of the symbols counted in freq, extra bits included.
+  uint64_t Cost (const uint32_t *freq) const;
+
+  // returns the table size in bytes.
+  size_t WriteTable (unsigned char *dst) const;
+};
+
+struct HuffDecoder
+{
+  uint16_t table[1 << HUFF_MAX_LEN];   // symbol << 4 | length; 0 where no code is assigned.
+
+  // false if the table is malformed.
+  bool ReadTable (const unsigned char *src, size_t avail, size_t & used);
+};
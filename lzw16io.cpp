@@ -0,0 +1,665 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  stdio and pipelined stream backends.          */
+/**************************************************/
+
+#include "common.h"
+#include "lzw16io.h"
+
+#include <cstring>
+#include <cerrno>
+#include <chrono>
+#include <new>
+#include <system_error>
+
+#include <unistd.h>
+
+/*--------------------------------------------------------------------*/
+/* stdio                                                              */
+/*--------------------------------------------------------------------*/
+
+#ifndef LZW_FIXED_FOOTPRINT
+
+size_t StdioInput::Read (void *buf, size_t len)
+{
+  size_t n = fread (buf, 1, len, fp);
+  position += n;
+  return n;
+}
+
+int64_t StdioInput::Size (void)
+{
+  long pos = ftell (fp);
+
+  if (pos < 0 || fseek (fp, 0, SEEK_END) != 0) return -1;
+
+  long size = ftell (fp);
+  fseek (fp, pos, SEEK_SET);
+
+  return size;
+}
+
+bool StdioOutput::Write (const void *buf, size_t len)
+{
+  size_t n = fwrite (buf, 1, len, fp);
+  position += n;
+  return n == len;
+}
+
+static bool allZero (const unsigned char *p, size_t len)
+{
+  for (size_t k = 0; k < len; k += 64)
+  {
+    uint64_t w[8];
+
+    memcpy (w, p + k, sizeof (w));
+
+    if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7])
+      return false;
+  }
+
+  return true;
+}
+
+// writes len bytes of data after the hole before them.
+bool SparseOutput::Put (const unsigned char *data, size_t len)
+{
+  static const unsigned char zeros[SPARSE_BLOCK] = { 0 };
+
+  if (len == 0)
+    return true;
+
+  if (hole && fseeko (fp, (off_t)hole, SEEK_CUR) == 0)
+  {
+    seeked = true;
+    hole = 0;
+  }
+
+  for (; hole; )
+  {
+    size_t n = (hole < SPARSE_BLOCK) ? (size_t)hole : SPARSE_BLOCK;
+
+    if (n != fwrite (zeros, 1, n, fp))
+      return false;
+
+    hole -= n;
+  }
+
+  return len == fwrite (data, 1, len, fp);
+}
+
+// writes or passes over one whole block.
+bool SparseOutput::Flush (const unsigned char *data)
+{
+  if (allZero (data, SPARSE_BLOCK))
+  {
+    hole += SPARSE_BLOCK;
+    return true;
+  }
+
+  return Put (data, SPARSE_BLOCK);
+}
+
+bool SparseOutput::Write (const void *buf, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)buf;
+  size_t k = 0;
+
+  if (fill)
+  {
+    k = (len < SPARSE_BLOCK - fill) ? len : SPARSE_BLOCK - fill;
+
+    memcpy (block + fill, p, k);
+    fill += k;
+
+    if (fill == SPARSE_BLOCK)
+    {
+      fill = 0;
+
+      if (!Flush (block))
+        return false;
+    }
+  }
+
+  size_t from = k;   // data not yet written.
+
+  for (; len - k >= SPARSE_BLOCK; k += SPARSE_BLOCK)
+  {
+    if (allZero (p + k, SPARSE_BLOCK))
+    {
+      if (!Put (p + from, k - from))
+        return false;
+
+      hole += SPARSE_BLOCK;
+      from = k + SPARSE_BLOCK;
+    }
+  }
+
+  if (!Put (p + from, k - from))
+    return false;
+
+  if (k < len)
+  {
+    memcpy (block, p + k, len - k);
+    fill = len - k;
+  }
+
+  position += len;
+  return true;
+}
+
+bool SparseOutput::Finish (void)
+{
+  // the last, short block is written unless it is all zeros.
+  if (fill)
+  {
+    size_t k = 0;
+
+    while (k < fill && block[k] == 0)
+      k++;
+
+    if (k == fill)
+      hole += fill;
+    else if (!Put (block, fill))
+      return false;
+
+    fill = 0;
+  }
+
+  // a hole at the end only exists once the file is that long.
+  if (hole && fseeko (fp, (off_t)hole, SEEK_CUR) == 0)
+  {
+    seeked = true;
+    hole = 0;
+  }
+
+  if (hole)
+  {
+    static const unsigned char zero = 0;
+
+    // no seeking: the zeros are written out, as Put does.
+    hole--;
+
+    if (!Put (&zero, 1))
+      return false;
+  }
+
+  if (fflush (fp) != 0)
+    return false;
+
+  return !seeked || ftruncate (fileno (fp), (off_t)position) == 0;
+}
+
+#endif // LZW_FIXED_FOOTPRINT
+
+/*--------------------------------------------------------------------*/
+/* callbacks                                                          */
+/*--------------------------------------------------------------------*/
+
+size_t CallbackInput::Read (void *buf, size_t len)
+{
+  size_t total = 0;
+  size_t want = (size >= 0 && len > (uint64_t)size - position) ? (size_t)((uint64_t)size - position) : len;
+
+  while (total < want && !failed)
+  {
+    ptrdiff_t n = source.read (source.opaque, (unsigned char *)buf + total, want - total);
+
+    // a source that ends before its size fails here, not once packed.
+    if (n == 0)
+    {
+      failed = (size >= 0 && position + total < (uint64_t)size);
+      break;
+    }
+
+    if (n < 0 || (size_t)n > want - total)
+      failed = true;
+    else
+      total += (size_t)n;
+  }
+
+  // a source with more than its size is not the input the header describes.
+  if (total == want && want < len && !failed)
+  {
+    unsigned char extra;
+
+    if (source.read (source.opaque, &extra, 1) != 0)
+      failed = true;
+  }
+
+  position += total;
+  return total;
+}
+
+bool CallbackOutput::Write (const void *buf, size_t len)
+{
+  if (stopped) return false;
+
+  if (len && sink.write (sink.opaque, buf, len) != 0)
+  {
+    stopped = true;
+    return false;
+  }
+
+  position += len;
+  return true;
+}
+
+bool PrefixOutput::Write (const void *buf, size_t len)
+{
+  size_t n = (len < limit - position) ? len : (size_t)(limit - position);
+
+  if (n && !dst.Write (buf, n))
+  {
+    failed = true;
+    return false;
+  }
+
+  position += n;
+
+  // stop as soon as the prefix is complete, not at the next write.
+  if (position == limit)
+    reached = true;
+
+  return !reached;
+}
+
+// the fixed footprint build has neither threads nor files.
+#ifndef LZW_FIXED_FOOTPRINT
+
+/*--------------------------------------------------------------------*/
+/* SPSC queue waiting: spin, then yield, then sleep.                  */
+/*--------------------------------------------------------------------*/
+
+static void backoff (unsigned & n)
+{
+  if (n >= 256)
+    std::this_thread::sleep_for (std::chrono::microseconds (50));
+  else if (n >= 64)
+    std::this_thread::yield ();
+
+  n++;
+}
+
+bool SPSCQueue::Push (uint32_t v, const std::atomic<bool> & stop)
+{
+  unsigned n = 0;
+
+  while (!TryPush (v))
+  {
+    if (stop.load (std::memory_order_relaxed)) return false;
+    backoff (n);
+  }
+  return true;
+}
+
+bool SPSCQueue::Pop (uint32_t & v, const std::atomic<bool> & stop)
+{
+  unsigned n = 0;
+
+  while (!TryPop (v))
+  {
+    if (stop.load (std::memory_order_relaxed)) return false;
+    backoff (n);
+  }
+  return true;
+}
+
+/*--------------------------------------------------------------------*/
+/* Ring                                                               */
+/*--------------------------------------------------------------------*/
+
+PipelineRing::PipelineRing (LZWAllocator & a, uint32_t count, size_t size) : alloc (a), stop (false)
+{
+  if (count >= SPSCQueue::CAPACITY) count = SPSCQueue::CAPACITY - 1; // leave room for the end marker.
+
+  slot_size = size;
+  slots = count;
+  memory = (unsigned char *)alloc.Alloc (slot_size * slots);
+  lengths = (size_t *)alloc.Alloc (slots * sizeof(size_t));
+
+  if (!lengths)
+  {
+    alloc.Free (memory, slot_size * slots);
+    memory = NULL;
+  }
+}
+
+PipelineRing::~PipelineRing ()
+{
+  alloc.Free (memory, slot_size * slots);
+  alloc.Free (lengths, slots * sizeof(size_t));
+}
+
+static const uint32_t END_OF_STREAM = 0xFFFFFFFF;
+
+/*--------------------------------------------------------------------*/
+/* Reader thread                                                      */
+/*--------------------------------------------------------------------*/
+
+PipelinedInput::PipelinedInput (LZWInput *source, LZWAllocator & a, uint32_t depth, size_t block) :
+  src (source), ring (a, depth, block), failed (false)
+{
+  current = 0;
+  offset = 0;
+  have_current = false;
+  at_end = false;
+  size = src->Size();
+}
+
+PipelinedInput::~PipelinedInput ()
+{
+  ring.stop = true;
+
+  if (reader.joinable()) reader.join();
+
+  delete src;
+}
+
+bool PipelinedInput::Start (void)
+{
+  if (!ring.memory) return false;
+
+  for (uint32_t i = 0; i < ring.slots; i++)
+    ring.empty.TryPush (i);
+
+  try
+  {
+    reader = std::thread (&PipelinedInput::ReaderLoop, this);
+  }
+  catch (const std::system_error &)
+  {
+    return false;
+  }
+
+  return true;
+}
+
+LZWInput *PipelinedInput::Release (void)
+{
+  LZWInput *ret = src;
+  src = NULL;
+  return ret;
+}
+
+void PipelinedInput::ReaderLoop (void)
+{
+  uint32_t s;
+
+  while (ring.empty.Pop (s, ring.stop))
+  {
+    size_t n = src->Read (ring.Slot (s), ring.slot_size);
+
+    if (n < ring.slot_size && src->Failed())
+      failed = true;
+
+    ring.lengths[s] = n;
+
+    if (!ring.filled.Push (s, ring.stop) || n < ring.slot_size)
+      break;
+  }
+}
+
+size_t PipelinedInput::Read (void *buf, size_t len)
+{
+  size_t total = 0;
+
+  while (total < len)
+  {
+    if (!have_current)
+    {
+      if (at_end || !ring.filled.Pop (current, ring.stop))
+        break;
+
+      offset = 0;
+      have_current = true;
+    }
+
+    size_t avail = ring.lengths[current] - offset;
+    size_t n = (len - total < avail) ? len - total : avail;
+
+    memcpy ((unsigned char *)buf + total, ring.Slot (current) + offset, n);
+
+    total += n;
+    offset += n;
+
+    if (offset == ring.lengths[current])
+    {
+      if (ring.lengths[current] < ring.slot_size)
+        at_end = true;
+
+      ring.empty.Push (current, ring.stop);
+      have_current = false;
+    }
+  }
+
+  position += total;
+  return total;
+}
+
+/*--------------------------------------------------------------------*/
+/* Writer thread                                                      */
+/*--------------------------------------------------------------------*/
+
+PipelinedOutput::PipelinedOutput (LZWOutput *destination, LZWAllocator & a, uint32_t depth, size_t block) :
+  dst (destination), ring (a, depth, block), failed (false)
+{
+  current = 0;
+  fill = 0;
+  have_current = false;
+  finished = false;
+}
+
+PipelinedOutput::~PipelinedOutput ()
+{
+  if (writer.joinable())
+  {
+    if (!finished) ring.filled.Push (END_OF_STREAM, ring.stop);
+
+    writer.join();
+  }
+
+  delete dst;
+}
+
+bool PipelinedOutput::Start (void)
+{
+  if (!ring.memory) return false;
+
+  for (uint32_t i = 0; i < ring.slots; i++)
+    ring.empty.TryPush (i);
+
+  try
+  {
+    writer = std::thread (&PipelinedOutput::WriterLoop, this);
+  }
+  catch (const std::system_error &)
+  {
+    return false;
+  }
+
+  return true;
+}
+
+LZWOutput *PipelinedOutput::Release (void)
+{
+  LZWOutput *ret = dst;
+  dst = NULL;
+  return ret;
+}
+
+void PipelinedOutput::WriterLoop (void)
+{
+  uint32_t s;
+
+  while (ring.filled.Pop (s, ring.stop) && s != END_OF_STREAM)
+  {
+    // after a failure keep recycling slots so that the coder never blocks.
+    if (!failed && !dst->Write (ring.Slot (s), ring.lengths[s]))
+      failed = true;
+
+    ring.empty.Push (s, ring.stop);
+  }
+}
+
+bool PipelinedOutput::Submit (void)
+{
+  ring.lengths[current] = fill;
+  have_current = false;
+  fill = 0;
+
+  return ring.filled.Push (current, ring.stop);
+}
+
+bool PipelinedOutput::Write (const void *buf, size_t len)
+{
+  const unsigned char *ptr = (const unsigned char *)buf;
+  size_t left = len;
+
+  while (left > 0)
+  {
+    if (failed) return false;
+
+    if (!have_current)
+    {
+      if (!ring.empty.Pop (current, ring.stop)) return false;
+
+      have_current = true;
+      fill = 0;
+    }
+
+    size_t n = ring.slot_size - fill;
+    if (n > left) n = left;
+
+    memcpy (ring.Slot (current) + fill, ptr, n);
+
+    fill += n;
+    ptr += n;
+    left -= n;
+
+    if (fill == ring.slot_size && !Submit())
+      return false;
+  }
+
+  position += len;
+  return true;
+}
+
+bool PipelinedOutput::Finish (void)
+{
+  if (!finished)
+  {
+    if (have_current && fill > 0) Submit();
+
+    ring.filled.Push (END_OF_STREAM, ring.stop);
+    writer.join();
+
+    finished = true;
+  }
+
+  return !failed && dst->Finish();
+}
+
+/*--------------------------------------------------------------------*/
+/* Factories                                                          */
+/*--------------------------------------------------------------------*/
+
+// blocks in flight in a pipeline ring: PIPELINE_DEPTH, or what the budget holds.
+static uint32_t pipelineDepth (const LZWAllocator & alloc)
+{
+  size_t fit = alloc.RingBudget () / PIPELINE_BLOCK;
+
+  return (fit < PIPELINE_DEPTH) ? (uint32_t)fit : PIPELINE_DEPTH;
+}
+
+LZWInput *OpenInput (const char *filename, int flags, LZWAllocator & alloc, size_t direct_block)
+{
+  FILE *fp = fopen (filename, "rb");
+
+  if (NULL == fp)
+  {
+    fprintf (stderr, "Cannot open input file \'%s\'.\n", filename);
+    fprintf (stderr, "%s\n", strerror(errno));
+    return NULL;
+  }
+
+  LZWInput *in = NULL;
+
+  if (flags & DIRECT_IO)
+    in = OpenDirectInput (fp, alloc, direct_block);
+  else if (flags & URING_IO)
+    in = OpenUringInput (fp, alloc);
+
+  if (!in) in = new (std::nothrow) StdioInput (fp, true);
+
+  if (!in)
+  {
+    fclose (fp);
+    return NULL;
+  }
+
+  if ((flags & PIPELINED_IO) && pipelineDepth (alloc) >= 2)
+  {
+    PipelinedInput *p = new (std::nothrow) PipelinedInput (in, alloc, pipelineDepth (alloc), PIPELINE_BLOCK);
+
+    if (p && p->Start())
+      return p;
+
+    if (p)  // no memory or threads for the pipeline; plain I/O still works.
+    {
+      in = p->Release();
+      delete p;
+    }
+  }
+
+  return in;
+}
+
+LZWOutput *OpenOutput (const char *filename, int flags, LZWAllocator & alloc, size_t direct_block)
+{
+  FILE *fp = fopen (filename, "wb");
+
+  if (NULL == fp)
+  {
+    fprintf (stderr, "Cannot open output file \'%s\'.\n", filename);
+    fprintf (stderr, "%s\n", strerror(errno));
+    return NULL;
+  }
+
+  LZWOutput *out = NULL;
+
+  // holes are left by seeking, which the uring backend does not do.
+  if (flags & SPARSE_OUTPUT)
+    out = new (std::nothrow) SparseOutput (fp, true);
+  else if (flags & DIRECT_IO)
+    out = OpenDirectOutput (fp, alloc, direct_block);
+  else if (flags & URING_IO)
+    out = OpenUringOutput (fp, alloc);
+
+  if (!out) out = new (std::nothrow) StdioOutput (fp, true);
+
+  if (!out)
+  {
+    fclose (fp);
+    return NULL;
+  }
+
+  if ((flags & PIPELINED_IO) && pipelineDepth (alloc) >= 2)
+  {
+    PipelinedOutput *p = new (std::nothrow) PipelinedOutput (out, alloc, pipelineDepth (alloc), PIPELINE_BLOCK);
+
+    if (p && p->Start())
+      return p;
+
+    if (p)
+    {
+      out = p->Release();
+      delete p;
+    }
+  }
+
+  return out;
+}
+
+#endif // LZW_FIXED_FOOTPRINT
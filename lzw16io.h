@@ -0,0 +1,395 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Byte streams used by the packer and unpacker. */
+/*  Backends (stdio, pipelined threads) are       */
+/*  chosen from the call flags by OpenInput and   */
+/*  OpenOutput.                                   */
+/**************************************************/
+
+#pragma once
+
+#include "common.h"
+#include "lzw16alloc.h"
+
+#include <cstdio>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+
+class LZWInput
+{
+  public:
+    virtual ~LZWInput () { }
+
+    // fread semantics: fewer than len bytes only at end of input or on error.
+    virtual size_t Read (void *buf, size_t len) = 0;
+
+    // total input size when known up front, -1 otherwise.
+    virtual int64_t Size (void) { return -1; }
+
+    virtual bool Failed (void) const { return false; }
+
+    uint64_t Position (void) const { return position; }
+
+  protected:
+    uint64_t position = 0;
+};
+
+class LZWOutput
+{
+  public:
+    virtual ~LZWOutput () { }
+
+    virtual bool Write (const void *buf, size_t len) = 0;
+
+    // flushes everything written so far; false if any write failed.
+    virtual bool Finish (void) { return true; }
+
+    uint64_t Position (void) const { return position; }
+
+    // true once the consumer asked to stop; failed writes are then expected.
+    virtual bool Stopped (void) const { return false; }
+
+  protected:
+    uint64_t position = 0;
+};
+
+/*--------------------------------------------------------------------*/
+/* stdio backend                                                      */
+/*--------------------------------------------------------------------*/
+
+class StdioInput : public LZWInput
+{
+  private:
+    FILE *fp;
+    bool owned;
+
+  public:
+    StdioInput (FILE *f, bool own) : fp (f), owned (own) { }
+    ~StdioInput () override { if (owned) fclose (fp); }
+
+    size_t Read (void *buf, size_t len) override;
+    int64_t Size (void) override;
+    bool Failed (void) const override { return ferror (fp) != 0; }
+};
+
+class StdioOutput : public LZWOutput
+{
+  private:
+    FILE *fp;
+    bool owned;
+
+  public:
+    StdioOutput (FILE *f, bool own) : fp (f), owned (own) { }
+    ~StdioOutput () override { if (owned) fclose (fp); }
+
+    bool Write (const void *buf, size_t len) override;
+    bool Finish (void) override { return fflush (fp) == 0; }
+};
+
+/* stdio output with holes (SPARSE_OUTPUT): whole SPARSE_BLOCK blocks of
+   zeros, at their offsets in the file, are seeked over rather than
+   written, and Finish sets the length of the file, for a hole at its end.
+   A block split between writes is held until it is complete. Where the
+   file cannot seek the zeros are written after all. */
+#define SPARSE_BLOCK  4096
+
+class SparseOutput : public LZWOutput
+{
+  private:
+    FILE *fp;
+    bool owned;
+    uint64_t hole;      // zeros passed over since the last write.
+    bool seeked;
+    unsigned char block[SPARSE_BLOCK];
+    size_t fill;        // of the block being held, position % SPARSE_BLOCK.
+
+    bool Put (const unsigned char *data, size_t len);
+    bool Flush (const unsigned char *data);
+
+  public:
+    SparseOutput (FILE *f, bool own) : fp (f), owned (own), hole (0), seeked (false), fill (0) { }
+    ~SparseOutput () override { if (owned) fclose (fp); }
+
+    bool Write (const void *buf, size_t len) override;
+    bool Finish (void) override;
+};
+
+/*--------------------------------------------------------------------*/
+/* Callback backend (lzw_source / lzw_sink)                           */
+/*--------------------------------------------------------------------*/
+
+class CallbackInput : public LZWInput
+{
+  private:
+    lzw_source source;
+    int64_t size;
+    bool failed;
+
+  public:
+    // size is the total the source will give, when known.
+    explicit CallbackInput (const lzw_source & s, int64_t total = -1) : source (s), size (total), failed (false) { }
+
+    size_t Read (void *buf, size_t len) override;
+    int64_t Size (void) override { return size; }
+    bool Failed (void) const override { return failed; }
+};
+
+class CallbackOutput : public LZWOutput
+{
+  private:
+    lzw_sink sink;
+    bool stopped;
+
+  public:
+    explicit CallbackOutput (const lzw_sink & s) : sink (s), stopped (false) { }
+
+    bool Write (const void *buf, size_t len) override;
+    bool Stopped (void) const override { return stopped; }
+};
+
+/*--------------------------------------------------------------------*/
+/* Memory backend: data the caller owns, e.g. a mapped file.          */
+/*--------------------------------------------------------------------*/
+
+class MemoryInput : public LZWInput
+{
+  private:
+    const unsigned char *data;
+    uint64_t size;
+
+  public:
+    MemoryInput (const void *d, uint64_t n) : data ((const unsigned char *)d), size (n) { }
+
+    size_t Read (void *buf, size_t len) override
+    {
+      if (len > size - position)
+        len = (size_t)(size - position);
+
+      if (len)
+        memcpy (buf, data + position, len);
+
+      position += len;
+      return len;
+    }
+
+    int64_t Size (void) override { return (int64_t)size; }
+
+    const unsigned char *Data (void) const { return data; }
+    void Seek (uint64_t pos) { position = pos < size ? pos : size; }
+};
+
+/* Passes on the first limit bytes, then stops the writer. */
+class PrefixOutput : public LZWOutput
+{
+  private:
+    LZWOutput & dst;
+    uint64_t limit;
+    bool reached, failed;
+
+  public:
+    PrefixOutput (LZWOutput & destination, uint64_t n) : dst (destination), limit (n), reached (false), failed (false) { }
+
+    bool Write (const void *buf, size_t len) override;
+    bool Finish (void) override { return !failed && dst.Finish(); }
+    bool Stopped (void) const override { return reached || dst.Stopped(); }
+
+    bool Reached (void) const { return reached && !failed; }
+};
+
+/* Passes writes on but leaves dst unfinished, so that the streams of an
+   appended file can be unpacked into it one after another. */
+class MemberOutput : public LZWOutput
+{
+  private:
+    LZWOutput & dst;
+
+  public:
+    explicit MemberOutput (LZWOutput & destination) : dst (destination) { }
+
+    bool Write (const void *buf, size_t len) override
+    {
+      if (!dst.Write (buf, len))
+        return false;
+
+      position += len;
+      return true;
+    }
+
+    bool Stopped (void) const override { return dst.Stopped(); }
+};
+
+/* Keeps the size bytes written from offset from on in data, and passes
+   over the rest; with size 0, it only counts. */
+class WindowOutput : public LZWOutput
+{
+  private:
+    unsigned char *data;
+    uint64_t from, size;
+
+  public:
+    WindowOutput (void *d, uint64_t start, uint64_t n) : data ((unsigned char *)d), from (start), size (n) { }
+
+    bool Write (const void *buf, size_t len) override
+    {
+      uint64_t lo = (position > from) ? position : from;
+      uint64_t hi = (position + len < from + size) ? position + len : from + size;
+
+      if (lo < hi)
+        memcpy (data + (lo - from), (const unsigned char *)buf + (lo - position), (size_t)(hi - lo));
+
+      position += len;
+      return true;
+    }
+};
+
+/*--------------------------------------------------------------------*/
+/* Lock-free single producer / single consumer queue of slot indices. */
+/*--------------------------------------------------------------------*/
+
+class SPSCQueue
+{
+  public:
+    static const unsigned CAPACITY = 64;   // power of two, more than any ring depth.
+
+  private:
+    uint32_t items[CAPACITY];
+    alignas(64) std::atomic<uint32_t> head;   // next to pop, owned by consumer.
+    alignas(64) std::atomic<uint32_t> tail;   // next to push, owned by producer.
+
+  public:
+    SPSCQueue () : head (0), tail (0) { }
+
+    bool TryPush (uint32_t v)
+    {
+      uint32_t t = tail.load (std::memory_order_relaxed);
+
+      if (t - head.load (std::memory_order_acquire) == CAPACITY) return false;
+
+      items[t & (CAPACITY - 1)] = v;
+      tail.store (t + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool TryPop (uint32_t & v)
+    {
+      uint32_t h = head.load (std::memory_order_relaxed);
+
+      if (h == tail.load (std::memory_order_acquire)) return false;
+
+      v = items[h & (CAPACITY - 1)];
+      head.store (h + 1, std::memory_order_release);
+      return true;
+    }
+
+    // blocking versions; give up (false) once stop is raised.
+    bool Push (uint32_t v, const std::atomic<bool> & stop);
+    bool Pop (uint32_t & v, const std::atomic<bool> & stop);
+};
+
+/* Ring of equally sized buffers handed between two threads. */
+struct PipelineRing
+{
+  LZWAllocator & alloc;
+  unsigned char *memory;
+  size_t slot_size;
+  uint32_t slots;
+  size_t *lengths;
+  SPSCQueue filled, empty;
+  std::atomic<bool> stop;
+
+  PipelineRing (LZWAllocator & a, uint32_t count, size_t size);
+  ~PipelineRing ();
+
+  bool Ok (void) const { return memory != NULL; }
+  unsigned char *Slot (uint32_t i) { return memory + (size_t)i * slot_size; }
+};
+
+/* A reader thread prefetches the source into the ring while the coder
+   works on the previously read block. */
+class PipelinedInput : public LZWInput
+{
+  private:
+    LZWInput *src;
+    PipelineRing ring;
+    std::thread reader;
+    std::atomic<bool> failed;
+    uint32_t current;
+    size_t offset;
+    bool have_current, at_end;
+    int64_t size;
+
+    void ReaderLoop (void);
+
+  public:
+    // takes ownership of source.
+    PipelinedInput (LZWInput *source, LZWAllocator & a, uint32_t depth, size_t block);
+    ~PipelinedInput () override;
+
+    bool Start (void);
+    LZWInput *Release (void);   // gives the source back when Start failed.
+
+    size_t Read (void *buf, size_t len) override;
+    int64_t Size (void) override { return size; }
+    bool Failed (void) const override { return failed.load(); }
+};
+
+/* Completed output is queued to a writer thread which drains it to the
+   destination, so the coder never waits on a write. */
+class PipelinedOutput : public LZWOutput
+{
+  private:
+    LZWOutput *dst;
+    PipelineRing ring;
+    std::thread writer;
+    std::atomic<bool> failed;
+    uint32_t current;
+    size_t fill;
+    bool have_current, finished;
+
+    void WriterLoop (void);
+    bool Submit (void);
+
+  public:
+    // takes ownership of destination.
+    PipelinedOutput (LZWOutput *destination, LZWAllocator & a, uint32_t depth, size_t block);
+    ~PipelinedOutput () override;
+
+    bool Start (void);
+    LZWOutput *Release (void);  // gives the destination back when Start failed.
+
+    bool Write (const void *buf, size_t len) override;
+    bool Finish (void) override;
+};
+
+/*--------------------------------------------------------------------*/
+/* Factories                                                          */
+/*--------------------------------------------------------------------*/
+
+#define PIPELINE_DEPTH  8
+#define PIPELINE_BLOCK  (256 * 1024)
+
+inline bool ValidIOBlock (size_t size)
+{
+  return size >= MIN_DIRECT_BLOCK && size <= MAX_DIRECT_BLOCK && size % 4096 == 0;
+}
+
+/* io_uring backend (Linux). NULL when io_uring cannot be used, in which
+   case fp stays open and the caller falls back to stdio. */
+LZWInput *OpenUringInput (FILE *fp, LZWAllocator & alloc);
+LZWOutput *OpenUringOutput (FILE *fp, LZWAllocator & alloc);
+
+/* Page-cache-aware backend (DIRECT_IO) moving block bytes at a time, a
+   multiple of 4 Kb. NULL for anything but a regular file, or when the
+   block does not fit alloc.RingBudget (); fp then stays open for stdio. */
+LZWInput *OpenDirectInput (FILE *fp, LZWAllocator & alloc, size_t block);
+LZWOutput *OpenDirectOutput (FILE *fp, LZWAllocator & alloc, size_t block);
+
+/* Open a file with the backend selected by flags (URING_IO, PIPELINED_IO, ...).
+   Errors are reported on stderr; NULL is returned. The stream owns the
+   file and closes it when deleted. Under a memory limit the rings are cut
+   to alloc.RingBudget (), and left out when they cannot hold two blocks.
+   direct_block is the DIRECT_IO block size. */
+LZWInput *OpenInput (const char *filename, int flags, LZWAllocator & alloc, size_t direct_block = DIRECT_BLOCK);
+LZWOutput *OpenOutput (const char *filename, int flags, LZWAllocator & alloc, size_t direct_block = DIRECT_BLOCK);
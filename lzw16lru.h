@@ -0,0 +1,98 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Leaf phrases in order of last use, for        */
+/*  FEATURE_LRU. Once the dictionary is full, the */
+/*  least recently used leaf (a phrase no other   */
+/*  one extends) gives its code to the next new   */
+/*  phrase. The packer and the unpacker make the  */
+/*  same calls in the same order, so they agree   */
+/*  on the codes without any being sent.          */
+/**************************************************/
+
+#pragma once
+
+#include <cstdint>
+
+class LZWLeafList
+{
+  private:
+    uint32_t *link;       // per code: the leaf used before it, then the one after.
+    uint32_t *children;   // per code: phrases one byte longer.
+    uint32_t oldest, newest;
+
+    void Unlink (uint32_t code)
+    {
+      uint32_t before = link[2 * code], after = link[2 * code + 1];
+
+      if (before == NONE) oldest = after; else link[2 * before + 1] = after;
+      if (after == NONE) newest = before; else link[2 * after] = before;
+    }
+
+    void Append (uint32_t code)
+    {
+      link[2 * code] = newest;
+      link[2 * code + 1] = NONE;
+
+      if (newest == NONE) oldest = code; else link[2 * newest + 1] = code;
+
+      newest = code;
+    }
+
+  public:
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    LZWLeafList () : link (NULL), children (NULL), oldest (NONE), newest (NONE) { }
+
+    // two links and a count per code, kept by the caller.
+    void Attach (uint32_t *links, uint32_t *counts)
+    {
+      link = links;
+      children = counts;
+      Reset ();
+    }
+
+    // the dictionary holds the bytes alone, which are never evicted.
+    void Reset (void) { oldest = newest = NONE; }
+
+    // code now stands for parent and one more byte.
+    void Add (uint32_t code, uint32_t parent)
+    {
+      children[code] = 0;
+      Append (code);
+
+      if (parent > 255 && children[parent]++ == 0)
+        Unlink (parent);
+    }
+
+    // code was just sent.
+    void Touch (uint32_t code)
+    {
+      if (code > 255 && children[code] == 0 && code != newest)
+      {
+        Unlink (code);
+        Append (code);
+      }
+    }
+
+    // Takes the least recently used leaf out of the list, for the caller
+    // to drop its phrase and Release its parent. NONE when that leaf is
+    // keep, the code just sent, which the new phrase is to extend.
+    uint32_t Evict (uint32_t keep)
+    {
+      uint32_t code = oldest;
+
+      if (code == NONE || code == keep)
+        return NONE;
+
+      Unlink (code);
+      return code;
+    }
+
+    // a phrase extending parent was dropped.
+    void Release (uint32_t parent)
+    {
+      if (parent > 255 && --children[parent] == 0)
+        Append (parent);
+    }
+};
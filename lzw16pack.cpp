@@ -4,10 +4,17 @@
 /**************************************************/
 /*  LZW compression program with full dictionary  */
 /*  reset when filled up. Variable width  codes   */ 
-/*  up to 16 bits in output.                      */   
+/*  up to 20 bits in output.                      */   
 /**************************************************/
 
 #include "common.h"
+#include "lzw16alloc.h"
+#include "lzw16io.h"
+#include "lzw16bits.h"
+#include "lzw16header.h"
+#include "lzw16filter.h"
+#include "lzw16huff.h"
+#include "lzw16lru.h"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -15,18 +22,23 @@
 #include <cassert>
 
 #include <cstdint>
+#include <new>
+#include <optional>
 
-#include <mutex>
+// build with -DUSE_STL_HASH for the std::unordered_map dictionary.
 
-#define USE_STL_HASH
+#if defined(USE_STL_HASH) && defined(LZW_FIXED_FOOTPRINT)
+#error "the fixed footprint build has no heap for std::unordered_map"
+#endif
 
 #ifdef USE_STL_HASH
 #include <unordered_map>
+#include <memory_resource>
 #endif 
 
 #ifndef USE_STL_HASH
 
-#define MISSING_KEY       (0xFFFFFFFFL) 
+#define MISSING_KEY       (0xFFFFFFFFU) 
 
 #endif 
 
@@ -34,48 +46,116 @@ class LZWPacker
 {
   private:
 
+    LZWAllocator alloc;
+
 #ifdef USE_STL_HASH
-    std::unordered_map<uint32_t,int16_t> table;
+    LZWMemoryResource resource;
+    std::pmr::unsynchronized_pool_resource pool;  // recycles map nodes between dictionary resets.
+    std::pmr::unordered_map<uint32_t,uint32_t> table;
 #else   
-    uint32_t *table ;  // important note: hashtable has combination of value (last MAX_BITS and key which is OR combination of byte plus previous key).
-                        // when MAX_BITS is 12, 32-bit row is enough (12 + 12 + 8 = 32).
-                        // but when MAX_BITS is 13-16, we need extra space. This is why table (32-bit, for keys) + extra (16-bit, for codes) is used.
-    uint16_t * extra;
+    uint64_t *table ;   // open addressing; each slot holds key (prefix code and byte, up to 28 bits) in the
+                        // high half and its code in the low half, so a probe touches a single cache line.
+                        // 2^(MAX_BITS+1) slots keep the load at or below one half: 16 Mb at 20 bits.
 #endif 
 
     uint32_t OUTLEN;
     uint32_t MAX_BITS ;
+    uint32_t AllocSlots;  // hash table slots last allocated; 0 if none.
+    uint32_t ReservedBits;  // static contexts: widest codes their workspace holds; 0 otherwise.
 
     uint32_t HT_SIZE, HT_KEY_MASK, HT_CLEAR_CODE, HT_MAX_CODE; 
+    uint32_t HT_SHIFT;  // 64 less the bits of a slot index.
 
     static const unsigned OUTPUT_INCREMENT = 4096;
+    static const unsigned CODE_BATCH = 32;
+
+    // a static context's line holds a sub-block, less a byte, and a batch of codes past it.
+    static_assert (SUBBLOCK_SIZE + CODE_BATCH * SUPPORTED_MAX_BITS / 8 + 16 <= lzw_footprint::SUB_BLOCK,
+                   "lzw_footprint::SUB_BLOCK does not hold a sub-block");
+
+    const LZWBitKernels & kernels;
+    uint32_t pending[CODE_BATCH];
+    unsigned npending;
+
     unsigned char * outline ;
+    unsigned char * buffer ;
+    uint32_t block_size;    // read size; a setting, like the filter chain.
+    uint32_t buffer_size;   // size buffer was allocated with.
+    uint32_t io_block;      // DIRECT_IO reads and writes.
 
-    FILE *fp ;
-    FILE *fout ;
+    LZWOutput *fout ;
 
-    uint16_t RunCode ;
+    uint32_t RunCode ;
     int16_t RunningBits ;
     uint32_t CodeBuffer;
     int16_t CurBufferShift;
-    uint16_t EOFCode ;
+    uint32_t EOFCode ;
     bool verbose, diagnostics;
 
-    mutable std::mutex _mtx;
+    FilterSpec filters[LZW_MAX_FILTERS];
+    unsigned nfilters;
+
+    // LZMW / LZAP engines: the hash table is a trie of (node, byte) -> child
+    // node. Only some nodes end a dictionary phrase and carry a code.
+    int engine;              // LZW_ENGINE_*; a setting, like the filter chain.
+    uint32_t *node_code;     // trie node -> code, NO_CODE for inner nodes.
+    uint32_t *code_node;     // code -> trie node, NO_CODE when not in the trie.
+    uint32_t *code_len;      // code -> phrase length.
+    uint32_t PhraseBits;     // MAX_BITS the above were allocated for; 0 if none.
+    uint32_t nodes;
+
+    // entropy stage: besides being packed, a segment's codes are held as
+    // they are and as distances back from the newest code. When the segment
+    // ends, the smallest of the three codings is written.
+    bool entropy;
+    uint32_t *seg_codes;     // SegCapacity codes, then as many distances.
+    uint32_t nseg;
+    uint32_t SegCapacity;    // 0 if seg_codes is not allocated.
+    uint32_t seg_freq[2][HUFF_SYMBOLS];
+    HuffEncoder huff;
+
+    // FEATURE_SUBBLOCKS: outline is sent every SUBBLOCK_SIZE bytes rather
+    // than held for the whole segment (entropy coded segments excepted).
+    bool subblocks;
+
+    // FEATURE_LRU (LZW engine only): a full dictionary evicts its least
+    // recently used leaves. The list lives in node_code and code_len, and
+    // code_node holds the hash key of each code, for it to be dropped.
+    bool lru;
+    LZWLeafList leaves;
+
+    // COMPRESS_FORMAT: codes sent at the current width, in the group of
+    // eight being filled, and the widest before the next widening.
+    uint32_t ZGroup, ZMaxCode;
+
+    static const uint32_t NO_CODE = 0xFFFFFFFF;
+    static const uint32_t Z_CHECK_GAP = 10000;   // input bytes between ratio checks of a full dictionary.
+    static const uint32_t PHRASE_CAP = 8192;   // longest phrase the packer will match; the unpacker has no limit.
+
+    static_assert (PHRASE_CAP == lzw_footprint::PHRASE_CAP, "lzw_footprint::PHRASE_CAP does not match");
 
   public:
-  LZWPacker ()
+  explicit LZWPacker (const lzw_allocator *custom = NULL) : alloc (custom)
+#ifdef USE_STL_HASH
+    , resource (alloc), pool (&resource), table (&pool)
+#endif
+    , kernels (SelectBitKernels())
   {
 #ifndef USE_STL_HASH    
     table = NULL;
-    extra = NULL;
 #endif
 
     OUTLEN = OUTPUT_INCREMENT;
+    MAX_BITS = 0;
+    AllocSlots = 0;
+    ReservedBits = 0;
 
     outline = NULL;
+    buffer = NULL;
+    block_size = DEFAULT_BLOCK_SIZE;
+    buffer_size = 0;
+    io_block = DIRECT_BLOCK;
 
-    fp = NULL;
     fout = NULL;
 
     RunCode = 256;
@@ -83,13 +163,32 @@ class LZWPacker
     CodeBuffer = 0;
     CurBufferShift = 0;
     EOFCode = 511;
+    npending = 0;
 
     verbose = false;
     diagnostics = false;
+
+    nfilters = 0;
+
+    engine = LZW_ENGINE_LZW;
+    node_code = code_node = code_len = NULL;
+    PhraseBits = 0;
+    nodes = 0;
+
+    entropy = false;
+    seg_codes = NULL;
+    nseg = SegCapacity = 0;
+    memset (seg_freq, 0, sizeof(seg_freq));
+
+    subblocks = false;
+    lru = false;
+
+    ZGroup = 0;
+    ZMaxCode = 511;
   }
   ~LZWPacker ()
   {
-    _mtx.unlock();
+    DeleteHashTable();
   }
 
   LZWPacker (const LZWPacker &) = delete;
@@ -106,6 +205,7 @@ class LZWPacker
       MAX_BITS = bits;
       HT_SIZE = (1 << (bits + 1));
       HT_KEY_MASK = HT_SIZE - 1;
+      HT_SHIFT = 64 - (bits + 1);
       HT_MAX_CODE = (1 << bits);
       HT_CLEAR_CODE = HT_MAX_CODE - 2;
 
@@ -115,7 +215,7 @@ class LZWPacker
 #ifndef USE_STL_HASH
   uint32_t HT_GET_KEY(const uint32_t key) const
   {
-    return table[key];
+    return (uint32_t)(table[key] >> 32);
   }
 #endif   
 
@@ -124,50 +224,180 @@ class LZWPacker
 #ifdef USE_STL_HASH
     table.clear();
 #else 
-    memset(table, 0xFF, HT_SIZE * sizeof(uint32_t));
-    memset (extra, 0xFF, HT_SIZE * sizeof(uint16_t));
+    memset(table, 0xFF, HT_SIZE * sizeof(uint64_t));
 #endif     
   }
 
   void DeleteHashTable (void)
   {
 #ifndef USE_STL_HASH    
-    free (table);
+    alloc.Free (table, AllocSlots * sizeof(uint64_t));
     table = NULL;
-    free (extra);
-    extra = NULL;
 #endif     
 
-    free (outline);
+    FreePhrases();
+
+    alloc.Free (seg_codes, 2 * SegCapacity * sizeof(uint32_t));
+    seg_codes = NULL;
+    SegCapacity = 0;
+
+    alloc.Free (outline, OUTLEN);
     outline = NULL;
+    OUTLEN = OUTPUT_INCREMENT;
+
+    alloc.Free (buffer, buffer_size);
+    buffer = NULL;
+    buffer_size = 0;
+
+    AllocSlots = 0;
+  }
+
+  bool GrowOutline (uint32_t needed)
+  {
+    // a static context's line already holds the longest segment, or sub-block.
+    if (ReservedBits)
+    {
+      LZW_ERROR ("Segment exceeds the static workspace for %d bits.\n", (int)ReservedBits);
+      return false;
+    }
+
+    uint32_t new_len = OUTLEN;
+
+    while (new_len < needed)
+    {
+      uint32_t next = new_len + (new_len < 0x100000 ? new_len : 0x100000); // doubling, then 1 MB steps.
+
+      if (next < new_len) // overflow
+      {
+        LZW_ERROR ("Length too large. Cannot proceed.\n");
+        return false;
+      }
+
+      new_len = next;
+    }
+
+    if (diagnostics)
+      LZW_PRINT ("reallocating outline to %d\n", new_len);
+
+    unsigned char *ptr = (unsigned char *)alloc.Realloc(outline, OUTLEN, new_len);
+    
+    if (NULL == ptr)
+    {
+      LZW_ERROR ("Failed to reallocate memory: %s\n", strerror (errno));
+      return false;
+    }
+
+    outline = ptr;
+    OUTLEN = new_len;
+
+    return true;
+  }
+
+  // Packs the queued codes (all of the current width) into outline.
+  int FlushCodes (uint32_t & len)
+  {
+    if (npending == 0)
+      return 1;
+
+    uint32_t needed = len + (npending * RunningBits) / 8 + 16; // pack kernels may store 8 bytes past the end.
+
+    if (needed > OUTLEN && !GrowOutline (needed))
+      return 0;
+
+    uint64_t acc = CodeBuffer;
+    unsigned accbits = CurBufferShift;
+
+    unsigned char *end = kernels.pack (pending, npending, RunningBits, acc, accbits, outline + len);
+
+    len = (uint32_t)(end - outline);
+    CodeBuffer = (uint32_t)acc;
+    CurBufferShift = (int16_t)accbits;
+    npending = 0;
+
+    if (subblocks && !entropy && len >= SUBBLOCK_SIZE)
+      return SendSubBlocks (len);
+
+    return 1;
+  }
+
+  // A sub-block is its 16-bit big-endian length, with the top bit set on
+  // the last one of the segment, then its bytes.
+  bool WriteSubBlock (const unsigned char *data, uint32_t n, bool last)
+  {
+    unsigned char header[2] = { (uint8_t)((n >> 8) | (last ? 0x80 : 0)), (uint8_t)n };
+
+    if (!fout->Write (header, 2) || !fout->Write (data, n))
+    {
+      LZW_ERROR ("Write error. Out of disk space? \n");
+      return false;
+    }
+
+    return true;
+  }
+
+  // Sends the whole sub-blocks in outline and keeps the rest.
+  int SendSubBlocks (uint32_t & len)
+  {
+    uint32_t sent = 0;
+
+    for (; len - sent >= SUBBLOCK_SIZE; sent += SUBBLOCK_SIZE)
+    {
+      if (!WriteSubBlock (outline + sent, SUBBLOCK_SIZE, false))
+        return 0;
+    }
+
+    memmove (outline, outline + sent, len - sent);
+    len -= sent;
+
+    return 1;
   }
 
-  int OutByte(const uint16_t code, uint32_t & len)
+  int OutByte(const uint32_t code, uint32_t & len)
   {
     if (code == HT_CLEAR_CODE)
     {
       if (diagnostics)
       {
-        printf ("Writing %d bytes\n", (int)len);
+        LZW_PRINT ("Writing %d bytes\n", (int)len);
+      }
+
+      if (subblocks)
+      {
+        // the rest of the segment, perhaps nothing, goes in the last one.
+        uint32_t sent = 0;
+
+        for (; len - sent > SUBBLOCK_SIZE; sent += SUBBLOCK_SIZE)
+        {
+          if (!WriteSubBlock (outline + sent, SUBBLOCK_SIZE, false))
+            return 0;
+        }
+
+        if (!WriteSubBlock (outline + sent, len - sent, true))
+          return 0;
+
+        len = 0;
+        return 1;
       }
 
+      unsigned char header[5];
+      size_t header_len;
+
       if ((len & 0x7FFF) == len) // fits in 15 bits
       {
-        unsigned char byte = (len >> 8) & 0xFF;
-        fwrite (&byte, 1, 1, fout);
-        byte = len & 0xFF;
-        fwrite (&byte, 1, 1, fout);
+        header[0] = (len >> 8) & 0xFF;
+        header[1] = len & 0xFF;
+        header_len = 2;
       }
       else 
       {
-        unsigned char byte = 255;
-        fwrite (&byte, 1, 1, fout);
-        fwrite (&len, 1, 4, fout);
+        header[0] = 255;
+        memcpy (header + 1, &len, 4);
+        header_len = 5;
       }
 
-      if (len != fwrite (outline, 1, len, fout))
+      if (!fout->Write (header, header_len) || !fout->Write (outline, len))
       {
-        fprintf (stderr, "Write error. Out of disk space? \n");
+        LZW_ERROR ("Write error. Out of disk space? \n");
         return 0;
       }
 
@@ -177,39 +407,145 @@ class LZWPacker
     }
     else
     {
-      if (len == OUTLEN)
+      if (len == OUTLEN && !GrowOutline (len + 1))
+        return 0;
+
+      outline[len++] = (uint8_t)code;
+
+      if (subblocks && !entropy && len >= SUBBLOCK_SIZE)
+        return SendSubBlocks (len);
+    }
+
+    return 1;
+  }
+
+  bool HoldCode (const uint32_t Code)
+  {
+    if (nseg == SegCapacity)
+    {
+      LZW_ERROR ("Segment too long. Cannot proceed.\n");
+      return false;
+    }
+
+    // distances count from the newest code the unpacker knows of, which
+    // under LZW lags one code behind the packer.
+    uint32_t newest = (engine == LZW_ENGINE_LZW) ? RunCode - 1 : RunCode;
+    uint32_t distance = (Code < 256) ? Code : 256 + (newest - Code);
+    unsigned nextra;
+    uint32_t extra;
+
+    seg_codes[nseg] = Code;
+    seg_codes[SegCapacity + nseg] = distance;
+    nseg++;
+
+    seg_freq[0][HuffSymbol (Code, nextra, extra)]++;
+    seg_freq[1][HuffSymbol (distance, nextra, extra)]++;
+
+    return true;
+  }
+
+  // Writes the held values with the current table, then the symbol ending
+  // the segment.
+  void WriteSymbols (const uint32_t *values, unsigned last, uint32_t & len)
+  {
+    uint64_t acc = 0;
+    int accbits = 0;
+
+    for (uint32_t k = 0; k <= nseg; k++)
+    {
+      unsigned sym = last, nextra = 0;
+      uint32_t extra = 0;
+
+      if (k < nseg)
+        sym = HuffSymbol (values[k], nextra, extra);
+
+      acc |= (uint64_t)(huff.code[sym] | (extra << huff.len[sym])) << accbits;
+      accbits += huff.len[sym] + nextra;
+
+      if (accbits >= 32)
       {
-        OUTLEN += OUTPUT_INCREMENT;
+        memcpy (outline + len, &acc, 4);
+        len += 4;
+        acc >>= 32;
+        accbits -= 32;
+      }
+    }
 
-        if (OUTLEN < len) // overflow
-        {
-          fprintf (stderr, "Length too large. Cannot proceed.\n");
-          return 0;
-        }
+    for (; accbits > 0; accbits -= 8)
+    {
+      outline[len++] = (uint8_t)acc;
+      acc >>= 8;
+    }
+  }
 
-        if (diagnostics)
-          printf ("reallocating outline to %d\n", OUTLEN);
+  // Outline holds the segment's packed codes; when one of the Huffman
+  // codings is smaller, it replaces them. Either way the coding used goes
+  // in the segment's first byte.
+  int ChooseCoding (unsigned last, uint32_t & len)
+  {
+    int best = SEGMENT_PACKED;
+    uint64_t best_size = len;
 
-        void *saved_ptr = outline;
-        outline = (unsigned char *)realloc(outline, OUTLEN);
-        
-        if (NULL == outline)
-        {
-          fprintf (stderr, "Failed to reallocate memory: %s\n", strerror (errno));
-          free (saved_ptr);
+    for (int m = 0; m < 2; m++)
+    {
+      seg_freq[m][last]++;
 
-          return 0;
-        }
+      huff.Build (seg_freq[m]);
+
+      uint64_t size = HUFF_TABLE_MAX + (huff.Cost (seg_freq[m]) + 7) / 8;
+
+      if (size < best_size)
+      {
+        best = SEGMENT_HUFFMAN + m;
+        best_size = size;
       }
+    }
 
-      outline[len++] = (uint8_t)code;
+    if (best == SEGMENT_PACKED)
+    {
+      if (len + 1 > OUTLEN && !GrowOutline (len + 1))
+        return 0;
+
+      memmove (outline + 1, outline, len);
+      outline[0] = SEGMENT_PACKED;
+      len++;
+    }
+    else
+    {
+      const uint32_t *values = seg_codes + (best == SEGMENT_HUFFMAN ? 0 : SegCapacity);
+
+      huff.Build (seg_freq[best - SEGMENT_HUFFMAN]);
+
+      uint32_t needed = 1 + HUFF_TABLE_MAX + (nseg + 1) * 4 + 8;  // a symbol and its extra bits take at most 30 bits.
+
+      if (needed > OUTLEN && !GrowOutline (needed))
+        return 0;
+
+      outline[0] = (uint8_t)best;
+      len = 1 + (uint32_t)huff.WriteTable (outline + 1);
+
+      WriteSymbols (values, last, len);
     }
 
+    nseg = 0;
+    memset (seg_freq, 0, sizeof(seg_freq));
+
     return 1;
   }
 
-  int CompressCode(const uint16_t Code, uint32_t & len)
+  int EndSegment (const uint32_t Code, uint32_t & len)
+  {
+    if (entropy && !ChooseCoding (Code == HT_CLEAR_CODE ? HUFF_SYM_CLEAR : HUFF_SYM_EOF, len))
+      return 0;
+
+    return OutByte (HT_CLEAR_CODE, len);
+  }
+
+  int CompressCode(const uint32_t Code, uint32_t & len)
   {
+    if ((Code == HT_CLEAR_CODE || Code == EOFCode) && !FlushCodes (len))
+      return 0;
+
     if (Code == HT_CLEAR_CODE)
     {
       CodeBuffer |= (((uint32_t)Code) << CurBufferShift);
@@ -223,7 +559,7 @@ class LZWPacker
         CodeBuffer >>= 8;
         CurBufferShift -= 8;
       }
-      if (!OutByte(HT_CLEAR_CODE, len))
+      if (!EndSegment(Code, len))
           return 0;
 
       CurBufferShift = 0;
@@ -240,20 +576,21 @@ class LZWPacker
         CurBufferShift -= 8;
       }
 
-      if (!OutByte(HT_CLEAR_CODE, len)) return 0;
+      if (!EndSegment(Code, len)) return 0;
 
       CurBufferShift = 0;
     }
     else
     {
-      CodeBuffer |= (((uint32_t)Code) << CurBufferShift);
-      CurBufferShift += RunningBits;
-      while (CurBufferShift >= 8)
-      {
-        if (!OutByte(CodeBuffer & 0xFF, len)) return 0;
-        CodeBuffer >>= 8;
-        CurBufferShift -= 8;
-      }
+      if (entropy && !HoldCode (Code))
+        return 0;
+
+      // codes are queued and packed in batches; the queue is drained
+      // before the width changes.
+      pending[npending++] = Code;
+
+      if ((npending == CODE_BATCH || RunCode == EOFCode) && !FlushCodes (len))
+        return 0;
     }
     if (RunCode == EOFCode)
     {
@@ -264,47 +601,181 @@ class LZWPacker
     return 1;
   }
 
+  // Writes the whole bytes in outline once there are enough of them.
+  int DrainZ (uint32_t & len, bool all)
+  {
+    if (!FlushCodes (len))
+      return 0;
+
+    if (len < OUTPUT_INCREMENT / 2 && !all)
+      return 1;
+
+    if (!fout->Write (outline, len))
+    {
+      LZW_ERROR ("Write error. Out of disk space? \n");
+      return 0;
+    }
+
+    len = 0;
+    return 1;
+  }
+
+  // Ends the group of eight codes with zero codes, ahead of a new width.
+  int PadZ (uint32_t & len)
+  {
+    while (ZGroup)
+    {
+      pending[npending++] = 0;
+      ZGroup = (ZGroup + 1) & 7;
+    }
+
+    return DrainZ (len, false);
+  }
+
+  // Sends Code; like compress(1), widens the codes after it once the next
+  // entry needs more bits, which the unpacker finds out a code later.
+  int SendZ (const uint32_t Code, uint32_t & len)
+  {
+    pending[npending++] = Code;
+    ZGroup = (ZGroup + 1) & 7;
+
+    if (npending == CODE_BATCH && !DrainZ (len, false))
+      return 0;
+
+    if (RunCode > ZMaxCode)
+    {
+      if (!PadZ (len))
+        return 0;
+
+      RunningBits++;
+      ZMaxCode = ((uint32_t)RunningBits == MAX_BITS) ? HT_MAX_CODE : (1U << RunningBits) - 1;
+    }
+
+    return 1;
+  }
+
+  // Allocations are kept between calls and only redone when a wider
+  // dictionary than the one already allocated is requested.
   bool InitHashTable (void)
   {
+    if (AllocSlots < HT_SIZE)
+    {
 #ifdef USE_STL_HASH
-    table.reserve (HT_SIZE);
+      try
+      {
+        table.reserve (HT_SIZE);
+      }
+      catch (const std::bad_alloc &)
+      {
+        return false;
+      }
 #else     
-    table = (uint32_t *)malloc(HT_SIZE * sizeof(uint32_t));
-    extra = (uint16_t *)malloc(HT_SIZE * sizeof(uint16_t));
-    
-    if (table == NULL || extra == NULL)
-      return false;
+      DeleteHashTable();
+
+      table = (uint64_t *)alloc.Alloc(HT_SIZE * sizeof(uint64_t));
+      
+      if (table == NULL)
+        return false;
 #endif       
-    
+      AllocSlots = HT_SIZE;
+    }
+
     ClearHashTable();
 
-    outline = (unsigned char *)malloc (OUTLEN);
+    if (outline == NULL)
+    {
+      OUTLEN = ReservedBits ? (uint32_t)lzw_footprint::pack_line (ReservedBits) : OUTPUT_INCREMENT;
+      outline = (unsigned char *)alloc.Alloc (OUTLEN);
+
+      if (outline == NULL) return false;
+    }
+
+    // phrase engines keep a whole capped phrase of look-ahead past a block.
+    if (buffer_size != block_size + PHRASE_CAP)
+    {
+      alloc.Free (buffer, buffer_size);
+      buffer_size = 0;
+
+      buffer = (unsigned char *)alloc.Alloc(block_size + PHRASE_CAP);
+
+      if (buffer == NULL) return false;
+
+      buffer_size = block_size + PHRASE_CAP;
+    }
+
+    // a segment holds fewer codes than the dictionary.
+    if (entropy && SegCapacity < HT_MAX_CODE)
+    {
+      alloc.Free (seg_codes, 2 * SegCapacity * sizeof(uint32_t));
+      SegCapacity = 0;
+
+      seg_codes = (uint32_t *)alloc.Alloc (2 * HT_MAX_CODE * sizeof(uint32_t));
+
+      if (seg_codes == NULL) return false;
 
-    if (outline == NULL) return false;
+      SegCapacity = HT_MAX_CODE;
+    }
 
     return true;
   }
 
 #ifndef USE_STL_HASH
+  // Fibonacci hashing: the top bits of the key times 2^64 / phi. Folding the
+  // code onto the character left runs of keys that linear probing crawled
+  // through past 16 bits.
   uint32_t KeyItem(const uint32_t Item) const 
   {
-    return ((Item >> MAX_BITS) ^ Item) & HT_KEY_MASK;
+    return (uint32_t)((Item * UINT64_C(0x9E3779B97F4A7C15)) >> HT_SHIFT);
   }
 #endif   
 
-  void InsertHashTable (const uint32_t Key, const int16_t Code)
+  bool InsertHashTable (const uint32_t Key, const uint32_t Code)
   {
 #ifdef USE_STL_HASH
-    table[Key] = Code;
+    try
+    {
+      table[Key] = Code;
+    }
+    catch (const std::bad_alloc &)
+    {
+      return false;
+    }
 #else     
     uint32_t HKey = KeyItem(Key);
 
     while (HT_GET_KEY(HKey) != MISSING_KEY)
       HKey = (HKey + 1) & HT_KEY_MASK;  
 
-    table[HKey] = Key;
-    extra[HKey] = Code;
+    table[HKey] = ((uint64_t)Key << 32) | Code;
 #endif     
+    return true;
+  }
+
+  // Linear probing: the entries after the one removed that would not be
+  // found past the gap are moved back into it.
+  void RemoveHashTable (const uint32_t Key)
+  {
+#ifdef USE_STL_HASH
+    table.erase (Key);
+#else
+    uint32_t hole = KeyItem(Key);
+
+    while (HT_GET_KEY(hole) != Key)
+      hole = (hole + 1) & HT_KEY_MASK;
+
+    for (uint32_t HKey = (hole + 1) & HT_KEY_MASK; HT_GET_KEY(HKey) != MISSING_KEY; HKey = (HKey + 1) & HT_KEY_MASK)
+    {
+      uint32_t home = KeyItem(HT_GET_KEY(HKey));
+
+      if (((HKey - home) & HT_KEY_MASK) >= ((HKey - hole) & HT_KEY_MASK))
+      {
+        table[hole] = table[HKey];
+        hole = HKey;
+      }
+    }
+
+    table[hole] = ~(uint64_t)0;
+#endif
   }
 
   int32_t ExistHashTable (const uint32_t Key) const 
@@ -326,7 +797,7 @@ class LZWPacker
     {
       if (Key == HTKey)
       {
-        return extra[HKey];
+        return (int32_t)(uint32_t)table[HKey];
       }
 
       HKey = (HKey + 1) & HT_KEY_MASK;
@@ -336,107 +807,670 @@ class LZWPacker
 #endif     
   }
 
-  public:
-
-  int Compress(const char *filename, const char *outfile, int flags, int bits = DEFAULT_MAX_BITS)
+  void FreePhrases (void)
   {
-    unsigned char *buffer;
-    uint16_t CurCode; 
-    int32_t NewCode; // must be signed
-    int32_t NewKey;
-    int len, i;
-    const char label[4] = "LZW";
-    const uint8_t version = PACKER_VERSION;
+    uint32_t codes = (1 << PhraseBits);
 
-    uint32_t out_pos = 0;
+    alloc.Free (node_code, 2 * codes * sizeof(uint32_t));
+    alloc.Free (code_node, codes * sizeof(uint32_t));
+    alloc.Free (code_len, codes * sizeof(uint32_t));
 
-    _mtx.lock(); // we want to allow calling Compress only once, since it allocates memory, etc. for class instance.
-                 // mutex is released in destructor when all memory is freed.
+    node_code = code_node = code_len = NULL;
+    PhraseBits = 0;
+  }
 
-    if (!setupConsts (bits))
+  // the trie gets up to two nodes per code; past that, new phrases still
+  // take a code but cannot be matched.
+  bool InitPhrases (void)
+  {
+    if (PhraseBits < MAX_BITS)
     {
-      fprintf (stderr, "Invalid encoding.\n");
-      return 0;
-    }
+      FreePhrases ();
 
-    if (is_big_endian())
-    {
-      fprintf (stderr, "Not supported on big endian machines.\n");
-      return 0;
-    }
+      node_code = (uint32_t *)alloc.Alloc (2 * HT_MAX_CODE * sizeof(uint32_t));
+      code_node = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
+      code_len = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
 
-    fp = fopen(filename, "rb");
-    
-    if (NULL == fp)
-    {
-      fprintf (stderr, "Cannot open input file \'%s\'.\n", filename);
-      fprintf (stderr, "%s\n", strerror(errno)); 
-      return 0;
-    }
+      PhraseBits = MAX_BITS;
 
-    fout = fopen(outfile, "wb");
+      if (!node_code || !code_node || !code_len)
+      {
+        FreePhrases ();
+        return false;
+      }
+    }
+
+    ResetPhrases ();
+
+    return true;
+  }
+
+  void ResetPhrases (void)
+  {
+    for (uint32_t c = 0; c < 256; c++)
+    {
+      node_code[c] = code_node[c] = c;
+      code_len[c] = 1;
+    }
+
+    nodes = 256;
+  }
+
+  bool InitLeaves (void)
+  {
+    if (!InitPhrases ())
+      return false;
+
+    leaves.Attach (node_code, code_len);
+    return true;
+  }
+
+  // Drops the phrase of the least recently used leaf, for its code to go
+  // to one extending Prev, the code just sent. NO_CODE when there is no
+  // leaf but Prev.
+  uint32_t EvictCode (const uint32_t Prev)
+  {
+    uint32_t Code = leaves.Evict (Prev);
+
+    if (Code == LZWLeafList::NONE)
+      return NO_CODE;
+
+    RemoveHashTable (code_node[Code]);
+    leaves.Release (code_node[Code] >> 8);
+
+    return Code;
+  }
+
+  // Flushes the codes of the current width, then widens until RunCode fits.
+  // Phrase engines can add several codes per step, so this may skip widths.
+  bool WidenCodes (uint32_t & len)
+  {
+    while (RunCode >= EOFCode)
+    {
+      if (!FlushCodes (len))
+        return false;
+
+      RunningBits++;
+      EOFCode = (EOFCode << 1) + 1;
+    }
 
-    if (NULL == fout)
+    return true;
+  }
+
+  // Adds the phrases that follow from emitting cur (of curlen bytes) after
+  // prev: prev + cur for LZMW, prev + each prefix of cur for LZAP. Every
+  // phrase takes a code, even one already in the dictionary, so that the
+  // unpacker need not look for duplicates.
+  bool AddPhrases (uint32_t prev, const unsigned char *cur, uint32_t curlen)
+  {
+    uint32_t node = code_node[prev];
+    bool in_trie = (node != NO_CODE);
+
+    for (uint32_t k = 1; k <= curlen && RunCode < HT_CLEAR_CODE; k++)
     {
-      fprintf (stderr, "Cannot open output file \'%s\'.\n", outfile);
-      fprintf (stderr, "%s\n", strerror(errno));
-      fclose (fp);
+      if (in_trie && code_len[prev] + k > PHRASE_CAP)
+        in_trie = false;
+
+      if (in_trie)
+      {
+        uint32_t key = (node << 8) | cur[k - 1];
+        int32_t child = ExistHashTable (key);
+
+        if (child < 0)
+        {
+          if (nodes == 2 * HT_MAX_CODE)
+            in_trie = false;
+          else
+          {
+            child = nodes++;
+            node_code[child] = NO_CODE;
+
+            if (!InsertHashTable (key, child))
+              return false;
+          }
+        }
+
+        node = child;
+      }
+
+      if (engine == LZW_ENGINE_LZAP || k == curlen)
+      {
+        code_len[RunCode] = code_len[prev] + k;
+        code_node[RunCode] = NO_CODE;
+
+        if (in_trie && node_code[node] == NO_CODE)
+        {
+          node_code[node] = RunCode;
+          code_node[RunCode] = node;
+        }
+
+        RunCode++;
+      }
+    }
+
+    return true;
+  }
+
+  // Greedy longest-phrase parse over a window holding PHRASE_CAP bytes of
+  // look-ahead, so matches carry across reads as in the LZW loop.
+  bool CompressPhrases (LZWInput & input, uint32_t & out_pos)
+  {
+    size_t pos = 0, avail = 0;
+    bool eof = false;
+    uint32_t prev = NO_CODE;
+
+    while (true)
+    {
+      if (!eof && avail - pos < PHRASE_CAP)
+      {
+        memmove (buffer, buffer + pos, avail - pos);
+        avail -= pos;
+        pos = 0;
+
+        size_t got = input.Read (buffer + avail, block_size);
+
+        if (got < block_size || input.Failed()) eof = true;
+
+        avail += got;
+      }
+
+      if (pos == avail)
+        break;
+
+      uint32_t node = buffer[pos], best = node;
+      uint32_t len = 1, best_len = 1;
+      uint32_t limit = (avail - pos < PHRASE_CAP) ? (uint32_t)(avail - pos) : PHRASE_CAP;
+      int32_t child;
+
+      while (len < limit && (child = ExistHashTable ((node << 8) | buffer[pos + len])) >= 0)
+      {
+        node = child;
+        len++;
+
+        if (node_code[node] != NO_CODE)
+        {
+          best = node;
+          best_len = len;
+        }
+      }
+
+      uint32_t code = node_code[best];
+
+      if (!CompressCode (code, out_pos))
+        return false;
+
+      if (prev != NO_CODE && !AddPhrases (prev, buffer + pos, best_len))
+      {
+        LZW_ERROR ("Failed to allocate memory for dictionary.\n");
+        return false;
+      }
+
+      prev = code;
+      pos += best_len;
+
+      if (!WidenCodes (out_pos))
+        return false;
+
+      if (RunCode == HT_CLEAR_CODE)
+      {
+        if (diagnostics)
+          LZW_PRINT ("resetting (HT_CLEAR_CODE)\n");
+
+        if (!CompressCode (HT_CLEAR_CODE, out_pos))
+          return false;
+
+        ClearHashTable();
+        ResetPhrases();
+        RunCode = 256;
+        RunningBits = 9;
+        EOFCode = 511;
+        prev = NO_CODE;
+      }
+    }
+
+    return true;
+  }
+
+  public:
+
+  const lzw_allocator *Allocator (void) const { return &alloc.Get(); }
+
+  // tables and buffers are kept between calls, and counted until freed.
+  size_t PeakMemory (void) const { return alloc.Peak(); }
+  void SetMemoryLimit (size_t bytes) { alloc.SetLimit (bytes); }
+  size_t MemoryLimit (void) const { return alloc.Limit(); }
+
+  // the filter chain is a setting; Reset leaves it in place.
+  bool AddFilter (int id, int param)
+  {
+    if (nfilters == LZW_MAX_FILTERS || !ValidFilter (id, param))
+      return false;
+
+    filters[nfilters].id = (uint8_t)id;
+    filters[nfilters].param = (uint8_t)param;
+    nfilters++;
+
+    return true;
+  }
+
+  void ClearFilters (void) { nfilters = 0; }
+
+  // settings only; dictionaries and buffers stay with each instance.
+  void CopySettings (const LZWPacker & other)
+  {
+    memcpy (filters, other.filters, sizeof(filters));
+    nfilters = other.nfilters;
+    engine = other.engine;
+    io_block = other.io_block;
+    alloc.SetLimit (other.alloc.Limit());
+
+    if (!ReservedBits)
+      block_size = other.block_size;
+  }
+
+  bool SetEngine (int id)
+  {
+    if (!ValidEngine (id))
+      return false;
+
+    engine = id;
+    return true;
+  }
+
+  bool SetBlockSize (size_t size)
+  {
+    if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (ReservedBits && size != block_size))
+      return false;
+
+    block_size = (uint32_t)size;
+    return true;
+  }
+
+  bool SetIOBlockSize (size_t size)
+  {
+    if (!ValidIOBlock (size))
+      return false;
+
+    io_block = (uint32_t)size;
+    return true;
+  }
+
+  // Returns the coder to its initial state. Allocated memory is kept so
+  // that the instance can be reused by the next Compress call.
+  void Reset (void)
+  {
+    RunCode = 256;
+    RunningBits = 9;
+    CodeBuffer = 0;
+    CurBufferShift = 0;
+    EOFCode = 511;
+    npending = 0;
+    nseg = 0;
+    memset (seg_freq, 0, sizeof(seg_freq));
+  }
+
+  // Static contexts: sets aside all that any call at up to bits can use,
+  // so that later calls allocate only the RLE and filter blocks, on top.
+  bool Reserve (int bits)
+  {
+    if (!setupConsts (bits))
+      return false;
+
+    ReservedBits = bits;
+    block_size = LZW_STATIC_BLOCK_SIZE;
+
+    HT_SIZE <<= 1;   // sized for the phrase trie.
+    HT_KEY_MASK = HT_SIZE - 1;
+    HT_SHIFT--;
+
+    entropy = true;
+
+    bool ok = InitHashTable() && InitPhrases();
+
+    entropy = false;
+
+    return ok;
+  }
+
+#ifndef LZW_FIXED_FOOTPRINT
+  int Compress(const char *filename, const char *outfile, int flags, int bits = DEFAULT_MAX_BITS)
+  {
+    LZWInput *in = OpenInput (filename, flags, alloc, io_block);
+
+    if (NULL == in)
+      return 0;
+
+    LZWOutput *out = OpenOutput (outfile, flags, alloc, io_block);
+
+    if (NULL == out)
+    {
+      delete in;
+      return 0;
+    }
+
+    int ret = Compress (*in, *out, flags, bits);
+
+    if (!out->Finish() && ret)
+    {
+      LZW_ERROR ("Write error. Out of disk space? \n");
+      ret = 0;
+    }
+
+    delete in;
+    delete out;
+
+    return ret;
+  }
+#endif // LZW_FIXED_FOOTPRINT
+
+  // compress(1) .Z output (COMPRESS_FORMAT): bytes 1F 9D, then the widest
+  // code width, with 0x80 for block mode; then a single run of codes, with
+  // no size, segments or end code. Codes go in groups of eight, as many
+  // bytes as their width, and a group is padded out when the width changes
+  // or Z_CLEAR is sent. A full dictionary is kept while the ratio, checked
+  // every Z_CHECK_GAP input bytes, improves, and cleared once it does not.
+  int CompressZ (LZWInput & input, LZWOutput & output, int flags, int bits)
+  {
+    uint32_t CurCode = 0;
+    bool matching = false;
+    uint32_t out_pos = 0;
+
+    Reset();
+
+    if (bits > Z_MAX_BITS || !setupConsts (bits))
+    {
+      LZW_ERROR ("The .Z format has codes of 9 to %d bits.\n", Z_MAX_BITS);
       return 0;
     }
 
+    if (ReservedBits && (uint32_t)bits > ReservedBits)
+    {
+      LZW_ERROR ("%d bit codes do not fit in the context's workspace.\n", bits);
+      return 0;
+    }
+
+    if (is_big_endian())
+    {
+      LZW_ERROR ("Not supported on big endian machines.\n");
+      return 0;
+    }
+
+    if (nfilters || engine != LZW_ENGINE_LZW || (flags & (RLE_STAGE | ENTROPY_STAGE | SUBBLOCK_FRAMING | LRU_EVICTION)))
+    {
+      LZW_ERROR ("The .Z format is plain LZW: no stages, filters or other engines.\n");
+      return 0;
+    }
+
+    entropy = lru = subblocks = false;
+
     if (!InitHashTable())
     {
-      fprintf(stderr, "Failed to allocate memory: %s\n", strerror (errno));
-      fclose (fp);
-      fclose (fout);
+      LZW_ERROR ("Failed to allocate memory: %s\n", strerror (errno));
       return 0;
     }
 
-    buffer = (unsigned char *)malloc(BUFFLEN);
+    const unsigned char magic[3] = { 0x1F, 0x9D, (uint8_t)(0x80 | bits) };
+    const uint64_t start = output.Position();
 
-    if (!buffer)
+    fout = &output;
+
+    if (!fout->Write (magic, 3))
     {
-      fclose (fp);
-      fclose (fout);
-      fprintf (stderr, "Cannot allocate memory: %s\n", strerror (errno));
-      DeleteHashTable();
+      LZW_ERROR ("Write error. Out of disk space? \n");
+      fout = NULL;
       return 0;
     }
 
-    fwrite(label, 1, 4, fout);
+    verbose = (0 != (flags & VERBOSE_OUTPUT));
+    diagnostics = (0 != (flags & DIAGNOSTIC_OUTPUT));
+
+    RunCode = Z_CLEAR + 1;
+    ZGroup = 0;
+    ZMaxCode = 511;
+
+    uint64_t in_count = 0, checkpoint = Z_CHECK_GAP, ratio = 0;
+    bool ok = true;
+
+    while (ok)
+    {
+      int len = (int)input.Read (buffer, block_size);
+
+      if (len == 0 || input.Failed())
+        break;
+
+      int i = 0;
+
+      if (!matching)
+      {
+        CurCode = *buffer;
+        matching = true;
+        i = 1;
+      }
 
-    fwrite (&version, 1, 1, fout);
+      for (; i < len; i++)
+      {
+        uint32_t NewKey = (CurCode << 8) + buffer[i];
+        int32_t NewCode = ExistHashTable (NewKey);
 
-    unsigned char infoBits = 0;
+        if (NewCode >= 0)
+        {
+          CurCode = NewCode;
+          continue;
+        }
 
-    infoBits |= (is_big_endian() ? 1 : 0);
-    infoBits |= VARIABLE_WIDTH ? 2 : 0;
-    // leaving 2 bits reserved.
-    infoBits |= ((MAX_BITS - 8) << 4); // we use left 4 bits for MAX_BITS information; can be between 8 and 23.
+        if (!SendZ (CurCode, out_pos))
+        {
+          ok = false;
+          break;
+        }
 
-    fwrite (&infoBits, 1, 1, fout);
+        CurCode = buffer[i];
 
-    // write size of input file.
-    fseek (fp, 0, SEEK_END);
-    uint32_t inputSize = ftell (fp);
-    fseek (fp, 0, SEEK_SET);
+        if (RunCode < HT_MAX_CODE)
+        {
+          if (!InsertHashTable (NewKey, RunCode++))
+          {
+            LZW_ERROR ("Failed to allocate memory for dictionary.\n");
+            ok = false;
+            break;
+          }
+        }
+        else if (in_count + i + 1 >= checkpoint)
+        {
+          // input bytes per output byte, in 1/256ths, as compress(1) has it.
+          uint64_t now = in_count + i + 1;
+          uint64_t rat = (now << 8) / (output.Position() - start + out_pos + (npending * RunningBits) / 8);
 
-    fwrite (&inputSize, 1, sizeof(uint32_t), fout);
+          checkpoint = now + Z_CHECK_GAP;
+
+          if (rat > ratio)
+          {
+            ratio = rat;
+            continue;
+          }
+
+          if (diagnostics)
+            LZW_PRINT ("resetting (Z_CLEAR)\n");
+
+          ratio = 0;
+          ClearHashTable();
+          RunCode = Z_CLEAR + 1;
+
+          if (!SendZ (Z_CLEAR, out_pos) || !PadZ (out_pos))
+          {
+            ok = false;
+            break;
+          }
+
+          RunningBits = 9;
+          ZMaxCode = 511;
+        }
+      }
+
+      in_count += len;
+    }
+
+    if (ok && input.Failed())
+    {
+      LZW_ERROR ("Read error.\n");
+      ok = false;
+    }
+
+    if (ok && matching)
+      ok = SendZ (CurCode, out_pos);
+
+    // the last byte, part filled.
+    if (ok && DrainZ (out_pos, false) && CurBufferShift > 0)
+    {
+      outline[out_pos++] = (uint8_t)CodeBuffer;
+      CurBufferShift = 0;
+    }
+
+    ok = ok && DrainZ (out_pos, true);
+
+    fout = NULL;
+
+    return ok ? 1 : 0;
+  }
+
+  int Compress(LZWInput & source, LZWOutput & output, int flags, int bits = DEFAULT_MAX_BITS)
+  {
+    if (flags & COMPRESS_FORMAT)
+      return CompressZ (source, output, flags, bits);
+
+    uint32_t CurCode = 0; 
+    bool matching = false;
+    int32_t NewCode; // must be signed
+    int32_t NewKey;
+    int len, i;
+
+    uint32_t out_pos = 0;
+
+    Reset();
+
+    if (!setupConsts (bits))
+    {
+      LZW_ERROR ("Invalid encoding.\n");
+      return 0;
+    }
+
+    if (ReservedBits && (uint32_t)bits > ReservedBits)
+    {
+      LZW_ERROR ("%d bit codes do not fit in the context's workspace.\n", bits);
+      return 0;
+    }
+
+    if (is_big_endian())
+    {
+      LZW_ERROR ("Not supported on big endian machines.\n");
+      return 0;
+    }
+
+    entropy = (0 != (flags & ENTROPY_STAGE));
+    lru = (0 != (flags & LRU_EVICTION));
+    subblocks = lru || (0 != (flags & SUBBLOCK_FRAMING));
+
+    if (lru && (engine != LZW_ENGINE_LZW || entropy))
+    {
+      LZW_ERROR ("LRU eviction is for the LZW engine without the entropy stage.\n");
+      return 0;
+    }
+
+    // the trie has up to twice as many nodes as there are codes.
+    if (engine != LZW_ENGINE_LZW)
+    {
+      HT_SIZE <<= 1;
+      HT_KEY_MASK = HT_SIZE - 1;
+      HT_SHIFT--;
+    }
+
+    if (!InitHashTable() || (engine != LZW_ENGINE_LZW && !InitPhrases()) || (lru && !InitLeaves()))
+    {
+      LZW_ERROR ("Failed to allocate memory: %s\n", strerror (errno));
+      return 0;
+    }
+
+    std::optional<FilterInput> filtered;
+
+    if (nfilters)
+    {
+      filtered.emplace (source, filters, nfilters, alloc);
+
+      if (!filtered->Ok())
+      {
+        LZW_ERROR ("Failed to allocate memory: %s\n", strerror (errno));
+        return 0;
+      }
+    }
+
+    LZWInput & stage = filtered ? (LZWInput &)*filtered : source;
+
+    std::optional<RLEInput> rle;
+
+    if (flags & RLE_STAGE)
+    {
+      rle.emplace (stage, alloc);
+
+      if (!rle->Ok())
+      {
+        LZW_ERROR ("Failed to allocate memory: %s\n", strerror (errno));
+        return 0;
+      }
+    }
+
+    LZWInput & input = rle ? (LZWInput &)*rle : stage;
+
+    LZWHeader header;
+
+    header.bits = MAX_BITS;
+    header.inputSize = (source.Size() < 0) ? UINT32_MAX : (uint64_t)source.Size();   // size of input file, before any filter.
+    header.features = FEATURE_BLOCKS | (rle ? FEATURE_RLE : 0) | (nfilters ? FEATURE_FILTERS : 0) |
+                      (engine != LZW_ENGINE_LZW ? FEATURE_ENGINE : 0) | (entropy ? FEATURE_ENTROPY : 0) |
+                      FEATURE_APPEND | (subblocks ? FEATURE_SUBBLOCKS : 0) | (lru ? FEATURE_LRU : 0) |
+                      (header.inputSize > UINT32_MAX ? FEATURE_LARGE : 0);
+    header.totalSize = header.inputSize;   // grows as streams are appended.
+    header.engine = (uint8_t)engine;
+    header.filterCount = nfilters;
+    memcpy (header.filters, filters, sizeof(filters));
+    header.blockSize = block_size;
+
+    fout = &output;
+
+    if (!header.Write (*fout))
+    {
+      LZW_ERROR ("Write error. Out of disk space? \n");
+      fout = NULL;
+      return 0;
+    }
 
     bool compress_ok = true;
 
     verbose = (0 != (flags & VERBOSE_OUTPUT));
     diagnostics = (0 != (flags & DIAGNOSTIC_OUTPUT));
 
-    while (compress_ok)
+    if (diagnostics)
+      LZW_PRINT ("Code packer: %s\n", kernels.name);
+
+    if (engine != LZW_ENGINE_LZW)
+      compress_ok = CompressPhrases (input, out_pos);
+
+    while (compress_ok && engine == LZW_ENGINE_LZW)
     {
-      len = (int)fread(buffer, 1, BUFFLEN, fp);
-      if (len == 0)
+      len = (int)input.Read(buffer, block_size);
+      if (len == 0 || input.Failed())
         break;
 
-      CurCode = *buffer;
+      i = 0;
+
+      // the current match carries over from the previous block.
+      if (!matching)
+      {
+        CurCode = *buffer;
+        matching = true;
+        i = 1;
+      }
 
-      for (i = 1; i < len && compress_ok; i++)
+      for (; i < len && compress_ok; i++)
       {
         NewKey = (((uint32_t)CurCode) << 8) + buffer[i];
         if ((NewCode = ExistHashTable(NewKey)) >= 0)
@@ -452,10 +1486,22 @@ class LZWPacker
           }
 
           CurCode = buffer[i];
-          if (RunCode == HT_CLEAR_CODE)
+
+          uint32_t Prev = (uint32_t)NewKey >> 8;
+          uint32_t Code = RunCode;
+
+          if (lru)
+          {
+            leaves.Touch (Prev);
+
+            if (RunCode == HT_CLEAR_CODE)
+              Code = EvictCode (Prev);
+          }
+
+          if (Code == HT_CLEAR_CODE || Code == NO_CODE)
           {
             if (diagnostics)
-              printf ("resetting (HT_CLEAR_CODE)\n");
+              LZW_PRINT ("resetting (HT_CLEAR_CODE)\n");
 
             if (!CompressCode(HT_CLEAR_CODE, out_pos))
             {
@@ -464,43 +1510,60 @@ class LZWPacker
             }
 
             ClearHashTable();
+            leaves.Reset();
             RunCode = 256;
             RunningBits = 9;
             EOFCode = 511;
           }
+          else if (!InsertHashTable(NewKey, Code))
+          {
+            LZW_ERROR ("Failed to allocate memory for dictionary.\n");
+            compress_ok = false;
+            break;
+          }
           else
           {
-            InsertHashTable(NewKey, RunCode++);
+            if (lru)
+            {
+              code_node[Code] = (uint32_t)NewKey;
+              leaves.Add (Code, Prev);
+            }
+
+            if (Code == RunCode)
+              RunCode++;
           }
         }
       }
+    }
 
-      if (!CompressCode(CurCode, out_pos))
-      {
-        compress_ok = false;
-      }
+    if (compress_ok && matching && !CompressCode(CurCode, out_pos))
+    {
+      compress_ok = false;
+    }
+
+    if (compress_ok && input.Failed())
+    {
+      LZW_ERROR ("Read error.\n");
+      compress_ok = false;
     }
 
     if (compress_ok)
     {
-      CompressCode (EOFCode, out_pos);
+      compress_ok = CompressCode (EOFCode, out_pos);
       CompressCode (0, out_pos);
     }
 
-    DeleteHashTable();
-
-    free (buffer);
-    fclose (fp);
-    fclose (fout);
+    fout = NULL;
 
     return compress_ok ? 1 : 0;
   }
 }; // end of class
 
-int Compress(const char *filename, const char *outfile, int flags)
+#ifndef LZW_FIXED_FOOTPRINT
+
+static int compressWith (LZWPacker & packer, const char *filename, const char *outfile, int flags, int max_bits)
 {
-  LZWPacker packer;
-  int ret = packer.Compress (filename, outfile, flags);
+  int ret = packer.Compress (filename, outfile, flags, max_bits);
 
   if (ret == 0)
   {
@@ -512,36 +1575,196 @@ int Compress(const char *filename, const char *outfile, int flags)
     long orig_size = fileSize (filename);
     long compressed_size = fileSize (outfile);
 
-    printf ("Compression ratio %.2f%%\n", 100.0 * (orig_size - compressed_size) / orig_size);
+    LZW_PRINT ("Compression ratio %.2f%%\n", 100.0 * (orig_size - compressed_size) / orig_size);
+    LZW_PRINT ("Peak memory %zu bytes\n", packer.PeakMemory());
   }
 
   return ret;
 }
 
+int Compress(const char *filename, const char *outfile, int flags)
+{
+  LZWPacker packer;
+
+  return compressWith (packer, filename, outfile, flags, DEFAULT_MAX_BITS);
+}
+
 int Compress2 (const char *filename, const char *outfile, int flags, int max_bits)
 {
   LZWPacker packer;
 
   if (flags & VERBOSE_OUTPUT)
   {
-    printf ("Compression using max bits = %d\n", max_bits);
+    LZW_PRINT ("Compression using max bits = %d\n", max_bits);
   }
 
-  int ret = packer.Compress (filename, outfile, flags, max_bits);
+  return compressWith (packer, filename, outfile, flags, max_bits);
+}
 
-  if (ret == 0)
+#endif // LZW_FIXED_FOOTPRINT
+
+/*--------------------------------------------------------------------*/
+/* Reusable compression context                                       */
+/*--------------------------------------------------------------------*/
+
+struct LZW_CCtx
+{
+  LZWPacker packer;
+
+  explicit LZW_CCtx (const lzw_allocator *custom) : packer (custom) { }
+};
+
+static_assert (sizeof (LZW_CCtx) <= lzw_footprint::CCTX, "lzw_footprint::CCTX is too small");
+static_assert (FILTER_BLOCK * 3 == lzw_footprint::STAGES, "lzw_footprint::STAGES does not match the stages");
+static_assert (BUFFLEN == lzw_footprint::LEGACY_BLOCK, "lzw_footprint::LEGACY_BLOCK does not match");
+static_assert (HUFF_TABLE_MAX + 9 + 4 <= 256, "lzw_footprint::pack_line leaves too little for the Huffman table");
+
+LZW_CCtx *lzw_cctx_create (void)
+{
+  return lzw_cctx_create_advanced (NULL);
+}
+
+/* the context object itself is also placed with the custom allocator. */
+LZW_CCtx *lzw_cctx_create_advanced (const lzw_allocator *custom)
+{
+  LZWAllocator a (custom);
+
+  void *mem = a.Alloc (sizeof (LZW_CCtx));
+
+  if (!mem) return NULL;
+
+  try
   {
-    cleanup (outfile, flags);
+    return new (mem) LZW_CCtx (custom);
+  }
+  catch (const std::bad_alloc &)
+  {
+    a.Free (mem, sizeof (LZW_CCtx));
+    return NULL;
   }
+}
 
-  else if (flags & VERBOSE_OUTPUT)
+LZW_CCtx *lzw_cctx_create_static (void *workspace, size_t size, int max_bits)
+{
+  size_t need = lzw_cctx_workspace_size (max_bits);
+
+  lzw_arena *arena = (need && size >= need) ? lzw_arena_place (workspace, size) : NULL;
+
+  if (!arena) return NULL;
+
+  lzw_allocator custom = lzw_arena_allocator (arena);
+  LZWAllocator a (&custom);
+
+  void *mem = a.Alloc (lzw_footprint::CCTX);
+
+  if (!mem) return NULL;
+
+  LZW_CCtx *ctx = new (mem) LZW_CCtx (&custom);
+
+  if (!ctx->packer.Reserve (max_bits))
   {
-    long orig_size = fileSize (filename);
-    long compressed_size = fileSize (outfile);
+    ctx->~LZW_CCtx();
+    return NULL;
+  }
 
-    printf ("Compression ratio %.2f%%\n", 100.0 * (orig_size - compressed_size) / orig_size);
+  return ctx;
+}
+
+void lzw_cctx_free (LZW_CCtx *ctx)
+{
+  if (!ctx) return;
+
+  LZWAllocator a (ctx->packer.Allocator());
+
+  ctx->~LZW_CCtx();
+  a.Free (ctx, sizeof (LZW_CCtx));
+}
+
+void lzw_cctx_reset (LZW_CCtx *ctx)
+{
+  if (ctx) ctx->packer.Reset();
+}
+
+int lzw_cctx_add_filter (LZW_CCtx *ctx, int filter, int param)
+{
+  if (!ctx) return 0;
+
+  return ctx->packer.AddFilter (filter, param) ? 1 : 0;
+}
+
+void lzw_cctx_clear_filters (LZW_CCtx *ctx)
+{
+  if (ctx) ctx->packer.ClearFilters();
+}
+
+int lzw_cctx_set_engine (LZW_CCtx *ctx, int engine)
+{
+  if (!ctx) return 0;
+
+  return ctx->packer.SetEngine (engine) ? 1 : 0;
+}
+
+int lzw_cctx_set_memory_limit (LZW_CCtx *ctx, size_t bytes)
+{
+  if (!ctx) return 0;
+
+  ctx->packer.SetMemoryLimit (bytes);
+  return 1;
+}
+
+size_t lzw_cctx_peak_memory (const LZW_CCtx *ctx)
+{
+  return ctx ? ctx->packer.PeakMemory() : 0;
+}
+
+size_t lzw_cctx_memory_limit (const LZW_CCtx *ctx)
+{
+  return ctx ? ctx->packer.MemoryLimit() : 0;
+}
+
+int lzw_cctx_set_block_size (LZW_CCtx *ctx, size_t size)
+{
+  if (!ctx) return 0;
+
+  return ctx->packer.SetBlockSize (size) ? 1 : 0;
+}
+
+int lzw_cctx_set_io_block_size (LZW_CCtx *ctx, size_t size)
+{
+  if (!ctx) return 0;
+
+  return ctx->packer.SetIOBlockSize (size) ? 1 : 0;
+}
+
+void lzw_cctx_copy_settings (LZW_CCtx *dst, const LZW_CCtx *src)
+{
+  if (dst && src) dst->packer.CopySettings (src->packer);
+}
+
+#ifndef LZW_FIXED_FOOTPRINT
+int lzw_compress_cctx (LZW_CCtx *ctx, const char *filename, const char *outfile, int flags, int max_bits)
+{
+  if (!ctx) return 0;
+
+  return compressWith (ctx->packer, filename, outfile, flags, max_bits);
+}
+#endif
+
+int lzw_compress_stream (LZW_CCtx *ctx, const lzw_source *source, size_t size, const lzw_sink *sink, int flags, int max_bits)
+{
+  if (!ctx || !source || !sink || !source->read || !sink->write) return 0;
+
+  CallbackInput in (*source, (int64_t)size);
+  CallbackOutput out (*sink);
+
+  int ret = ctx->packer.Compress (in, out, flags, max_bits);
+
+  // the header promised size bytes.
+  if (ret && in.Position() != size)
+  {
+    LZW_ERROR ("Input size changed while packing.\n");
+    ret = 0;
   }
 
   return ret;
 }
-
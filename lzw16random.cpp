@@ -0,0 +1,188 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+#include "lzw16random.h"
+
+LZWSegmentIndex::LZWSegmentIndex (LZWAllocator & a) :
+  alloc (a), entries (NULL), count (0), capacity (0), streams (NULL), nstreams (0), stream_capacity (0)
+{
+}
+
+LZWSegmentIndex::~LZWSegmentIndex ()
+{
+  alloc.Free (entries, capacity * sizeof (LZWIndexEntry));
+  alloc.Free (streams, stream_capacity * sizeof (LZWIndexStream));
+}
+
+bool LZWSegmentIndex::AddStream (const LZWHeader & header, uint64_t offset)
+{
+  if (nstreams == stream_capacity)
+  {
+    uint32_t grown = stream_capacity ? 2 * stream_capacity : 4;
+
+    void *p = alloc.Realloc (streams, stream_capacity * sizeof (LZWIndexStream), grown * sizeof (LZWIndexStream));
+
+    if (!p) return false;
+
+    streams = (LZWIndexStream *)p;
+    stream_capacity = grown;
+  }
+
+  streams[nstreams].header = header;
+  streams[nstreams].offset = streams[nstreams].end = offset;
+  nstreams++;
+
+  return true;
+}
+
+bool LZWSegmentIndex::Add (uint64_t packed, uint64_t offset)
+{
+  const LZWIndexStream & s = streams[nstreams - 1];
+
+  offset += s.offset;
+
+  // a segment that unpacks to nothing (the empty last one) holds no byte to find.
+  if (count && entries[count - 1].stream == nstreams - 1 && entries[count - 1].offset == offset)
+    count--;
+
+  if (count == capacity)
+  {
+    if (capacity > UINT32_MAX / 2)
+      return false;
+
+    uint32_t grown = capacity ? 2 * capacity : 64;
+
+    void *p = alloc.Realloc (entries, capacity * sizeof (LZWIndexEntry), grown * sizeof (LZWIndexEntry));
+
+    if (!p) return false;
+
+    entries = (LZWIndexEntry *)p;
+    capacity = grown;
+  }
+
+  entries[count].packed = packed;
+  entries[count].offset = offset;
+  entries[count].stream = nstreams - 1;
+  count++;
+
+  return true;
+}
+
+uint32_t LZWSegmentIndex::Find (uint64_t offset) const
+{
+  uint32_t lo = 0, hi = count;
+
+  // the last entry starting at or before offset.
+  while (hi - lo > 1)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+
+    if (entries[mid].offset <= offset) lo = mid; else hi = mid;
+  }
+
+  return lo;
+}
+
+LZWSegmentCache::LZWSegmentCache (LZWAllocator & a, size_t bytes) :
+  alloc (a), capacity (bytes), used (0), entries (0), data (NULL), size (NULL), link (NULL),
+  oldest (NONE), newest (NONE)
+{
+}
+
+LZWSegmentCache::~LZWSegmentCache ()
+{
+  for (uint32_t k = 0; data && k < entries; k++)
+    alloc.Free (data[k], size[k]);
+
+  alloc.Free (data, entries * sizeof (unsigned char *));
+  alloc.Free (size, entries * sizeof (size_t));
+  alloc.Free (link, 2 * entries * sizeof (uint32_t));
+}
+
+bool LZWSegmentCache::Init (uint32_t n)
+{
+  data = (unsigned char **)alloc.Alloc (n * sizeof (unsigned char *));
+  size = (size_t *)alloc.Alloc (n * sizeof (size_t));
+  link = (uint32_t *)alloc.Alloc (2 * n * sizeof (uint32_t));
+
+  if (!data || !size || !link)
+  {
+    alloc.Free (data, n * sizeof (unsigned char *));
+    alloc.Free (size, n * sizeof (size_t));
+    alloc.Free (link, 2 * n * sizeof (uint32_t));
+    data = NULL; size = NULL; link = NULL;
+    return false;
+  }
+
+  for (uint32_t k = 0; k < n; k++)
+  {
+    data[k] = NULL;
+    size[k] = 0;
+  }
+
+  entries = n;
+  return true;
+}
+
+void LZWSegmentCache::Unlink (uint32_t k)
+{
+  uint32_t before = link[2 * k], after = link[2 * k + 1];
+
+  if (before == NONE) oldest = after; else link[2 * before + 1] = after;
+  if (after == NONE) newest = before; else link[2 * after] = before;
+}
+
+void LZWSegmentCache::Append (uint32_t k)
+{
+  link[2 * k] = newest;
+  link[2 * k + 1] = NONE;
+
+  if (newest == NONE) oldest = k; else link[2 * newest + 1] = k;
+
+  newest = k;
+}
+
+const unsigned char *LZWSegmentCache::Find (uint32_t k)
+{
+  if (!data[k])
+    return NULL;
+
+  if (k != newest)
+  {
+    Unlink (k);
+    Append (k);
+  }
+
+  return data[k];
+}
+
+unsigned char *LZWSegmentCache::Insert (uint32_t k, size_t n)
+{
+  if (!n || n > capacity || data[k])
+    return NULL;
+
+  while (used > capacity - n)
+    Drop (oldest);
+
+  data[k] = (unsigned char *)alloc.Alloc (n);
+
+  if (!data[k])
+    return NULL;
+
+  size[k] = n;
+  used += n;
+  Append (k);
+
+  return data[k];
+}
+
+void LZWSegmentCache::Drop (uint32_t k)
+{
+  if (!data[k])
+    return;
+
+  Unlink (k);
+  alloc.Free (data[k], size[k]);
+  used -= size[k];
+  data[k] = NULL;
+  size[k] = 0;
+}
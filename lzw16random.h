@@ -0,0 +1,110 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Random access to packed files (lzw_open).     */
+/*  The index tells where each segment starts in  */
+/*  the file and in the unpacked data; segments   */
+/*  start with an empty dictionary, so each can   */
+/*  be unpacked on its own. Streams with RLE or   */
+/*  filters, or without blocks, are indexed as a  */
+/*  whole. The cache keeps the segments used      */
+/*  last, up to a number of bytes.                */
+/**************************************************/
+
+#pragma once
+
+#include "lzw16alloc.h"
+#include "lzw16header.h"
+
+#include <cstdint>
+
+struct LZWIndexEntry
+{
+  uint64_t packed;    // of its first length bytes (sub-block or segment), in the file.
+  uint64_t offset;    // of its first byte, in the unpacked data.
+  uint32_t stream;
+};
+
+struct LZWIndexStream
+{
+  LZWHeader header;
+  uint64_t offset, end;   // of its unpacked bytes.
+};
+
+class LZWSegmentIndex
+{
+  private:
+    LZWAllocator & alloc;
+    LZWIndexEntry *entries;
+    uint32_t count, capacity;
+    LZWIndexStream *streams;
+    uint32_t nstreams, stream_capacity;
+
+  public:
+    explicit LZWSegmentIndex (LZWAllocator & a);
+    ~LZWSegmentIndex ();
+
+    LZWSegmentIndex (const LZWSegmentIndex &) = delete;
+    LZWSegmentIndex & operator=(const LZWSegmentIndex &) = delete;
+
+    // the streams are added in turn, each with its entries.
+    bool AddStream (const LZWHeader & header, uint64_t offset);
+    void EndStream (uint64_t end) { streams[nstreams - 1].end = end; }
+
+    // offset is from the start of the stream being added.
+    bool Add (uint64_t packed, uint64_t offset);
+
+    uint32_t Count (void) const { return count; }
+    const LZWIndexEntry & Entry (uint32_t k) const { return entries[k]; }
+    const LZWIndexStream & Stream (uint32_t s) const { return streams[s]; }
+
+    // unpacked bytes of all the streams.
+    uint64_t Size (void) const { return nstreams ? streams[nstreams - 1].end : 0; }
+
+    // where the bytes of entry k end.
+    uint64_t End (uint32_t k) const
+    {
+      return (k + 1 < count && entries[k + 1].stream == entries[k].stream) ? entries[k + 1].offset
+                                                                           : streams[entries[k].stream].end;
+    }
+
+    // the entry holding the byte at offset, which is below Size ().
+    uint32_t Find (uint64_t offset) const;
+};
+
+class LZWSegmentCache
+{
+  private:
+    static const uint32_t NONE = 0xFFFFFFFF;
+
+    LZWAllocator & alloc;
+    size_t capacity, used;
+    uint32_t entries;
+    unsigned char **data;   // per index entry; NULL when it is not cached.
+    size_t *size;
+    uint32_t *link;         // per cached entry: the one used before it, then after.
+    uint32_t oldest, newest;
+
+    void Unlink (uint32_t k);
+    void Append (uint32_t k);
+
+  public:
+    LZWSegmentCache (LZWAllocator & a, size_t bytes);
+    ~LZWSegmentCache ();
+
+    LZWSegmentCache (const LZWSegmentCache &) = delete;
+    LZWSegmentCache & operator=(const LZWSegmentCache &) = delete;
+
+    // for an index of n entries.
+    bool Init (uint32_t n);
+
+    // entry k's bytes, now the last used; NULL when not cached.
+    const unsigned char *Find (uint32_t k);
+
+    // Room for entry k's n bytes, the least recently used entries making
+    // way; NULL when n is over the capacity or the memory is not there.
+    unsigned char *Insert (uint32_t k, size_t n);
+
+    // entry k could not be filled in after all.
+    void Drop (uint32_t k);
+};
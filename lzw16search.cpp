@@ -0,0 +1,148 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+#include "lzw16search.h"
+
+#include <cstring>
+
+LZWPattern::LZWPattern (const void *pattern, size_t length, lzw_match_fn fn, void *user) :
+  fail (NULL), m ((uint32_t)length), state (0), matched (0), position (0), count (0),
+  match (fn), opaque (user), stopped (false)
+{
+  memset (masks, 0, sizeof (masks));
+
+  bytes = (length && length <= UINT32_MAX) ? (unsigned char *)alloc.Alloc (length) : NULL;
+
+  if (!bytes)
+    return;
+
+  memcpy (bytes, pattern, length);
+
+  if (Bitwise ())
+  {
+    for (uint32_t k = 0; k < m; k++)
+      masks[bytes[k]] |= 1ULL << k;
+
+    return;
+  }
+
+  fail = (uint32_t *)alloc.Alloc (m * sizeof (uint32_t));
+
+  if (!fail)
+  {
+    alloc.Free (bytes, m);
+    bytes = NULL;
+    return;
+  }
+
+  // fail[k]: the longest proper border of the first k + 1 bytes.
+  fail[0] = 0;
+
+  for (uint32_t k = 1, b = 0; k < m; k++)
+  {
+    while (b && bytes[k] != bytes[b])
+      b = fail[b - 1];
+
+    if (bytes[k] == bytes[b])
+      b++;
+
+    fail[k] = b;
+  }
+}
+
+LZWPattern::~LZWPattern ()
+{
+  alloc.Free (bytes, m);
+  alloc.Free (fail, m * sizeof (uint32_t));
+}
+
+bool LZWPattern::Found (uint64_t start)
+{
+  count++;
+
+  if (match && match (opaque, start))
+  {
+    stopped = true;
+    return false;
+  }
+
+  return true;
+}
+
+bool LZWPattern::Scan (const unsigned char *data, size_t len)
+{
+  if (stopped)
+    return false;
+
+  if (Bitwise ())
+  {
+    const uint64_t last = 1ULL << (m - 1);
+    uint64_t s = state;
+
+    for (size_t k = 0; k < len; k++)
+    {
+      s = ((s << 1) | 1) & masks[data[k]];
+
+      if ((s & last) && !Found (position + k + 1 - m))
+        return false;
+    }
+
+    state = s;
+  }
+  else
+  {
+    uint32_t b = matched;
+
+    for (size_t k = 0; k < len; k++)
+    {
+      while (b && data[k] != bytes[b])
+        b = fail[b - 1];
+
+      if (data[k] == bytes[b])
+        b++;
+
+      if (b == m)
+      {
+        if (!Found (position + k + 1 - m))
+          return false;
+
+        b = fail[m - 1];
+      }
+    }
+
+    matched = b;
+  }
+
+  position += len;
+  return true;
+}
+
+bool LZWPattern::Join (const LZWSegmentHits & seg, const uint64_t *starts)
+{
+  if (stopped)
+    return false;
+
+  // the head is shorter than the pattern, so whatever matches in it
+  // started before the segment.
+  const uint64_t last = 1ULL << (m - 1);
+  uint64_t s = state;
+
+  for (uint32_t k = 0; k < seg.headLength && s; k++)
+  {
+    s = (s << 1) & masks[seg.head[k]];
+
+    if ((s & last) && !Found (position + k + 1 - m))
+      return false;
+  }
+
+  for (size_t k = 0; k < seg.count; k++)
+  {
+    if (!Found (position + starts[k]))
+      return false;
+  }
+
+  // a segment shorter than the pattern is all head.
+  state = (seg.length < m) ? (s | seg.state) : seg.state;
+  position += seg.length;
+
+  return true;
+}
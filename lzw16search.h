@@ -0,0 +1,102 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  Pattern search over unpacked data. Patterns   */
+/*  of up to 64 bytes are matched with Shift-And  */
+/*  bit masks, which also summarize a whole       */
+/*  dictionary phrase, so LZW streams can be      */
+/*  searched on their codes; the unpacker keeps   */
+/*  the masks per code. Longer patterns are       */
+/*  matched with KMP over the unpacked bytes.     */
+/**************************************************/
+
+#pragma once
+
+#include "lzw16alloc.h"
+#include "lzw16io.h"
+
+#include <cstdint>
+
+class LZWPattern;
+
+/* What the search of one segment on its own, from an empty state, leaves
+   for the segments before it to be joined with (LZWPattern::Join). */
+struct LZWSegmentHits
+{
+  uint64_t offset;          // of the segment's length bytes, in the file.
+  uint64_t payload;         // of its codes.
+  uint32_t size;            // of its codes.
+  uint64_t length;          // bytes it unpacks to.
+  uint64_t state;           // Shift-And state at its end.
+  unsigned char head[64];   // its first bytes, up to the pattern length less one.
+  uint32_t headLength;
+  unsigned worker;          // whose hits hold its matches,
+  size_t first, count;      // at these indices, as offsets from its start.
+  int status;               // SEGMENT_*.
+  bool last;                // ends the stream.
+};
+
+enum { SEGMENT_FOUND = 0, SEGMENT_CORRUPT = 1, SEGMENT_NO_MEMORY = 2 };
+
+class LZWPattern
+{
+  private:
+    LZWAllocator alloc;
+    unsigned char *bytes;
+    uint32_t *fail;          // KMP failure links, patterns over WORD_MAX bytes only.
+    uint32_t m;
+    uint64_t masks[256];     // bit k of masks[c]: byte k of the pattern is c.
+    uint64_t state;          // bit k: the last k + 1 bytes are the pattern's first.
+    uint32_t matched;        // KMP: pattern bytes matched.
+    uint64_t position;       // unpacked bytes searched so far.
+    uint64_t count;
+    lzw_match_fn match;
+    void *opaque;
+    bool stopped;
+
+    bool Found (uint64_t start);
+
+  public:
+    static const uint32_t WORD_MAX = 64;
+
+    LZWPattern (const void *pattern, size_t length, lzw_match_fn fn, void *user);
+    ~LZWPattern ();
+
+    LZWPattern (const LZWPattern &) = delete;
+    LZWPattern & operator=(const LZWPattern &) = delete;
+
+    bool Ok (void) const { return bytes != NULL; }
+
+    uint32_t Length (void) const { return m; }
+    bool Bitwise (void) const { return m <= WORD_MAX; }
+    uint64_t Mask (unsigned c) const { return masks[c]; }
+
+    uint64_t Position (void) const { return position; }
+    uint64_t Count (void) const { return count; }
+    bool Stopped (void) const { return stopped; }
+
+    // searches the next len bytes; false once the callback stopped the search.
+    bool Scan (const unsigned char *data, size_t len);
+
+    // Appends a segment searched on its own. Matches that start before it
+    // end in its head; starts are those found in it.
+    bool Join (const LZWSegmentHits & seg, const uint64_t *starts);
+};
+
+/* Searches what is written to it instead of storing it. */
+class ScanOutput : public LZWOutput
+{
+  private:
+    LZWPattern & pattern;
+
+  public:
+    explicit ScanOutput (LZWPattern & p) : pattern (p) { }
+
+    bool Write (const void *buf, size_t len) override
+    {
+      position += len;
+      return pattern.Scan ((const unsigned char *)buf, len);
+    }
+
+    bool Stopped (void) const override { return pattern.Stopped(); }
+};
@@ -4,10 +4,17 @@
 /**************************************************/
 /*  LZW decompression program with full           */
 /*  dictionary reset when filled up. Variable     */
-/*  width codes up to 16 bits in output.          */   
+/*  width codes up to 20 bits in output.          */   
 /**************************************************/
 
 #include "common.h"
+#include "lzw16alloc.h"
+#include "lzw16io.h"
+#include "lzw16bits.h"
+#include "lzw16header.h"
+#include "lzw16filter.h"
+#include "lzw16huff.h"
+#include "lzw16lru.h"
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -15,35 +22,150 @@
 #include <cassert>
 
 #include <cstdint>
-#include <mutex>
+#include <new>
+#include <optional>
+
+#ifndef LZW_FIXED_FOOTPRINT
+#include "lzw16search.h"
+#include "lzw16random.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// bit k of x to bit 63 - k.
+static inline uint64_t reverseBits (uint64_t x)
+{
+  x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+
+  return __builtin_bswap64 (x);
+}
+#endif
 
 class LZWUnpacker
 {
   private:
-    uint16_t * suffix;
-    uint16_t * prefix;
-    uint16_t * stack;
+    LZWAllocator alloc;
+
+    uint8_t * suffix;     // last byte of each code's string.
+    uint32_t * prefix;    // code of the string without it.
+    uint8_t * stack;
     unsigned char * outline;
     unsigned char *buffer ;
     uint32_t CurBufferShift;
     int16_t RunningBits;
-    uint16_t EOFCode;
+    uint32_t EOFCode;
 
     uint32_t MAX_BITS ;
     uint32_t HT_SIZE, HT_KEY_MASK, HT_CLEAR_CODE, HT_MAX_CODE; 
 
+    uint32_t buffer_size;
+    uint32_t AllocBits;     // MAX_BITS the dictionary was last allocated for; 0 if none.
+    uint32_t ReservedBits;  // static contexts: widest codes their workspace holds; 0 otherwise.
+    uint32_t io_block;      // DIRECT_IO reads and writes.
+    uint32_t outline_size, stack_size;
+    uint32_t flush_at;      // outline is written out once it holds this much.
+    uint64_t head;          // output wanted, when only a prefix is.
+
+    // LZMW / LZAP: a code above 255 stands for its left phrase followed by
+    // the first (len - len[left]) bytes of its right phrase.
+    uint32_t * left;
+    uint32_t * right;
+    uint32_t * plen;
+    uint32_t * pstack;    // (code, length) pairs still to expand, innermost last.
+    uint32_t PhraseBits;  // MAX_BITS the above were allocated for; 0 if none.
+
+    static const unsigned CODE_QUEUE = 64;
+    static const unsigned BUFFER_PADDING = sizeof(uint64_t);  // unpack kernels load 8 bytes at a time.
+
+    const LZWBitKernels & kernels;
+    uint32_t queue[CODE_QUEUE];
+    uint32_t qpos, qlen;
+    uint32_t SegmentBits;   // bits of the segment's codes in buffer; with sub-blocks, up to the last one read in.
+
+    bool entropy;           // FEATURE_ENTROPY: each segment starts with its coding.
+
+    // FEATURE_SUBBLOCKS: buffer holds a window on the segment's codes,
+    // topped up from subin with the next sub-blocks as it runs low. Entropy
+    // coded segments are still read whole.
+    bool subblocks;
+    bool last_block;        // the segment's last sub-block is in.
+    bool broken;            // a sub-block could not be read.
+    LZWInput *subin;
+
+    static const uint32_t SUBBLOCK_KEEP = CODE_QUEUE * SUPPORTED_MAX_BITS / 8 + BUFFER_PADDING;  // a full queue.
+
+    // a static context's buffer holds a sub-block after less than SUBBLOCK_KEEP bytes.
+    static_assert (SUBBLOCK_SIZE + SUBBLOCK_KEEP + BUFFER_PADDING <= lzw_footprint::SUB_BLOCK,
+                   "lzw_footprint::SUB_BLOCK does not hold a sub-block");
+
+    int coding;             // SEGMENT_*, of the current segment.
+    HuffDecoder huff;
+
+    // FEATURE_LRU: leaves evicted as the packer did, in pstack and left.
+    bool lru;
+    LZWLeafList leaves;
+
+#ifndef LZW_FIXED_FOOTPRINT
+    // Search on the codes (see lzw_search). Per code: its length and first
+    // byte, and Shift-And masks of the pattern against it: sD, the pattern
+    // prefixes it ends with; sI, where in the pattern it ends, when it lies
+    // wholly inside; sS, bit j when its first j bytes are the pattern's
+    // last j. socc is the longest of its prefixes ending with the whole
+    // pattern, so the matches inside a code are found by following them.
+    uint32_t * slen;
+    uint32_t * socc;
+    uint64_t * sD;
+    uint64_t * sI;
+    uint64_t * sS;
+    uint8_t * sfirst;
+    uint32_t SearchBits;  // MAX_BITS the above were allocated for; 0 if none.
+    uint64_t * hits;      // matches of the segments searched, from the start of each.
+    size_t hits_size, hits_count;
+
+    LZWSegmentIndex * index;   // lzw_open: where each segment starts is noted in it.
+#endif
+
     static const int CLEAR_BYTE = 0xFF;
-    static const int NOT_CODE = 0xFFFF;
+    static const uint32_t NOT_CODE = 0xFFFFFFFF;
+    static const uint64_t NO_HEAD = UINT64_MAX;
+    static const uint32_t QUEUED_EOF = 0xFFFFFFFE;   // entropy stage segment ends, queued ahead of the
+    static const uint32_t QUEUED_CLEAR = 0xFFFFFFFD; // width they are read at.
 
     static const int INITIAL_BUFFER = 0x8000;
 
-    mutable std::mutex _mtx;
-
   public:
 
-  LZWUnpacker ()
+  explicit LZWUnpacker (const lzw_allocator *custom = NULL) : alloc (custom), kernels (SelectBitKernels())
   {
+    qpos = qlen = 0;
+    SegmentBits = 0;
+    entropy = false;
+    coding = SEGMENT_PACKED;
+    subblocks = false;
+    last_block = true;
+    broken = false;
+    subin = NULL;
+    lru = false;
     buffer = NULL;
+    buffer_size = 0;
+    MAX_BITS = 0;
+    AllocBits = 0;
+    ReservedBits = 0;
+    io_block = DIRECT_BLOCK;
+    outline_size = stack_size = 0;
+    flush_at = 0;
+    head = NO_HEAD;
+    left = right = plen = pstack = NULL;
+    PhraseBits = 0;
     CurBufferShift = 0;
     RunningBits = 0;
     EOFCode = 0;
@@ -51,16 +173,19 @@ class LZWUnpacker
     prefix = NULL;
     stack = NULL;
     outline = NULL;
+#ifndef LZW_FIXED_FOOTPRINT
+    slen = socc = NULL;
+    sD = sI = sS = NULL;
+    sfirst = NULL;
+    SearchBits = 0;
+    hits = NULL;
+    hits_size = hits_count = 0;
+    index = NULL;
+#endif
   }
   ~LZWUnpacker ()
   {
-    free (buffer);
-    free (suffix);
-    free (prefix);
-    free (stack);
-    free (outline);
-
-    _mtx.unlock();
+    freeAll();
   }
 
   LZWUnpacker (const LZWUnpacker &) = delete;
@@ -83,366 +208,1790 @@ class LZWUnpacker
       return true; 
   }
 
-  bool initialAllocs (uint32_t buffer_size)
+  void freePhrases (void)
   {
-      buffer = (unsigned char *)malloc ( buffer_size );
-      suffix = (uint16_t *)malloc (HT_MAX_CODE * sizeof(uint16_t));
-      prefix = (uint16_t *)malloc (HT_MAX_CODE * sizeof(uint16_t));
-      stack = (uint16_t *)malloc (BUFFLEN * sizeof(uint16_t));
+      uint32_t codes = (1 << PhraseBits);
 
-      outline = (unsigned char *)malloc(BUFFLEN);
+      alloc.Free (left, codes * sizeof(uint32_t));
+      alloc.Free (right, codes * sizeof(uint32_t));
+      alloc.Free (plen, codes * sizeof(uint32_t));
+      alloc.Free (pstack, 2 * codes * sizeof(uint32_t));
 
-      return (buffer && suffix && prefix && stack && outline);
+      left = right = plen = pstack = NULL;
+      PhraseBits = 0;
   }
 
-  int16_t GetPrefixChar(uint16_t code) const 
+  bool phraseAllocs (void)
   {
-    while (code >= 256)
-    {
-      assert (code < HT_MAX_CODE);
+      if (PhraseBits < MAX_BITS)
+      {
+        freePhrases ();
 
-      code = prefix[code];
-    }
-    return code;
-  }
+        left = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
+        right = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
+        plen = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
+        pstack = (uint32_t *)alloc.Alloc (2 * HT_MAX_CODE * sizeof(uint32_t));
 
-  uint16_t GetCode ()
-  {
-    uint32_t val = *(uint32_t *)(buffer + (CurBufferShift >> 3));
-    val >>= (CurBufferShift & 0x07);
+        PhraseBits = MAX_BITS;
 
-    CurBufferShift += RunningBits;
+        if (!left || !right || !plen || !pstack)
+        {
+          freePhrases ();
+          return false;
+        }
 
-    val &= (uint32_t)EOFCode;
+        for (uint32_t c = 0; c < 256; c++)
+          plen[c] = 1;
+      }
 
-    return (uint16_t)val;
+      return true;
   }
 
-  public:
+  void freeAll (void)
+  {
+      freePhrases ();
+#ifndef LZW_FIXED_FOOTPRINT
+      freeSearch ();
+#endif
+
+      uint32_t codes = (1 << AllocBits);
+
+      alloc.Free (buffer, buffer_size);
+      alloc.Free (suffix, codes * sizeof(uint8_t));
+      alloc.Free (prefix, codes * sizeof(uint32_t));
+      alloc.Free (stack, stack_size);
+      alloc.Free (outline, outline_size);
+
+      buffer = NULL;
+      suffix = stack = NULL;
+      prefix = NULL;
+      outline = NULL;
+      buffer_size = 0;
+      AllocBits = 0;
+      outline_size = stack_size = 0;
+  }
 
-  int Decompress (const char *filename, const char *outfile, int flags)
+  // Allocations are kept between calls; the dictionary, stack and output
+  // line are only reallocated when a stream needs more than any seen before.
+  // A string can be as long as the dictionary is large, so without the
+  // legacy restarts the output line must hold at least that much.
+  bool initialAllocs (uint32_t block, bool continuous)
   {
-    int16_t i = 0;
-    uint32_t len = 0;
-    uint16_t RunCode = 256;
-    uint32_t OldCode = NOT_CODE, CurPrefix;
-    uint32_t code;
-    uint32_t buffer_size = INITIAL_BUFFER;
-    char label[4] = { 0 };
-    uint8_t version = 255;
-    uint32_t StackCount = 0;
+      // a static context's output line fits the longest string, which is
+      // all continuous streams need, and the legacy restart interval.
+      if (ReservedBits)
+        block = BUFFLEN;
+
+      if (AllocBits < MAX_BITS)
+      {
+        uint32_t codes = (1 << AllocBits);
 
-    _mtx.lock(); // we want to allow calling Decompress only once, since it allocates memory, etc. for class instance.
-                 // mutex is released in destructor when all memory is freed.
+        alloc.Free (suffix, codes * sizeof(uint8_t));
+        alloc.Free (prefix, codes * sizeof(uint32_t));
 
-    if (is_big_endian())
+        suffix = (uint8_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint8_t));
+        prefix = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
+
+        if (!suffix || !prefix)
+        {
+          alloc.Free (suffix, HT_MAX_CODE * sizeof(uint8_t));
+          alloc.Free (prefix, HT_MAX_CODE * sizeof(uint32_t));
+          suffix = NULL;
+          prefix = NULL;
+          AllocBits = 0;
+          return false;
+        }
+
+        AllocBits = MAX_BITS;
+      }
+
+      if (!buffer)
+      {
+        buffer = (unsigned char *)alloc.Alloc ( INITIAL_BUFFER );
+        buffer_size = buffer ? INITIAL_BUFFER : 0;
+      }
+
+      uint32_t need_stack = (HT_MAX_CODE > BUFFLEN) ? HT_MAX_CODE : BUFFLEN;
+      uint32_t need_outline = (continuous && block < HT_MAX_CODE) ? HT_MAX_CODE : block;
+
+      if (stack_size < need_stack)
+      {
+        alloc.Free (stack, stack_size);
+        stack = (uint8_t *)alloc.Alloc (need_stack);
+        stack_size = stack ? need_stack : 0;
+      }
+
+      if (outline_size < need_outline)
+      {
+        alloc.Free (outline, outline_size);
+        outline = (unsigned char *)alloc.Alloc (need_outline);
+        outline_size = outline ? need_outline : 0;
+      }
+
+      return (buffer && suffix && prefix && stack && outline);
+  }
+
+  // Codes are unpacked into a small queue, as many at a time as can
+  // be read before the code width may change (RunCode reaching EOFCode)
+  // or the segment ends. A full dictionary keeps its width.
+  void RefillCodes (uint32_t RunCode)
+  {
+    if (subblocks && !last_block && SegmentBits < CurBufferShift + SUBBLOCK_KEEP * 8)
+      MoreCodes ();
+
+    if (broken)
     {
-      fprintf (stderr, "Not supported on big endian machines.\n");
-      return 0;
+      queue[0] = NOT_CODE;
+      qpos = 0;
+      qlen = 1;
+      return;
     }
 
-    if (!(flags & OVERWRITE_FLAG) &&  file_exists(outfile))
+    uint32_t n = (RunCode < HT_CLEAR_CODE) ? EOFCode - RunCode : CODE_QUEUE;
+
+    if (n > CODE_QUEUE) n = CODE_QUEUE;
+
+    uint32_t avail = (SegmentBits > CurBufferShift) ? (SegmentBits - CurBufferShift) / RunningBits : 0;
+
+    if (n > avail) n = avail;
+    if (n == 0) n = 1; // truncated segment; the buffer padding keeps the read in bounds.
+
+    CurBufferShift = kernels.unpack (buffer, CurBufferShift, RunningBits, n, queue);
+    qpos = 0;
+    qlen = n;
+  }
+
+  // Huffman coded values do not depend on the width, so the queue fills up
+  // to the symbol ending the segment. Running off the segment or into a gap
+  // in the table yields NOT_CODE, which the decoders reject.
+  void RefillSymbols (void)
+  {
+    uint32_t n = 0;
+
+    while (n < CODE_QUEUE)
     {
-      // file exists and no overwrite flag set
-      fprintf (stderr, "File \'%s\' already exists. Use overwrite flag.\n", outfile);
-      return 0;
+      if (CurBufferShift >= SegmentBits)
+      {
+        queue[n++] = NOT_CODE;
+        break;
+      }
+
+      uint64_t bits;
+
+      memcpy (&bits, buffer + (CurBufferShift >> 3), sizeof(bits));
+      bits >>= (CurBufferShift & 7);
+
+      uint16_t entry = huff.table[bits & ((1 << HUFF_MAX_LEN) - 1)];
+      unsigned sym = entry >> 4, len = entry & 0x0F;
+
+      if (len == 0)
+      {
+        queue[n++] = NOT_CODE;
+        break;
+      }
+
+      CurBufferShift += len;
+
+      if (sym < 256)
+      {
+        queue[n++] = sym;
+      }
+      else if (sym == HUFF_SYM_CLEAR)
+      {
+        queue[n++] = QUEUED_CLEAR;
+        break;
+      }
+      else if (sym == HUFF_SYM_EOF)
+      {
+        queue[n++] = QUEUED_EOF;
+        break;
+      }
+      else
+      {
+        unsigned nextra;
+        uint32_t base;
+
+        HuffBucket (sym, nextra, base);
+
+        queue[n++] = base + (uint32_t)((bits >> len) & ((1U << nextra) - 1));
+        CurBufferShift += nextra;
+      }
     }
 
-    FILE *fp = fopen(filename, "rb");
+    qpos = 0;
+    qlen = n;
+  }
 
-    if (NULL == fp)
+  uint32_t GetCode (uint32_t RunCode)
+  {
+    if (qpos == qlen)
     {
-      fprintf (stderr, "Cannot open file \'%s\'.\n", filename);
-      fprintf (stderr, "%s\n", strerror(errno));
-      return 0;
+      if (coding == SEGMENT_PACKED)
+        RefillCodes (RunCode);
+      else
+        RefillSymbols ();
     }
 
-    if (4 != fread(label, 1, 4, fp))
+    uint32_t code = queue[qpos++];
+
+    if (coding == SEGMENT_PACKED || code < 256)
+      return code;
+
+    if (code == QUEUED_EOF)
+      return EOFCode;
+
+    if (code == QUEUED_CLEAR)
+      return HT_CLEAR_CODE;
+
+    if (coding == SEGMENT_HUFFMAN)
+      return code;
+
+    // 256 plus the distance back from RunCode.
+    return (code <= RunCode) ? RunCode - (code - 256) : NOT_CODE;
+  }
+
+  // Makes room for len bytes in buffer, and the unpack kernels' padding.
+  bool FitBuffer (uint32_t len, LZWInput *fp)
+  {
+    (void)fp;   // the fixed footprint build has no message.
+
+    if (buffer_size >= len + BUFFER_PADDING)
+      return true;
+
+    if (ReservedBits)
     {
-      printf("Not LZW file!\n");
-      fclose (fp);
-      return 0;
+      LZW_ERROR ("Segment exceeds the static workspace for %d bits. Position: %ld\n", (int)ReservedBits, (long)fp->Position());
+      return false;
     }
 
-    if (memcmp(label, "LZW", 3) != 0)
+    if (len > UINT32_MAX - BUFFER_PADDING)
     {
-      printf("Not LZW file!\n");
-      fclose (fp);
-      return 0;
+      LZW_ERROR ("Segment too long. Position: %ld\n", (long)fp->Position());
+      return false;
     }
 
-    if (1 != fread (&version, 1, 1, fp))
+    unsigned char *ptr = (unsigned char *)alloc.Realloc (buffer, buffer_size, len + BUFFER_PADDING);
+
+    if (!ptr)
     {
-      fprintf(stderr, "Unexpected read error.\n");
-      fclose (fp);
-      return 0;
+      LZW_ERROR ("Failed to reallocate memory: %s\n", strerror (errno));
+      return false;
     }
 
-    if (version != PACKER_VERSION)
+    buffer = ptr;
+    buffer_size = len + BUFFER_PADDING;
+
+    return true;
+  }
+
+  // Appends sub-blocks to the have bytes in buffer until it holds want, or
+  // the segment's last one is in.
+  bool LoadSubBlocks (LZWInput *fp, uint32_t & have, uint32_t want)
+  {
+    while (have < want && !last_block)
     {
-      fprintf(stderr, "Packer/unpacker version mismatch.\n");
-      fclose (fp);
-      return 0;
-    }
+      unsigned char size[2];
 
-    unsigned char infoBits = 0;
+      if (2 != fp->Read (size, 2))
+      {
+        LZW_ERROR ("Unexpected read error. Position: %ld\n", (long)fp->Position());
+        return false;
+      }
 
-    infoBits |= (is_big_endian() ? 1 : 0);
-    infoBits |= VARIABLE_WIDTH ? 2 : 0;
+      uint32_t n = ((size[0] & 0x7F) << 8) | size[1];
 
-    // get infoFlags byte:
-    unsigned char infoFlag = 0;
+      last_block = (0 != (size[0] & 0x80));
 
-    if (1 != fread (&infoFlag, 1, 1, fp))
-    {
-      fprintf(stderr, "Unexpected read error.\n");
-      fclose (fp);
-      return 0;
-    }
+      if (n > UINT32_MAX - have || !FitBuffer (have + n, fp))
+        return false;
 
-    // compare only last 4 bits. fiirst 4 bits have "number of bits".
+      if ((size_t)n != fp->Read (buffer + have, n))
+      {
+        LZW_ERROR ("Unexpected end of file reading %d bytes. Position: %ld\n", (int)n, (long)fp->Position());
+        return false;
+      }
 
-    if ((infoBits & 0x0F) != (infoFlag & 0x0F))
-    {
-      fprintf(stderr, "Encoding flags mismatch.\n");
-      fclose (fp);
-      return 0;
+      have += n;
     }
 
-    int bits = 8 + (infoFlag >> 4);
+    return true;
+  }
 
-    if (!setupConsts (bits))
+  // Skips what is left of the segment; the code that ended it can come
+  // before its last sub-block.
+  bool DrainSegment (LZWInput *fp)
+  {
+    while (!last_block)
     {
-      fprintf(stderr, "Unsupported encoding.\n");
-      fclose (fp);
-      return 0;
+      uint32_t have = 0;
+
+      if (!LoadSubBlocks (fp, have, 1))
+        return false;
     }
 
-    // get expected output size:
+    return true;
+  }
+
+#ifndef LZW_FIXED_FOOTPRINT
+  // Notes where the next segment starts, in the file and in the output of
+  // the stream; the last one read can have sub-blocks left.
+  bool MarkSegment (LZWInput *fp, uint64_t offset)
+  {
+    if (!DrainSegment (fp))
+      return false;
 
-    uint32_t expectedSize = 0;
-    if (4 != fread (&expectedSize, 1, sizeof(uint32_t), fp))
+    if (!index->Add (fp->Position(), offset))
     {
-      fprintf(stderr, "Unexpected read error.\n");
-      fclose (fp);
-      return 0;
+      LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+      return false;
     }
 
-    if (flags & VERBOSE_OUTPUT) 
-      printf ("Expected output size: %ld.\n", (long)expectedSize);
+    return true;
+  }
+#endif
 
-    FILE *fout = fopen(outfile, "wb");
+  // Slides the unread codes to the front of buffer and reads sub-blocks in
+  // after them. Failing that, the code reader returns NOT_CODE from now on.
+  void MoreCodes (void)
+  {
+    uint32_t from = CurBufferShift >> 3;
+    uint32_t have = (SegmentBits >> 3 > from) ? (SegmentBits >> 3) - from : 0;
+
+    memmove (buffer, buffer + from, have);
+    CurBufferShift &= 7;
 
-    if (NULL == fout)
+    if (!LoadSubBlocks (subin, have, SUBBLOCK_KEEP))
     {
-      fprintf (stderr, "Cannot open file \'%s\'\n", outfile);
-      fprintf (stderr, "%s\n", strerror(errno));
-      fclose (fp);
-      return 0;
+      broken = true;
+      last_block = true;
     }
-    
-    if (!initialAllocs ( buffer_size ))
+
+    SegmentBits = have * 8;
+  }
+
+  // Reads the next segment into buffer and restarts the code reader.
+  bool ReadSegment (LZWInput *fp, int flags)
+  {
+    uint32_t len = 0;
+
+    if (subblocks)
     {
-      fclose (fp);
-      fclose (fout);
-      fprintf (stderr, "Cannot allocate memory: %s\n", strerror ( errno ));
-      return 0;
-    }
-    
-    memset(prefix, CLEAR_BYTE, HT_SIZE);
+      if (!DrainSegment (fp))
+        return false;
 
-    while (true)
+      last_block = false;
+      subin = fp;
+
+      if (!LoadSubBlocks (fp, len, entropy ? UINT32_MAX : SUBBLOCK_KEEP))
+        return false;
+    }
+    else
     {
       unsigned char byte1 = 0, byte2 = 0;
       int rb = 0;
-      rb += (int)fread (&byte1, 1, 1, fp);
+      rb += (int)fp->Read (&byte1, 1);
 
       if (1 != rb)
       {
-        fprintf (stderr, "Unexpected read error. Position: %ld\n", ftell(fp));
+        LZW_ERROR ("Unexpected read error. Position: %ld\n", (long)fp->Position());
 
-        fclose (fp);
-        fclose (fout);
-        return 0;
+        return false;
       }
 
       if (byte1 == 255)
       {
-        if (4 != fread (&len, 1, 4, fp))
+        if (4 != fp->Read (&len, 4))
         {
-          fprintf (stderr, "Unexpected read error. Position: %ld\n", ftell(fp));
+          LZW_ERROR ("Unexpected read error. Position: %ld\n", (long)fp->Position());
 
-          fclose (fp);
-          fclose (fout);
-          return 0;
-        }
-
-        if (buffer_size < len)
-        {
-          buffer_size = len;
-          void *saved_ptr = buffer;
-          buffer = (unsigned char *)realloc (buffer, len);
-          
-          if (!buffer)
-          {
-            fprintf (stderr, "Failed to reallocate memory: %s\n", strerror (errno));
-            free (saved_ptr);
-            fclose (fp);
-            fclose (fout);
-            return 0; 
-          }
+          return false;
         }
       }
       else
       {
-        if (1 != fread (&byte2, 1, 1, fp))
+        if (1 != fp->Read (&byte2, 1))
         {
-          fprintf (stderr, "Unexpected read error. Position: %ld\n", ftell(fp));
+          LZW_ERROR ("Unexpected read error. Position: %ld\n", (long)fp->Position());
 
-          fclose (fp);
-          fclose (fout);
-          cleanup (outfile, flags);
-          return 0;
+          return false;
         }
 
         len = byte2 + (byte1 << 8);
       }
 
-      if ((size_t)len != fread(buffer, 1, len, fp))
-      {
-        fprintf (stderr, "Unexpected end of file reading %d bytes. Position: %ld\n", (int)len, ftell (fp));
-        fclose (fp);
-        fclose (fout);
-        return 0;
-      }
-      else 
+      if (!FitBuffer (len, fp))
+        return false;
+
+      if ((size_t)len != fp->Read (buffer, len))
       {
-        if (flags & DIAGNOSTIC_OUTPUT)
-        { 
-          printf ("Read %d bytes\n", (int)len);
-        }
+        LZW_ERROR ("Unexpected end of file reading %d bytes. Position: %ld\n", (int)len, (long)fp->Position());
+        return false;
       }
+    }
 
-      RunCode = 256;
-      RunningBits = 9;
-      EOFCode = 511;
-      OldCode = NOT_CODE;
-      CurBufferShift = 0;
+    if (flags & DIAGNOSTIC_OUTPUT)
+    {
+      LZW_PRINT ("Read %d bytes\n", (int)len);
+    }
 
-      while (true)
-      {
-        code = GetCode();
+    if (!StartSegment (len))
+    {
+      LZW_ERROR ("Corrupt input. Position: %ld\n", (long)fp->Position());
+      return false;
+    }
 
-        if (code == EOFCode)
-        {
-          if (i != (int)fwrite (outline, 1, i, fout))
-          {
-            // write error
-            fclose (fout);
-            fclose (fp);
-            fprintf (stderr, "Write error. Out of disk space?\n");
-            return 0;
-          }
+    return true;
+  }
 
-          fflush (fout);
-          fclose (fp);
+  // Restarts the code reader on the len bytes in buffer; false if the
+  // entropy stage's coding of them is corrupt.
+  bool StartSegment (uint32_t len)
+  {
+    RunningBits = 9;
+    EOFCode = 511;
+    CurBufferShift = 0;
+    SegmentBits = len * 8;
+    qpos = qlen = 0;
 
-          // compare expected size with actual size.
+    coding = SEGMENT_PACKED;
 
-          if (expectedSize != ftell (fout))
-          {
-            fprintf (stderr, "Expected and actual sizes dont match.\n");
-            fclose (fout);
-            return 0;
-          }
+    if (entropy)
+    {
+      size_t used = 0;
 
-          fclose(fout);
+      if (len == 0 || buffer[0] > SEGMENT_HUFFMAN_DISTANCE ||
+          (buffer[0] != SEGMENT_PACKED && !huff.ReadTable (buffer + 1, len - 1, used)))
+        return false;
 
-          return 1;
-        }
-        else if (code == HT_CLEAR_CODE)
-        {
-          memset(prefix, CLEAR_BYTE, HT_SIZE);
-          break;
-        }
-        else
-        {
-          if (code < 256)
-          {
-            assert (i < BUFFLEN);
-            outline[i++] = (uint8_t)code;
-          }
-          else
-          {
-            if (prefix[code] == NOT_CODE)
-            {
-              CurPrefix = OldCode;
-              suffix[RunCode] = GetPrefixChar(OldCode);
+      coding = buffer[0];
+      CurBufferShift = (uint32_t)(1 + used) * 8;
+    }
 
-              assert (StackCount < BUFFLEN);
+    return true;
+  }
 
-              stack[StackCount++] = suffix[RunCode];
-            }
-            else
-              CurPrefix = code;
+  int FinishOutput (LZWOutput *fout, uint32_t i, uint64_t expectedSize)
+  {
+    if (!fout->Write (outline, i) || !fout->Finish())
+    {
+      // write error, unless the consumer stopped us.
+      if (!fout->Stopped ())
+        LZW_ERROR ("Write error. Out of disk space?\n");
+      return 0;
+    }
 
-            while (CurPrefix > 255)
-            {
-              assert (StackCount < BUFFLEN);
+    // compare expected size with actual size.
 
-              assert (CurPrefix < HT_MAX_CODE);
+    if (expectedSize != fout->Position())
+    {
+      LZW_ERROR ("Expected and actual sizes dont match.\n");
+      return 0;
+    }
 
-              stack[StackCount++] = suffix[CurPrefix];
-              CurPrefix = prefix[CurPrefix];
-            }
+    return 1;
+  }
 
-            assert (StackCount < BUFFLEN);
-  
-            stack[StackCount++] = CurPrefix;
+  // Puts back the codes read ahead at the old width. Huffman coded
+  // values do not depend on it and stay queued.
+  void DropQueue (void)
+  {
+    if (coding != SEGMENT_PACKED)
+      return;
 
-            while (StackCount != 0)
-            {
-              assert (i < BUFFLEN);
-              outline[i++] = (uint8_t)stack[--StackCount];
-            }
-          }
+    CurBufferShift -= (qlen - qpos) * RunningBits;
+    qlen = qpos;
+  }
 
-          if ((OldCode != NOT_CODE))
-          {
-            prefix[RunCode] = OldCode;
-            
-            if (code != RunCode)
-              suffix[RunCode] = GetPrefixChar(code);
+  // Writes the first n bytes of code's phrase. Walking left costs nothing
+  // to remember; each time the phrase also needs bytes of the right half,
+  // that half is stacked. Codes fall along any path, so the stack is bounded
+  // by the dictionary size.
+  bool ExpandPhrase (LZWOutput *fout, uint32_t code, uint32_t n, uint32_t & i)
+  {
+    uint32_t depth = 0;
 
-            RunCode++;
+    while (true)
+    {
+      while (code >= 256)
+      {
+        uint32_t l = left[code];
 
-            if (RunCode == EOFCode)
-            {
-              EOFCode = (EOFCode << 1) + 1;
-              RunningBits++;
+        if (n > plen[l])
+        {
+          pstack[depth++] = right[code];
+          pstack[depth++] = n - plen[l];
+          n = plen[l];
+        }
 
-              if (flags & DIAGNOSTIC_OUTPUT)
-              {
-                printf ("new EOF: %d\n", EOFCode);
-              }
-            }
-          }
+        code = l;
+      }
 
-          OldCode = code;
+      if (i >= flush_at && !FlushOutline (fout, i))
+        return false;
 
-          if (i == BUFFLEN)
-          {
-            if (BUFFLEN != fwrite(outline, 1, BUFFLEN, fout))
-            {
-              // write error
-              fclose (fout);
-              fclose (fp);
-              fprintf (stderr, "Write error. Out of disk space?\n");
-              return 0;
-            }
+      outline[i++] = (uint8_t)code;
 
-            i = 0;
-            OldCode = NOT_CODE;
+      if (depth == 0)
+        return true;
+
+      n = pstack[--depth];
+      code = pstack[--depth];
+    }
+  }
+
+  int DecompressPhrases (LZWInput *fp, LZWOutput *fout, uint64_t expectedSize, int engine, int flags)
+  {
+    static const uint32_t PHRASE_LIMIT = 1 << 30;   // no sane stream gets near; guards the sums below.
+
+    uint32_t i = 0;
+
+    if (!phraseAllocs ())
+    {
+      LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+      return 0;
+    }
+
+    while (true)
+    {
+#ifndef LZW_FIXED_FOOTPRINT
+      if (index && !MarkSegment (fp, fout->Position() + i))
+        return 0;
+#endif
+
+      if (!ReadSegment (fp, flags))
+        return 0;
+
+      uint32_t RunCode = 256;
+      uint32_t prev = NOT_CODE;
+
+      while (true)
+      {
+        uint32_t code = GetCode (RunCode);
+
+        if (code == EOFCode)
+          return DrainSegment (fp) && FinishOutput (fout, i, expectedSize);
+
+        if (code == HT_CLEAR_CODE)
+          break;
+
+        if (code >= RunCode)
+        {
+          LZW_ERROR ("Corrupt input. Position: %ld\n", (long)fp->Position());
+          return 0;
+        }
+
+        if (!ExpandPhrase (fout, code, plen[code], i))
+          return 0;
+
+        if (prev != NOT_CODE)
+        {
+          if (plen[prev] + plen[code] > PHRASE_LIMIT)
+          {
+            LZW_ERROR ("Corrupt input. Position: %ld\n", (long)fp->Position());
+            return 0;
+          }
+
+          // LZMW adds prev + code; LZAP prev + every prefix of code.
+          uint32_t k = (engine == LZW_ENGINE_LZAP) ? 1 : plen[code];
+
+          for (; k <= plen[code] && RunCode < HT_CLEAR_CODE; k++)
+          {
+            left[RunCode] = prev;
+            right[RunCode] = code;
+            plen[RunCode] = plen[prev] + k;
+            RunCode++;
+          }
+
+          while (RunCode >= EOFCode)
+          {
+            DropQueue ();
+            EOFCode = (EOFCode << 1) + 1;
+            RunningBits++;
+
+            if (flags & DIAGNOSTIC_OUTPUT)
+            {
+              LZW_PRINT ("new EOF: %d\n", EOFCode);
+            }
+          }
+        }
+
+        prev = code;
+      }
+    }
+  }
+
+#ifndef LZW_FIXED_FOOTPRINT
+  void freeSearch (void)
+  {
+      uint32_t codes = (1 << SearchBits);
+
+      alloc.Free (slen, codes * sizeof(uint32_t));
+      alloc.Free (socc, codes * sizeof(uint32_t));
+      alloc.Free (sD, codes * sizeof(uint64_t));
+      alloc.Free (sI, codes * sizeof(uint64_t));
+      alloc.Free (sS, codes * sizeof(uint64_t));
+      alloc.Free (sfirst, codes * sizeof(uint8_t));
+      alloc.Free (hits, hits_size * sizeof(uint64_t));
+
+      slen = socc = NULL;
+      sD = sI = sS = NULL;
+      sfirst = NULL;
+      SearchBits = 0;
+      hits = NULL;
+      hits_size = hits_count = 0;
+  }
+
+  // Sets up the code search of a stream with header's coding: the
+  // dictionary, segment buffer and search tables, with the single bytes
+  // filled in for pattern.
+  bool PrepareSearch (const LZWHeader & header, const LZWPattern & pattern)
+  {
+      Reset();
+
+      if (!setupConsts (header.bits))
+        return false;
+
+      entropy = (0 != (header.features & FEATURE_ENTROPY));
+      subblocks = false;
+
+      if (!initialAllocs (header.blockSize, true))
+        return false;
+
+      if (SearchBits < MAX_BITS)
+      {
+        freeSearch ();
+
+        slen = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
+        socc = (uint32_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint32_t));
+        sD = (uint64_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint64_t));
+        sI = (uint64_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint64_t));
+        sS = (uint64_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint64_t));
+        sfirst = (uint8_t *)alloc.Alloc (HT_MAX_CODE * sizeof(uint8_t));
+
+        SearchBits = MAX_BITS;
+
+        if (!slen || !socc || !sD || !sI || !sS || !sfirst)
+        {
+          freeSearch ();
+          return false;
+        }
+      }
+
+      const uint32_t m = pattern.Length();
+      const uint64_t last = 1ULL << (m - 1);
+
+      for (uint32_t c = 0; c < 256; c++)
+      {
+        uint64_t mask = pattern.Mask (c);
+
+        slen[c] = 1;
+        sfirst[c] = (uint8_t)c;
+        sD[c] = mask & 1;
+        sI[c] = mask;
+        sS[c] = (m > 1 && (mask & last)) ? 2 : 0;
+        socc[c] = (sD[c] & last) ? c : NOT_CODE;
+      }
+
+      return true;
+  }
+
+  // Entry code: entry p followed by byte ch. Its masks follow from p's
+  // the way a Shift-And state follows from the one before a byte.
+  void AddSearchEntry (uint32_t code, uint32_t p, uint8_t ch, uint32_t m)
+  {
+      const uint64_t last = 1ULL << (m - 1);
+      const uint64_t mask = sI[ch];   // the pattern bytes equal to ch.
+
+      prefix[code] = p;
+      suffix[code] = ch;
+      slen[code] = slen[p] + 1;
+      sfirst[code] = sfirst[p];
+      sD[code] = ((sD[p] << 1) | 1) & mask;
+      sI[code] = (sI[p] << 1) & mask;
+      sS[code] = sS[p] | ((slen[code] < m && (sI[code] & last)) ? (1ULL << slen[code]) : 0);
+      socc[code] = (sD[code] & last) ? code : socc[p];
+  }
+
+  bool AddHit (uint64_t offset)
+  {
+      if (hits_count == hits_size)
+      {
+        size_t grown = hits_size ? 2 * hits_size : 4096;
+        uint64_t *ptr = (uint64_t *)alloc.Realloc (hits, hits_size * sizeof(uint64_t), grown * sizeof(uint64_t));
+
+        if (!ptr)
+          return false;
+
+        hits = ptr;
+        hits_size = grown;
+      }
+
+      hits[hits_count++] = offset;
+      return true;
+  }
+
+  // Copies the first bytes of code's string to the segment's head, as
+  // many as it still wants.
+  void CopyHead (uint32_t code, uint32_t want, LZWSegmentHits & seg)
+  {
+      uint32_t n = want - seg.headLength;
+
+      if (n > slen[code])
+        n = slen[code];
+
+      while (slen[code] > n)
+        code = prefix[code];
+
+      for (uint32_t k = n; k-- > 0; code = prefix[code])
+        seg.head[seg.headLength + k] = (code < 256) ? (uint8_t)code : suffix[code];
+
+      seg.headLength += n;
+  }
+
+  // Searches the segment whose codes are at data (seg.size bytes) for
+  // pattern, as if it started the stream. Failures are only recorded: the
+  // segment may lie past the end of the stream, when the driver never
+  // looks at it.
+  void SearchSegment (const unsigned char *data, const LZWPattern & pattern, LZWSegmentHits & seg)
+  {
+      const uint32_t m = pattern.Length();
+
+      seg.status = SEGMENT_NO_MEMORY;
+      seg.length = seg.state = 0;
+      seg.headLength = 0;
+      seg.first = hits_count;
+      seg.count = 0;
+      seg.last = false;
+
+      if (buffer_size < seg.size + BUFFER_PADDING)
+      {
+        unsigned char *ptr = (unsigned char *)alloc.Alloc (seg.size + BUFFER_PADDING);
+
+        if (!ptr)
+          return;
+
+        alloc.Free (buffer, buffer_size);
+        buffer = ptr;
+        buffer_size = seg.size + BUFFER_PADDING;
+      }
+
+      memcpy (buffer, data, seg.size);
+
+      seg.status = SEGMENT_CORRUPT;
+
+      if (!StartSegment (seg.size))
+        return;
+
+      uint32_t RunCode = 256;
+      uint32_t OldCode = NOT_CODE;
+      uint64_t pos = 0, state = 0;
+
+      while (true)
+      {
+        uint32_t code = GetCode (RunCode);
+
+        if (code == EOFCode || code == HT_CLEAR_CODE)
+        {
+          seg.last = (code == EOFCode);
+          break;
+        }
+
+        if (code >= HT_MAX_CODE || (code >= RunCode && (code != RunCode || OldCode == NOT_CODE)))
+          return;
+
+        if (OldCode != NOT_CODE)
+        {
+          // the packer always clears before the dictionary fills up.
+          if (RunCode >= HT_CLEAR_CODE)
+            return;
+
+          // code may be the entry being added, OldCode's string and its first byte.
+          AddSearchEntry (RunCode, OldCode, sfirst[code < RunCode ? code : OldCode], m);
+
+          RunCode++;
+
+          if (RunCode == EOFCode)
+          {
+            EOFCode = (EOFCode << 1) + 1;
+            RunningBits++;
+          }
+        }
+
+        uint32_t len = slen[code];
+
+        // matches running into the code: its first j bytes end the pattern
+        // and the state before it holds the pattern's first m - j.
+        if (state && sS[code])
+        {
+          for (uint64_t cross = sS[code] & (reverseBits (state) >> (64 - m)); cross; cross &= cross - 1)
+          {
+            if (!AddHit (pos + __builtin_ctzll (cross) - m))
+            {
+              seg.status = SEGMENT_NO_MEMORY;
+              return;
+            }
+          }
+        }
+
+        // matches inside it, from the longest prefix that ends with one down.
+        size_t from = hits_count;
+
+        for (uint32_t e = socc[code]; e != NOT_CODE; e = (e < 256) ? NOT_CODE : socc[prefix[e]])
+        {
+          if (!AddHit (pos + slen[e] - m))
+          {
+            seg.status = SEGMENT_NO_MEMORY;
+            return;
+          }
+        }
+
+        std::reverse (hits + from, hits + hits_count);
+
+        if (seg.headLength < m - 1)
+          CopyHead (code, m - 1, seg);
+
+        state = ((len < 64) ? ((state << len) & sI[code]) : 0) | sD[code];
+        pos += len;
+        OldCode = code;
+      }
+
+      seg.length = pos;
+      seg.state = state;
+      seg.count = hits_count - seg.first;
+      seg.status = SEGMENT_FOUND;
+  }
+
+  // Where the segment whose length bytes are at seg.offset has its codes;
+  // false when the input ends first.
+  static bool FrameSegment (MemoryInput & input, LZWSegmentHits & seg)
+  {
+      const unsigned char *data = input.Data();
+      uint64_t size = (uint64_t)input.Size(), at = seg.offset;
+
+      if (at >= size || size - at < 2)
+        return false;
+
+      if (data[at] == 255)
+      {
+        if (size - at < 5)
+          return false;
+
+        memcpy (&seg.size, data + at + 1, 4);
+        seg.payload = at + 5;
+      }
+      else
+      {
+        seg.size = (data[at] << 8) | data[at + 1];
+        seg.payload = at + 2;
+      }
+
+      return seg.size <= size - seg.payload;
+  }
+
+  // Searches segs[0..n) on the workers, each taking the next one left.
+  static void RunSearches (MemoryInput & input, const LZWPattern & pattern, LZWUnpacker **workers,
+                           unsigned nworkers, LZWSegmentHits *segs, uint32_t n)
+  {
+      std::atomic<uint32_t> next (0);
+
+      auto work = [&] (unsigned w)
+      {
+        LZWUnpacker *u = workers[w];
+        uint32_t k;
+
+        u->hits_count = 0;
+
+        while ((k = next++) < n)
+        {
+          segs[k].worker = w;
+          u->SearchSegment (input.Data() + segs[k].payload, pattern, segs[k]);
+        }
+      };
+
+      std::vector<std::thread> helpers;
+
+      try
+      {
+        for (unsigned w = 1; w < nworkers && w < n; w++)
+          helpers.emplace_back (work, w);
+      }
+      catch (const std::exception &)
+      {
+        // fewer helpers; the segments still all get searched.
+      }
+
+      work (0);
+
+      for (auto & t : helpers)
+        t.join ();
+  }
+
+  // The code search of one stream. Segments start with an empty dictionary,
+  // so they are framed ahead, a batch at a time, searched in parallel and
+  // joined in order. Whether a segment ends the stream is only known once
+  // it is searched; the rest of its batch is then dropped.
+  int SearchCodes (MemoryInput & input, const LZWHeader & header, LZWPattern & pattern, LZWUnpacker **workers,
+                   unsigned nworkers, LZWSegmentHits *segs, uint32_t batch)
+  {
+      uint64_t start = pattern.Position();
+      uint64_t at = input.Position();
+
+      for (unsigned w = 0; w < nworkers; w++)
+      {
+        if (!workers[w]->PrepareSearch (header, pattern))
+        {
+          LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+          return 0;
+        }
+      }
+
+      while (true)
+      {
+        uint32_t n = 0;
+
+        for (segs[0].offset = at; n < batch && FrameSegment (input, segs[n]); n++)
+        {
+          if (n + 1 < batch)
+            segs[n + 1].offset = segs[n].payload + segs[n].size;
+        }
+
+        if (n == 0)
+        {
+          LZW_ERROR ("Unexpected end of file. Position: %ld\n", (long)at);
+          return 0;
+        }
+
+        RunSearches (input, pattern, workers, nworkers, segs, n);
+
+        for (uint32_t k = 0; k < n; k++)
+        {
+          const LZWSegmentHits & seg = segs[k];
+
+          at = seg.payload + seg.size;
+
+          if (seg.status == SEGMENT_CORRUPT)
+          {
+            LZW_ERROR ("Corrupt input. Position: %ld\n", (long)at);
+            return 0;
+          }
+
+          if (seg.status == SEGMENT_NO_MEMORY)
+          {
+            LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( ENOMEM ));
+            return 0;
+          }
+
+          // a stop from the callback is not an error.
+          if (!pattern.Join (seg, workers[seg.worker]->hits + seg.first))
+            return 1;
+
+          if (seg.last)
+          {
+            input.Seek (at);
+
+            if (pattern.Position() - start != header.inputSize)
+            {
+              LZW_ERROR ("Expected and actual sizes dont match.\n");
+              return 0;
+            }
+
+            return 1;
+          }
+        }
+      }
+  }
+
+  // One stream, its header just read: on the codes when the pattern and
+  // the stream's stages allow, otherwise unpacked into the pattern.
+  int SearchStream (MemoryInput & input, const LZWHeader & header, LZWPattern & pattern, LZWUnpacker **workers,
+                    unsigned nworkers, LZWSegmentHits *segs, uint32_t batch, int flags)
+  {
+      bool codes = pattern.Bitwise() && header.engine == LZW_ENGINE_LZW && header.filterCount == 0 &&
+                   (header.features & (FEATURE_RLE | FEATURE_BLOCKS | FEATURE_SUBBLOCKS | FEATURE_LRU)) == FEATURE_BLOCKS;
+
+      if (!codes)
+      {
+        ScanOutput scan (pattern);
+
+        return DecompressStream (input, scan, header, flags) || pattern.Stopped();
+      }
+
+      if (!setupConsts (header.bits))
+      {
+        LZW_ERROR ("Unsupported encoding.\n");
+        return 0;
+      }
+
+      return SearchCodes (input, header, pattern, workers, nworkers, segs, batch);
+  }
+#endif // LZW_FIXED_FOOTPRINT
+
+  bool FlushOutline (LZWOutput *fout, uint32_t & i)
+  {
+    if (!fout->Write (outline, i))
+    {
+      // write error, unless the consumer stopped us.
+      if (!fout->Stopped ())
+        LZW_ERROR ("Write error. Out of disk space?\n");
+      return false;
+    }
+
+    i = 0;
+    return true;
+  }
+
+  // compress(1) .Z input (COMPRESS_FORMAT; see the packer for the layout).
+  // Codes are unpacked a group of eight at a time, from a whole group of
+  // input bytes; a width change or a Z_CLEAR leaves the rest of the group
+  // as padding. The checks and quirks are those of compress(1), so that
+  // whatever it reads is read the same: the dictionary takes an entry
+  // after a Z_CLEAR only from the second code on, and a 9 bit stream
+  // widens to 10 bits once it is full.
+  int DecompressZ (LZWInput & input, LZWOutput & output, int flags)
+  {
+    unsigned char magic[3];
+
+    Reset();
+
+    if (3 != input.Read (magic, 3) || magic[0] != 0x1F || magic[1] != 0x9D)
+    {
+      LZW_PRINT ("Not .Z file!\n");
+      return 0;
+    }
+
+    int bits = magic[2] & 0x1F;
+    bool block = (0 != (magic[2] & 0x80));
+
+    if (bits > Z_MAX_BITS || !setupConsts (bits))
+    {
+      LZW_ERROR ("Unsupported encoding.\n");
+      return 0;
+    }
+
+    if (ReservedBits && (uint32_t)bits > ReservedBits)
+    {
+      LZW_ERROR ("%d bit codes do not fit in the context's workspace.\n", bits);
+      return 0;
+    }
+
+    if (!initialAllocs (BUFFLEN, true))
+    {
+      LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+      return 0;
+    }
+
+    if (flags & DIAGNOSTIC_OUTPUT)
+      LZW_PRINT ("Code unpacker: %s\n", kernels.name);
+
+    LZWOutput *fout = &output;
+
+    flush_at = (head < outline_size) ? (head ? (uint32_t)head : 1) : outline_size;
+
+    const uint32_t capacity = buffer_size - BUFFER_PADDING;
+    uint32_t have = 0, at = 0;    // bytes in buffer, and where the current group starts.
+    bool ended = false;
+
+    uint32_t n = 9, MaxCode = 511;
+    uint32_t FreeCode = block ? Z_CLEAR + 1 : 256;
+    uint32_t OldCode = NOT_CODE, FirstChar = 0, CurPrefix;
+    uint32_t StackCount = 0;
+    uint32_t i = 0;
+
+    while (true)
+    {
+      if (have - at < n && !ended)
+      {
+        memmove (buffer, buffer + at, have - at);
+        have -= at;
+        at = 0;
+
+        size_t got = input.Read (buffer + have, capacity - have);
+
+        ended = (got < capacity - have);
+        have += (uint32_t)got;
+
+        if (input.Failed())
+        {
+          LZW_ERROR ("Read error.\n");
+          return 0;
+        }
+      }
+
+      // trailing bits short of a code are padding.
+      uint32_t count = (have - at >= n) ? 8 : ((have - at) * 8) / n;
+
+      if (count == 0)
+        break;
+
+      kernels.unpack (buffer, at * 8, n, count, queue);
+
+      uint32_t next = at + n;
+
+      for (uint32_t k = 0; k < count; k++)
+      {
+        if (FreeCode > MaxCode)
+        {
+          // a group cut short; at its start, it is read again wider.
+          if (k == 0)
+            next = at;
+
+          n++;
+          MaxCode = (n == MAX_BITS) ? HT_MAX_CODE : (1U << n) - 1;
+          break;
+        }
+
+        uint32_t code = queue[k];
+
+        if (OldCode == NOT_CODE)
+        {
+          if (code > 255)
+          {
+            LZW_ERROR ("Corrupt input. Position: %ld\n", (long)input.Position());
+            return 0;
+          }
+
+          if (i >= flush_at && !FlushOutline (fout, i))
+            return 0;
+
+          outline[i++] = (uint8_t)code;
+          OldCode = FirstChar = code;
+          continue;
+        }
+
+        if (code == Z_CLEAR && block)
+        {
+          FreeCode = Z_CLEAR;
+          n = 9;
+          MaxCode = 511;
+          break;
+        }
+
+        if (code >= FreeCode)
+        {
+          // with a full table, FreeCode is past the last entry, and no
+          // entry is being made that code could stand for.
+          if (code > FreeCode || FreeCode == HT_MAX_CODE)
+          {
+            LZW_ERROR ("Corrupt input. Position: %ld\n", (long)input.Position());
+            return 0;
+          }
+
+          stack[StackCount++] = (uint8_t)FirstChar;
+          CurPrefix = OldCode;
+        }
+        else
+          CurPrefix = code;
+
+        while (CurPrefix > 255)
+        {
+          assert (StackCount < stack_size);
+
+          stack[StackCount++] = suffix[CurPrefix];
+          CurPrefix = prefix[CurPrefix];
+        }
+
+        assert (StackCount < stack_size);
+
+        stack[StackCount++] = (uint8_t)CurPrefix;
+        FirstChar = CurPrefix;
+
+        if (i + StackCount > flush_at && !FlushOutline (fout, i))
+          return 0;
+
+        while (StackCount != 0)
+          outline[i++] = stack[--StackCount];
+
+        if (FreeCode < HT_MAX_CODE)
+        {
+          prefix[FreeCode] = OldCode;
+          suffix[FreeCode] = (uint8_t)FirstChar;
+          FreeCode++;
+        }
+
+        OldCode = code;
+      }
+
+      at = (next < have) ? next : have;
+    }
+
+    if (!fout->Write (outline, i) || !fout->Finish())
+    {
+      if (!fout->Stopped ())
+        LZW_ERROR ("Write error. Out of disk space?\n");
+      return 0;
+    }
+
+    return 1;
+  }
+
+  public:
+
+  const lzw_allocator *Allocator (void) const { return &alloc.Get(); }
+
+  size_t PeakMemory (void) const { return alloc.Peak(); }
+  void SetMemoryLimit (size_t bytes) { alloc.SetLimit (bytes); }
+
+  bool SetIOBlockSize (size_t size)
+  {
+    if (!ValidIOBlock (size))
+      return false;
+
+    io_block = (uint32_t)size;
+    return true;
+  }
+
+  // Static contexts: sets aside all that any stream of up to bits can use,
+  // so that later calls allocate only the RLE and filter blocks, on top.
+  bool Reserve (int bits)
+  {
+    if (!setupConsts (bits))
+      return false;
+
+    ReservedBits = bits;
+
+    buffer_size = (uint32_t)lzw_footprint::unpack_segment (bits);
+    buffer = (unsigned char *)alloc.Alloc (buffer_size);
+
+    if (!buffer)
+    {
+      buffer_size = 0;
+      return false;
+    }
+
+    return initialAllocs (BUFFLEN, true) && phraseAllocs ();
+  }
+
+  // Returns the decoder to its initial state. Allocated memory is kept so
+  // that the instance can be reused by the next Decompress call.
+  void Reset (void)
+  {
+    CurBufferShift = 0;
+    RunningBits = 9;
+    EOFCode = 511;
+    qpos = qlen = 0;
+    last_block = true;
+    broken = false;
+  }
+
+#ifndef LZW_FIXED_FOOTPRINT
+  int Decompress (const char *filename, const char *outfile, int flags, uint64_t limit = NO_HEAD)
+  {
+    if (!(flags & OVERWRITE_FLAG) &&  file_exists(outfile))
+    {
+      // file exists and no overwrite flag set
+      LZW_ERROR ("File \'%s\' already exists. Use overwrite flag.\n", outfile);
+      return 0;
+    }
+
+    LZWInput *in = OpenInput (filename, flags, alloc, io_block);
+
+    if (NULL == in)
+      return 0;
+
+    LZWOutput *out = OpenOutput (outfile, flags, alloc, io_block);
+
+    if (NULL == out)
+    {
+      delete in;
+      return 0;
+    }
+
+    int ret = (limit == NO_HEAD) ? Decompress (*in, *out, flags) : DecompressPrefix (*in, *out, limit, flags);
+
+    delete in;
+    delete out;
+
+    return ret;
+  }
+#endif // LZW_FIXED_FOOTPRINT
+
+  // Decodes until the first n bytes are out. The output is flushed as soon
+  // as the prefix may be complete, and no later segment is read.
+  int DecompressPrefix (LZWInput & input, LZWOutput & output, uint64_t n, int flags)
+  {
+    PrefixOutput out (output, n);
+
+    head = n;
+
+    int ret = Decompress (input, out, flags);
+
+    head = NO_HEAD;
+
+    if (!ret && out.Reached ())
+    {
+      ret = output.Finish () ? 1 : 0;
+
+      if (!ret)
+        LZW_ERROR ("Write error. Out of disk space?\n");
+    }
+
+    return ret;
+  }
+
+  int Decompress (LZWInput & input, LZWOutput & output, int flags)
+  {
+    if (is_big_endian())
+    {
+      LZW_ERROR ("Not supported on big endian machines.\n");
+      return 0;
+    }
+
+    if (flags & COMPRESS_FORMAT)
+      return DecompressZ (input, output, flags);
+
+    LZWHeader header;
+
+    if (!header.Read (input))
+      return 0;
+
+    if (!(header.features & FEATURE_APPEND))
+      return DecompressStream (input, output, header, flags);
+
+    // the streams appended after the first one each have a header of their
+    // own, and the first header counts the bytes of all of them.
+    uint64_t start = output.Position();
+    uint64_t total = header.totalSize;
+    bool ended = false;
+
+    while (!ended)
+    {
+      MemberOutput member (output);
+
+      if (!DecompressStream (input, member, header, flags))
+        return 0;
+
+      if (!header.ReadNext (input, ended) && !ended)
+        return 0;
+    }
+
+    if (!output.Finish())
+    {
+      if (!output.Stopped ())
+        LZW_ERROR ("Write error. Out of disk space?\n");
+      return 0;
+    }
+
+    if (output.Position() - start != total)
+    {
+      LZW_ERROR ("Expected and actual sizes dont match.\n");
+      return 0;
+    }
+
+    return 1;
+  }
+
+#ifndef LZW_FIXED_FOOTPRINT
+  // Searches what input unpacks to for pattern (see lzw_search). This
+  // unpacker is the first of the workers; the others are made for the call.
+  int Search (MemoryInput & input, LZWPattern & pattern, int jobs, int flags)
+  {
+    if (is_big_endian())
+    {
+      LZW_ERROR ("Not supported on big endian machines.\n");
+      return 0;
+    }
+
+    LZWHeader header;
+
+    if (!header.Read (input))
+      return 0;
+
+    if (jobs < 1)
+      jobs = (int)std::thread::hardware_concurrency ();
+
+    if (jobs < 1)
+      jobs = 1;
+
+    unsigned nworkers = (unsigned)jobs;
+    LZWUnpacker **workers = (LZWUnpacker **)alloc.Alloc (nworkers * sizeof (LZWUnpacker *));
+
+    if (!workers)
+    {
+      LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+      return 0;
+    }
+
+    workers[0] = this;
+
+    for (unsigned w = 1; w < nworkers; w++)
+    {
+      void *mem = alloc.Alloc (sizeof (LZWUnpacker));
+
+      if (!mem)
+      {
+        nworkers = w;   // fewer workers.
+        break;
+      }
+
+      workers[w] = new (mem) LZWUnpacker (&alloc.Get());
+      workers[w]->SetMemoryLimit (alloc.Limit());
+    }
+
+    uint32_t batch = 2 * nworkers;
+    LZWSegmentHits *segs = (LZWSegmentHits *)alloc.Alloc (batch * sizeof (LZWSegmentHits));
+
+    uint64_t total = header.totalSize;
+    bool appended = (0 != (header.features & FEATURE_APPEND));
+    bool ended = !appended;
+    int ret = 0;
+
+    if (!segs)
+      LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+
+    while (segs)
+    {
+      ret = SearchStream (input, header, pattern, workers, nworkers, segs, batch, flags);
+
+      if (!ret || pattern.Stopped())
+        break;
+
+      if (appended && !header.ReadNext (input, ended) && !ended)
+        ret = 0;
+
+      if (!ret || ended)
+        break;
+    }
+
+    if (ret && !pattern.Stopped() && pattern.Position() != total)
+    {
+      LZW_ERROR ("Expected and actual sizes dont match.\n");
+      ret = 0;
+    }
+
+    for (unsigned w = 1; w < nworkers; w++)
+    {
+      workers[w]->~LZWUnpacker();
+      alloc.Free (workers[w], sizeof (LZWUnpacker));
+    }
+
+    alloc.Free (segs, batch * sizeof (LZWSegmentHits));
+    alloc.Free (workers, (unsigned)jobs * sizeof (LZWUnpacker *));
+
+    return ret;
+  }
+
+  // Unpacks input into nothing, noting in idx where each segment starts
+  // (see lzw_open). Streams with RLE or filters carry state from segment
+  // to segment, and legacy ones restart by the line, so each is noted as
+  // a whole.
+  int Index (MemoryInput & input, LZWSegmentIndex & idx)
+  {
+    if (is_big_endian())
+    {
+      LZW_ERROR ("Not supported on big endian machines.\n");
+      return 0;
+    }
+
+    LZWHeader header;
+
+    if (!header.Read (input))
+      return 0;
+
+    WindowOutput sink (NULL, 0, 0);
+    uint64_t total = header.totalSize;
+    bool ended = !(header.features & FEATURE_APPEND);
+
+    while (true)
+    {
+      MemberOutput member (sink);
+
+      bool whole = header.filterCount || (header.features & FEATURE_RLE) || !(header.features & FEATURE_BLOCKS);
+
+      if (!idx.AddStream (header, sink.Position()) || (whole && !idx.Add (input.Position(), 0)))
+      {
+        LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+        return 0;
+      }
+
+      index = whole ? NULL : &idx;
+
+      int ret = DecompressStream (input, member, header, 0);
+
+      index = NULL;
+
+      if (!ret)
+        return 0;
+
+      idx.EndStream (sink.Position());
+
+      if (ended)
+        return 1;
+
+      if (!header.ReadNext (input, ended) && !ended)
+        return 0;
+
+      if (ended)
+        break;
+    }
+
+    if (sink.Position() != total)
+    {
+      LZW_ERROR ("Expected and actual sizes dont match.\n");
+      return 0;
+    }
+
+    return 1;
+  }
+
+  // Unpacks the first n bytes from where entry k of idx starts to output.
+  int ReadEntry (MemoryInput & input, const LZWSegmentIndex & idx, uint32_t k, LZWOutput & output, uint64_t n)
+  {
+    const LZWIndexEntry & e = idx.Entry (k);
+    const LZWIndexStream & s = idx.Stream (e.stream);
+
+    // the stream as if it started with the entry.
+    LZWHeader header = s.header;
+    header.inputSize = s.end - e.offset;
+
+    PrefixOutput out (output, n);
+
+    input.Seek (e.packed);
+    head = n;
+
+    int ret = DecompressStream (input, out, header, 0);
+
+    head = NO_HEAD;
+
+    return (ret || out.Reached ()) ? 1 : 0;
+  }
+#endif // LZW_FIXED_FOOTPRINT
+
+  int DecompressStream (LZWInput & input, LZWOutput & output, const LZWHeader & header, int flags)
+  {
+    uint32_t i = 0;
+    uint32_t RunCode = 256;
+    uint32_t OldCode = NOT_CODE, CurPrefix;
+    uint32_t FirstChar = 0;   // first byte of the last decoded string, i.e. of OldCode.
+    uint32_t code;
+    uint32_t StackCount = 0;
+    uint32_t Evicted = NOT_CODE;   // FEATURE_LRU: code of the next phrase once the dictionary is full.
+
+    LZWInput *fp = &input;
+    LZWOutput *fout = &output;
+
+    Reset();
+
+    if (!setupConsts (header.bits))
+    {
+      LZW_ERROR ("Unsupported encoding.\n");
+      return 0;
+    }
+
+    if (ReservedBits && (uint32_t)header.bits > ReservedBits)
+    {
+      LZW_ERROR ("%d bit codes do not fit in the context's workspace.\n", header.bits);
+      return 0;
+    }
+
+    uint64_t expectedSize = header.inputSize;
+
+    std::optional<FilterOutput> filtered;
+
+    if (header.filterCount)
+    {
+      filtered.emplace (output, header.filters, header.filterCount, alloc);
+
+      if (!filtered->Ok())
+      {
+        LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+        return 0;
+      }
+
+      fout = &*filtered;
+    }
+
+    std::optional<RLEOutput> rle;
+
+    if (header.features & FEATURE_RLE)
+    {
+      rle.emplace (*fout, alloc);
+
+      if (!rle->Ok())
+      {
+        LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+        return 0;
+      }
+
+      fout = &*rle;
+    }
+
+    if (flags & VERBOSE_OUTPUT) 
+      LZW_PRINT ("Expected output size: %llu.\n", (unsigned long long)expectedSize);
+
+    if (flags & DIAGNOSTIC_OUTPUT)
+      LZW_PRINT ("Code unpacker: %s\n", kernels.name);
+
+    bool continuous = (0 != (header.features & FEATURE_BLOCKS));
+
+    entropy = (0 != (header.features & FEATURE_ENTROPY));
+    subblocks = (0 != (header.features & FEATURE_SUBBLOCKS));
+    lru = (0 != (header.features & FEATURE_LRU));
+
+    if (!initialAllocs (header.blockSize, continuous) || (lru && !phraseAllocs ()))
+    {
+      LZW_ERROR ("Cannot allocate memory: %s\n", strerror ( errno ));
+      return 0;
+    }
+
+    if (lru)
+      leaves.Attach (pstack, left);
+    
+    // legacy files count their restarts in whole output lines.
+    flush_at = (continuous && head < outline_size) ? (head ? (uint32_t)head : 1) : outline_size;
+
+    memset(prefix, CLEAR_BYTE, HT_MAX_CODE * sizeof(uint32_t));
+
+    if (header.engine != LZW_ENGINE_LZW)
+      return DecompressPhrases (fp, fout, expectedSize, header.engine, flags);
+
+    while (true)
+    {
+#ifndef LZW_FIXED_FOOTPRINT
+      if (index && !MarkSegment (fp, fout->Position() + i))
+        return 0;
+#endif
+
+      if (!ReadSegment (fp, flags))
+        return 0;
+
+      RunCode = 256;
+      OldCode = NOT_CODE;
+      Evicted = NOT_CODE;
+      leaves.Reset();
+
+      while (true)
+      {
+        code = GetCode(RunCode);
+
+        if (code == EOFCode)
+        {
+          return DrainSegment (fp) && FinishOutput (fout, i, expectedSize);
+        }
+        else if (code == HT_CLEAR_CODE)
+        {
+          memset(prefix, CLEAR_BYTE, HT_MAX_CODE * sizeof(uint32_t));
+          break;
+        }
+        else if (code >= HT_MAX_CODE)
+        {
+          // only the entropy stage can code values past the dictionary.
+          LZW_ERROR ("Corrupt input. Position: %ld\n", (long)fp->Position());
+          return 0;
+        }
+        else
+        {
+          if (code < 256)
+          {
+            if (i >= flush_at && !FlushOutline (fout, i))
+              return 0;
+
+            outline[i++] = (uint8_t)code;
+            FirstChar = code;
+          }
+          else
+          {
+            if (prefix[code] == NOT_CODE)
+            {
+              // only the phrase being added may be used before it is; the
+              // leaf list must not meet a code that was never added.
+              if (OldCode == NOT_CODE || (lru && code != (RunCode < HT_CLEAR_CODE ? RunCode : Evicted)))
+              {
+                LZW_ERROR ("Corrupt input. Position: %ld\n", (long)fp->Position());
+                return 0;
+              }
+
+              CurPrefix = OldCode;
+
+              assert (StackCount < stack_size);
+
+              stack[StackCount++] = (uint8_t)FirstChar;
+            }
+            else
+              CurPrefix = code;
+
+            while (CurPrefix > 255)
+            {
+              assert (StackCount < stack_size);
+
+              assert (CurPrefix < HT_MAX_CODE);
+
+              stack[StackCount++] = suffix[CurPrefix];
+              CurPrefix = prefix[CurPrefix];
+            }
+
+            assert (StackCount < stack_size);
+  
+            stack[StackCount++] = (uint8_t)CurPrefix;
+            FirstChar = CurPrefix;
+
+            if (i + StackCount > flush_at && !FlushOutline (fout, i))
+              return 0;
+
+            while (StackCount != 0)
+            {
+              outline[i++] = stack[--StackCount];
+            }
+          }
+
+          if ((OldCode != NOT_CODE) && RunCode >= HT_CLEAR_CODE)
+          {
+            // the packer clears before the dictionary fills up, unless a
+            // leaf was evicted for the new phrase.
+            if (Evicted == NOT_CODE)
+            {
+              LZW_ERROR ("Corrupt input. Position: %ld\n", (long)fp->Position());
+              return 0;
+            }
+
+            prefix[Evicted] = OldCode;
+            suffix[Evicted] = (uint8_t)FirstChar;
+            leaves.Add (Evicted, OldCode);
+            Evicted = NOT_CODE;
+          }
+          else if ((OldCode != NOT_CODE))
+          {
+            prefix[RunCode] = OldCode;
+            suffix[RunCode] = (uint8_t)FirstChar;
+
+            if (lru)
+              leaves.Add (RunCode, OldCode);
+
+            RunCode++;
+
+            if (RunCode == EOFCode)
+            {
+              EOFCode = (EOFCode << 1) + 1;
+              RunningBits++;
+
+              if (flags & DIAGNOSTIC_OUTPUT)
+              {
+                LZW_PRINT ("new EOF: %d\n", EOFCode);
+              }
+            }
+          }
+
+          OldCode = code;
+
+          // the packer evicts as it sends code, ahead of the phrase that
+          // extends it; the phrase is dropped now, the code given it next.
+          if (lru)
+          {
+            leaves.Touch (code);
+
+            if (RunCode >= HT_CLEAR_CODE && (Evicted = leaves.Evict (code)) != LZWLeafList::NONE)
+            {
+              leaves.Release (prefix[Evicted]);
+              prefix[Evicted] = NOT_CODE;
+            }
+          }
+
+          // files without FEATURE_BLOCKS restart the match every BUFFLEN bytes.
+          if (!continuous && i == BUFFLEN)
+          {
+            if (!FlushOutline (fout, i))
+              return 0;
+
+            OldCode = NOT_CODE;
           }
         }
       }
@@ -450,16 +1999,377 @@ class LZWUnpacker
   }
 }; // end of class
 
+#ifndef LZW_FIXED_FOOTPRINT
+
+static int decompressWith (LZWUnpacker & unpacker, const char *filename, const char *outfile, int flags,
+                           uint64_t limit = UINT64_MAX)
+{
+  int ret = unpacker.Decompress (filename, outfile, flags, limit);
+
+  if (ret == 0)
+  {
+    cleanup (outfile, flags);
+  }
+
+  else if (flags & VERBOSE_OUTPUT)
+  {
+    LZW_PRINT ("Peak memory %zu bytes\n", unpacker.PeakMemory());
+  }
+
+  return ret;
+}
+
 int Decompress (const char *filename, const char *outfile, int flags)
 {
   LZWUnpacker unpacker;
 
-  int ret = unpacker.Decompress (filename, outfile, flags);
+  return decompressWith (unpacker, filename, outfile, flags);
+}
+
+int DecompressPrefix (const char *filename, size_t n, const char *outfile, int flags)
+{
+  LZWUnpacker unpacker;
+
+  return decompressWith (unpacker, filename, outfile, flags, n);
+}
 
-  if (ret == 0)
+// Maps filename whole for reading; map is NULL when it is empty.
+static bool mapFile (const char *filename, void *& map, size_t & size, int advice)
+{
+  int fd = open (filename, O_RDONLY);
+
+  if (fd < 0)
   {
-    cleanup (outfile, flags);
+    LZW_ERROR ("Cannot open file \'%s\': %s\n", filename, strerror (errno));
+    return false;
+  }
+
+  struct stat st;
+
+  map = NULL;
+  size = 0;
+
+  if (fstat (fd, &st) == 0 && st.st_size > 0)
+  {
+    size = (size_t)st.st_size;
+    map = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+
+  close (fd);
+
+  if (map == MAP_FAILED)
+  {
+    LZW_ERROR ("Cannot map file \'%s\': %s\n", filename, strerror (errno));
+    return false;
+  }
+
+  if (map)
+    madvise (map, size, advice);
+
+  return true;
+}
+
+long long lzw_search (const char *filename, const void *pattern, size_t length, int flags, int jobs,
+                      lzw_match_fn match, void *opaque)
+{
+  if (!filename || !pattern || length == 0)
+  {
+    LZW_ERROR ("Empty pattern.\n");
+    return -1;
+  }
+
+  // the file is mapped, so that segments can be framed ahead and
+  // searched where they are.
+  void *map;
+  size_t size;
+
+  if (!mapFile (filename, map, size, MADV_SEQUENTIAL))
+    return -1;
+
+  long long ret = -1;
+
+  {
+    LZWPattern p (pattern, length, match, opaque);
+    LZWUnpacker unpacker;
+    MemoryInput in (map, size);
+
+    if (!p.Ok ())
+      LZW_ERROR ("Cannot allocate memory: %s\n", strerror (errno));
+    else if (unpacker.Search (in, p, jobs, flags))
+      ret = (long long)p.Count ();
   }
 
+  if (map)
+    munmap (map, size);
+
   return ret;
 }
+
+/*--------------------------------------------------------------------*/
+/* Random access                                                      */
+/*--------------------------------------------------------------------*/
+
+struct LZW_File
+{
+  LZWAllocator alloc;
+  LZWUnpacker unpacker;
+  LZWSegmentIndex index;
+  LZWSegmentCache cache;
+  MemoryInput input;
+  void *map;
+  size_t size;
+
+  LZW_File (void *m, size_t n, size_t cache_size) :
+    index (alloc), cache (alloc, cache_size), input (m, n), map (m), size (n) { }
+
+  ~LZW_File ()
+  {
+    if (map)
+      munmap (map, size);
+  }
+
+  // Copies n bytes of entry k, from offset from in it, to dst.
+  bool Read (uint32_t k, uint64_t from, unsigned char *dst, size_t n)
+  {
+    const unsigned char *seg = cache.Find (k);
+
+    if (!seg)
+    {
+      uint64_t length = index.End (k) - index.Entry (k).offset;
+      unsigned char *fill = (length <= SIZE_MAX) ? cache.Insert (k, (size_t)length) : NULL;
+
+      // too large to keep: unpacked up to the end of the range.
+      if (!fill)
+      {
+        WindowOutput out (dst, from, n);
+        return unpacker.ReadEntry (input, index, k, out, from + n);
+      }
+
+      WindowOutput out (fill, 0, length);
+
+      if (!unpacker.ReadEntry (input, index, k, out, length))
+      {
+        cache.Drop (k);
+        return false;
+      }
+
+      seg = fill;
+    }
+
+    memcpy (dst, seg + from, n);
+    return true;
+  }
+};
+
+LZW_File *lzw_open (const char *filename, size_t cache_size)
+{
+  void *map;
+  size_t size;
+
+  if (!filename || !mapFile (filename, map, size, MADV_RANDOM))
+    return NULL;
+
+  LZWAllocator a;
+
+  void *mem = a.Alloc (sizeof (LZW_File));
+
+  if (!mem)
+  {
+    LZW_ERROR ("Cannot allocate memory: %s\n", strerror (errno));
+
+    if (map)
+      munmap (map, size);
+
+    return NULL;
+  }
+
+  LZW_File *file = new (mem) LZW_File (map, size, cache_size ? cache_size : LZW_DEFAULT_CACHE);
+
+  if (!file->unpacker.Index (file->input, file->index))
+  {
+    lzw_close (file);
+    return NULL;
+  }
+
+  if (!file->cache.Init (file->index.Count()))
+  {
+    LZW_ERROR ("Cannot allocate memory: %s\n", strerror (errno));
+    lzw_close (file);
+    return NULL;
+  }
+
+  return file;
+}
+
+ptrdiff_t lzw_pread (LZW_File *file, void *buf, size_t len, unsigned long long offset)
+{
+  if (!file || (!buf && len))
+    return -1;
+
+  uint64_t total = file->index.Size();
+
+  if (offset >= total)
+    return 0;
+
+  if (len > total - offset)
+    len = (size_t)(total - offset);
+
+  if (len > PTRDIFF_MAX)
+    len = PTRDIFF_MAX;
+
+  unsigned char *dst = (unsigned char *)buf;
+  size_t done = 0;
+
+  for (uint32_t k = file->index.Find (offset); done < len; k++)
+  {
+    uint64_t pos = offset + done;
+    uint64_t start = file->index.Entry (k).offset;
+    uint64_t end = file->index.End (k);
+
+    if (pos >= end)
+      continue;   // an empty stream.
+
+    size_t n = (end - pos < len - done) ? (size_t)(end - pos) : len - done;
+
+    if (!file->Read (k, pos - start, dst + done, n))
+      return -1;
+
+    done += n;
+  }
+
+  return (ptrdiff_t)done;
+}
+
+unsigned long long lzw_file_size (const LZW_File *file)
+{
+  return file ? file->index.Size() : 0;
+}
+
+void lzw_close (LZW_File *file)
+{
+  if (!file) return;
+
+  LZWAllocator a;
+
+  file->~LZW_File();
+  a.Free (file, sizeof (LZW_File));
+}
+
+#endif // LZW_FIXED_FOOTPRINT
+
+/*--------------------------------------------------------------------*/
+/* Reusable decompression context                                     */
+/*--------------------------------------------------------------------*/
+
+struct LZW_DCtx
+{
+  LZWUnpacker unpacker;
+
+  explicit LZW_DCtx (const lzw_allocator *custom) : unpacker (custom) { }
+};
+
+static_assert (sizeof (LZW_DCtx) <= lzw_footprint::DCTX, "lzw_footprint::DCTX is too small");
+
+LZW_DCtx *lzw_dctx_create (void)
+{
+  return lzw_dctx_create_advanced (NULL);
+}
+
+/* the context object itself is also placed with the custom allocator. */
+LZW_DCtx *lzw_dctx_create_advanced (const lzw_allocator *custom)
+{
+  LZWAllocator a (custom);
+
+  void *mem = a.Alloc (sizeof (LZW_DCtx));
+
+  if (!mem) return NULL;
+
+  return new (mem) LZW_DCtx (custom);
+}
+
+LZW_DCtx *lzw_dctx_create_static (void *workspace, size_t size, int max_bits)
+{
+  size_t need = lzw_dctx_workspace_size (max_bits);
+
+  lzw_arena *arena = (need && size >= need) ? lzw_arena_place (workspace, size) : NULL;
+
+  if (!arena) return NULL;
+
+  lzw_allocator custom = lzw_arena_allocator (arena);
+  LZWAllocator a (&custom);
+
+  void *mem = a.Alloc (lzw_footprint::DCTX);
+
+  if (!mem) return NULL;
+
+  LZW_DCtx *ctx = new (mem) LZW_DCtx (&custom);
+
+  if (!ctx->unpacker.Reserve (max_bits))
+  {
+    ctx->~LZW_DCtx();
+    return NULL;
+  }
+
+  return ctx;
+}
+
+void lzw_dctx_free (LZW_DCtx *ctx)
+{
+  if (!ctx) return;
+
+  LZWAllocator a (ctx->unpacker.Allocator());
+
+  ctx->~LZW_DCtx();
+  a.Free (ctx, sizeof (LZW_DCtx));
+}
+
+void lzw_dctx_reset (LZW_DCtx *ctx)
+{
+  if (ctx) ctx->unpacker.Reset();
+}
+
+#ifndef LZW_FIXED_FOOTPRINT
+int lzw_decompress_dctx (LZW_DCtx *ctx, const char *filename, const char *outfile, int flags)
+{
+  if (!ctx) return 0;
+
+  return decompressWith (ctx->unpacker, filename, outfile, flags);
+}
+
+int lzw_decompress_prefix_dctx (LZW_DCtx *ctx, const char *filename, size_t n, const char *outfile, int flags)
+{
+  if (!ctx) return 0;
+
+  return decompressWith (ctx->unpacker, filename, outfile, flags, n);
+}
+#endif
+
+int lzw_dctx_set_memory_limit (LZW_DCtx *ctx, size_t bytes)
+{
+  if (!ctx) return 0;
+
+  ctx->unpacker.SetMemoryLimit (bytes);
+  return 1;
+}
+
+int lzw_dctx_set_io_block_size (LZW_DCtx *ctx, size_t size)
+{
+  if (!ctx) return 0;
+
+  return ctx->unpacker.SetIOBlockSize (size) ? 1 : 0;
+}
+
+size_t lzw_dctx_peak_memory (const LZW_DCtx *ctx)
+{
+  return ctx ? ctx->unpacker.PeakMemory() : 0;
+}
+
+int lzw_decompress_stream (LZW_DCtx *ctx, const lzw_source *source, const lzw_sink *sink, int flags)
+{
+  if (!ctx || !source || !sink || !source->read || !sink->write) return 0;
+
+  CallbackInput in (*source);
+  CallbackOutput out (*sink);
+
+  return ctx->unpacker.Decompress (in, out, flags);
+}
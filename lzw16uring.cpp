@@ -0,0 +1,557 @@
+/* Copyright (c) 1996-2021 Yuriy Yakimenko        */
+
+/**************************************************/
+/*  io_uring stream backend (Linux only). Reads   */
+/*  of upcoming input blocks and writes of        */
+/*  completed output blocks are kept in flight    */
+/*  on a ring with registered buffers.            */
+/**************************************************/
+
+#include "common.h"
+#include "lzw16io.h"
+
+#include <cstring>
+#include <new>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define URING_DEPTH 16
+#define URING_BLOCK (256 * 1024)
+
+/*--------------------------------------------------------------------*/
+/* Minimal ring: no liburing dependency.                              */
+/*--------------------------------------------------------------------*/
+
+class UringQueue
+{
+  private:
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    io_uring_sqe *sqes;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned pending;   // prepared, not yet submitted.
+
+  public:
+    UringQueue () : fd (-1), sq_ptr (MAP_FAILED), cq_ptr (MAP_FAILED), sqes (NULL), pending (0) { }
+
+    ~UringQueue ()
+    {
+      if (sqes) munmap (sqes, sqes_size);
+      if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap (cq_ptr, cq_size);
+      if (sq_ptr != MAP_FAILED) munmap (sq_ptr, sq_size);
+      if (fd >= 0) close (fd);
+    }
+
+    bool Init (unsigned entries)
+    {
+      io_uring_params p;
+      memset (&p, 0, sizeof(p));
+
+      fd = (int)syscall (__NR_io_uring_setup, entries, &p);
+
+      if (fd < 0) return false;
+
+      sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+      if (p.features & IORING_FEAT_SINGLE_MMAP)
+      {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+      }
+
+      sq_ptr = mmap (NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+      if (sq_ptr == MAP_FAILED) return false;
+
+      if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+      else
+      {
+        cq_ptr = mmap (NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+        if (cq_ptr == MAP_FAILED) return false;
+      }
+
+      sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+      void *s = mmap (NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+      if (s == MAP_FAILED) return false;
+
+      sqes = (io_uring_sqe *)s;
+
+      char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+
+      sq_head = (unsigned *)(sq + p.sq_off.head);
+      sq_tail = (unsigned *)(sq + p.sq_off.tail);
+      sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+      sq_array = (unsigned *)(sq + p.sq_off.array);
+
+      cq_head = (unsigned *)(cq + p.cq_off.head);
+      cq_tail = (unsigned *)(cq + p.cq_off.tail);
+      cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+      cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+      return true;
+    }
+
+    bool RegisterBuffers (const iovec *iov, unsigned count)
+    {
+      return syscall (__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+    }
+
+    // queues a read or write; nothing reaches the kernel until Enter.
+    void Prepare (uint8_t opcode, int file, void *buf, unsigned len, uint64_t offset, int buf_index, uint64_t user_data)
+    {
+      unsigned tail = *sq_tail;
+      unsigned idx = tail & *sq_mask;
+      io_uring_sqe *sqe = &sqes[idx];
+
+      memset (sqe, 0, sizeof(*sqe));
+      sqe->opcode = opcode;
+      sqe->fd = file;
+      sqe->addr = (uint64_t)(uintptr_t)buf;
+      sqe->len = len;
+      sqe->off = offset;
+      sqe->buf_index = (uint16_t)(buf_index < 0 ? 0 : buf_index);
+      sqe->user_data = user_data;
+
+      sq_array[idx] = idx;
+      __atomic_store_n (sq_tail, tail + 1, __ATOMIC_RELEASE);
+      pending++;
+    }
+
+    // one syscall submits everything prepared and optionally waits.
+    bool Enter (unsigned wait_nr)
+    {
+      while (pending > 0 || wait_nr > 0)
+      {
+        int ret = (int)syscall (__NR_io_uring_enter, fd, pending, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (ret < 0)
+        {
+          if (errno == EINTR) continue;
+          return false;
+        }
+
+        pending -= (unsigned)ret;
+        return true;
+      }
+      return true;
+    }
+
+    bool Reap (uint64_t & user_data, int & res)
+    {
+      unsigned head = *cq_head;
+
+      if (head == __atomic_load_n (cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+      io_uring_cqe *cqe = &cqes[head & *cq_mask];
+      user_data = cqe->user_data;
+      res = cqe->res;
+
+      __atomic_store_n (cq_head, head + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+};
+
+/* Buffers shared by the input and output streams. */
+struct UringBuffers
+{
+  LZWAllocator & alloc;
+  unsigned char *memory;
+  iovec iov[URING_DEPTH];
+  bool registered;
+
+  explicit UringBuffers (LZWAllocator & a) : alloc (a), memory (NULL), registered (false)
+  {
+    if ((size_t)URING_DEPTH * URING_BLOCK <= alloc.RingBudget ())
+      memory = (unsigned char *)alloc.Alloc ((size_t)URING_DEPTH * URING_BLOCK);
+
+    for (unsigned i = 0; memory && i < URING_DEPTH; i++)
+    {
+      iov[i].iov_base = memory + (size_t)i * URING_BLOCK;
+      iov[i].iov_len = URING_BLOCK;
+    }
+  }
+
+  ~UringBuffers ()
+  {
+    alloc.Free (memory, (size_t)URING_DEPTH * URING_BLOCK);
+  }
+
+  unsigned char *Slot (unsigned i) { return (unsigned char *)iov[i].iov_base; }
+
+  // registration pins pages; without enough RLIMIT_MEMLOCK plain reads are used.
+  bool Setup (UringQueue & q)
+  {
+    if (!memory) return false;
+
+    registered = q.RegisterBuffers (iov, URING_DEPTH);
+    return true;
+  }
+};
+
+/*--------------------------------------------------------------------*/
+/* Input: every slot has a read in flight for the next unread block.  */
+/*--------------------------------------------------------------------*/
+
+class UringInput : public LZWInput
+{
+  private:
+    FILE *fp;
+    int fd;
+    UringQueue ring;
+    UringBuffers buffers;
+    int64_t file_size;
+    uint64_t next_offset;         // file offset of the next read to submit.
+    int result[URING_DEPTH];      // bytes read, or -1 while in flight.
+    size_t expected[URING_DEPTH];
+    uint64_t offset[URING_DEPTH];
+    unsigned current;             // slot being consumed; slots complete in file order.
+    size_t consumed;
+    unsigned inflight;
+    bool failed, owned;
+
+    void Submit (unsigned slot)
+    {
+      size_t len = URING_BLOCK;
+
+      if ((int64_t)(next_offset + len) > file_size) len = (size_t)(file_size - next_offset);
+
+      expected[slot] = len;
+      offset[slot] = next_offset;
+      result[slot] = -1;
+
+      if (len == 0)
+      {
+        result[slot] = 0;
+        return;
+      }
+
+      if (buffers.registered)
+        ring.Prepare (IORING_OP_READ_FIXED, fd, buffers.Slot (slot), (unsigned)len, next_offset, slot, slot);
+      else
+        ring.Prepare (IORING_OP_READ, fd, buffers.Slot (slot), (unsigned)len, next_offset, -1, slot);
+
+      next_offset += len;
+      inflight++;
+    }
+
+    bool Wait (unsigned slot)
+    {
+      while (result[slot] < 0)
+      {
+        uint64_t data;
+        int res;
+
+        if (!ring.Reap (data, res))
+        {
+          if (!ring.Enter (1)) return false;
+          continue;
+        }
+
+        inflight--;
+
+        if (res < 0) return false;
+
+        result[data] = res;
+      }
+
+      // a short read inside the file: finish the block synchronously.
+      while ((size_t)result[slot] < expected[slot])
+      {
+        ssize_t n = pread (fd, buffers.Slot (slot) + result[slot], expected[slot] - result[slot], offset[slot] + result[slot]);
+
+        if (n <= 0) return false;
+
+        result[slot] += (int)n;
+      }
+
+      return true;
+    }
+
+  public:
+    UringInput (FILE *f, LZWAllocator & a) : fp (f), fd (fileno (f)), buffers (a)
+    {
+      file_size = 0;
+      next_offset = 0;
+      current = 0;
+      consumed = 0;
+      inflight = 0;
+      failed = false;
+      owned = false;
+    }
+
+    ~UringInput () override
+    {
+      // the kernel may still write into the buffers: wait for every read.
+      while (inflight > 0)
+      {
+        uint64_t data;
+        int res;
+
+        if (ring.Reap (data, res)) inflight--;
+        else if (!ring.Enter (1)) break;
+      }
+
+      if (owned) fclose (fp);
+    }
+
+    bool Start (void)
+    {
+      struct stat st;
+
+      if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode)) return false;
+
+      file_size = st.st_size;
+
+      if (!ring.Init (URING_DEPTH * 2) || !buffers.Setup (ring)) return false;
+
+      for (unsigned i = 0; i < URING_DEPTH; i++)
+        Submit (i);
+
+      if (!ring.Enter (0)) return false;
+
+      owned = true;
+      return true;
+    }
+
+    size_t Read (void *buf, size_t len) override
+    {
+      size_t total = 0;
+
+      while (total < len && !failed)
+      {
+        if (!Wait (current))
+        {
+          failed = true;
+          break;
+        }
+
+        size_t avail = (size_t)result[current] - consumed;
+
+        if (avail == 0) break;   // end of file.
+
+        size_t n = (len - total < avail) ? len - total : avail;
+
+        memcpy ((unsigned char *)buf + total, buffers.Slot (current) + consumed, n);
+
+        total += n;
+        consumed += n;
+
+        if (consumed == (size_t)result[current])
+        {
+          Submit (current);      // prepared now, submitted with the next wait.
+          current = (current + 1) % URING_DEPTH;
+          consumed = 0;
+        }
+      }
+
+      position += total;
+      return total;
+    }
+
+    int64_t Size (void) override { return file_size; }
+    bool Failed (void) const override { return failed; }
+};
+
+/*--------------------------------------------------------------------*/
+/* Output: filled blocks are written asynchronously at their offsets. */
+/*--------------------------------------------------------------------*/
+
+class UringOutput : public LZWOutput
+{
+  private:
+    FILE *fp;
+    int fd;
+    UringQueue ring;
+    UringBuffers buffers;
+    bool busy[URING_DEPTH];
+    size_t length[URING_DEPTH];
+    uint64_t offset[URING_DEPTH];
+    unsigned current;
+    size_t fill;
+    unsigned inflight;
+    uint64_t next_offset;
+    bool failed, owned;
+
+    // completes one write, retrying short writes synchronously.
+    bool ReapOne (bool wait)
+    {
+      uint64_t data;
+      int res;
+
+      while (!ring.Reap (data, res))
+      {
+        if (!wait) return false;
+        if (!ring.Enter (1)) { failed = true; return false; }
+      }
+
+      inflight--;
+      busy[data] = false;
+
+      if (res < 0)
+      {
+        failed = true;
+        return true;
+      }
+
+      size_t done = (size_t)res;
+
+      while (done < length[data])
+      {
+        ssize_t n = pwrite (fd, buffers.Slot ((unsigned)data) + done, length[data] - done, offset[data] + done);
+
+        if (n <= 0)
+        {
+          failed = true;
+          break;
+        }
+
+        done += (size_t)n;
+      }
+
+      return true;
+    }
+
+    void SubmitCurrent (void)
+    {
+      length[current] = fill;
+      offset[current] = next_offset;
+      busy[current] = true;
+
+      if (buffers.registered)
+        ring.Prepare (IORING_OP_WRITE_FIXED, fd, buffers.Slot (current), (unsigned)fill, next_offset, current, current);
+      else
+        ring.Prepare (IORING_OP_WRITE, fd, buffers.Slot (current), (unsigned)fill, next_offset, -1, current);
+
+      next_offset += fill;
+      inflight++;
+      fill = 0;
+      current = (current + 1) % URING_DEPTH;
+
+      // batch submissions: one syscall per half ring of blocks.
+      if (inflight % (URING_DEPTH / 2) == 0 && !ring.Enter (0))
+        failed = true;
+    }
+
+  public:
+    UringOutput (FILE *f, LZWAllocator & a) : fp (f), fd (fileno (f)), buffers (a)
+    {
+      memset (busy, 0, sizeof(busy));
+      current = 0;
+      fill = 0;
+      inflight = 0;
+      next_offset = 0;
+      failed = false;
+      owned = false;
+    }
+
+    ~UringOutput () override
+    {
+      while (inflight > 0 && ReapOne (true)) { }
+
+      if (owned) fclose (fp);
+    }
+
+    bool Start (void)
+    {
+      owned = ring.Init (URING_DEPTH * 2) && buffers.Setup (ring);
+      return owned;
+    }
+
+    bool Write (const void *buf, size_t len) override
+    {
+      const unsigned char *ptr = (const unsigned char *)buf;
+      size_t left = len;
+
+      while (left > 0 && !failed)
+      {
+        if (fill == 0)
+        {
+          // reuse of a slot must wait for its previous write.
+          if (busy[current] && !ring.Enter (0)) failed = true;
+
+          while (busy[current] && !failed)
+            ReapOne (true);
+
+          if (failed) break;
+        }
+
+        size_t n = URING_BLOCK - fill;
+        if (n > left) n = left;
+
+        memcpy (buffers.Slot (current) + fill, ptr, n);
+
+        fill += n;
+        ptr += n;
+        left -= n;
+
+        if (fill == URING_BLOCK) SubmitCurrent();
+      }
+
+      if (failed) return false;
+
+      position += len;
+      return true;
+    }
+
+    bool Finish (void) override
+    {
+      if (!failed && fill > 0) SubmitCurrent();
+
+      if (!ring.Enter (0)) failed = true;
+
+      while (inflight > 0 && ReapOne (true)) { }
+
+      return !failed;
+    }
+};
+
+/* On success the stream owns fp; otherwise fp is left open for stdio. */
+
+LZWInput *OpenUringInput (FILE *fp, LZWAllocator & alloc)
+{
+  UringInput *in = new (std::nothrow) UringInput (fp, alloc);
+
+  if (in && in->Start()) return in;
+
+  delete in;
+  return NULL;
+}
+
+LZWOutput *OpenUringOutput (FILE *fp, LZWAllocator & alloc)
+{
+  UringOutput *out = new (std::nothrow) UringOutput (fp, alloc);
+
+  if (out && out->Start()) return out;
+
+  delete out;
+  return NULL;
+}
+
+#else // no io_uring on this platform
+
+LZWInput *OpenUringInput (FILE *, LZWAllocator &)
+{
+  return NULL;
+}
+
+LZWOutput *OpenUringOutput (FILE *, LZWAllocator &)
+{
+  return NULL;
+}
+
+#endif
@@ -28,7 +28,8 @@
 
 enum ByteSequence { SEQ_CONSTANT = 0, SEQ_INCREASING, SEQ_RANDOM };
 
-enum ArgOption { PARSE_ERROR = -1, SYNTHETIC_TEST = 0, FLAG_PACK = 1, FLAG_UNPACK = 2, FLAG_TEST = 3 };
+enum ArgOption { PARSE_ERROR = -1, SYNTHETIC_TEST = 0, FLAG_PACK = 1, FLAG_UNPACK = 2, FLAG_TEST = 3,
+                 FLAG_CREATE = 4, FLAG_EXTRACT = 5, FLAG_LIST = 6, FLAG_APPEND = 7, FLAG_SEARCH = 8 };
 
 struct progArguments
 {
@@ -36,6 +37,18 @@ struct progArguments
     char *outputFile;
     int flags;
     int bits, kb256;
+    int filters[LZW_MAX_FILTERS][2];   // filter id, param; in command line order.
+    int nfilters;
+    int block;      // read block size in bytes; 0 for the default.
+    int engine;
+    long long head;  // bytes to unpack with --head; -1 for the whole file.
+    long long skip;  // unpacked bytes to leave out with --skip; -1 for none.
+    char **files;    // names after the first one (archive members); not owned.
+    int nfiles;
+    int jobs;        // archive and search worker threads; 0 for one per core.
+    bool concat;     // -a adds the streams of a packed inputFile as they are.
+    size_t maxMemory;  // bytes the packer or unpacker may hold; 0 for no limit.
+    int ioBlock;     // --direct read and write size in bytes; 0 for the default.
     progArguments ()
     {
       inputFile = NULL;
@@ -43,6 +56,17 @@ struct progArguments
       flags = 0;
       bits = 0;
       kb256 = 0;
+      nfilters = 0;
+      block = 0;
+      engine = LZW_ENGINE_LZW;
+      head = -1;
+      skip = -1;
+      files = NULL;
+      nfiles = 0;
+      jobs = 0;
+      concat = false;
+      maxMemory = 0;
+      ioBlock = 0;
     }
     ~progArguments ()
     {
@@ -52,6 +76,142 @@ struct progArguments
 };
 
 
+/* a context carrying the command line's filters, block size and engine. */
+static LZW_CCtx *settingsContext (const progArguments & params)
+{
+  LZW_CCtx *ctx = lzw_cctx_create ();
+
+  if (!ctx)
+    return NULL;
+
+  if (params.block)
+    lzw_cctx_set_block_size (ctx, params.block);
+
+  lzw_cctx_set_engine (ctx, params.engine);
+  lzw_cctx_set_memory_limit (ctx, params.maxMemory);
+
+  if (params.ioBlock)
+    lzw_cctx_set_io_block_size (ctx, params.ioBlock);
+
+  for (int k = 0; k < params.nfilters; k++)
+    lzw_cctx_add_filter (ctx, params.filters[k][0], params.filters[k][1]);
+
+  return ctx;
+}
+
+/* filters, block size and engine are context settings, so those packs go through a context. */
+static int packFile (const progArguments & params, const char *outfile)
+{
+  if (params.nfilters == 0 && params.block == 0 && params.engine == LZW_ENGINE_LZW && params.maxMemory == 0 &&
+      params.ioBlock == 0)
+    return Compress2 (params.inputFile, outfile, params.flags, params.bits);
+
+  LZW_CCtx *ctx = settingsContext (params);
+
+  if (!ctx)
+    return 0;
+
+  int ret = lzw_compress_cctx (ctx, params.inputFile, outfile, params.flags, params.bits);
+
+  lzw_cctx_free (ctx);
+
+  return ret;
+}
+
+/* --skip reads through lzw_open, which unpacks only the segments the range is in. */
+static int unpackRange (const char *infile, const char *outfile, int flags, long long skip, long long head)
+{
+  if (!(flags & OVERWRITE_FLAG) && file_exists (outfile))
+  {
+    fprintf (stderr, "File \'%s\' already exists. Use overwrite flag.\n", outfile);
+    return 0;
+  }
+
+  LZW_File *file = lzw_open (infile, 0);
+
+  if (!file)
+    return 0;
+
+  FILE *out = fopen (outfile, "wb");
+
+  if (!out)
+  {
+    fprintf (stderr, "Cannot open output file \'%s\'.\n", outfile);
+    lzw_close (file);
+    return 0;
+  }
+
+  static char buf[1 << 16];
+  unsigned long long pos = (unsigned long long)skip;
+  unsigned long long left = (head >= 0) ? (unsigned long long)head : ~0ULL;
+  int ok = 1;
+
+  while (left)
+  {
+    ptrdiff_t n = lzw_pread (file, buf, left < sizeof (buf) ? (size_t)left : sizeof (buf), pos);
+
+    if (n <= 0)
+    {
+      ok = (n == 0);
+      break;
+    }
+
+    if (fwrite (buf, 1, (size_t)n, out) != (size_t)n)
+    {
+      fprintf (stderr, "Write error. Out of disk space?\n");
+      ok = 0;
+      break;
+    }
+
+    pos += (unsigned long long)n;
+    left -= (unsigned long long)n;
+  }
+
+  if (fclose (out) != 0)
+    ok = 0;
+
+  lzw_close (file);
+
+  if (!ok)
+    cleanup (outfile, flags);
+
+  return ok;
+}
+
+/* a memory limit or --direct block size needs a context; so does --head with one. */
+static int unpackFile (const progArguments & params, const char *infile, const char *outfile, int flags, long long head)
+{
+  if (params.skip >= 0)
+    return unpackRange (infile, outfile, flags, params.skip, head);
+
+  if (params.maxMemory == 0 && params.ioBlock == 0)
+    return (head >= 0) ? DecompressPrefix (infile, (size_t)head, outfile, flags) : Decompress (infile, outfile, flags);
+
+  LZW_DCtx *ctx = lzw_dctx_create ();
+
+  if (!ctx)
+    return 0;
+
+  lzw_dctx_set_memory_limit (ctx, params.maxMemory);
+
+  if (params.ioBlock)
+    lzw_dctx_set_io_block_size (ctx, params.ioBlock);
+
+  int ret = (head >= 0) ? lzw_decompress_prefix_dctx (ctx, infile, (size_t)head, outfile, flags) :
+                          lzw_decompress_dctx (ctx, infile, outfile, flags);
+
+  lzw_dctx_free (ctx);
+
+  return ret;
+}
+
+/* -g prints the offset of each match on a line of its own. */
+static int printMatch (void *, unsigned long long offset)
+{
+  printf ("%llu\n", offset);
+  return 0;
+}
+
 static void show_command (const char* cmd) 
 {
   char buffer[128];
@@ -82,15 +242,45 @@ static void show_command (const char* cmd)
 
 static void printSyntax (const char *prog)
 {
-  printf ("syntax: %s -(p|u|t) [-v -f -k -t] [-bN] inputFile outputFile \n", prog);
+  printf ("syntax: %s -(p|u|t) [-v -f -k -t -Z] [-bN] inputFile outputFile \n", prog);
+  printf ("        %s -(c|x|l) [-v -f -k] [-bN] archive [files] \n", prog);
+  printf ("        %s -a [--concat] [-v] [-bN] inputFile outputFile \n", prog);
+  printf ("        %s -g [-v] pattern inputFile \n", prog);
   printf ("        %s -large [N] \n", prog);
   printf ("\t -p - pack \n");
   printf ("\t -u - unpack \n");
   printf ("\t -v - verbose \n");
-  printf ("\t -f - force overwrite; applicable with -u option only \n");
+  printf ("\t -f - force overwrite; applicable with -u and -x options only \n");
   printf ("\t -k - keep dirty/incomplete output file on failure \n");
   printf ("\t -t - test option; requires only inputFile \n");
-  printf ("\t -bN - set maximum code bits. N from 12 to %d. Default is %d.\n", SUPPORTED_MAX_BITS, DEFAULT_MAX_BITS);
+  printf ("\t -c - create archive of the files \n");
+  printf ("\t -x - extract the named members of archive, or all of them \n");
+  printf ("\t -l - list archive members \n");
+  printf ("\t -a - pack inputFile onto the end of the packed outputFile \n");
+  printf ("\t -Z - read or write the .Z format of compress(1), with -b9 to -b16 (-b16 by default) \n");
+  printf ("\t -g - print the offset of each occurrence of pattern in the unpacked inputFile, \n");
+  printf ("\t      without unpacking it; exits with 1 when there is none \n");
+  printf ("\t -bN - set maximum code bits. N from 12 to %d, or 9 to %d with -Z. Default is %d.\n", SUPPORTED_MAX_BITS, Z_MAX_BITS, DEFAULT_MAX_BITS);
+  printf ("\t --pipeline - overlap file reads and writes with coding using I/O threads \n");
+  printf ("\t --uring - asynchronous file I/O through io_uring (Linux) \n");
+  printf ("\t --direct[=N] - keep the files out of the page cache, reading and writing N Kb blocks (default %d) \n", DIRECT_BLOCK / 1024);
+  printf ("\t --sparse - leave 4 Kb blocks of zeros of unpacked files (-u, -x) as holes \n");
+  printf ("\t --rle - run-length stage before packing; for input with long runs of equal bytes \n");
+  printf ("\t --huffman - Huffman-code the emitted codes, with a table per segment \n");
+  printf ("\t --subblocks - write segments in %d byte sub-blocks, so neither side buffers a whole segment \n", SUBBLOCK_SIZE);
+  printf ("\t --lru - once the dictionary is full, reuse the codes of its least recently used phrases \n");
+  printf ("\t         instead of clearing it; LZW only, not with --huffman; implies --subblocks \n");
+  printf ("\t --lzmw, --lzap - grow the dictionary by joining whole phrases (LZMW) or also their prefixes (LZAP) \n");
+  printf ("\t --block=N - read and code the input in N Kb blocks. Default is %d.\n", DEFAULT_BLOCK_SIZE / 1024);
+  printf ("\t --delta=N - subtract the byte N positions back before packing (N = record size) \n");
+  printf ("\t --shuffle=N - group byte k of each N-byte element together before packing \n");
+  printf ("\t --concat - with -a, add the streams of a packed inputFile as they are \n");
+  printf ("\t --jobs=N - worker threads for -c, -x and -g. Default is one per core.\n");
+  printf ("\t --head=N - unpack only the first N bytes; applicable with -u option only \n");
+  printf ("\t --skip=N - unpack from byte N on, with --head the N bytes after it; only the \n");
+  printf ("\t            segments needed are unpacked; applicable with -u option only \n");
+  printf ("\t --max-memory=N - memory the packer or unpacker may use, in bytes or with a K, M or G suffix; \n");
+  printf ("\t                  -v reports the peak. Shared by the --jobs workers, which are cut to fit.\n");
   printf ("\t -large - synthetic data test; N is size in 256 Kb units. Default N is 32.\n");
 }
 
@@ -104,7 +294,21 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
     int flagVerbose = 0;
     int flagKeepDirty = 0;
     int flagTest = 0;
+    int flagCreate = 0;
+    int flagExtract = 0;
+    int flagList = 0;
+    int flagAppend = 0;
+    int flagSearch = 0;
     int flagDiagnostics = 0;
+    int flagPipeline = 0;
+    int flagUring = 0;
+    int flagSparse = 0;
+    int flagDirect = 0;
+    int flagSubBlocks = 0;
+    int flagLRU = 0;
+    int flagZ = 0;
+    int flagRLE = 0;
+    int flagHuffman = 0;
     int bits = DEFAULT_MAX_BITS;
 
     bool bits_set = false;
@@ -129,14 +333,23 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
 
             if (strncmp (argv[i], "-b", 2) == 0)
             {
-              /* the Compress and Decompress supports bit values from 9 to 15          */
+              /* the Compress and Decompress supports bit values from 9 to 20          */
               /* however values below 12 produce low compression and are not practical */
+              /* for .lzw files; -b9 to -b11 are accepted for -Z only (checked below), */
+              /* as compress(1) writes them.                                           */
 
-              if (strcmp (argv[i], "-b12") == 0) bits = 12;
+              if (strcmp (argv[i], "-b9") == 0) bits = 9;
+              else if (strcmp (argv[i], "-b10") == 0) bits = 10;
+              else if (strcmp (argv[i], "-b11") == 0) bits = 11;
+              else if (strcmp (argv[i], "-b12") == 0) bits = 12;
               else if (strcmp (argv[i], "-b13") == 0) bits = 13;
               else if (strcmp (argv[i], "-b14") == 0) bits = 14;
               else if (strcmp (argv[i], "-b15") == 0) bits = 15;
               else if (strcmp (argv[i], "-b16") == 0) bits = 16;
+              else if (strcmp (argv[i], "-b17") == 0) bits = 17;
+              else if (strcmp (argv[i], "-b18") == 0) bits = 18;
+              else if (strcmp (argv[i], "-b19") == 0) bits = 19;
+              else if (strcmp (argv[i], "-b20") == 0) bits = 20;
               else 
               {
                 fprintf (stderr, "Invalid number of bits. Allowed range 12 to %d.\n", SUPPORTED_MAX_BITS);    
@@ -148,6 +361,169 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
               continue;
             }
 
+            if (strcmp (argv[i], "--pipeline") == 0)
+            {
+              flagPipeline = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--uring") == 0)
+            {
+              flagUring = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--sparse") == 0)
+            {
+              flagSparse = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--direct") == 0 || strncmp (argv[i], "--direct=", 9) == 0)
+            {
+              int kb = argv[i][8] ? atoi (argv[i] + 9) : DIRECT_BLOCK / 1024;
+
+              if (kb < MIN_DIRECT_BLOCK / 1024 || kb > MAX_DIRECT_BLOCK / 1024 || kb % 4)
+              {
+                fprintf (stderr, "Invalid I/O block size. Allowed range %d to %d Kb, in steps of 4.\n",
+                         MIN_DIRECT_BLOCK / 1024, MAX_DIRECT_BLOCK / 1024);
+                return PARSE_ERROR;
+              }
+
+              flagDirect = true;
+              params.ioBlock = (kb == DIRECT_BLOCK / 1024) ? 0 : kb * 1024;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--subblocks") == 0)
+            {
+              flagSubBlocks = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--lru") == 0)
+            {
+              flagLRU = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--rle") == 0)
+            {
+              flagRLE = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--concat") == 0)
+            {
+              params.concat = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--huffman") == 0)
+            {
+              flagHuffman = true;
+              continue;
+            }
+
+            if (strcmp (argv[i], "--lzmw") == 0 || strcmp (argv[i], "--lzap") == 0)
+            {
+              params.engine = (argv[i][4] == 'm') ? LZW_ENGINE_LZMW : LZW_ENGINE_LZAP;
+              continue;
+            }
+
+            if (strncmp (argv[i], "--block=", 8) == 0)
+            {
+              int kb = atoi (argv[i] + 8);
+
+              if (kb < MIN_BLOCK_SIZE / 1024 || kb > MAX_BLOCK_SIZE / 1024)
+              {
+                fprintf (stderr, "Invalid block size. Allowed range %d to %d Kb.\n", MIN_BLOCK_SIZE / 1024, MAX_BLOCK_SIZE / 1024);
+                return PARSE_ERROR;
+              }
+
+              params.block = kb * 1024;
+              continue;
+            }
+
+            if (strncmp (argv[i], "--delta=", 8) == 0 || strncmp (argv[i], "--shuffle=", 10) == 0)
+            {
+              bool delta = (argv[i][2] == 'd');
+              int param = atoi (strchr (argv[i], '=') + 1);
+
+              if (params.nfilters == LZW_MAX_FILTERS || param < (delta ? 1 : 2) || param > 255)
+              {
+                fprintf (stderr, "Invalid filter %s. At most %d filters, N up to 255.\n", argv[i], LZW_MAX_FILTERS);
+                return PARSE_ERROR;
+              }
+
+              params.filters[params.nfilters][0] = delta ? LZW_FILTER_DELTA : LZW_FILTER_SHUFFLE;
+              params.filters[params.nfilters][1] = param;
+              params.nfilters++;
+              continue;
+            }
+
+            if (strncmp (argv[i], "--jobs=", 7) == 0)
+            {
+              params.jobs = atoi (argv[i] + 7);
+
+              if (params.jobs < 1 || params.jobs > 1024)
+              {
+                fprintf (stderr, "Invalid number of jobs. Allowed range 1 to 1024.\n");
+                return PARSE_ERROR;
+              }
+
+              continue;
+            }
+
+            if (strncmp (argv[i], "--max-memory=", 13) == 0)
+            {
+              char *end = NULL;
+              unsigned long long n = strtoull (argv[i] + 13, &end, 10);
+              int shift = 0;
+
+              if (end && *end && !end[1])
+                shift = (*end == 'K' || *end == 'k') ? 10 : (*end == 'M' || *end == 'm') ? 20 : (*end == 'G' || *end == 'g') ? 30 : -1;
+
+              if (end == argv[i] + 13 || n == 0 || shift < 0 || (*end && !shift) || n > (~0ULL >> 1) >> shift)
+              {
+                fprintf (stderr, "Invalid memory limit %s.\n", argv[i]);
+                return PARSE_ERROR;
+              }
+
+              params.maxMemory = (size_t)(n << shift);
+              continue;
+            }
+
+            if (strncmp (argv[i], "--skip=", 7) == 0)
+            {
+              char *end = NULL;
+
+              params.skip = strtoll (argv[i] + 7, &end, 10);
+
+              if (end == argv[i] + 7 || *end != '\0' || params.skip < 0)
+              {
+                fprintf (stderr, "Invalid byte count %s.\n", argv[i]);
+                return PARSE_ERROR;
+              }
+
+              continue;
+            }
+
+            if (strncmp (argv[i], "--head=", 7) == 0)
+            {
+              char *end = NULL;
+
+              params.head = strtoll (argv[i] + 7, &end, 10);
+
+              if (end == argv[i] + 7 || *end != '\0' || params.head < 0)
+              {
+                fprintf (stderr, "Invalid byte count %s.\n", argv[i]);
+                return PARSE_ERROR;
+              }
+
+              continue;
+            }
+
             if ((i == 1 || (i == 2 && bits_set)) && 0 == strcmp(argv[i], "-large"))
             {
                 params.bits = DEFAULT_MAX_BITS;
@@ -201,10 +577,34 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
                 {
                     flagTest = true;
                 }
+                else if (flag == 'c')
+                {
+                    flagCreate = true;
+                }
+                else if (flag == 'x')
+                {
+                    flagExtract = true;
+                }
+                else if (flag == 'l')
+                {
+                    flagList = true;
+                }
+                else if (flag == 'a')
+                {
+                    flagAppend = true;
+                }
+                else if (flag == 'g')
+                {
+                    flagSearch = true;
+                }
                 else if (flag == 'd')
                 {
                     flagDiagnostics = true;
                 }
+                else if (flag == 'Z')
+                {
+                    flagZ = true;
+                }
                 else 
                 {
                     fprintf (stderr, "Unknown flag -%c\n", flag);
@@ -219,6 +619,8 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
             if (!params.inputFile)
             {
                 params.inputFile = str_dup (argv[i]);
+                params.files = argv + i + 1;
+                params.nfiles = argc - i - 1;
             }
             else if (!params.outputFile)
             {
@@ -227,29 +629,81 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
         } 
     }
 
-    if (flagTest + flagPack + flagUnpack > 1) /* inconsistent args */
+    int archive = flagCreate + flagExtract + flagList;
+
+    if (flagTest + flagPack + flagUnpack + flagAppend + flagSearch + archive > 1) /* inconsistent args */
     {
-        fprintf (stderr, "Cannot combine -p, -u and -t flags.\n");
+        fprintf (stderr, "Cannot combine -p, -u, -t, -a, -g, -c, -x and -l flags.\n");
         return PARSE_ERROR;
     }
 
-    if (flagTest + flagPack + flagUnpack == 0) 
+    if (flagTest + flagPack + flagUnpack + flagAppend + flagSearch + archive == 0) 
     {
         fprintf (stderr, "No pack, unpack or test flags given.\n");
         return PARSE_ERROR;
     }
 
-    if (flagUnpack && bits_set)
+    if (flagZ && !(flagPack || flagUnpack || flagTest))
+    {
+        fprintf (stderr, "-Z applies to -p, -u and -t only.\n");
+        return PARSE_ERROR;
+    }
+
+    if (flagZ && params.skip >= 0)
+    {
+        fprintf (stderr, "Cannot combine -Z and --skip.\n");
+        return PARSE_ERROR;
+    }
+
+    if (!flagZ && bits < 12)
+    {
+        fprintf (stderr, "Invalid number of bits. Allowed range 12 to %d.\n", SUPPORTED_MAX_BITS);
+        return PARSE_ERROR;
+    }
+
+    if (flagZ && bits > Z_MAX_BITS)
+    {
+        fprintf (stderr, "The .Z format has codes of 9 to %d bits.\n", Z_MAX_BITS);
+        return PARSE_ERROR;
+    }
+
+    if (flagZ && !bits_set)
+        bits = Z_MAX_BITS;
+
+    if (params.concat && !flagAppend)
+    {
+        fprintf (stderr, "--concat applies to -a only.\n");
+        return PARSE_ERROR;
+    }
+
+    if ((flagUnpack || flagExtract || flagList || flagSearch) && bits_set)
     {
         fprintf (stderr, "Cannot cobine -u and -bit flag.\n");
         return PARSE_ERROR;
     }
 
+    if (!flagUnpack && params.head >= 0)
+    {
+        fprintf (stderr, "--head applies to -u only.\n");
+        return PARSE_ERROR;
+    }
+
+    if (!flagUnpack && params.skip >= 0)
+    {
+        fprintf (stderr, "--skip applies to -u only.\n");
+        return PARSE_ERROR;
+    }
+
     if (flagTest)
     {
       if (NULL == params.inputFile)
         return PARSE_ERROR;
     }
+    else if (archive)
+    {
+      if (NULL == params.inputFile || (flagCreate && params.nfiles == 0) || (flagList && params.nfiles > 0))
+        return PARSE_ERROR;
+    }
     else
     {
       if (NULL == params.inputFile || NULL == params.outputFile)
@@ -260,6 +714,15 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
     if (flagVerbose) params.flags |= VERBOSE_OUTPUT;
     if (flagKeepDirty) params.flags |= KEEP_ON_ERROR;
     if (flagDiagnostics) params.flags |= DIAGNOSTIC_OUTPUT;
+    if (flagPipeline) params.flags |= PIPELINED_IO;
+    if (flagUring) params.flags |= URING_IO;
+    if (flagSparse) params.flags |= SPARSE_OUTPUT;
+    if (flagDirect) params.flags |= DIRECT_IO;
+    if (flagSubBlocks) params.flags |= SUBBLOCK_FRAMING;
+    if (flagLRU) params.flags |= LRU_EVICTION;
+    if (flagZ) params.flags |= COMPRESS_FORMAT;
+    if (flagRLE) params.flags |= RLE_STAGE;
+    if (flagHuffman) params.flags |= ENTROPY_STAGE;
 
     params.bits = bits;
     
@@ -268,6 +731,11 @@ static enum ArgOption parseArguments (int argc, char *argv[], progArguments & pa
     if (flagTest) ret = FLAG_TEST;
     else if (flagPack) ret = FLAG_PACK;
     else if (flagUnpack) ret = FLAG_UNPACK;
+    else if (flagCreate) ret = FLAG_CREATE;
+    else if (flagExtract) ret = FLAG_EXTRACT;
+    else if (flagList) ret = FLAG_LIST;
+    else if (flagAppend) ret = FLAG_APPEND;
+    else if (flagSearch) ret = FLAG_SEARCH;
 
     return ret;
 }
@@ -384,7 +852,7 @@ int main(int argc, char *argv[])
 
   else if (option == FLAG_PACK)
   {
-    if (0 == Compress2 (params.inputFile, params.outputFile, params.flags, params.bits))
+    if (0 == packFile (params, params.outputFile))
     {
       printf ("Compression failed.\n");
       return EXIT_FAILURE;
@@ -397,7 +865,9 @@ int main(int argc, char *argv[])
   }
   else if (option == FLAG_UNPACK)
   {
-    if (0 == Decompress(params.inputFile, params.outputFile, params.flags))
+    int ok = unpackFile (params, params.inputFile, params.outputFile, params.flags, params.head);
+
+    if (0 == ok)
     {
       printf ("Decompression failed.\n");
       return EXIT_FAILURE;
@@ -414,7 +884,7 @@ int main(int argc, char *argv[])
 
     tmpnam_s (temp_name, sizeof(temp_name));
 
-    if (0 == Compress2 (params.inputFile, temp_name, params.flags, params.bits ))
+    if (0 == packFile (params, temp_name))
     {
       printf ("Compression failed.\n");
       return EXIT_FAILURE;
@@ -426,7 +896,7 @@ int main(int argc, char *argv[])
 
     tmpnam_s (out_name, sizeof(out_name));
 
-    if (0 == Decompress(temp_name, out_name, params.flags | OVERWRITE_FLAG))
+    if (0 == unpackFile (params, temp_name, out_name, params.flags | OVERWRITE_FLAG, -1))
     {
       printf ("Decompression failed.\n");
       return EXIT_FAILURE;
@@ -444,6 +914,77 @@ int main(int argc, char *argv[])
     remove (temp_name);
     remove (out_name);
   }
+  else if (option == FLAG_CREATE)
+  {
+    LZW_CCtx *ctx = settingsContext (params);
+
+    int ok = ctx && lzw_archive_create (params.inputFile, params.files, params.nfiles, ctx, params.flags, params.bits, params.jobs);
+
+    lzw_cctx_free (ctx);
+
+    if (0 == ok)
+    {
+      printf ("Compression failed.\n");
+      return EXIT_FAILURE;
+    }
+
+    printf ("Compression successful.\n");
+  }
+  else if (option == FLAG_EXTRACT)
+  {
+    if (0 == lzw_archive_extract2 (params.inputFile, params.files, params.nfiles, params.flags, params.jobs, params.maxMemory))
+    {
+      printf ("Decompression failed.\n");
+      return EXIT_FAILURE;
+    }
+
+    printf ("Decompression successful.\n");
+  }
+  else if (option == FLAG_LIST)
+  {
+    if (0 == lzw_archive_list (params.inputFile))
+      return EXIT_FAILURE;
+  }
+  else if (option == FLAG_APPEND)
+  {
+    int ok;
+
+    if (params.concat)
+      ok = lzw_concat (params.outputFile, params.inputFile);
+    else
+    {
+      LZW_CCtx *ctx = settingsContext (params);
+
+      ok = ctx && lzw_append (params.outputFile, params.inputFile, ctx, params.flags, params.bits);
+
+      lzw_cctx_free (ctx);
+    }
+
+    if (0 == ok)
+    {
+      printf ("Append failed.\n");
+      return EXIT_FAILURE;
+    }
+
+    printf ("Append successful.\n");
+  }
+  else if (option == FLAG_SEARCH)
+  {
+    /* the pattern is the first name, the packed file the second. */
+    long long found = lzw_search (params.outputFile, params.inputFile, strlen (params.inputFile), params.flags,
+                                  params.jobs, printMatch, NULL);
+
+    if (found < 0)
+    {
+      fprintf (stderr, "Search failed.\n");
+      return 2;
+    }
+
+    if (params.flags & VERBOSE_OUTPUT)
+      fprintf (stderr, "%lld matches.\n", found);
+
+    return found ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
   
   return EXIT_SUCCESS;
 }